@@ -475,19 +475,15 @@ create_proxy_for_file2 (GFile *file1,
   if (connection == NULL)
     goto out;
 
-  proxy = gvfs_dbus_mount_proxy_new_sync (connection,
-                                          G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
-                                          mount_info1->dbus_id,
-                                          mount_info1->object_path,
-                                          cancellable,
-                                          error);
+  proxy = _g_dbus_mount_proxy_new_sync (connection,
+                                        mount_info1->dbus_id,
+                                        mount_info1->object_path,
+                                        cancellable,
+                                        error);
   
   if (proxy == NULL)
     goto out;
   
-  /* Set infinite timeout, see bug 687534 */
-  g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (proxy), G_MAXINT);
-  
   _g_dbus_connect_vfs_filters (connection);
 
   if (mount_info1_out)
@@ -580,7 +576,7 @@ async_proxy_new_cb (GObject *source_object,
   GError *error = NULL;
   GSimpleAsyncResult *result;
   
-  proxy = gvfs_dbus_mount_proxy_new_finish (res, &error);
+  proxy = _g_dbus_mount_proxy_new_finish (res, &error);
   if (proxy == NULL)
     {
       _g_simple_async_result_take_error_stripped (data->result, error);
@@ -591,9 +587,6 @@ async_proxy_new_cb (GObject *source_object,
   
   data->proxy = proxy;
 
-  /* Set infinite timeout, see bug 687534 */
-  g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (data->proxy), G_MAXINT);
-
   _g_dbus_connect_vfs_filters (data->connection);
   path = g_mount_info_resolve_path (data->mount_info, daemon_file->path);
 
@@ -620,13 +613,12 @@ async_construct_proxy (GDBusConnection *connection,
                        AsyncProxyCreate *data)
 {
   data->connection = g_object_ref (connection);
-  gvfs_dbus_mount_proxy_new (connection,
-                             G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
-                             data->mount_info->dbus_id,
-                             data->mount_info->object_path,
-                             data->cancellable,
-                             async_proxy_new_cb,
-                             data);
+  _g_dbus_mount_proxy_new (connection,
+                           data->mount_info->dbus_id,
+                           data->mount_info->object_path,
+                           data->cancellable,
+                           async_proxy_new_cb,
+                           data);
 }
 
 static void
@@ -2670,12 +2662,12 @@ set_metadata_attribute (GFile *file,
                        _("values must be string or list of strings"));
         }
       else if (appended > 0 &&
-               !gvfs_metadata_call_set_sync (proxy,
-                                             metatreefile,
-                                             daemon_file->path,
-                                             g_variant_builder_end (builder),
-                                             cancellable,
-                                             error))
+               !_g_daemon_vfs_set_metadata (proxy,
+                                            metatreefile,
+                                            daemon_file->path,
+                                            g_variant_builder_end (builder),
+                                            cancellable,
+                                            error))
         res = FALSE;
 
       g_variant_builder_unref (builder);
@@ -44,6 +44,10 @@
 
 #define MAX_WRITE_SIZE (4*1024*1024)
 
+/* Limits for the amount of unacknowledged writes in write-behind mode */
+#define MAX_WRITE_BEHIND_REQUESTS 16
+#define MAX_WRITE_BEHIND_SIZE (8*1024*1024)
+
 typedef enum {
   STATE_OP_DONE,
   STATE_OP_READ,
@@ -55,7 +59,8 @@ typedef enum {
   WRITE_STATE_INIT = 0,
   WRITE_STATE_WROTE_COMMAND,
   WRITE_STATE_SEND_DATA,
-  WRITE_STATE_HANDLE_INPUT
+  WRITE_STATE_HANDLE_INPUT,
+  WRITE_STATE_WAIT_WINDOW
 } WriteState;
 
 typedef struct {
@@ -73,8 +78,15 @@ typedef struct {
   gboolean sent_cancel;
   
   guint32 seq_nr;
+  gsize written; /* by partial replies */
 } WriteOperation;
 
+typedef struct {
+  guint32 seq_nr;
+  gsize size;
+  gsize written;
+} PendingWrite;
+
 typedef enum {
   SEEK_STATE_INIT = 0,
   SEEK_STATE_WROTE_REQUEST,
@@ -117,6 +129,19 @@ typedef struct {
   guint32 seq_nr;
 } CloseOperation;
 
+typedef enum {
+  FLUSH_STATE_INIT = 0,
+  FLUSH_STATE_HANDLE_INPUT
+} FlushState;
+
+typedef struct {
+  FlushState state;
+
+  /* Output */
+  gboolean ret_val;
+  GError *ret_error;
+} FlushOperation;
+
 typedef enum {
   QUERY_STATE_INIT = 0,
   QUERY_STATE_WROTE_REQUEST,
@@ -158,6 +183,9 @@ struct _GDaemonFileOutputStream {
   GOutputStream *command_stream;
   GInputStream *data_stream;
   guint can_seek : 1;
+  guint write_behind : 1;
+  /* The daemon acked a write-behind request as such */
+  guint write_behind_acked : 1;
   
   guint32 seq_nr;
   goffset current_offset;
@@ -167,6 +195,11 @@ struct _GDaemonFileOutputStream {
   
   GString *output_buffer;
 
+  /* Writes sent but not yet acknowledged, oldest first */
+  GQueue *pending_writes;
+  gsize pending_size;
+  GError *write_behind_error;
+
   char *etag;
   
 };
@@ -176,6 +209,9 @@ static gssize     g_daemon_file_output_stream_write             (GOutputStream
 								 gsize                 count,
 								 GCancellable         *cancellable,
 								 GError              **error);
+static gboolean   g_daemon_file_output_stream_flush             (GOutputStream        *stream,
+								 GCancellable         *cancellable,
+								 GError              **error);
 static gboolean   g_daemon_file_output_stream_close             (GOutputStream        *stream,
 								 GCancellable         *cancellable,
 								 GError              **error);
@@ -201,6 +237,14 @@ static void       g_daemon_file_output_stream_write_async       (GOutputStream
 static gssize     g_daemon_file_output_stream_write_finish      (GOutputStream        *stream,
 								 GAsyncResult         *result,
 								 GError              **error);
+static void       g_daemon_file_output_stream_flush_async       (GOutputStream        *stream,
+								 int                   io_priority,
+								 GCancellable         *cancellable,
+								 GAsyncReadyCallback   callback,
+								 gpointer              data);
+static gboolean   g_daemon_file_output_stream_flush_finish      (GOutputStream        *stream,
+								 GAsyncResult         *result,
+								 GError              **error);
 static void       g_daemon_file_output_stream_close_async       (GOutputStream        *stream,
 								 int                   io_priority,
 								 GCancellable         *cancellable,
@@ -250,6 +294,10 @@ g_daemon_file_output_stream_finalize (GObject *object)
   g_string_free (file->input_buffer, TRUE);
   g_string_free (file->output_buffer, TRUE);
 
+  g_queue_free_full (file->pending_writes, g_free);
+  if (file->write_behind_error)
+    g_error_free (file->write_behind_error);
+
   g_free (file->etag);
   
   if (G_OBJECT_CLASS (g_daemon_file_output_stream_parent_class)->finalize)
@@ -266,10 +314,13 @@ g_daemon_file_output_stream_class_init (GDaemonFileOutputStreamClass *klass)
   gobject_class->finalize = g_daemon_file_output_stream_finalize;
 
   stream_class->write_fn = g_daemon_file_output_stream_write;
+  stream_class->flush = g_daemon_file_output_stream_flush;
   stream_class->close_fn = g_daemon_file_output_stream_close;
   
   stream_class->write_async = g_daemon_file_output_stream_write_async;
   stream_class->write_finish = g_daemon_file_output_stream_write_finish;
+  stream_class->flush_async = g_daemon_file_output_stream_flush_async;
+  stream_class->flush_finish = g_daemon_file_output_stream_flush_finish;
   stream_class->close_async = g_daemon_file_output_stream_close_async;
   stream_class->close_finish = g_daemon_file_output_stream_close_finish;
   
@@ -287,6 +338,7 @@ g_daemon_file_output_stream_init (GDaemonFileOutputStream *info)
 {
   info->output_buffer = g_string_new ("");
   info->input_buffer = g_string_new ("");
+  info->pending_writes = g_queue_new ();
   info->seq_nr = 1;
 }
 
@@ -303,6 +355,7 @@ g_daemon_file_output_stream_new (int fd,
   stream->data_stream = g_unix_input_stream_new (fd, TRUE);
   stream->can_seek = can_seek;
   stream->current_offset = initial_offset;
+  stream->write_behind = g_getenv ("GVFS_DISABLE_WRITE_BEHIND") == NULL;
   
   return G_FILE_OUTPUT_STREAM (stream);
 }
@@ -392,6 +445,81 @@ decode_error (GVfsDaemonSocketProtocolReply *reply, char *data, GError **error)
 		       data + strlen (data) + 1);
 }
 
+static gboolean
+write_window_is_full (GDaemonFileOutputStream *file,
+		      gsize size)
+{
+  if (g_queue_is_empty (file->pending_writes))
+    return FALSE;
+
+  return
+    g_queue_get_length (file->pending_writes) >= MAX_WRITE_BEHIND_REQUESTS ||
+    file->pending_size + size > MAX_WRITE_BEHIND_SIZE;
+}
+
+static void
+add_pending_write (GDaemonFileOutputStream *file,
+		   guint32 seq_nr,
+		   gsize size)
+{
+  PendingWrite *pending;
+
+  pending = g_new0 (PendingWrite, 1);
+  pending->seq_nr = seq_nr;
+  pending->size = size;
+
+  g_queue_push_tail (file->pending_writes, pending);
+  file->pending_size += size;
+}
+
+/* Consumes replies to writes sent in write-behind mode. Any failure is
+   kept around and reported by the next write, flush or close. */
+static gboolean
+handle_write_behind_reply (GDaemonFileOutputStream *file,
+			   GVfsDaemonSocketProtocolReply *reply,
+			   char *data)
+{
+  PendingWrite *pending;
+  GList *l;
+
+  pending = NULL;
+  for (l = file->pending_writes->head; l != NULL; l = l->next)
+    {
+      pending = l->data;
+      if (pending->seq_nr == reply->seq_nr)
+	break;
+    }
+
+  if (l == NULL)
+    return FALSE;
+
+  if (reply->type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_WRITTEN)
+    {
+      pending->written += reply->arg1;
+
+      if (reply->arg2 & G_VFS_DAEMON_SOCKET_PROTOCOL_WRITTEN_FLAG_PARTIAL)
+	return TRUE;
+
+      if (pending->written < pending->size &&
+	  file->write_behind_error == NULL)
+	g_set_error (&file->write_behind_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		     _("Error in stream protocol: %s"), _("Short write"));
+    }
+  else if (reply->type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_ERROR)
+    {
+      if (file->write_behind_error == NULL)
+	decode_error (reply, data, &file->write_behind_error);
+    }
+  else
+    return FALSE;
+
+  file->pending_size -= pending->size;
+  g_queue_delete_link (file->pending_writes, l);
+  g_free (pending);
+
+  return TRUE;
+}
+
 
 static gboolean
 run_sync_state_machine (GDaemonFileOutputStream *file,
@@ -496,8 +624,24 @@ iterate_write_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_
 	{
 	  /* Initial state for read op */
 	case WRITE_STATE_INIT:
+	  if (file->write_behind_error)
+	    {
+	      op->ret_val = -1;
+	      op->ret_error = g_error_copy (file->write_behind_error);
+	      return STATE_OP_DONE;
+	    }
+
+	  if (file->write_behind && file->write_behind_acked &&
+	      write_window_is_full (file, op->buffer_size))
+	    {
+	      op->state = WRITE_STATE_WAIT_WINDOW;
+	      break;
+	    }
+
 	  append_request (file, G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_WRITE,
-			  op->buffer_size, 0, op->buffer_size, &op->seq_nr);
+			  op->buffer_size,
+			  file->write_behind ? G_VFS_DAEMON_SOCKET_PROTOCOL_WRITE_FLAG_BEHIND : 0,
+			  op->buffer_size, &op->seq_nr);
 	  op->state = WRITE_STATE_WROTE_COMMAND;
 	  io_op->io_buffer = file->output_buffer->str;
 	  io_op->io_size = file->output_buffer->len;
@@ -548,6 +692,14 @@ iterate_write_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_
 	      return STATE_OP_WRITE;
 	    }
 
+	  if (file->write_behind && file->write_behind_acked)
+	    {
+	      /* Don't wait for the reply, it is picked up later */
+	      add_pending_write (file, op->seq_nr, op->buffer_size);
+	      op->ret_val = op->buffer_size;
+	      return STATE_OP_DONE;
+	    }
+
 	  op->state = WRITE_STATE_HANDLE_INPUT;
 	  break;
 
@@ -600,12 +752,30 @@ iterate_write_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_
 		return STATE_OP_DONE;
 	      }
 	    else if (reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_WRITTEN &&
-		     reply.seq_nr == op->seq_nr)
+		     reply.seq_nr == op->seq_nr &&
+		     !(reply.arg2 & G_VFS_DAEMON_SOCKET_PROTOCOL_WRITTEN_FLAG_PARTIAL))
 	      {
-		op->ret_val = reply.arg1;
+		op->ret_val = op->written + reply.arg1;
+
+		/* The first write-behind request is waited for. A daemon
+		   that doesn't know about them acks it like any other
+		   write and may return a short count. */
+		if (file->write_behind && !file->write_behind_acked)
+		  {
+		    if (reply.arg2 & G_VFS_DAEMON_SOCKET_PROTOCOL_WRITTEN_FLAG_BEHIND)
+		      file->write_behind_acked = TRUE;
+		    else
+		      file->write_behind = FALSE;
+		  }
+
 		g_string_truncate (file->input_buffer, 0);
 		return STATE_OP_DONE;
 	      }
+	    else if (reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_WRITTEN &&
+		     reply.seq_nr == op->seq_nr)
+	      op->written += reply.arg1;
+	    else
+	      handle_write_behind_reply (file, &reply, data);
 	    /* Ignore other reply types */
 	  }
 
@@ -614,6 +784,53 @@ iterate_write_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_
 	  /* This wasn't interesting, read next reply */
 	  op->state = WRITE_STATE_HANDLE_INPUT;
 	  break;
+
+	  /* Wait for an acknowledgement to free up the write window */
+	case WRITE_STATE_WAIT_WINDOW:
+	  if (io_op->io_cancelled)
+	    {
+	      /* Nothing of this write was sent yet */
+	      g_string_set_size (file->input_buffer,
+				 file->input_buffer->len - io_op->io_size);
+	      op->ret_val = -1;
+	      g_set_error_literal (&op->ret_error,
+				   G_IO_ERROR,
+				   G_IO_ERROR_CANCELLED,
+				   _("Operation was cancelled"));
+	      return STATE_OP_DONE;
+	    }
+
+	  if (io_op->io_res > 0)
+	    {
+	      gsize unread_size = io_op->io_size - io_op->io_res;
+	      g_string_set_size (file->input_buffer,
+				 file->input_buffer->len - unread_size);
+	    }
+
+	  len = get_reply_header_missing_bytes (file->input_buffer);
+	  if (len > 0)
+	    {
+	      gsize current_len = file->input_buffer->len;
+	      g_string_set_size (file->input_buffer,
+				 current_len + len);
+	      io_op->io_buffer = file->input_buffer->str + current_len;
+	      io_op->io_size = len;
+	      io_op->io_allow_cancel = TRUE;
+	      return STATE_OP_READ;
+	    }
+
+	  {
+	    GVfsDaemonSocketProtocolReply reply;
+	    char *data;
+	    data = decode_reply (file->input_buffer, &reply);
+	    handle_write_behind_reply (file, &reply, data);
+	  }
+
+	  g_string_truncate (file->input_buffer, 0);
+
+	  /* Check the error and the window again */
+	  op->state = WRITE_STATE_INIT;
+	  break;
 	  
 	default:
 	  g_assert_not_reached ();
@@ -663,6 +880,108 @@ g_daemon_file_output_stream_write (GOutputStream *stream,
   return op.ret_val;
 }
 
+static StateOp
+iterate_flush_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_op, FlushOperation *op)
+{
+  gsize len;
+
+  while (TRUE)
+    {
+      switch (op->state)
+	{
+	case FLUSH_STATE_INIT:
+	  op->state = FLUSH_STATE_HANDLE_INPUT;
+	  break;
+
+	  /* Read replies until all writes are acknowledged */
+	case FLUSH_STATE_HANDLE_INPUT:
+	  if (io_op->io_cancelled)
+	    {
+	      g_string_set_size (file->input_buffer,
+				 file->input_buffer->len - io_op->io_size);
+	      op->ret_val = FALSE;
+	      g_set_error_literal (&op->ret_error,
+				   G_IO_ERROR,
+				   G_IO_ERROR_CANCELLED,
+				   _("Operation was cancelled"));
+	      return STATE_OP_DONE;
+	    }
+
+	  if (io_op->io_res > 0)
+	    {
+	      gsize unread_size = io_op->io_size - io_op->io_res;
+	      g_string_set_size (file->input_buffer,
+				 file->input_buffer->len - unread_size);
+	    }
+
+	  if (g_queue_is_empty (file->pending_writes))
+	    {
+	      if (file->write_behind_error)
+		{
+		  op->ret_val = FALSE;
+		  op->ret_error = g_error_copy (file->write_behind_error);
+		}
+	      else
+		op->ret_val = TRUE;
+	      return STATE_OP_DONE;
+	    }
+
+	  len = get_reply_header_missing_bytes (file->input_buffer);
+	  if (len > 0)
+	    {
+	      gsize current_len = file->input_buffer->len;
+	      g_string_set_size (file->input_buffer,
+				 current_len + len);
+	      io_op->io_buffer = file->input_buffer->str + current_len;
+	      io_op->io_size = len;
+	      io_op->io_allow_cancel = TRUE;
+	      return STATE_OP_READ;
+	    }
+
+	  {
+	    GVfsDaemonSocketProtocolReply reply;
+	    char *data;
+	    data = decode_reply (file->input_buffer, &reply);
+	    handle_write_behind_reply (file, &reply, data);
+	  }
+
+	  g_string_truncate (file->input_buffer, 0);
+	  break;
+
+	default:
+	  g_assert_not_reached ();
+	}
+
+      /* Clear io_op between non-op state switches */
+      io_op->io_size = 0;
+      io_op->io_res = 0;
+      io_op->io_cancelled = FALSE;
+    }
+}
+
+static gboolean
+g_daemon_file_output_stream_flush (GOutputStream *stream,
+				  GCancellable *cancellable,
+				  GError      **error)
+{
+  GDaemonFileOutputStream *file;
+  FlushOperation op;
+
+  file = G_DAEMON_FILE_OUTPUT_STREAM (stream);
+
+  memset (&op, 0, sizeof (op));
+  op.state = FLUSH_STATE_INIT;
+
+  if (!run_sync_state_machine (file, (state_machine_iterator)iterate_flush_state_machine,
+			       &op, cancellable, error))
+    return FALSE; /* IO Error */
+
+  if (!op.ret_val)
+    g_propagate_error (error, op.ret_error);
+
+  return op.ret_val;
+}
+
 static StateOp
 iterate_close_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_op, CloseOperation *op)
 {
@@ -674,8 +993,11 @@ iterate_close_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_
 	{
 	  /* Initial state for read op */
 	case CLOSE_STATE_INIT:
+	  /* Don't let the daemon commit a file a write to which failed */
 	  append_request (file, G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_CLOSE,
-			  0, 0, 0, &op->seq_nr);
+			  0,
+			  file->write_behind_error ? G_VFS_DAEMON_SOCKET_PROTOCOL_CLOSE_FLAG_ABORT : 0,
+			  0, &op->seq_nr);
 	  op->state = CLOSE_STATE_WROTE_REQUEST;
 	  io_op->io_buffer = file->output_buffer->str;
 	  io_op->io_size = file->output_buffer->len;
@@ -767,6 +1089,8 @@ iterate_close_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_
 		g_string_truncate (file->input_buffer, 0);
 		return STATE_OP_DONE;
 	      }
+	    else
+	      handle_write_behind_reply (file, &reply, data);
 	    /* Ignore other reply types */
 	  }
 
@@ -808,6 +1132,14 @@ g_daemon_file_output_stream_close (GOutputStream *stream,
   if (!run_sync_state_machine (file, (state_machine_iterator)iterate_close_state_machine,
 			       &op, cancellable, error))
     res = FALSE;
+  else if (file->write_behind_error)
+    {
+      /* A write failed after we returned from it */
+      if (op.ret_error)
+	g_error_free (op.ret_error);
+      g_propagate_error (error, g_error_copy (file->write_behind_error));
+      res = FALSE;
+    }
   else
     {
       if (!op.ret_val)
@@ -961,6 +1293,8 @@ iterate_seek_state_machine (GDaemonFileOutputStream *file, IOOperationData *io_o
 		g_string_truncate (file->input_buffer, 0);
 		return STATE_OP_DONE;
 	      }
+	    else
+	      handle_write_behind_reply (file, &reply, data);
 	    /* Ignore other reply types */
 	  }
 
@@ -1143,6 +1477,8 @@ iterate_query_state_machine (GDaemonFileOutputStream *file,
 		g_string_truncate (file->input_buffer, 0);
 		return STATE_OP_DONE;
 	      }
+	    else
+	      handle_write_behind_reply (file, &reply, data);
 	    /* Ignore other reply types */
 	  }
 
@@ -1490,6 +1826,80 @@ g_daemon_file_output_stream_write_finish (GOutputStream             *stream,
   return nwritten;
 }
 
+static void
+async_flush_done (GOutputStream *stream,
+		  gpointer op_data,
+		  GAsyncReadyCallback callback,
+		  gpointer user_data,
+                  GCancellable *cancellable,
+		  GError *io_error)
+{
+  GSimpleAsyncResult *simple;
+  FlushOperation *op;
+  gboolean result;
+  GError *error;
+
+  op = op_data;
+
+  if (io_error)
+    {
+      result = FALSE;
+      error = io_error;
+    }
+  else
+    {
+      result = op->ret_val;
+      error = op->ret_error;
+    }
+
+  simple = g_simple_async_result_new (G_OBJECT (stream),
+				      callback, user_data,
+				      g_daemon_file_output_stream_flush_async);
+
+  if (!result)
+    g_simple_async_result_set_from_error (simple, error);
+
+  /* Complete immediately, not in idle, since we're already in a mainloop callout */
+  _g_simple_async_result_complete_with_cancellable (simple, cancellable);
+  g_object_unref (simple);
+
+  if (op->ret_error)
+    g_error_free (op->ret_error);
+  g_free (op);
+}
+
+static void
+g_daemon_file_output_stream_flush_async (GOutputStream     *stream,
+					 int                 io_priority,
+					 GCancellable       *cancellable,
+					 GAsyncReadyCallback callback,
+					 gpointer            data)
+{
+  GDaemonFileOutputStream *file;
+  FlushOperation *op;
+
+  file = G_DAEMON_FILE_OUTPUT_STREAM (stream);
+
+  op = g_new0 (FlushOperation, 1);
+  op->state = FLUSH_STATE_INIT;
+
+  run_async_state_machine (file,
+			   (state_machine_iterator)iterate_flush_state_machine,
+			   op, io_priority,
+			   callback, data,
+			   cancellable,
+			   async_flush_done);
+}
+
+static gboolean
+g_daemon_file_output_stream_flush_finish (GOutputStream             *stream,
+					  GAsyncResult              *result,
+					  GError                   **error)
+{
+  /* Failures handled in generic flush_finish code */
+  return TRUE;
+}
+
 static void
 async_close_done (GOutputStream *stream,
 		  gpointer op_data,
@@ -1513,6 +1923,12 @@ async_close_done (GOutputStream *stream,
       result = FALSE;
       error = io_error;
     }
+  else if (file->write_behind_error)
+    {
+      /* A write failed after we returned from it */
+      result = FALSE;
+      error = file->write_behind_error;
+    }
   else
     {
       result = op->ret_val;
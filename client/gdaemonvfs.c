@@ -55,7 +55,9 @@ struct _GDaemonVfs
   GDBusConnection *async_bus;
   
   GVfs *wrapped_vfs;
-  GList *mount_cache;
+  /* both protected by mount_cache_lock */
+  GHashTable *mount_cache; /* GMountSpec items -> GPtrArray of GMountInfo, longest mount prefix first */
+  GHashTable *mount_cache_by_fuse_path; /* fuse mountpoint -> GMountInfo */
 
   GFile *fuse_root;
   
@@ -78,7 +80,27 @@ static GDaemonVfs *the_vfs = NULL;
 G_LOCK_DEFINE_STATIC (metadata_proxy);
 static GVfsMetadata *metadata_proxy = NULL;
 
-G_LOCK_DEFINE_STATIC(mount_cache);
+typedef struct {
+  int ref_count; /* protected by metadata_batch lock */
+  char *treefile;
+  GPtrArray *paths;
+  GPtrArray *datas;
+  gboolean sent;
+  gboolean done;
+  GError *error;
+} MetadataBatch;
+
+/* Writes to the same metadata tree that arrive while a SetMany call is
+   in flight are collected into the next batch */
+G_LOCK_DEFINE_STATIC (metadata_batch);
+static GCond metadata_batch_cond;
+static GHashTable *metadata_batches = NULL; /* treefile -> pending MetadataBatch */
+static GHashTable *metadata_batches_in_flight = NULL; /* treefile set */
+static gint metadata_set_many_unsupported = FALSE; /* atomic */
+
+/* Lookups by far outnumber changes to the mount cache, so they only take
+   the lock for reading and don't block each other */
+static GRWLock mount_cache_lock;
 
 
 static void fill_mountable_info (GDaemonVfs *vfs);
@@ -98,6 +120,9 @@ g_daemon_vfs_finalize (GObject *object)
 
   g_strfreev (vfs->supported_uri_schemes);
 
+  g_hash_table_destroy (vfs->mount_cache);
+  g_hash_table_destroy (vfs->mount_cache_by_fuse_path);
+
   g_clear_object (&vfs->async_bus);
   g_clear_object (&vfs->wrapped_vfs);
   
@@ -294,6 +319,14 @@ g_daemon_vfs_init (GDaemonVfs *vfs)
   bindtextdomain (GETTEXT_PACKAGE, GVFS_LOCALEDIR);
   bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
 
+  vfs->mount_cache = g_hash_table_new_full (g_mount_spec_items_hash,
+                                            g_mount_spec_items_equal,
+                                            (GDestroyNotify) g_mount_spec_unref,
+                                            (GDestroyNotify) g_ptr_array_unref);
+  vfs->mount_cache_by_fuse_path = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         g_free,
+                                                         (GDestroyNotify) g_mount_info_unref);
+
   vfs->async_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
 
   if (vfs->async_bus == NULL)
@@ -706,36 +739,31 @@ g_daemon_vfs_get_supported_uri_schemes (GVfs *vfs)
 }
 
 static GMountInfo *
-lookup_mount_info_in_cache_locked (GMountSpec *spec,
-				   const char *path)
+lookup_mount_info_in_cache (GMountSpec *spec,
+			   const char *path)
 {
   GMountInfo *info;
-  GList *l;
+  GPtrArray *infos;
+  guint i;
 
   info = NULL;
-  for (l = the_vfs->mount_cache; l != NULL; l = l->next)
+  g_rw_lock_reader_lock (&mount_cache_lock);
+  infos = g_hash_table_lookup (the_vfs->mount_cache, spec);
+  if (infos)
     {
-      GMountInfo *mount_info = l->data;
+      /* sorted so the longest matching mount prefix is found first */
+      for (i = 0; i < infos->len; i++)
+        {
+          GMountInfo *mount_info = g_ptr_array_index (infos, i);
 
-      if (g_mount_spec_match_with_path (mount_info->mount_spec, spec, path))
-	{
-	  info = g_mount_info_ref (mount_info);
-	  break;
-	}
+          if (g_mount_spec_match_with_path (mount_info->mount_spec, spec, path))
+            {
+              info = g_mount_info_ref (mount_info);
+              break;
+            }
+        }
     }
-  
-  return info;
-}
-
-static GMountInfo *
-lookup_mount_info_in_cache (GMountSpec *spec,
-			   const char *path)
-{
-  GMountInfo *info;
-
-  G_LOCK (mount_cache);
-  info = lookup_mount_info_in_cache_locked (spec, path);
-  G_UNLOCK (mount_cache);
+  g_rw_lock_reader_unlock (&mount_cache_lock);
 
   return info;
 }
@@ -745,65 +773,92 @@ lookup_mount_info_by_fuse_path_in_cache (const char *fuse_path,
 					 char **mount_path)
 {
   GMountInfo *info;
-  GList *l;
+  char *prefix, *slash;
 
-  G_LOCK (mount_cache);
   info = NULL;
-  for (l = the_vfs->mount_cache; l != NULL; l = l->next)
+  prefix = g_strdup (fuse_path);
+
+  /* try the path and then each of its parents, longest first */
+  g_rw_lock_reader_lock (&mount_cache_lock);
+  for (;;)
     {
-      GMountInfo *mount_info = l->data;
+      info = g_hash_table_lookup (the_vfs->mount_cache_by_fuse_path, prefix);
+      if (info)
+        {
+          const char *rest = fuse_path + strlen (prefix);
+
+          if (*rest == 0)
+            *mount_path = g_strdup ("/");
+          else
+            *mount_path = g_strdup (rest);
+          g_mount_info_ref (info);
+          break;
+        }
 
-      if (mount_info->fuse_mountpoint != NULL &&
-	  g_str_has_prefix (fuse_path, mount_info->fuse_mountpoint))
-	{
-	  int len = strlen (mount_info->fuse_mountpoint);
-	  if (fuse_path[len] == 0 ||
-	      fuse_path[len] == '/')
-	    {
-	      if (fuse_path[len] == 0)
-		*mount_path = g_strdup ("/");
-	      else
-		*mount_path = g_strdup (fuse_path + len);
-	      info = g_mount_info_ref (mount_info);
-	      break;
-	    }
-	}
+      slash = strrchr (prefix, '/');
+      if (slash == NULL)
+        break;
+      *slash = 0;
     }
-  G_UNLOCK (mount_cache);
+  g_rw_lock_reader_unlock (&mount_cache_lock);
 
+  g_free (prefix);
   return info;
 }
 
+static gboolean
+mount_info_has_dbus_id (gpointer key,
+                        gpointer value,
+                        gpointer dbus_id)
+{
+  GMountInfo *mount_info = value;
+
+  return strcmp (mount_info->dbus_id, dbus_id) == 0;
+}
 
 void
 _g_daemon_vfs_invalidate_dbus_id (const char *dbus_id)
 {
-  GList *l, *next;
+  GHashTableIter iter;
+  GPtrArray *infos;
+  guint i;
 
-  G_LOCK (mount_cache);
-  for (l = the_vfs->mount_cache; l != NULL; l = next)
+  g_rw_lock_writer_lock (&mount_cache_lock);
+
+  g_hash_table_iter_init (&iter, the_vfs->mount_cache);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &infos))
     {
-      GMountInfo *mount_info = l->data;
-      next = l->next;
+      for (i = infos->len; i > 0; i--)
+        {
+          GMountInfo *mount_info = g_ptr_array_index (infos, i - 1);
 
-      if (strcmp (mount_info->dbus_id, dbus_id) == 0)
-	{
-	  the_vfs->mount_cache = g_list_delete_link (the_vfs->mount_cache, l);
-	  g_mount_info_unref (mount_info);
-	}
+          if (strcmp (mount_info->dbus_id, dbus_id) == 0)
+            g_ptr_array_remove_index (infos, i - 1);
+        }
+      if (infos->len == 0)
+        g_hash_table_iter_remove (&iter);
     }
-  
-  G_UNLOCK (mount_cache);
+
+  g_hash_table_foreach_remove (the_vfs->mount_cache_by_fuse_path,
+                               mount_info_has_dbus_id,
+                               (gpointer) dbus_id);
+
+  g_rw_lock_writer_unlock (&mount_cache_lock);
 }
 
+static gsize
+mount_prefix_len (GMountInfo *info)
+{
+  return info->mount_spec->mount_prefix ? strlen (info->mount_spec->mount_prefix) : 0;
+}
 
 static GMountInfo *
 handler_lookup_mount_reply (GVariant *iter,
 			    GError **error)
 {
   GMountInfo *info;
-  GList *l;
-  gboolean in_cache;
+  GPtrArray *infos;
+  guint i;
   
   info = g_mount_info_from_dbus (iter);
   if (info == NULL)
@@ -814,28 +869,47 @@ handler_lookup_mount_reply (GVariant *iter,
       return NULL;
     }
 
-  G_LOCK (mount_cache);
+  g_rw_lock_writer_lock (&mount_cache_lock);
+
+  infos = g_hash_table_lookup (the_vfs->mount_cache, info->mount_spec);
+  if (infos == NULL)
+    {
+      infos = g_ptr_array_new_with_free_func ((GDestroyNotify) g_mount_info_unref);
+      g_hash_table_insert (the_vfs->mount_cache,
+                           g_mount_spec_ref (info->mount_spec),
+                           infos);
+    }
 
-  in_cache = FALSE;
   /* Already in cache from other thread? */
-  for (l = the_vfs->mount_cache; l != NULL; l = l->next)
+  for (i = 0; i < infos->len; i++)
     {
-      GMountInfo *cached_info = l->data;
+      GMountInfo *cached_info = g_ptr_array_index (infos, i);
       
       if (g_mount_info_equal (info, cached_info))
 	{
-	  in_cache = TRUE;
 	  g_mount_info_unref (info);
 	  info = g_mount_info_ref (cached_info);
 	  break;
 	}
     }
 
-  /* No, lets add it to the cache */
-  if (!in_cache)
-    the_vfs->mount_cache = g_list_prepend (the_vfs->mount_cache, g_mount_info_ref (info));
+  /* No, lets add it to the cache, keeping longer mount prefixes first */
+  if (i == infos->len)
+    {
+      g_ptr_array_add (infos, g_mount_info_ref (info));
+      for (i = infos->len - 1;
+           i > 0 && mount_prefix_len (g_ptr_array_index (infos, i - 1)) < mount_prefix_len (info);
+           i--)
+        g_ptr_array_index (infos, i) = g_ptr_array_index (infos, i - 1);
+      g_ptr_array_index (infos, i) = info;
 
-  G_UNLOCK (mount_cache);
+      if (info->fuse_mountpoint)
+        g_hash_table_replace (the_vfs->mount_cache_by_fuse_path,
+                              g_strdup (info->fuse_mountpoint),
+                              g_mount_info_ref (info));
+    }
+
+  g_rw_lock_writer_unlock (&mount_cache_lock);
   
   return info;
 }
@@ -1252,6 +1326,161 @@ _g_daemon_vfs_get_metadata_proxy (GCancellable *cancellable, GError **error)
   return proxy;
 }
 
+static MetadataBatch *
+metadata_batch_new (const char *treefile)
+{
+  MetadataBatch *batch;
+
+  batch = g_new0 (MetadataBatch, 1);
+  batch->ref_count = 1;
+  batch->treefile = g_strdup (treefile);
+  batch->paths = g_ptr_array_new_with_free_func (g_free);
+  batch->datas = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+
+  return batch;
+}
+
+static void
+metadata_batch_unref (MetadataBatch *batch)
+{
+  if (--batch->ref_count > 0)
+    return;
+
+  g_free (batch->treefile);
+  g_ptr_array_free (batch->paths, TRUE);
+  g_ptr_array_free (batch->datas, TRUE);
+  if (batch->error)
+    g_error_free (batch->error);
+  g_free (batch);
+}
+
+static gboolean
+metadata_batch_send (GVfsMetadata *proxy,
+                     MetadataBatch *batch,
+                     GCancellable *cancellable,
+                     GError **error)
+{
+  GVariantBuilder builder;
+  GError *my_error;
+  guint i;
+
+  if (!g_atomic_int_get (&metadata_set_many_unsupported))
+    {
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(aya{sv})"));
+      for (i = 0; i < batch->paths->len; i++)
+        g_variant_builder_add (&builder, "(^ay@a{sv})",
+                               g_ptr_array_index (batch->paths, i),
+                               g_ptr_array_index (batch->datas, i));
+
+      my_error = NULL;
+      if (gvfs_metadata_call_set_many_sync (proxy,
+                                            batch->treefile,
+                                            g_variant_builder_end (&builder),
+                                            cancellable,
+                                            &my_error))
+        return TRUE;
+
+      if (!g_error_matches (my_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        {
+          g_propagate_error (error, my_error);
+          return FALSE;
+        }
+
+      /* Older metadata daemon, fall back to one call per path */
+      g_error_free (my_error);
+      g_atomic_int_set (&metadata_set_many_unsupported, TRUE);
+    }
+
+  for (i = 0; i < batch->paths->len; i++)
+    {
+      if (!gvfs_metadata_call_set_sync (proxy,
+                                        batch->treefile,
+                                        g_ptr_array_index (batch->paths, i),
+                                        g_ptr_array_index (batch->datas, i),
+                                        cancellable,
+                                        error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Sets metadata on path, data is the a{sv} built with
+ * _g_daemon_vfs_append_metadata_for_set() and is sunk if floating.
+ *
+ * Concurrent writers to the same tree are coalesced: whoever finds no
+ * call in flight sends everything queued so far as a single SetMany
+ * call, the others wait for the batch holding their data to finish.
+ * The call is made with the cancellable of the caller sending it.
+ */
+gboolean
+_g_daemon_vfs_set_metadata (GVfsMetadata *proxy,
+                            const char *treefile,
+                            const char *path,
+                            GVariant *data,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+  MetadataBatch *batch;
+  GError *my_error;
+  gboolean res;
+
+  G_LOCK (metadata_batch);
+
+  if (metadata_batches == NULL)
+    {
+      metadata_batches = g_hash_table_new (g_str_hash, g_str_equal);
+      metadata_batches_in_flight = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                          g_free, NULL);
+    }
+
+  batch = g_hash_table_lookup (metadata_batches, treefile);
+  if (batch == NULL)
+    {
+      batch = metadata_batch_new (treefile);
+      g_hash_table_insert (metadata_batches, batch->treefile, batch);
+    }
+
+  g_ptr_array_add (batch->paths, g_strdup (path));
+  g_ptr_array_add (batch->datas, g_variant_ref_sink (data));
+  batch->ref_count++;
+
+  while (!batch->done)
+    {
+      if (!batch->sent &&
+          !g_hash_table_contains (metadata_batches_in_flight, treefile))
+        {
+          g_hash_table_remove (metadata_batches, treefile);
+          g_hash_table_add (metadata_batches_in_flight, g_strdup (treefile));
+          batch->sent = TRUE;
+          G_UNLOCK (metadata_batch);
+
+          my_error = NULL;
+          metadata_batch_send (proxy, batch, cancellable, &my_error);
+
+          G_LOCK (metadata_batch);
+          g_hash_table_remove (metadata_batches_in_flight, treefile);
+          batch->error = my_error;
+          batch->done = TRUE;
+          g_cond_broadcast (&metadata_batch_cond);
+          /* The reference of metadata_batches */
+          metadata_batch_unref (batch);
+        }
+      else
+        g_cond_wait (&metadata_batch_cond, &G_LOCK_NAME (metadata_batch));
+    }
+
+  res = batch->error == NULL;
+  if (!res)
+    g_propagate_error (error, g_error_copy (batch->error));
+
+  metadata_batch_unref (batch);
+
+  G_UNLOCK (metadata_batch);
+
+  return res;
+}
+
 static gboolean
 g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 					const char *filename,
@@ -1347,12 +1576,11 @@ g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
                 }
 	      
 	      if (num_set > 0 &&
-	          ! gvfs_metadata_call_set_sync (proxy,
-	                                         metatreefile,
-	                                         tree_path,
-	                                         g_variant_builder_end (builder),
-	                                         NULL,
-	                                         error))
+	          ! _g_daemon_vfs_set_metadata (proxy,
+	                                        metatreefile,
+	                                        tree_path,
+	                                        g_variant_builder_end (builder),
+	                                        error))
                 {
 	          res = FALSE;
                   error = NULL; /* Don't set further errors */
@@ -78,6 +78,12 @@ int             _g_daemon_vfs_append_metadata_for_set  (GVariantBuilder *builder
 
 GVfsMetadata *  _g_daemon_vfs_get_metadata_proxy       (GCancellable             *cancellable,
                                                         GError                  **error);
+gboolean        _g_daemon_vfs_set_metadata             (GVfsMetadata             *proxy,
+                                                        const char               *treefile,
+                                                        const char               *path,
+                                                        GVariant                 *data,
+                                                        GCancellable             *cancellable,
+                                                        GError                  **error);
 
 
 
@@ -56,6 +56,9 @@ G_LOCK_DEFINE_STATIC(async_map);
 static GHashTable *obj_path_map = NULL;
 G_LOCK_DEFINE_STATIC(obj_path_map);
 
+/* protects the mount proxies cached on connections */
+G_LOCK_DEFINE_STATIC(mount_proxies);
+
 
 GQuark
 _g_vfs_error_quark (void)
@@ -176,6 +179,8 @@ connection_data_free (gpointer p)
   g_free (data);
 }
 
+static void drop_mount_proxies (GDBusConnection *connection);
+
 static void
 vfs_connection_closed (GDBusConnection *connection,
                        gboolean remote_peer_vanished,
@@ -187,6 +192,8 @@ vfs_connection_closed (GDBusConnection *connection,
   connection_data = g_object_get_data (G_OBJECT (connection), "connection_data");
   g_assert (connection_data != NULL);
 
+  drop_mount_proxies (connection);
+
   if (connection_data->async_dbus_id)
     {
       _g_daemon_vfs_invalidate_dbus_id (connection_data->async_dbus_id);
@@ -569,6 +576,14 @@ struct _ThreadLocalConnections {
 static void
 free_local_connections (ThreadLocalConnections *local)
 {
+  GHashTableIter iter;
+  GDBusConnection *connection;
+
+  /* cached proxies ref the connection */
+  g_hash_table_iter_init (&iter, local->connections);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &connection))
+    drop_mount_proxies (connection);
+
   g_hash_table_destroy (local->connections);
   g_clear_object (&local->session_bus);
   g_free (local);
@@ -579,12 +594,18 @@ invalidate_local_connection (const char *dbus_id,
 			     GError **error)
 {
   ThreadLocalConnections *local;
+  GDBusConnection *connection;
   
   _g_daemon_vfs_invalidate_dbus_id (dbus_id);
 
   local = g_private_get (&local_connections);
   if (local)
-    g_hash_table_remove (local->connections, dbus_id);
+    {
+      connection = g_hash_table_lookup (local->connections, dbus_id);
+      if (connection)
+        drop_mount_proxies (connection);
+      g_hash_table_remove (local->connections, dbus_id);
+    }
   
   g_set_error_literal (error,
 		       G_VFS_ERROR,
@@ -712,6 +733,225 @@ _g_dbus_connection_get_sync (const char *dbus_id,
   return connection;
 }
 
+/*************************************************************************
+ *               Caching of mount proxies                                *
+ *************************************************************************/
+
+/* Every connection caches the proxies created on it in a hash table of
+ * "dbus_id object_path" -> GVfsDBusMount. As the proxies ref the
+ * connection, the cache is dropped when the connection closes or when its
+ * thread goes away. */
+
+static char *
+mount_proxy_key (const char *dbus_id,
+                 const char *object_path)
+{
+  return g_strconcat (dbus_id ? dbus_id : "", " ", object_path, NULL);
+}
+
+static void
+drop_mount_proxies (GDBusConnection *connection)
+{
+  GHashTable *proxies;
+
+  G_LOCK (mount_proxies);
+  proxies = g_object_steal_data (G_OBJECT (connection), "mount_proxies");
+  G_UNLOCK (mount_proxies);
+
+  if (proxies)
+    g_hash_table_destroy (proxies);
+}
+
+static GVfsDBusMount *
+lookup_mount_proxy (GDBusConnection *connection,
+                    const char *dbus_id,
+                    const char *object_path)
+{
+  GHashTable *proxies;
+  GVfsDBusMount *proxy;
+  char *key;
+
+  proxy = NULL;
+  key = mount_proxy_key (dbus_id, object_path);
+
+  G_LOCK (mount_proxies);
+  proxies = g_object_get_data (G_OBJECT (connection), "mount_proxies");
+  if (proxies)
+    proxy = g_hash_table_lookup (proxies, key);
+  if (proxy)
+    g_object_ref (proxy);
+  G_UNLOCK (mount_proxies);
+
+  g_free (key);
+  return proxy;
+}
+
+static void
+cache_mount_proxy (GDBusConnection *connection,
+                   const char *dbus_id,
+                   const char *object_path,
+                   GVfsDBusMount *proxy)
+{
+  GHashTable *proxies;
+
+  /* Set infinite timeout, see bug 687534 */
+  g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (proxy), G_MAXINT);
+
+  G_LOCK (mount_proxies);
+  /* a closed connection would never drop the cache */
+  if (!g_dbus_connection_is_closed (connection))
+    {
+      proxies = g_object_get_data (G_OBJECT (connection), "mount_proxies");
+      if (proxies == NULL)
+        {
+          proxies = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+          g_object_set_data (G_OBJECT (connection), "mount_proxies", proxies);
+        }
+      g_hash_table_replace (proxies,
+                            mount_proxy_key (dbus_id, object_path),
+                            g_object_ref (proxy));
+    }
+  G_UNLOCK (mount_proxies);
+}
+
+/**
+ * _g_dbus_mount_proxy_new_sync:
+ * @connection: the connection to the mount daemon
+ * @dbus_id: the bus name of the mount daemon
+ * @object_path: the object path of the mount
+ * @cancellable: a cancellable
+ * @error: return location for an error
+ *
+ * Gets a proxy for the mount at @object_path, creating it only if none is
+ * cached for @connection yet. The proxy has an infinite timeout set.
+ *
+ * Returns: a new reference to the proxy or %NULL on error
+ **/
+GVfsDBusMount *
+_g_dbus_mount_proxy_new_sync (GDBusConnection *connection,
+                              const char *dbus_id,
+                              const char *object_path,
+                              GCancellable *cancellable,
+                              GError **error)
+{
+  GVfsDBusMount *proxy;
+
+  proxy = lookup_mount_proxy (connection, dbus_id, object_path);
+  if (proxy)
+    return proxy;
+
+  proxy = gvfs_dbus_mount_proxy_new_sync (connection,
+                                          G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                          dbus_id,
+                                          object_path,
+                                          cancellable,
+                                          error);
+  if (proxy)
+    cache_mount_proxy (connection, dbus_id, object_path, proxy);
+
+  return proxy;
+}
+
+typedef struct {
+  GSimpleAsyncResult *result;
+  GDBusConnection *connection;
+  char *dbus_id;
+  char *object_path;
+} AsyncMountProxyNew;
+
+static void
+async_mount_proxy_new_cb (GObject *source_object,
+                          GAsyncResult *res,
+                          gpointer user_data)
+{
+  AsyncMountProxyNew *data = user_data;
+  GVfsDBusMount *proxy;
+  GError *error = NULL;
+
+  proxy = gvfs_dbus_mount_proxy_new_finish (res, &error);
+  if (proxy == NULL)
+    g_simple_async_result_take_error (data->result, error);
+  else
+    {
+      cache_mount_proxy (data->connection, data->dbus_id, data->object_path, proxy);
+      g_simple_async_result_set_op_res_gpointer (data->result, proxy, g_object_unref);
+    }
+
+  g_simple_async_result_complete (data->result);
+
+  g_object_unref (data->result);
+  g_object_unref (data->connection);
+  g_free (data->dbus_id);
+  g_free (data->object_path);
+  g_free (data);
+}
+
+/**
+ * _g_dbus_mount_proxy_new:
+ * @connection: the connection to the mount daemon
+ * @dbus_id: the bus name of the mount daemon
+ * @object_path: the object path of the mount
+ * @cancellable: a cancellable
+ * @callback: callback to call when the proxy is ready
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of _g_dbus_mount_proxy_new_sync(). A cached proxy
+ * is returned from an idle callback.
+ **/
+void
+_g_dbus_mount_proxy_new (GDBusConnection *connection,
+                         const char *dbus_id,
+                         const char *object_path,
+                         GCancellable *cancellable,
+                         GAsyncReadyCallback callback,
+                         gpointer user_data)
+{
+  GSimpleAsyncResult *result;
+  AsyncMountProxyNew *data;
+  GVfsDBusMount *proxy;
+
+  result = g_simple_async_result_new (G_OBJECT (connection),
+                                      callback, user_data,
+                                      _g_dbus_mount_proxy_new);
+
+  proxy = lookup_mount_proxy (connection, dbus_id, object_path);
+  if (proxy)
+    {
+      g_simple_async_result_set_op_res_gpointer (result, proxy, g_object_unref);
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
+    }
+
+  data = g_new0 (AsyncMountProxyNew, 1);
+  data->result = result;
+  data->connection = g_object_ref (connection);
+  data->dbus_id = g_strdup (dbus_id);
+  data->object_path = g_strdup (object_path);
+
+  gvfs_dbus_mount_proxy_new (connection,
+                             G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                             dbus_id,
+                             object_path,
+                             cancellable,
+                             async_mount_proxy_new_cb,
+                             data);
+}
+
+GVfsDBusMount *
+_g_dbus_mount_proxy_new_finish (GAsyncResult *res,
+                                GError **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (res);
+
+  g_warn_if_fail (g_simple_async_result_get_source_tag (simple) == _g_dbus_mount_proxy_new);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+
+  return g_object_ref (g_simple_async_result_get_op_res_gpointer (simple));
+}
+
 /**
  * _g_simple_async_result_complete_with_cancellable:
  * @result: the result
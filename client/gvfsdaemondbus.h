@@ -25,6 +25,7 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <gvfsdbus.h>
 
 G_BEGIN_DECLS
 
@@ -60,6 +61,19 @@ void            _g_dbus_connection_get_for_async        (const char
                                                          GVfsAsyncDBusCallback           callback,
                                                          gpointer                        callback_data,
                                                          GCancellable                   *cancellable);
+GVfsDBusMount  *_g_dbus_mount_proxy_new_sync            (GDBusConnection                *connection,
+                                                         const char                     *dbus_id,
+                                                         const char                     *object_path,
+                                                         GCancellable                   *cancellable,
+                                                         GError                        **error);
+void            _g_dbus_mount_proxy_new                 (GDBusConnection                *connection,
+                                                         const char                     *dbus_id,
+                                                         const char                     *object_path,
+                                                         GCancellable                   *cancellable,
+                                                         GAsyncReadyCallback             callback,
+                                                         gpointer                        user_data);
+GVfsDBusMount  *_g_dbus_mount_proxy_new_finish          (GAsyncResult                   *res,
+                                                         GError                        **error);
 void        _g_simple_async_result_complete_with_cancellable
                                                         (GSimpleAsyncResult             *result,
                                                          GCancellable                   *cancellable);
@@ -62,6 +62,52 @@ typedef enum {
   FILE_OP_WRITE
 } FileOp;
 
+typedef struct {
+  gchar      *path;
+  gint        error;            /* 0, or the negated errno of a failed lookup */
+  struct stat stat;
+  gint        access_denied;    /* R_OK, W_OK and X_OK the backend refuses */
+  gint64      expires;
+  GList      *link;             /* in attr_cache_queue */
+} AttrCacheEntry;
+
+typedef struct {
+  gchar        *path;
+  GFile        *dir;
+} AttrCacheWatch;
+
+typedef struct {
+  GFileMonitor *monitor;        /* NULL if the backend can't monitor */
+  gint64        last_used;
+} AttrCacheMonitor;
+
+/* Reads on a file handle go to a small set of input streams, so the
+ * kernel's parallel read-ahead requests don't wait for each other and
+ * don't make a single stream seek back and forth. Each stream may be a
+ * connection of its own to the server, so the number can be lowered with
+ * GVFS_FUSE_READ_STREAMS, and a handle makes do with the streams it has
+ * once the backend refuses to open another one. */
+#define DEFAULT_READ_STREAMS  4
+
+/* Small reads fetch at least this much, the rest is kept in the handle's
+ * read cache for the reads that follow, in whatever order they come */
+#define READ_BLOCK_SIZE    (128 * 1024)
+#define READ_CACHE_BLOCKS  8
+
+/* Sequential writes are collected up to this size before they are sent
+ * to the output stream, which is a round trip to the daemon */
+#define WRITE_BUFFER_SIZE  (1024 * 1024)
+
+typedef struct {
+  GInputStream *stream;
+  goffset       pos;
+} ReadStream;
+
+typedef struct {
+  goffset   offset;
+  GBytes   *data;
+} ReadCacheBlock;
+
 typedef struct {
   gint      refcount;
 
@@ -70,10 +116,26 @@ typedef struct {
   FileOp    op;
   gpointer  stream;
   goffset   pos;
+
+  /* Positional reads, protected by mutex. Streams in use are not in
+   * read_streams, but count in n_read_streams. */
+  GQueue          read_streams;         /* idle, most recently used first */
+  guint           n_read_streams;
+  guint           max_read_streams;
+  guint           read_generation;      /* bumped when reads are dropped */
+  GCond           read_cond;
+  ReadCacheBlock  read_cache [READ_CACHE_BLOCKS];
+  guint           read_cache_next;
+
+  /* Writes not yet sent to the output stream, protected by mutex */
+  GByteArray     *write_buffer;
+  goffset         write_buffer_offset;
+  gint            write_error;          /* -errno of a failed flush, reported once */
 } FileHandle;
 
 static GThread        *subthread             = NULL;
 static GMainLoop      *subthread_main_loop   = NULL;
+static gint            unmounting            = FALSE;
 static GVfs           *gvfs                  = NULL;
 
 static GVolumeMonitor *volume_monitor        = NULL;
@@ -91,8 +153,57 @@ static GHashTable     *global_path_to_fh_map = NULL;
 static GHashTable     *global_active_fh_map  = NULL;
 
 static GDBusConnection *dbus_conn            = NULL;
+
+static guint           max_read_streams      = DEFAULT_READ_STREAMS;
 static guint            daemon_name_watcher;
 
+/* Largest write requests libfuse 2.x passes on, 32 pages */
+#define MAX_WRITE_SIZE (128 * 1024)
+
+/* How long the kernel may cache entries, attributes and failed lookups,
+ * in milliseconds; GVFS_FUSE_KERNEL_CACHE_TIMEOUT overrides it. Unlike
+ * our attribute cache, the kernel's isn't invalidated by file monitors,
+ * so this stays at the libfuse default for entries and attributes. */
+#define KERNEL_CACHE_DEFAULT_TIMEOUT_MSECS 1000
+
+/* Etags of files at their last open for reading. If a file's etag is
+ * unchanged at the next open, the kernel may keep its cached pages.
+ * Many backends build etags from the modification time in seconds, so
+ * the size is compared as well, and files modified in the last
+ * CONTENT_ETAG_SETTLE_SECS aren't trusted, as they may change again
+ * within the same second. Protected by global_mutex. */
+#define MAX_CONTENT_ETAGS        10000
+#define CONTENT_ETAG_SETTLE_SECS 2
+
+static GHashTable     *content_etags         = NULL;
+
+/* Results of getattr and of failed lookups, so tools that stat the same
+ * (or missing) paths over and over don't query the backend every time.
+ * Entries are queued in insertion order, which is also expiry order.
+ * The timeout (in milliseconds, 0 disables the cache) and the size can
+ * be tuned with GVFS_FUSE_ATTR_CACHE_TIMEOUT and GVFS_FUSE_ATTR_CACHE_SIZE;
+ * with GVFS_FUSE_ATTR_CACHE_STATS set, hit rates are printed regularly. */
+#define ATTR_CACHE_DEFAULT_TIMEOUT_MSECS   1000
+#define ATTR_CACHE_DEFAULT_SIZE            10000
+#define ATTR_CACHE_MAX_MONITORS            64
+#define ATTR_CACHE_STATS_INTERVAL_SECS     60
+
+static GMutex          attr_cache_mutex      = {NULL};
+static GHashTable     *attr_cache            = NULL;
+static GQueue          attr_cache_queue      = G_QUEUE_INIT;
+static GHashTable     *attr_cache_monitors   = NULL;
+static gint64          attr_cache_timeout    = ATTR_CACHE_DEFAULT_TIMEOUT_MSECS * 1000;
+static guint           attr_cache_size       = ATTR_CACHE_DEFAULT_SIZE;
+static guint           attr_cache_stats_id   = 0;
+
+static struct {
+  guint64 hits;
+  guint64 negative_hits;
+  guint64 misses;
+  guint64 evictions;
+  guint64 invalidations;
+} attr_cache_stats;
+
 /* ------- *
  * Helpers *
  * ------- */
@@ -212,6 +323,8 @@ file_handle_new (const gchar *path)
   file_handle = g_new0 (FileHandle, 1);
   file_handle->refcount = 1;
   g_mutex_init (&file_handle->mutex);
+  g_cond_init (&file_handle->read_cond);
+  file_handle->max_read_streams = max_read_streams;
   file_handle->op = FILE_OP_NONE;
   file_handle->path = g_strdup (path);
 
@@ -249,10 +362,50 @@ file_handle_unref (FileHandle *file_handle)
     }
 }
 
+/* Closing is a round trip to the daemon, so call this without fh->mutex
+ * held where possible */
+static void
+read_stream_free (ReadStream *reader)
+{
+  g_input_stream_close (reader->stream, NULL, NULL);
+  g_object_unref (reader->stream);
+  g_free (reader);
+}
+
+/* Closes the idle read streams and empties the read cache. Streams in
+ * use are closed when they are given back. The idle ones are closed right
+ * away, before a write stream may be opened on the file. */
+static void
+file_handle_drop_reads (FileHandle *file_handle)
+{
+  ReadStream *reader;
+  guint       i;
+
+  while ((reader = g_queue_pop_head (&file_handle->read_streams)) != NULL)
+    {
+      read_stream_free (reader);
+      file_handle->n_read_streams--;
+    }
+
+  for (i = 0; i < READ_CACHE_BLOCKS; i++)
+    {
+      if (file_handle->read_cache [i].data)
+        g_bytes_unref (file_handle->read_cache [i].data);
+      file_handle->read_cache [i].data = NULL;
+    }
+
+  file_handle->read_generation++;
+  g_cond_broadcast (&file_handle->read_cond);
+}
+
+static void file_handle_flush_writes (FileHandle *fh);
+
 static void
 file_handle_close_stream (FileHandle *file_handle)
 {
   debug_print ("file_handle_close_stream\n");
+  file_handle_flush_writes (file_handle);
+  file_handle_drop_reads (file_handle);
   if (file_handle->stream)
     {
       switch (file_handle->op)
@@ -282,6 +435,9 @@ file_handle_free (FileHandle *file_handle)
   g_hash_table_remove (global_active_fh_map, file_handle);
 
   file_handle_close_stream (file_handle);
+  if (file_handle->write_buffer)
+    g_byte_array_free (file_handle->write_buffer, TRUE);
+  g_cond_clear (&file_handle->read_cond);
   g_mutex_clear (&file_handle->mutex);
   g_free (file_handle->path);
   g_free (file_handle);
@@ -370,6 +526,59 @@ reindex_file_handle_for_path (const gchar *old_path, const gchar *new_path)
   g_mutex_unlock (&global_mutex);
 }
 
+/* Remembers the etag of path, returns TRUE if it is the one seen last time */
+static gboolean
+content_etag_unchanged (const gchar *path, const gchar *etag)
+{
+  const gchar *old_etag;
+  gboolean     unchanged;
+
+  g_mutex_lock (&global_mutex);
+
+  old_etag = g_hash_table_lookup (content_etags, path);
+  unchanged = old_etag && strcmp (old_etag, etag) == 0;
+
+  if (!unchanged)
+    {
+      /* Forgetting etags only costs a refill of the page cache */
+      if (g_hash_table_size (content_etags) >= MAX_CONTENT_ETAGS)
+        g_hash_table_remove_all (content_etags);
+      g_hash_table_insert (content_etags, g_strdup (path), g_strdup (etag));
+    }
+
+  g_mutex_unlock (&global_mutex);
+  return unchanged;
+}
+
+static void
+content_etag_forget (const gchar *path)
+{
+  g_mutex_lock (&global_mutex);
+  g_hash_table_remove (content_etags, path);
+  g_mutex_unlock (&global_mutex);
+}
+
+/* Returns what identifies the content of a file for content_etags, or
+ * NULL if it can't be told whether the content changed */
+static gchar *
+content_etag_for_file_info (GFileInfo *file_info)
+{
+  const gchar *etag;
+  guint64      mtime;
+
+  etag = g_file_info_get_etag (file_info);
+  if (etag == NULL ||
+      !g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_STANDARD_SIZE) ||
+      !g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    return NULL;
+
+  mtime = g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+  if (mtime + CONTENT_ETAG_SETTLE_SECS > (guint64) (g_get_real_time () / G_USEC_PER_SEC))
+    return NULL;
+
+  return g_strdup_printf ("%s:%" G_GOFFSET_FORMAT, etag, g_file_info_get_size (file_info));
+}
+
 static MountRecord *
 mount_record_new (GMount *mount)
 {
@@ -617,6 +826,367 @@ file_from_full_path (const gchar *path)
   return file;
 }
 
+/* --------------- *
+ * Attribute cache *
+ * --------------- */
+
+static void
+attr_cache_entry_free (AttrCacheEntry *entry)
+{
+  g_queue_delete_link (&attr_cache_queue, entry->link);
+  g_free (entry->path);
+  g_free (entry);
+}
+
+static void
+attr_cache_monitor_free (AttrCacheMonitor *monitor)
+{
+  if (monitor->monitor)
+    {
+      g_file_monitor_cancel (monitor->monitor);
+      g_object_unref (monitor->monitor);
+    }
+  g_free (monitor);
+}
+
+static void
+attr_cache_watch_free (AttrCacheWatch *watch)
+{
+  g_free (watch->path);
+  g_object_unref (watch->dir);
+  g_free (watch);
+}
+
+static void
+attr_cache_init (void)
+{
+  const gchar *value;
+
+  value = g_getenv ("GVFS_FUSE_ATTR_CACHE_TIMEOUT");
+  if (value)
+    attr_cache_timeout = g_ascii_strtoull (value, NULL, 10) * 1000;
+
+  value = g_getenv ("GVFS_FUSE_ATTR_CACHE_SIZE");
+  if (value)
+    attr_cache_size = g_ascii_strtoull (value, NULL, 10);
+
+  attr_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                      NULL, (GDestroyNotify) attr_cache_entry_free);
+  attr_cache_monitors = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, (GDestroyNotify) attr_cache_monitor_free);
+}
+
+static void
+attr_cache_print_stats (void)
+{
+  g_mutex_lock (&attr_cache_mutex);
+  g_print ("gvfsd-fuse attribute cache: %u entries, %u monitors, "
+           "%" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " negative hits, "
+           "%" G_GUINT64_FORMAT " misses, %" G_GUINT64_FORMAT " evictions, "
+           "%" G_GUINT64_FORMAT " invalidations\n",
+           g_hash_table_size (attr_cache), g_hash_table_size (attr_cache_monitors),
+           attr_cache_stats.hits, attr_cache_stats.negative_hits,
+           attr_cache_stats.misses, attr_cache_stats.evictions,
+           attr_cache_stats.invalidations);
+  g_mutex_unlock (&attr_cache_mutex);
+}
+
+static gboolean
+attr_cache_stats_cb (gpointer user_data)
+{
+  attr_cache_print_stats ();
+  return TRUE;
+}
+
+static void
+attr_cache_destroy (void)
+{
+  if (attr_cache_stats_id)
+    {
+      g_source_remove (attr_cache_stats_id);
+      attr_cache_print_stats ();
+    }
+
+  g_hash_table_destroy (attr_cache_monitors);
+  g_hash_table_destroy (attr_cache);
+}
+
+/* Must be called with attr_cache_mutex held */
+static void
+attr_cache_prune_locked (void)
+{
+  AttrCacheEntry *entry;
+  gint64          now = g_get_monotonic_time ();
+
+  while ((entry = g_queue_peek_head (&attr_cache_queue)) != NULL &&
+         entry->expires <= now)
+    g_hash_table_remove (attr_cache, entry->path);
+}
+
+static void
+attr_cache_insert_entry (const gchar *path, gint error, const struct stat *sbuf, gint access_denied)
+{
+  AttrCacheEntry *entry;
+
+  if (attr_cache_timeout == 0 || attr_cache_size == 0)
+    return;
+
+  entry = g_new0 (AttrCacheEntry, 1);
+  entry->path = g_strdup (path);
+  entry->error = error;
+  if (sbuf)
+    entry->stat = *sbuf;
+  entry->access_denied = access_denied;
+  entry->expires = g_get_monotonic_time () + attr_cache_timeout;
+
+  g_mutex_lock (&attr_cache_mutex);
+
+  g_hash_table_remove (attr_cache, path);
+  attr_cache_prune_locked ();
+
+  while (g_hash_table_size (attr_cache) >= attr_cache_size)
+    {
+      AttrCacheEntry *oldest = g_queue_peek_head (&attr_cache_queue);
+
+      g_hash_table_remove (attr_cache, oldest->path);
+      attr_cache_stats.evictions++;
+    }
+
+  g_queue_push_tail (&attr_cache_queue, entry);
+  entry->link = g_queue_peek_tail_link (&attr_cache_queue);
+  g_hash_table_insert (attr_cache, entry->path, entry);
+
+  g_mutex_unlock (&attr_cache_mutex);
+}
+
+static void
+attr_cache_insert (const gchar *path, const struct stat *sbuf, gint access_denied)
+{
+  attr_cache_insert_entry (path, 0, sbuf, access_denied);
+}
+
+static void
+attr_cache_insert_error (const gchar *path, gint error)
+{
+  attr_cache_insert_entry (path, error, NULL, 0);
+}
+
+/* Returns TRUE if path is cached. *error is then 0 and sbuf and
+ * access_denied are filled in, or *error is the cached failure */
+static gboolean
+attr_cache_lookup (const gchar *path, gint *error, struct stat *sbuf, gint *access_denied)
+{
+  AttrCacheEntry *entry;
+  gboolean        found = FALSE;
+
+  g_mutex_lock (&attr_cache_mutex);
+
+  entry = g_hash_table_lookup (attr_cache, path);
+  if (entry && entry->expires <= g_get_monotonic_time ())
+    {
+      g_hash_table_remove (attr_cache, path);
+      entry = NULL;
+    }
+
+  if (entry)
+    {
+      *error = entry->error;
+      if (entry->error == 0)
+        {
+          if (sbuf)
+            *sbuf = entry->stat;
+          if (access_denied)
+            *access_denied = entry->access_denied;
+          attr_cache_stats.hits++;
+        }
+      else
+        {
+          attr_cache_stats.negative_hits++;
+        }
+      found = TRUE;
+    }
+  else
+    {
+      attr_cache_stats.misses++;
+    }
+
+  g_mutex_unlock (&attr_cache_mutex);
+
+  return found;
+}
+
+/* Drops expired entries, so listing large directories doesn't make the
+ * cache grow without bounds */
+static void
+attr_cache_prune (void)
+{
+  g_mutex_lock (&attr_cache_mutex);
+  attr_cache_prune_locked ();
+  g_mutex_unlock (&attr_cache_mutex);
+}
+
+static void
+attr_cache_invalidate (const gchar *path)
+{
+  g_mutex_lock (&attr_cache_mutex);
+  if (g_hash_table_remove (attr_cache, path))
+    attr_cache_stats.invalidations++;
+  g_mutex_unlock (&attr_cache_mutex);
+}
+
+static gboolean
+attr_cache_entry_in_tree (gpointer key, gpointer value, gpointer path)
+{
+  return g_str_has_prefix (key, path) && ((gchar *) key)[strlen (path)] == '/';
+}
+
+/* Drops path and everything below it */
+static void
+attr_cache_invalidate_tree (const gchar *path)
+{
+  g_mutex_lock (&attr_cache_mutex);
+  if (g_hash_table_remove (attr_cache, path))
+    attr_cache_stats.invalidations++;
+  attr_cache_stats.invalidations +=
+    g_hash_table_foreach_remove (attr_cache, attr_cache_entry_in_tree, (gpointer) path);
+  g_mutex_unlock (&attr_cache_mutex);
+}
+
+/* Drops path, everything below it and its parent directory, whose
+ * modification time changes when entries are added or removed */
+static void
+attr_cache_invalidate_dirent (const gchar *path)
+{
+  gchar *parent;
+
+  attr_cache_invalidate_tree (path);
+
+  parent = g_path_get_dirname (path);
+  attr_cache_invalidate (parent);
+  g_free (parent);
+}
+
+static void
+attr_cache_invalidate_monitored_file (AttrCacheWatch *watch, GFile *file)
+{
+  gchar *relative;
+  gchar *path;
+
+  if (g_file_equal (file, watch->dir))
+    {
+      attr_cache_invalidate_tree (watch->path);
+      return;
+    }
+
+  relative = g_file_get_relative_path (watch->dir, file);
+  if (!relative)
+    return;
+
+  path = g_strconcat (watch->path, "/", relative, NULL);
+  attr_cache_invalidate_tree (path);
+  attr_cache_invalidate (watch->path);
+
+  g_free (path);
+  g_free (relative);
+}
+
+static void
+attr_cache_monitor_changed (GFileMonitor      *monitor,
+                            GFile             *file,
+                            GFile             *other_file,
+                            GFileMonitorEvent  event_type,
+                            AttrCacheWatch    *watch)
+{
+  if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT)
+    return;
+
+  attr_cache_invalidate_monitored_file (watch, file);
+  if (other_file)
+    attr_cache_invalidate_monitored_file (watch, other_file);
+}
+
+/* Starts monitoring a directory whose children were cached, if the
+ * backend supports it, so changes made by others are picked up before
+ * the entries expire. Only the most recently listed directories are
+ * monitored. */
+static void
+attr_cache_monitor_directory (const gchar *path, GFile *dir)
+{
+  AttrCacheMonitor *monitor;
+  AttrCacheMonitor *stale      = NULL;
+  gchar            *stale_path = NULL;
+  GFileMonitor     *file_monitor;
+  AttrCacheWatch   *watch;
+  GHashTableIter    iter;
+  gpointer          key, value;
+
+  if (attr_cache_timeout == 0 || attr_cache_size == 0)
+    return;
+
+  g_mutex_lock (&attr_cache_mutex);
+  monitor = g_hash_table_lookup (attr_cache_monitors, path);
+  if (monitor)
+    monitor->last_used = g_get_monotonic_time ();
+  g_mutex_unlock (&attr_cache_mutex);
+
+  if (monitor)
+    return;
+
+  /* Set up outside the lock, this is a round trip to the daemon */
+  file_monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_SEND_MOVED, NULL, NULL);
+  if (file_monitor)
+    {
+      watch = g_new0 (AttrCacheWatch, 1);
+      watch->path = g_strdup (path);
+      watch->dir = g_object_ref (dir);
+
+      /* The closure keeps the watch alive while a signal is being emitted */
+      g_signal_connect_data (file_monitor, "changed",
+                             G_CALLBACK (attr_cache_monitor_changed), watch,
+                             (GClosureNotify) attr_cache_watch_free, 0);
+    }
+
+  monitor = g_new0 (AttrCacheMonitor, 1);
+  monitor->monitor = file_monitor;
+  monitor->last_used = g_get_monotonic_time ();
+
+  g_mutex_lock (&attr_cache_mutex);
+
+  if (g_hash_table_lookup (attr_cache_monitors, path))
+    {
+      /* Someone else was faster */
+      stale = monitor;
+    }
+  else
+    {
+      if (g_hash_table_size (attr_cache_monitors) >= ATTR_CACHE_MAX_MONITORS)
+        {
+          g_hash_table_iter_init (&iter, attr_cache_monitors);
+          while (g_hash_table_iter_next (&iter, &key, &value))
+            {
+              AttrCacheMonitor *candidate = value;
+
+              if (!stale || candidate->last_used < stale->last_used)
+                {
+                  stale = candidate;
+                  stale_path = key;
+                }
+            }
+
+          /* Freed below, outside the lock */
+          g_hash_table_steal (attr_cache_monitors, stale_path);
+        }
+
+      g_hash_table_insert (attr_cache_monitors, g_strdup (path), monitor);
+    }
+
+  g_mutex_unlock (&attr_cache_mutex);
+
+  if (stale)
+    attr_cache_monitor_free (stale);
+  g_free (stale_path);
+}
+
 /* ------------- *
  * VFS functions *
  * ------------- */
@@ -723,56 +1293,82 @@ file_info_get_stat_mode (GFileInfo *file_info)
   return unix_mode;
 }
 
-static gint
-getattr_for_file (GFile *file, struct stat *sbuf)
+#define GETATTR_ATTRIBUTES                   \
+  G_FILE_ATTRIBUTE_STANDARD_TYPE ","         \
+  G_FILE_ATTRIBUTE_STANDARD_NAME ","         \
+  G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","   \
+  G_FILE_ATTRIBUTE_STANDARD_SIZE ","         \
+  G_FILE_ATTRIBUTE_UNIX_MODE ","             \
+  G_FILE_ATTRIBUTE_TIME_CHANGED ","          \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED ","         \
+  G_FILE_ATTRIBUTE_TIME_ACCESS ","           \
+  G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE ","       \
+  G_FILE_ATTRIBUTE_UNIX_BLOCKS ","           \
+  "access::*"
+
+static void
+getattr_from_file_info (GFileInfo *file_info, struct stat *sbuf)
 {
-  GFileInfo *file_info;
-  GError    *error  = NULL;
-  gint       result = 0;
+  GTimeVal mod_time;
 
-  file_info = g_file_query_info (file, 
-                                 G_FILE_ATTRIBUTE_STANDARD_TYPE ","
-                                 G_FILE_ATTRIBUTE_STANDARD_NAME ","
-                                 G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","
-                                 G_FILE_ATTRIBUTE_STANDARD_SIZE ","
-                                 G_FILE_ATTRIBUTE_UNIX_MODE ","
-                                 G_FILE_ATTRIBUTE_TIME_CHANGED ","
-                                 G_FILE_ATTRIBUTE_TIME_MODIFIED ","
-                                 G_FILE_ATTRIBUTE_TIME_ACCESS ","
-                                 G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE ","
-                                 G_FILE_ATTRIBUTE_UNIX_BLOCKS ","
-				 "access::*",
-                                 0, NULL, &error);
+  sbuf->st_mode = file_info_get_stat_mode (file_info);
+  sbuf->st_size = g_file_info_get_size (file_info);
+  sbuf->st_uid = daemon_uid;
+  sbuf->st_gid = daemon_gid;
 
-  if (file_info)
-    {
-      GTimeVal mod_time;
+  g_file_info_get_modification_time (file_info, &mod_time);
+  sbuf->st_mtime = mod_time.tv_sec;
+  sbuf->st_ctime = mod_time.tv_sec;
+  sbuf->st_atime = mod_time.tv_sec;
 
-      sbuf->st_mode = file_info_get_stat_mode (file_info);
-      sbuf->st_size = g_file_info_get_size (file_info);
-      sbuf->st_uid = daemon_uid;
-      sbuf->st_gid = daemon_gid;
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED))
+    sbuf->st_ctime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED);
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS))
+    sbuf->st_atime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS);
 
-      g_file_info_get_modification_time (file_info, &mod_time);
-      sbuf->st_mtime = mod_time.tv_sec;
-      sbuf->st_ctime = mod_time.tv_sec;
-      sbuf->st_atime = mod_time.tv_sec;
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE))
+    sbuf->st_blksize = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE);
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS))
+    sbuf->st_blocks = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS);
+  else /* fake it to make 'du' work like 'du --apparent'. */
+    sbuf->st_blocks = (sbuf->st_size + 511) / 512;
 
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED))
-        sbuf->st_ctime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED);
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS))
-        sbuf->st_atime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+  /* Setting st_nlink to 1 for directories makes 'find' work */
+  sbuf->st_nlink = 1;
+}
 
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE))
-	sbuf->st_blksize = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE);
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS))
-	sbuf->st_blocks = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS);
-      else /* fake it to make 'du' work like 'du --apparent'. */
-	sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+static gint
+file_info_get_access_denied (GFileInfo *file_info)
+{
+  gint access_denied = 0;
+
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) &&
+      !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ))
+    access_denied |= R_OK;
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE) &&
+      !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE))
+    access_denied |= W_OK;
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE) &&
+      !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE))
+    access_denied |= X_OK;
+
+  return access_denied;
+}
+
+static gint
+getattr_for_file (GFile *file, struct stat *sbuf, gint *access_denied)
+{
+  GFileInfo *file_info;
+  GError    *error  = NULL;
+  gint       result = 0;
 
-      /* Setting st_nlink to 1 for directories makes 'find' work */
-      sbuf->st_nlink = 1;
+  file_info = g_file_query_info (file, GETATTR_ATTRIBUTES, 0, NULL, &error);
 
+  if (file_info)
+    {
+      getattr_from_file_info (file_info, sbuf);
+      if (access_denied)
+        *access_denied = file_info_get_access_denied (file_info);
       g_object_unref (file_info);
     }
   else
@@ -793,6 +1389,33 @@ getattr_for_file (GFile *file, struct stat *sbuf)
   return result;
 }
 
+/* Like getattr_for_file(), but answers from the attribute cache when it
+ * can and caches what the backend returned otherwise */
+static gint
+getattr_for_path (const gchar *path, GFile *file, struct stat *sbuf, gint *access_denied)
+{
+  gint file_access_denied = 0;
+  gint result;
+
+  if (attr_cache_lookup (path, &result, sbuf, access_denied))
+    return result;
+
+  result = getattr_for_file (file, sbuf, &file_access_denied);
+
+  if (result == 0)
+    {
+      if (access_denied)
+        *access_denied = file_access_denied;
+      attr_cache_insert (path, sbuf, file_access_denied);
+    }
+  else if (result == -ENOENT)
+    {
+      attr_cache_insert_error (path, result);
+    }
+
+  return result;
+}
+
 static void
 getattr_for_file_handle (FileHandle *fh, struct stat *sbuf)
 {
@@ -801,6 +1424,8 @@ getattr_for_file_handle (FileHandle *fh, struct stat *sbuf)
   sbuf->st_gid = daemon_gid;
   sbuf->st_nlink = 1;
   sbuf->st_size = fh->pos;
+  if (fh->write_buffer && fh->write_buffer->len > 0)
+    sbuf->st_size = MAX (sbuf->st_size, fh->write_buffer_offset + fh->write_buffer->len);
   sbuf->st_blksize = 512;
   sbuf->st_blocks = (sbuf->st_size + 511) / 512;
 }
@@ -843,9 +1468,24 @@ vfs_getattr (const gchar *path, struct stat *sbuf)
     {
       /* Submount */
 
-      result = getattr_for_file (file, sbuf);
+      result = getattr_for_path (path, file, sbuf, NULL);
 
-      if (result != 0)
+      if (result == 0)
+        {
+          FileHandle *fh = get_file_handle_for_path (path);
+
+          /* The backend doesn't know about writes that are still buffered */
+          if (fh != NULL)
+            {
+              g_mutex_lock (&fh->mutex);
+              if (fh->write_buffer && fh->write_buffer->len > 0)
+                sbuf->st_size = MAX (sbuf->st_size, fh->write_buffer_offset + fh->write_buffer->len);
+              g_mutex_unlock (&fh->mutex);
+
+              file_handle_unref (fh);
+            }
+        }
+      else
         {
           FileHandle *fh = get_file_handle_for_path (path);
 
@@ -907,6 +1547,7 @@ setup_input_stream (GFile *file, FileHandle *fh)
         {
           debug_print ("setup_input_stream: doing write\n");
 
+          file_handle_flush_writes (fh);
           g_output_stream_close (fh->stream, NULL, NULL);
           g_object_unref (fh->stream);
           fh->stream = NULL;
@@ -941,6 +1582,8 @@ setup_output_stream (GFile *file, FileHandle *fh, int flags)
   GError *error  = NULL;
   gint    result = 0;
 
+  file_handle_drop_reads (fh);
+
   if (fh->stream)
     {
       if (fh->op == FILE_OP_WRITE)
@@ -1019,7 +1662,12 @@ vfs_open (const gchar *path, struct fuse_file_info *fi)
       GFileInfo *file_info;
       GError    *error = NULL;
 
-      file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, &error);
+      file_info = g_file_query_info (file,
+                                     G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                     G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                     G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                                     G_FILE_ATTRIBUTE_ETAG_VALUE,
+                                     0, NULL, &error);
 
       if (file_info)
         {
@@ -1027,7 +1675,18 @@ vfs_open (const gchar *path, struct fuse_file_info *fi)
 
           if (file_type == G_FILE_TYPE_REGULAR)
             {
+              gchar *etag = content_etag_for_file_info (file_info);
+
               result = open_common (path, fi, file, 0);
+
+              /* Pages cached from an unchanged file are still good */
+              if (result == 0 && etag &&
+                  !(fi->flags & O_WRONLY || fi->flags & O_RDWR || fi->flags & O_TRUNC))
+                fi->keep_cache = content_etag_unchanged (path, etag);
+              else if (result == 0 && !etag)
+                content_etag_forget (path);
+
+              g_free (etag);
             }
           else if (file_type == G_FILE_TYPE_DIRECTORY)
             {
@@ -1136,6 +1795,8 @@ vfs_create (const gchar *path, mode_t mode, struct fuse_file_info *fi)
       result = -ENOENT;
     }
 
+  attr_cache_invalidate_dirent (path);
+
   debug_print ("vfs_create: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1145,31 +1806,35 @@ static gint
 vfs_release (const gchar *path, struct fuse_file_info *fi)
 {
   FileHandle *fh = get_file_handle_from_info (fi);
+  gint        result = 0;
 
   debug_print ("vfs_release: %s\n", path);
 
   if (fh)
     {
+      g_mutex_lock (&fh->mutex);
+      file_handle_flush_writes (fh);
+      result = file_handle_take_write_error (fh);
+      g_mutex_unlock (&fh->mutex);
+
       /* get_file_handle_from_info () adds a "working ref", so unref twice. */
       file_handle_unref (fh);
       file_handle_unref (fh);
     }
 
-  return 0;
+  return result;
 }
 
 static gint
-read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t offset)
+read_stream (GInputStream *input_stream, goffset *pos,
+             gchar *output_buf, size_t output_buf_size, off_t offset)
 {
-  GInputStream *input_stream;
   gint          n_bytes_skipped = 0;
   gint          n_bytes_read    = 0;
   gint          result          = 0;
   GError       *error           = NULL;
 
-  input_stream = fh->stream;
-
-  if (offset != fh->pos)
+  if (offset != *pos)
     {
       if (g_seekable_can_seek (G_SEEKABLE (input_stream)))
         {
@@ -1179,7 +1844,7 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
 
           if (g_seekable_seek (G_SEEKABLE (input_stream), offset, G_SEEK_SET, NULL, &error))
             {
-              fh->pos = offset;
+              *pos = offset;
             }
           else
             {
@@ -1187,18 +1852,18 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
               g_error_free (error);
             }
         }
-      else if (offset > fh->pos)
+      else if (offset > *pos)
         {
           /* Can skip ahead */
 
           debug_print ("read_stream: skipping to offset %d.\n", offset);
 
-          n_bytes_skipped = g_input_stream_skip (input_stream, offset - fh->pos, NULL, &error);
+          n_bytes_skipped = g_input_stream_skip (input_stream, offset - *pos, NULL, &error);
 
           if (n_bytes_skipped > 0)
-            fh->pos += n_bytes_skipped;
+            *pos += n_bytes_skipped;
 
-          if (n_bytes_skipped != offset - fh->pos)
+          if (n_bytes_skipped != offset - *pos)
             {
               if (error)
                 {
@@ -1236,7 +1901,7 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
                                                  &error);
 
           n_bytes_read += part_bytes_read;
-          fh->pos += part_bytes_read;
+          *pos += part_bytes_read;
 
           if (!part_result || part_bytes_read == 0)
             break;
@@ -1259,6 +1924,242 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
   return result;
 }
 
+static gboolean
+read_cache_lookup (FileHandle *fh, gchar *buf, size_t size, off_t offset, gint *n_bytes)
+{
+  guint i;
+
+  for (i = 0; i < READ_CACHE_BLOCKS; i++)
+    {
+      ReadCacheBlock *block = &fh->read_cache [i];
+      gsize           block_size;
+
+      if (!block->data || offset < block->offset)
+        continue;
+
+      block_size = g_bytes_get_size (block->data);
+
+      /* A short block ends at the end of the file */
+      if (offset + size <= block->offset + block_size ||
+          (block_size < READ_BLOCK_SIZE && offset <= block->offset + block_size))
+        {
+          *n_bytes = MIN (size, block->offset + block_size - offset);
+          memcpy (buf, (const gchar *) g_bytes_get_data (block->data, NULL) + (offset - block->offset), *n_bytes);
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static void
+read_cache_insert (FileHandle *fh, GBytes *data, off_t offset)
+{
+  ReadCacheBlock *block = &fh->read_cache [fh->read_cache_next];
+
+  if (block->data)
+    g_bytes_unref (block->data);
+
+  block->offset = offset;
+  block->data = g_bytes_ref (data);
+
+  fh->read_cache_next = (fh->read_cache_next + 1) % READ_CACHE_BLOCKS;
+}
+
+static gboolean
+read_stream_can_serve (ReadStream *reader, off_t offset)
+{
+  /* Streams that can't seek only skip forward */
+  return reader->pos <= offset || g_seekable_can_seek (G_SEEKABLE (reader->stream));
+}
+
+/* Takes the idle stream that is already at offset, or opens a new one if
+ * the handle may have more. Otherwise takes the least recently used
+ * stream that can get to offset, or replaces one that can't by a new
+ * stream. The replaced stream is returned in evicted, for the caller to
+ * close after releasing fh->mutex. */
+static ReadStream *
+read_streams_pick (FileHandle *fh, off_t offset, gboolean *open_new, ReadStream **evicted)
+{
+  GList *l;
+
+  *open_new = FALSE;
+  *evicted = NULL;
+
+  for (l = fh->read_streams.head; l != NULL; l = l->next)
+    {
+      ReadStream *reader = l->data;
+
+      if (reader->pos == offset)
+        {
+          g_queue_delete_link (&fh->read_streams, l);
+          return reader;
+        }
+    }
+
+  if (fh->n_read_streams < fh->max_read_streams)
+    {
+      fh->n_read_streams++;
+      *open_new = TRUE;
+      return NULL;
+    }
+
+  for (l = fh->read_streams.tail; l != NULL; l = l->prev)
+    {
+      ReadStream *reader = l->data;
+
+      if (read_stream_can_serve (reader, offset))
+        {
+          g_queue_delete_link (&fh->read_streams, l);
+          return reader;
+        }
+    }
+
+  *evicted = g_queue_pop_tail (&fh->read_streams);
+  *open_new = *evicted != NULL;
+
+  return NULL;
+}
+
+/* Called with fh->mutex held, which is released while reading, so
+ * several reads on one handle can be in flight */
+static gint
+file_handle_read (FileHandle *fh, GFile *file, gchar *buf, size_t size, off_t offset)
+{
+  ReadStream *reader = NULL;
+  ReadStream *evicted;
+  GBytes     *block  = NULL;
+  gchar      *fetch_buf;
+  gsize       fetch_size;
+  gboolean    open_new;
+  gboolean    keep;
+  guint       generation;
+  gint        result;
+
+  if (read_cache_lookup (fh, buf, size, offset, &result))
+    return result;
+
+  if (fh->op == FILE_OP_WRITE)
+    {
+      file_handle_close_stream (fh);
+    }
+  else if (fh->op == FILE_OP_READ)
+    {
+      /* Adopt the stream set up by open() */
+      reader = g_new0 (ReadStream, 1);
+      reader->stream = fh->stream;
+      reader->pos = fh->pos;
+      g_queue_push_head (&fh->read_streams, reader);
+      fh->n_read_streams++;
+
+      fh->stream = NULL;
+      fh->op = FILE_OP_NONE;
+    }
+
+  result = 0;
+  for (;;)
+    {
+      GError *error = NULL;
+
+      while ((reader = read_streams_pick (fh, offset, &open_new, &evicted)) == NULL && !open_new)
+        g_cond_wait (&fh->read_cond, &fh->mutex);
+
+      generation = fh->read_generation;
+      g_mutex_unlock (&fh->mutex);
+
+      if (evicted)
+        read_stream_free (evicted);
+
+      if (!open_new)
+        break;
+
+      debug_print ("file_handle_read: opening another stream\n");
+
+      reader = g_new0 (ReadStream, 1);
+      reader->stream = G_INPUT_STREAM (g_file_read (file, NULL, &error));
+      if (reader->stream)
+        break;
+
+      g_free (reader);
+      reader = NULL;
+
+      g_mutex_lock (&fh->mutex);
+      if (fh->n_read_streams > 1)
+        {
+          /* The backend may be out of connections, use the streams
+           * this handle already has from now on */
+          debug_print ("file_handle_read: %s, limiting to %u streams\n",
+                       error->message, fh->n_read_streams - 1);
+          fh->n_read_streams--;
+          fh->max_read_streams = fh->n_read_streams;
+          g_error_free (error);
+          continue;
+        }
+      g_mutex_unlock (&fh->mutex);
+
+      result = -errno_from_error (error);
+      g_error_free (error);
+      break;
+    }
+
+  if (reader)
+    {
+      fetch_size = MAX (size, READ_BLOCK_SIZE);
+      fetch_buf = fetch_size > size ? g_malloc (fetch_size) : buf;
+
+      result = read_stream (reader->stream, &reader->pos, fetch_buf, fetch_size, offset);
+
+      if (fetch_buf != buf)
+        {
+          if (result > 0)
+            {
+              memcpy (buf, fetch_buf, MIN ((gsize) result, size));
+              block = g_bytes_new_take (fetch_buf, result);
+              result = MIN ((gsize) result, size);
+            }
+          else
+            {
+              g_free (fetch_buf);
+            }
+        }
+    }
+
+  if (reader && result >= 0)
+    {
+      g_mutex_lock (&fh->mutex);
+      keep = generation == fh->read_generation;
+      if (!keep)
+        g_mutex_unlock (&fh->mutex);
+    }
+  else
+    {
+      keep = FALSE;
+    }
+
+  if (keep)
+    {
+      g_queue_push_head (&fh->read_streams, reader);
+      if (block)
+        read_cache_insert (fh, block, offset);
+    }
+  else
+    {
+      /* Still counted while closing, so no stream is opened in its place
+       * before it's gone */
+      if (reader)
+        read_stream_free (reader);
+      g_mutex_lock (&fh->mutex);
+      fh->n_read_streams--;
+    }
+
+  if (block)
+    g_bytes_unref (block);
+
+  g_cond_signal (&fh->read_cond);
+
+  return result;
+}
+
 static gint
 vfs_read (const gchar *path, gchar *buf, size_t size,
           off_t offset, struct fuse_file_info *fi)
@@ -1275,18 +2176,7 @@ vfs_read (const gchar *path, gchar *buf, size_t size,
       if (fh)
         {
           g_mutex_lock (&fh->mutex);
-
-          result = setup_input_stream (file, fh);
-
-          if (result == 0)
-            {
-              result = read_stream (fh, buf, size, offset);
-            }
-          else
-            {
-              debug_print ("vfs_read: failed to setup input_stream!\n");
-            }
-
+          result = file_handle_read (fh, file, buf, size, offset);
           g_mutex_unlock (&fh->mutex);
           file_handle_unref (fh);
         }
@@ -1387,6 +2277,74 @@ write_stream (FileHandle *fh, const gchar *input_buf, size_t input_buf_size, off
   return result;
 }
 
+/* Sends the buffered writes to the output stream. vfs_write() already
+ * reported success for them, so a failure is kept in write_error until
+ * it can be returned by file_handle_take_write_error(). */
+static void
+file_handle_flush_writes (FileHandle *fh)
+{
+  gint result;
+
+  if (!fh->write_buffer || fh->write_buffer->len == 0)
+    return;
+
+  result = write_stream (fh, (const gchar *) fh->write_buffer->data,
+                         fh->write_buffer->len, fh->write_buffer_offset);
+  g_byte_array_set_size (fh->write_buffer, 0);
+
+  if (result < 0 && fh->write_error == 0)
+    fh->write_error = result;
+}
+
+static gint
+file_handle_take_write_error (FileHandle *fh)
+{
+  gint result = fh->write_error;
+
+  fh->write_error = 0;
+  return result;
+}
+
+/* Coalesces sequential writes, a discontiguous one sends what was
+ * buffered so far */
+static gint
+file_handle_write (FileHandle *fh, const gchar *buf, size_t len, off_t offset)
+{
+  gint result;
+
+  /* An earlier buffered write failed */
+  result = file_handle_take_write_error (fh);
+  if (result < 0)
+    return result;
+
+  if (!fh->write_buffer)
+    fh->write_buffer = g_byte_array_sized_new (WRITE_BUFFER_SIZE);
+
+  if (fh->write_buffer->len > 0 &&
+      offset != fh->write_buffer_offset + fh->write_buffer->len)
+    {
+      file_handle_flush_writes (fh);
+      result = file_handle_take_write_error (fh);
+      if (result < 0)
+        return result;
+    }
+
+  if (fh->write_buffer->len == 0)
+    fh->write_buffer_offset = offset;
+
+  g_byte_array_append (fh->write_buffer, (const guint8 *) buf, len);
+
+  if (fh->write_buffer->len >= WRITE_BUFFER_SIZE)
+    {
+      file_handle_flush_writes (fh);
+      result = file_handle_take_write_error (fh);
+      if (result < 0)
+        return result;
+    }
+
+  return len;
+}
+
 static gint
 vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
            struct fuse_file_info *fi)
@@ -1407,7 +2365,7 @@ vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
           result = setup_output_stream (file, fh, 0);
           if (result == 0)
             {
-              result = write_stream (fh, buf, len, offset);
+              result = file_handle_write (fh, buf, len, offset);
             }
 
           g_mutex_unlock (&fh->mutex);
@@ -1425,6 +2383,8 @@ vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
       result = -EIO;
     }
 
+  attr_cache_invalidate (path);
+
   if (result < 0)
     debug_print ("vfs_write: -> %s\n", g_strerror (-result));
   else
@@ -1437,6 +2397,7 @@ static gint
 vfs_flush (const gchar *path, struct fuse_file_info *fi)
 {
   FileHandle *fh = get_file_handle_from_info (fi);
+  gint        result = 0;
 
   debug_print ("vfs_flush: %s\n", path);
 
@@ -1444,20 +2405,24 @@ vfs_flush (const gchar *path, struct fuse_file_info *fi)
     {
       g_mutex_lock (&fh->mutex);
       file_handle_close_stream (fh);
+      result = file_handle_take_write_error (fh);
       g_mutex_unlock (&fh->mutex);
 
       /* get_file_handle_from_info () adds a "working ref", so release that. */
       file_handle_unref (fh);
     }
 
-  /* TODO: Error handling. */
-  return 0;
+  /* Closing the stream may have changed the size */
+  attr_cache_invalidate (path);
+
+  return result;
 }
 
 static gint
 vfs_fsync (const gchar *path, gint sync_data_only, struct fuse_file_info *fi)
 {
   FileHandle *fh = get_file_handle_from_info (fi);
+  gint        result = 0;
 
   debug_print ("vfs_flush: %s\n", path);
 
@@ -1465,14 +2430,14 @@ vfs_fsync (const gchar *path, gint sync_data_only, struct fuse_file_info *fi)
     {
       g_mutex_lock (&fh->mutex);
       file_handle_close_stream (fh);
+      result = file_handle_take_write_error (fh);
       g_mutex_unlock (&fh->mutex);
 
       /* get_file_handle_from_info () adds a "working ref", so release that. */
       file_handle_unref (fh);
     }
 
-  /* TODO: Error handling. */
-  return 0;
+  return result;
 }
 
 static gint
@@ -1506,15 +2471,19 @@ vfs_opendir (const gchar *path, struct fuse_file_info *fi)
 }
 
 static gint
-readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
+readdir_for_file (const gchar *path, GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
 {
   GFileEnumerator *enumerator;
   GFileInfo       *file_info;
   GError          *error = NULL;
+  struct stat      sbuf;
+  gchar           *child_path;
 
   g_assert (base_file != NULL);
 
-  enumerator = g_file_enumerate_children (base_file, G_FILE_ATTRIBUTE_STANDARD_NAME, 0, NULL, &error);
+  /* Get the attributes getattr needs right away, so listing a directory
+   * with its attributes takes one round trip instead of one per file */
+  enumerator = g_file_enumerate_children (base_file, GETATTR_ATTRIBUTES, 0, NULL, &error);
   if (!enumerator)
     {
       gint result;
@@ -1537,9 +2506,20 @@ readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
   filler (buf, ".", NULL, 0);
   filler (buf, "..", NULL, 0);
 
+  attr_cache_prune ();
+  attr_cache_monitor_directory (path, base_file);
+
   while ((file_info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
     {
-      filler (buf, g_file_info_get_name (file_info), NULL, 0);
+      memset (&sbuf, 0, sizeof (sbuf));
+      sbuf.st_blksize = 4096;
+      getattr_from_file_info (file_info, &sbuf);
+
+      child_path = g_strconcat (path, "/", g_file_info_get_name (file_info), NULL);
+      attr_cache_insert (child_path, &sbuf, file_info_get_access_denied (file_info));
+      g_free (child_path);
+
+      filler (buf, g_file_info_get_name (file_info), &sbuf, 0);
       g_object_unref (file_info);
     }
 
@@ -1581,7 +2561,7 @@ vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offs
     {
       /* Submount */
 
-      result = readdir_for_file (base_file, buf, filler);
+      result = readdir_for_file (path, base_file, buf, filler);
 
       g_object_unref (base_file);
     }
@@ -1654,6 +2634,11 @@ vfs_rename (const gchar *old_path, const gchar *new_path)
   if (new_file)
     g_object_unref (new_file);
 
+  attr_cache_invalidate_dirent (old_path);
+  attr_cache_invalidate_dirent (new_path);
+  content_etag_forget (old_path);
+  content_etag_forget (new_path);
+
   debug_print ("vfs_rename: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1703,6 +2688,9 @@ vfs_unlink (const gchar *path)
       result = -ENOENT;
     }
 
+  attr_cache_invalidate_dirent (path);
+  content_etag_forget (path);
+
   debug_print ("vfs_unlink: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1741,6 +2729,8 @@ vfs_mkdir (const gchar *path, mode_t mode)
       result = -ENOENT;
     }
 
+  attr_cache_invalidate_dirent (path);
+
   debug_print ("vfs_mkdir: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1797,6 +2787,8 @@ vfs_rmdir (const gchar *path)
       result = -ENOENT;
     }
 
+  attr_cache_invalidate_dirent (path);
+
   debug_print ("vfs_rmdir: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1835,7 +2827,7 @@ file_handle_get_size (FileHandle *fh,
   return res;
 }
 
-#define PAD_BLOCK_SIZE 65536
+#define PAD_BLOCK_SIZE WRITE_BUFFER_SIZE
 
 static gint
 pad_file (FileHandle *fh, gsize num, goffset current_size)
@@ -1844,6 +2836,17 @@ pad_file (FileHandle *fh, gsize num, goffset current_size)
   gsize written;
   gint res;
 
+  /* Writing the last byte leaves a hole on backends that can seek past
+   * the end of a file, so only those that can't get streamed zeros */
+  if (g_seekable_can_seek (G_SEEKABLE (fh->stream)) &&
+      g_seekable_seek (G_SEEKABLE (fh->stream), current_size + num - 1, G_SEEK_SET, NULL, NULL))
+    {
+      fh->pos = current_size + num - 1;
+      res = write_stream (fh, "", 1, fh->pos);
+      if (res >= 0)
+        return 0;
+    }
+
   res = 0;
   buf = g_malloc0 (PAD_BLOCK_SIZE);
   for (written = 0; written < num; written += PAD_BLOCK_SIZE)
@@ -1878,6 +2881,11 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
           g_mutex_lock (&fh->mutex);
 
           result = setup_output_stream (file, fh, 0);
+          if (result == 0)
+            {
+              file_handle_flush_writes (fh);
+              result = file_handle_take_write_error (fh);
+            }
 
           if (result == 0)
             {
@@ -1946,6 +2954,8 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
       result = -ENOENT;
     }
 
+  attr_cache_invalidate (path);
+
   debug_print ("vfs_ftruncate: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1970,9 +2980,17 @@ vfs_truncate (const gchar *path, off_t size)
       /* Get a file handle just to lock the path while we're working */
       fh = get_file_handle_for_path (path);
       if (fh)
-        g_mutex_lock (&fh->mutex);
+        {
+          g_mutex_lock (&fh->mutex);
+          file_handle_flush_writes (fh);
+          result = file_handle_take_write_error (fh);
+        }
 
-      if (size == 0)
+      if (result < 0)
+        {
+          /* Don't truncate data we failed to write */
+        }
+      else if (size == 0)
         {
           file_output_stream = g_file_replace (file, 0, FALSE, 0, NULL, &error);
         }
@@ -2008,6 +3026,8 @@ vfs_truncate (const gchar *path, off_t size)
       result = -ENOENT;
     }
 
+  attr_cache_invalidate (path);
+
   debug_print ("vfs_truncate: -> %s\n", g_strerror (-result));
 
   return result;
@@ -2039,6 +3059,8 @@ vfs_symlink (const gchar *path_old, const gchar *path_new)
       result = -ENOENT;
     }
 
+  attr_cache_invalidate_dirent (path_new);
+
   debug_print ("vfs_symlink: -> %s\n", g_strerror (-result));
 
   return result;
@@ -2048,7 +3070,6 @@ static gint
 vfs_access (const gchar *path, gint mode)
 {
   GFile  *file;
-  GError *error  = NULL;
   gint    result = 0;
 
   debug_print ("vfs_access: %s\n", path);
@@ -2057,34 +3078,16 @@ vfs_access (const gchar *path, gint mode)
 
   if (file)
     {
-      GFileInfo *file_info;
+      struct stat sbuf;
+      gint        access_denied = 0;
 
-      file_info = g_file_query_info (file,
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE ","
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE ",",
-                                     0, NULL, &error);
-      if (file_info)
-        {
-          if ((mode & R_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) &&
-                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ))) ||
-              (mode & W_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE) &&
-                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE))) ||
-              (mode & X_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE) &&
-                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE))))
-            result = -EACCES;
+      /* Shares the cached getattr results, shells probe PATH with both */
+      memset (&sbuf, 0, sizeof (sbuf));
+      sbuf.st_blksize = 4096;
+      result = getattr_for_path (path, file, &sbuf, &access_denied);
 
-          g_object_unref (file_info);
-        }
-      else if (error)
-        {
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
-      else
-        {
-          result = -EIO;
-        }
+      if (result == 0 && (mode & access_denied))
+        result = -EACCES;
 
       if (result != 0)
         {
@@ -2189,6 +3192,8 @@ vfs_utimens (const gchar *path, const struct timespec tv [2])
       result = -ENOENT;
     }
 
+  attr_cache_invalidate (path);
+
   debug_print ("vfs_utimens: -> %s\n", g_strerror (-result));
   return result;
 }
@@ -2215,6 +3220,8 @@ vfs_chmod (const gchar *path, mode_t mode)
       g_object_unref (file);
     }
 
+  attr_cache_invalidate (path);
+
   return result;
 }
 
@@ -2276,14 +3283,13 @@ subthread_main (gpointer data)
   g_signal_handlers_disconnect_by_func (volume_monitor, mount_tracker_mounted_cb, NULL);
   g_signal_handlers_disconnect_by_func (volume_monitor, mount_tracker_unmounted_cb, NULL);
 
-  g_main_loop_unref (subthread_main_loop);
-  subthread_main_loop = NULL;
-
   g_object_unref (volume_monitor);
   volume_monitor = NULL;
 
-  /* Tell the main thread to unmount. Using kill() is necessary according to FUSE maintainers. */
-  kill (getpid (), SIGHUP);
+  /* Tell the main thread to unmount. Using kill() is necessary according to FUSE maintainers.
+   * Not when vfs_destroy() stopped us, FUSE no longer handles the signal by then. */
+  if (!g_atomic_int_get (&unmounting))
+    kill (getpid (), SIGHUP);
 
   return NULL;
 }
@@ -2336,6 +3342,8 @@ vfs_init (struct fuse_conn_info *conn)
                                                  NULL, (GDestroyNotify) file_handle_free);
   global_active_fh_map = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                                 NULL, NULL);
+  content_etags = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, g_free);
 
   
   error = NULL;
@@ -2388,9 +3396,19 @@ vfs_init (struct fuse_conn_info *conn)
   subthread_main_loop = g_main_loop_new (NULL, FALSE);
   subthread = g_thread_new ("gvfs-fuse-sub", (GThreadFunc) subthread_main, NULL);
 
+  /* Runs in the subthread, like the monitors of the attribute cache */
+  if (g_getenv ("GVFS_FUSE_ATTR_CACHE_STATS"))
+    attr_cache_stats_id = g_timeout_add_seconds (ATTR_CACHE_STATS_INTERVAL_SECS,
+                                                 attr_cache_stats_cb, NULL);
+
   /* Indicate O_TRUNC support for open() */
   conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
 
+  /* Every request is at least one round trip to the daemon, so ask for
+   * writes as large as libfuse handles instead of single pages. */
+  conn->want |= FUSE_CAP_BIG_WRITES;
+  conn->max_write = MAX_WRITE_SIZE;
+
   return NULL;
 }
 
@@ -2399,11 +3417,23 @@ vfs_destroy (gpointer param)
 {
   if (daemon_name_watcher)
     g_bus_unwatch_name (daemon_name_watcher);
+
+  /* Stop the subthread first, the monitors of the attribute cache are
+   * dispatched there */
+  if (subthread != NULL)
+    {
+      g_atomic_int_set (&unmounting, TRUE);
+      g_main_loop_quit (subthread_main_loop);
+      g_thread_join (subthread);
+      subthread = NULL;
+    }
+  g_clear_pointer (&subthread_main_loop, g_main_loop_unref);
+
   g_clear_object (&dbus_conn);
   
   mount_list_free ();
-  if (subthread_main_loop != NULL) 
-    g_main_loop_quit (subthread_main_loop);
+  attr_cache_destroy ();
+  g_hash_table_destroy (content_etags);
   g_object_unref (gvfs);
 }
 
@@ -2453,5 +3483,30 @@ static struct fuse_operations vfs_oper =
 gint
 main (gint argc, gchar *argv [])
 {
-  return fuse_main (argc, argv, &vfs_oper, NULL /* user data */);
+  struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
+  gchar            timeout [G_ASCII_DTOSTR_BUF_SIZE];
+  gchar           *timeouts;
+  guint64          kernel_timeout;
+  gint             result;
+
+  attr_cache_init ();
+
+  if (g_getenv ("GVFS_FUSE_READ_STREAMS"))
+    max_read_streams = MAX (1, g_ascii_strtoull (g_getenv ("GVFS_FUSE_READ_STREAMS"), NULL, 10));
+
+  /* Let the kernel cache failed lookups as well, not only entries and
+   * attributes. Inserted first, so options from the command line win. */
+  kernel_timeout = KERNEL_CACHE_DEFAULT_TIMEOUT_MSECS;
+  if (g_getenv ("GVFS_FUSE_KERNEL_CACHE_TIMEOUT"))
+    kernel_timeout = g_ascii_strtoull (g_getenv ("GVFS_FUSE_KERNEL_CACHE_TIMEOUT"), NULL, 10);
+  g_ascii_dtostr (timeout, sizeof (timeout), (gdouble) kernel_timeout / 1000);
+  timeouts = g_strdup_printf ("-oentry_timeout=%s,attr_timeout=%s,negative_timeout=%s",
+                              timeout, timeout, timeout);
+  fuse_opt_insert_arg (&args, 1, timeouts);
+  g_free (timeouts);
+
+  result = fuse_main (args.argc, args.argv, &vfs_oper, NULL /* user data */);
+
+  fuse_opt_free_args (&args);
+  return result;
 }
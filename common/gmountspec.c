@@ -353,6 +353,34 @@ g_mount_spec_hash (gconstpointer _mount)
   return hash;
 }
 
+/* Hashes the items of a mount spec, but not its mount prefix, so specs
+ * that g_mount_spec_match_with_path() may match hash the same */
+guint
+g_mount_spec_items_hash (gconstpointer _mount)
+{
+  GMountSpec *mount = (GMountSpec *) _mount;
+  guint hash;
+  int i;
+
+  hash = 0;
+  for (i = 0; i < mount->items->len; i++)
+    {
+      GMountSpecItem *item = &g_array_index (mount->items, GMountSpecItem, i);
+      hash = hash * 31 + g_str_hash (item->key);
+      hash = hash * 31 + g_str_hash (item->value);
+    }
+
+  return hash;
+}
+
+gboolean
+g_mount_spec_items_equal (gconstpointer mount1,
+                          gconstpointer mount2)
+{
+  return items_equal (((GMountSpec *) mount1)->items,
+                      ((GMountSpec *) mount2)->items);
+}
+
 gboolean
 g_mount_spec_equal (GMountSpec      *mount1,
 		    GMountSpec      *mount2)
@@ -37,6 +37,12 @@ typedef struct {
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_SEEK_END 5
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_QUERY_INFO 6
 
+/* Flags for arg2 of a WRITE request */
+#define G_VFS_DAEMON_SOCKET_PROTOCOL_WRITE_FLAG_BEHIND 1
+
+/* Flags for arg2 of a CLOSE request */
+#define G_VFS_DAEMON_SOCKET_PROTOCOL_CLOSE_FLAG_ABORT 1
+
 /*
 read, readahead reply:
 type, seek_generation, size, data
@@ -44,6 +50,23 @@ type, seek_generation, size, data
 seek reply:
 type, pos (64),
 
+written reply:
+type, size, flags
+
+ A write sent with WRITE_FLAG_BEHIND is never acknowledged with a
+ short count. The daemon instead writes the rest of the data itself
+ and sends one WRITTEN reply per backend write, all with the seq_nr
+ of the request, flagging all but the last one with
+ WRITTEN_FLAG_PARTIAL. This lets the client keep several writes in
+ flight without having to resend data. All of these replies carry
+ WRITTEN_FLAG_BEHIND, older daemons ignore the request flag and
+ don't set it.
+
+ Once a write-behind request failed, the daemon fails all later
+ writes on the channel. A CLOSE with CLOSE_FLAG_ABORT, or any close
+ after such a failure, doesn't replace the target where the backend
+ writes to a temporary file.
+
 error:
 type, code, size, data (size bytes, 2 strings: domain, message)
 
@@ -68,6 +91,10 @@ typedef struct {
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_CLOSED   4
 #define G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_INFO     5
 
+/* Flags for arg2 of a WRITTEN reply */
+#define G_VFS_DAEMON_SOCKET_PROTOCOL_WRITTEN_FLAG_PARTIAL 1
+#define G_VFS_DAEMON_SOCKET_PROTOCOL_WRITTEN_FLAG_BEHIND  2
+
 
 typedef union {
   gboolean boolean;
@@ -80,6 +80,9 @@ struct _GVfsBackendPrivate
   char *default_location;
   GMountSpec *mount_spec;
   gboolean block_requests;
+  GVfsBackendConcurrency concurrency;
+  guint32 readahead_max_read_size;
+  guint readahead_max_window;
 };
 
 
@@ -205,6 +208,8 @@ g_vfs_backend_init (GVfsBackend *backend)
   backend->priv->stable_name = g_strdup ("");
   backend->priv->user_visible = TRUE;
   backend->priv->default_location = g_strdup ("");
+  backend->priv->readahead_max_read_size = 1024 * 1024;
+  backend->priv->readahead_max_window = 4;
 }
 
 static void
@@ -588,6 +593,42 @@ g_vfs_backend_add_auto_info (GVfsBackend *backend,
   
 }
 
+void
+g_vfs_backend_set_concurrency (GVfsBackend           *backend,
+			       GVfsBackendConcurrency concurrency)
+{
+  backend->priv->concurrency = concurrency;
+}
+
+GVfsBackendConcurrency
+g_vfs_backend_get_concurrency (GVfsBackend *backend)
+{
+  return backend->priv->concurrency;
+}
+
+/* Limits for the adaptive readahead of read channels. max_read_size
+ * caps the size of each backend read and max_window the number of
+ * reads done ahead of the client. */
+void
+g_vfs_backend_set_readahead_limits (GVfsBackend *backend,
+				    guint32      max_read_size,
+				    guint        max_window)
+{
+  backend->priv->readahead_max_read_size = MAX (max_read_size, 4 * 1024);
+  backend->priv->readahead_max_window = MAX (max_window, 1);
+}
+
+void
+g_vfs_backend_get_readahead_limits (GVfsBackend *backend,
+				    guint32     *max_read_size,
+				    guint       *max_window)
+{
+  if (max_read_size)
+    *max_read_size = backend->priv->readahead_max_read_size;
+  if (max_window)
+    *max_window = backend->priv->readahead_max_window;
+}
+
 void
 g_vfs_backend_set_block_requests (GVfsBackend *backend)
 {
@@ -78,6 +78,21 @@ typedef struct _GVfsJobError            GVfsJobError;
 
 typedef gpointer GVfsBackendHandle;
 
+/* How the daemon may run the blocking (non-try) jobs of a backend
+ * on its worker threads:
+ *
+ * REENTRANT: any number of jobs at once, limited only by the thread
+ *   count. This is the default.
+ * PER_HANDLE: jobs on the same open handle run one at a time, mount
+ *   and unmount run alone, everything else runs in parallel.
+ * GLOBAL: one job at a time.
+ */
+typedef enum {
+  G_VFS_BACKEND_CONCURRENCY_REENTRANT,
+  G_VFS_BACKEND_CONCURRENCY_PER_HANDLE,
+  G_VFS_BACKEND_CONCURRENCY_GLOBAL
+} GVfsBackendConcurrency;
+
 struct _GVfsBackend
 {
   GObject parent_instance;
@@ -503,6 +518,17 @@ void        g_vfs_backend_add_auto_info                  (GVfsBackend
 							  GFileInfo             *info,
 							  const char            *uri);
 
+void        g_vfs_backend_set_concurrency                (GVfsBackend           *backend,
+							  GVfsBackendConcurrency concurrency);
+GVfsBackendConcurrency g_vfs_backend_get_concurrency     (GVfsBackend           *backend);
+
+void        g_vfs_backend_set_readahead_limits           (GVfsBackend           *backend,
+							  guint32                max_read_size,
+							  guint                  max_window);
+void        g_vfs_backend_get_readahead_limits           (GVfsBackend           *backend,
+							  guint32               *max_read_size,
+							  guint                 *max_window);
+
 void        g_vfs_backend_set_block_requests             (GVfsBackend           *backend);
 gboolean    g_vfs_backend_get_block_requests             (GVfsBackend           *backend);
 
@@ -59,9 +59,11 @@
 
 typedef struct _ArchiveFile ArchiveFile;
 struct _ArchiveFile {
-  char *	name;			/* name of the file inside the archive */
+  char *	name;			/* name of the file inside the archive, owned by the backend's names */
   GFileInfo *	info;			/* file info created from archive_entry */
   GSList *	children;		/* (unordered) list of child files */
+  GHashTable *	child_index;		/* name => child file, NULL if no children */
+  gint64	header_offset;		/* offset of the entry's header in the archive file */
 };
 
 struct _GVfsBackendArchive
@@ -70,6 +72,8 @@ struct _GVfsBackendArchive
 
   GFile *		file;
   ArchiveFile *		files;		/* the tree of files */
+  GStringChunk *	names;		/* interned names of all files */
+  gboolean		indexed;	/* entries can be read starting at header_offset */
 };
 
 G_DEFINE_TYPE (GVfsBackendArchive, g_vfs_backend_archive, G_VFS_TYPE_BACKEND)
@@ -81,6 +85,7 @@ static void backend_unmount (GVfsBackendArchive *ba);
 typedef struct {
   struct archive *  archive;
   GFile *	    file;
+  goffset	    start_offset;
   GFileInputStream *stream;
   GVfsJob *	    job;
   GError *	    error;
@@ -100,6 +105,12 @@ gvfs_archive_open (struct archive *archive,
   d->stream = g_file_read (d->file,
 			   d->job->cancellable,
 			   &d->error);
+  if (d->stream != NULL && d->start_offset > 0)
+    g_seekable_seek (G_SEEKABLE (d->stream),
+		     d->start_offset,
+		     G_SEEK_SET,
+		     d->job->cancellable,
+		     &d->error);
   return gvfs_archive_return (d);
 }
 
@@ -156,8 +167,7 @@ gvfs_archive_close (struct archive *archive,
   GVfsArchive *d = data;
 
   DEBUG ("CLOSE\n");
-  g_object_unref (d->stream);
-  d->stream = NULL;
+  g_clear_object (&d->stream);
   return ARCHIVE_OK;
 }
 
@@ -200,24 +210,41 @@ gvfs_archive_pop_job (GVfsArchive *archive)
   archive->job = NULL;
 }
 
+static void
+gvfs_archive_free (GVfsArchive *archive)
+{
+  archive_read_free (archive->archive);
+  g_slice_free (GVfsArchive, archive);
+}
+
 static void
 gvfs_archive_finish (GVfsArchive *archive)
 {
   gvfs_archive_pop_job (archive);
+  gvfs_archive_free (archive);
+}
 
-  archive_read_free (archive->archive);
-  g_slice_free (GVfsArchive, archive);
+/* Frees the archive without completing its job */
+static void
+gvfs_archive_discard (GVfsArchive *archive)
+{
+  g_clear_error (&archive->error);
+  archive->job = NULL;
+  gvfs_archive_free (archive);
 }
 
-/* NB: assumes an GVfsArchive initialized with ARCHIVE_DATA_INIT */
+/* Creates a reader that starts parsing at start_offset in the archive
+ * file instead of at its beginning. Only meaningful for offsets from
+ * ArchiveFile::header_offset of an indexed archive. */
 static GVfsArchive *
-gvfs_archive_new (GVfsBackendArchive *ba, GVfsJob *job)
+gvfs_archive_new (GVfsBackendArchive *ba, GVfsJob *job, goffset start_offset)
 {
   GVfsArchive *d;
   
   d = g_slice_new0 (GVfsArchive);
 
   d->file = ba->file;
+  d->start_offset = start_offset;
   gvfs_archive_push_job (d, job);
 
   d->archive = archive_read_new ();
@@ -249,63 +276,87 @@ g_vfs_backend_archive_finalize (GObject *object)
 static void
 g_vfs_backend_archive_init (GVfsBackendArchive *archive)
 {
+  /* Every open handle has its own libarchive reader and the file tree
+   * is read-only once mounted, so only mount/unmount need exclusion */
+  g_vfs_backend_set_concurrency (G_VFS_BACKEND (archive),
+                                 G_VFS_BACKEND_CONCURRENCY_PER_HANDLE);
 }
 
 /*** FILE TREE HANDLING ***/
 
+static ArchiveFile *
+archive_file_new (GVfsBackendArchive *ba, const char *name)
+{
+  ArchiveFile *file;
+
+  file = g_slice_new0 (ArchiveFile);
+  file->name = g_string_chunk_insert_const (ba->names, name);
+  file->header_offset = -1;
+
+  return file;
+}
+
+static ArchiveFile *
+archive_file_add_child (GVfsBackendArchive *ba, ArchiveFile *file, const char *name)
+{
+  ArchiveFile *child;
+
+  DEBUG ("adding node %s to %s\n", name, file->name);
+  child = archive_file_new (ba, name);
+  if (file->child_index == NULL)
+    file->child_index = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (file->child_index, child->name, child);
+  file->children = g_slist_prepend (file->children, child);
+
+  return child;
+}
+
 /* NB: filename must NOT start with a slash */
 static ArchiveFile *
-archive_file_get_from_path (ArchiveFile *file, const char *filename, gboolean add)
+archive_file_get_from_path (GVfsBackendArchive *ba, const char *filename, gboolean add)
 {
-  char **names;
-  ArchiveFile *cur;
-  GSList *walk;
-  guint i;
+  ArchiveFile *file, *cur;
+  char *path, *name, *next;
 
   /* libarchive reports paths starting with ./ for some archive types */
   if (g_str_has_prefix (filename, "./"))
     filename += 2;
-  names = g_strsplit (filename, "/", -1);
 
   DEBUG ("%s %s\n", add ? "add" : "find", filename);
-  for (i = 0; file && names[i] != NULL; i++)
+  file = ba->files;
+  if (*filename == 0)
+    return file;
+
+  /* split the path in place instead of allocating every component */
+  path = g_strdup (filename);
+  for (name = path; file && name != NULL; name = next)
     {
+      next = strchr (name, '/');
+      if (next != NULL)
+        *next++ = 0;
+
       cur = NULL;
-      for (walk = file->children; walk; walk = walk->next)
-	{
-	  cur = walk->data;
-	  if (g_str_equal (cur->name, names[i]))
-	    break;
-	  cur = NULL;
-	}
+      if (file->child_index != NULL)
+        cur = g_hash_table_lookup (file->child_index, name);
       if (cur == NULL && add != FALSE)
 	{
-	  DEBUG ("adding node %s to %s\n", names[i], file->name);
-	  /* (hopefully) clever trick to avoid string copy */
-	  if (names[i][0] != 0 &&
-              strcmp (names[i], ".") != 0)
-	    {
-	      cur = g_slice_new0 (ArchiveFile);
-	      cur->name = names[i];
-	      names[i] = NULL;
-	      file->children = g_slist_prepend (file->children, cur);
-	    }
+	  if (name[0] != 0 &&
+              strcmp (name, ".") != 0)
+	    cur = archive_file_add_child (ba, file, name);
 	  else
 	    {
 	      /* happens when adding directories, their path ends with a / */
               /* Can also happen with "." in e.g. iso files */
-	      g_assert (names[i + 1] == NULL);
-	      g_free (names[i]);
-	      names[i] = NULL;
+	      g_assert (next == NULL);
 	      cur = file;
 	    }
 	}
       file = cur;
     }
-  g_strfreev (names);
+  g_free (path);
   return file;
 }
-#define archive_file_find(ba, filename) archive_file_get_from_path((ba)->files, (filename) + 1, FALSE)
+#define archive_file_find(ba, filename) archive_file_get_from_path((ba), (filename) + 1, FALSE)
 
 static void
 create_root_file (GVfsBackendArchive *ba)
@@ -315,8 +366,8 @@ create_root_file (GVfsBackendArchive *ba)
   char *s, *display_name;
   GIcon *icon;
 
-  root = g_slice_new0 (ArchiveFile);
-  root->name = g_strdup ("/");
+  ba->names = g_string_chunk_new (4096);
+  root = archive_file_new (ba, "/");
   ba->files = root;
 
   info = g_file_info_new ();
@@ -468,6 +519,30 @@ fixup_dirs (ArchiveFile *file)
     fixup_dirs (l->data);
 }
 
+/* Whether every entry of the archive can be parsed on its own by
+ * starting a new reader at its header, which is the case for
+ * uncompressed archives made of self-contained headers. Other formats
+ * need state from earlier in the file (ISO volume descriptors, 7z and
+ * RAR solid blocks, compression filters), so they are always read from
+ * the start. */
+static gboolean
+archive_can_index (struct archive *archive)
+{
+  if (archive_filter_count (archive) != 1 ||
+      archive_filter_code (archive, 0) != ARCHIVE_FILTER_NONE)
+    return FALSE;
+
+  switch (archive_format (archive) & ARCHIVE_FORMAT_BASE_MASK)
+    {
+      case ARCHIVE_FORMAT_TAR:
+      case ARCHIVE_FORMAT_CPIO:
+      case ARCHIVE_FORMAT_ZIP:
+        return TRUE;
+      default:
+        return FALSE;
+    }
+}
+
 static void
 create_file_tree (GVfsBackendArchive *ba, GVfsJob *job)
 {
@@ -475,8 +550,9 @@ create_file_tree (GVfsBackendArchive *ba, GVfsJob *job)
   struct archive_entry *entry;
   int result;
   guint64 entry_index = 0;
+  gint64 header_offset;
 
-  archive = gvfs_archive_new (ba, job);
+  archive = gvfs_archive_new (ba, job, 0);
 
   g_assert (ba->files != NULL);
 
@@ -490,13 +566,20 @@ create_file_tree (GVfsBackendArchive *ba, GVfsJob *job)
   	    archive_set_error (archive->archive, ARCHIVE_OK, "No error");
   	    archive_clear_error (archive->archive);
 	  }
+
+          if (entry_index == 0)
+            ba->indexed = archive_can_index (archive->archive);
+          header_offset = archive_read_header_position (archive->archive);
   
-	  ArchiveFile *file = archive_file_get_from_path (ba->files, 
+	  ArchiveFile *file = archive_file_get_from_path (ba,
 	                                                  archive_entry_pathname (entry), 
 							  TRUE);
           /* Don't set info for root */
           if (file != ba->files)
-            archive_file_set_info_from_entry (file, entry, entry_index);
+            {
+              archive_file_set_info_from_entry (file, entry, entry_index);
+              file->header_offset = header_offset;
+            }
 	  archive_read_data_skip (archive->archive);
 	  entry_index++;
 	}
@@ -514,9 +597,11 @@ static void
 archive_file_free (ArchiveFile *file)
 {
   g_slist_free_full (file->children, (GDestroyNotify) archive_file_free);
+  if (file->child_index)
+    g_hash_table_destroy (file->child_index);
   if (file->info)
     g_object_unref (file->info);
-  g_free (file->name);
+  g_slice_free (ArchiveFile, file);
 }
 
 static void
@@ -617,6 +702,11 @@ backend_unmount (GVfsBackendArchive *ba)
       archive_file_free (ba->files);
       ba->files = NULL;
     }
+  if (ba->names)
+    {
+      g_string_chunk_free (ba->names);
+      ba->names = NULL;
+    }
 }
 
 static void
@@ -630,6 +720,46 @@ do_unmount (GVfsBackend *backend,
   g_vfs_job_succeeded (G_VFS_JOB (job));
 }
 
+/* Reads headers until the entry for filename (without leading slash) is
+ * found, leaving the reader positioned at its data. With first_only set,
+ * gives up after the first header. */
+static gboolean
+gvfs_archive_read_to_entry (GVfsArchive *archive,
+                            const char  *filename,
+                            gboolean     first_only)
+{
+  struct archive_entry *entry;
+  int result;
+  const char *entry_pathname;
+
+  do
+    {
+      result = archive_read_next_header (archive->archive, &entry);
+      if (result >= ARCHIVE_WARN && result <= ARCHIVE_OK)
+        {
+	  if (result < ARCHIVE_OK) {
+	    DEBUG ("gvfs_archive_read_to_entry: result = %d, error = '%s'\n", result, archive_error_string (archive->archive));
+	    archive_set_error (archive->archive, ARCHIVE_OK, "No error");
+	    archive_clear_error (archive->archive);
+	  }
+
+          entry_pathname = archive_entry_pathname (entry);
+          /* skip leading garbage if present */
+          if (g_str_has_prefix (entry_pathname, "./"))
+            entry_pathname += 2;
+          if (g_str_equal (entry_pathname, filename))
+            return TRUE;
+          else if (first_only)
+            return FALSE;
+          else
+            archive_read_data_skip (archive->archive);
+        }
+    }
+  while (result != ARCHIVE_FATAL && result != ARCHIVE_EOF);
+
+  return FALSE;
+}
+
 static void
 do_open_for_read (GVfsBackend *       backend,
 		  GVfsJobOpenForRead *job,
@@ -637,10 +767,7 @@ do_open_for_read (GVfsBackend *       backend,
 {
   GVfsBackendArchive *ba = G_VFS_BACKEND_ARCHIVE (backend);
   GVfsArchive *archive;
-  struct archive_entry *entry;
-  int result;
   ArchiveFile *file;
-  const char *entry_pathname;
 
   file = archive_file_find (ba, filename);
   if (file == NULL)
@@ -659,37 +786,22 @@ do_open_for_read (GVfsBackend *       backend,
 			_("Can't open directory"));
       return;
     }
-  
-  archive = gvfs_archive_new (ba, G_VFS_JOB (job));
 
-  do
+  if (ba->indexed && file->header_offset >= 0)
     {
-      result = archive_read_next_header (archive->archive, &entry);
-      if (result >= ARCHIVE_WARN && result <= ARCHIVE_OK)
-        {
-	  if (result < ARCHIVE_OK) {
-	    DEBUG ("do_open_for_read: result = %d, error = '%s'\n", result, archive_error_string (archive->archive));
-	    archive_set_error (archive->archive, ARCHIVE_OK, "No error");
-	    archive_clear_error (archive->archive);
-	  }
-
-          entry_pathname = archive_entry_pathname (entry);
-          /* skip leading garbage if present */
-          if (g_str_has_prefix (entry_pathname, "./"))
-            entry_pathname += 2;
-          if (g_str_equal (entry_pathname, filename + 1))
-            {
-              /* SUCCESS */
-              g_vfs_job_open_for_read_set_handle (job, archive);
-              g_vfs_job_open_for_read_set_can_seek (job, FALSE);
-              gvfs_archive_pop_job (archive);
-              return;
-            }
-          else
-            archive_read_data_skip (archive->archive);
-        }
+      archive = gvfs_archive_new (ba, G_VFS_JOB (job), file->header_offset);
+      if (gvfs_archive_read_to_entry (archive, filename + 1, TRUE))
+        goto found;
+
+      /* The index didn't work out for this entry, fall back to a scan */
+      DEBUG ("no entry for %s at offset %" G_GINT64_FORMAT "\n",
+             filename, file->header_offset);
+      gvfs_archive_discard (archive);
     }
-  while (result != ARCHIVE_FATAL && result != ARCHIVE_EOF);
+
+  archive = gvfs_archive_new (ba, G_VFS_JOB (job), 0);
+  if (gvfs_archive_read_to_entry (archive, filename + 1, FALSE))
+    goto found;
 
   if (!gvfs_archive_in_error (archive))
     {
@@ -699,6 +811,12 @@ do_open_for_read (GVfsBackend *       backend,
 			   _("File doesn't exist"));
     }
   gvfs_archive_finish (archive);
+  return;
+
+ found:
+  g_vfs_job_open_for_read_set_handle (job, archive);
+  g_vfs_job_open_for_read_set_can_seek (job, FALSE);
+  gvfs_archive_pop_job (archive);
 }
 
 static void
@@ -2278,13 +2278,175 @@ try_open_for_read (GVfsBackend        *backend,
 
 
 
+/* *** write handles *** */
+
+/* Files smaller than this are sent in one PUT with a Content-Length on
+ * close, larger ones are streamed with chunked encoding as they arrive */
+#define PUT_STREAMING_THRESHOLD (256 * 1024)
+
+/* Amount of data handed to libsoup but not yet sent before writes
+ * are held back */
+#define PUT_MAX_UNSENT_SIZE (1024 * 1024)
+
+typedef struct {
+  GVfsBackend *backend;
+  SoupMessage *msg;
+
+  /* Data collected before streaming starts */
+  GByteArray *buffer;
+  gboolean streaming;
+  gboolean done;
+  /* The request had to be resent after part of the body was sent */
+  gboolean restart_failed;
+
+  goffset queued_size;
+  goffset sent_size;
+
+  /* Write waiting for unsent data to drain, and pending close */
+  GVfsJob *write_job;
+  GVfsJob *close_job;
+} DavWriteHandle;
+
+static DavWriteHandle *
+dav_write_handle_new (GVfsBackend *backend, SoupMessage *put_msg)
+{
+  DavWriteHandle *handle;
+
+  handle = g_slice_new0 (DavWriteHandle);
+  handle->backend = backend;
+  handle->msg = put_msg;
+  handle->buffer = g_byte_array_new ();
+
+  return handle;
+}
+
+static void
+dav_write_handle_free (DavWriteHandle *handle)
+{
+  if (handle->buffer)
+    g_byte_array_free (handle->buffer, TRUE);
+  g_object_unref (handle->msg);
+  g_slice_free (DavWriteHandle, handle);
+}
+
+static void
+dav_write_handle_fail_job (DavWriteHandle *handle, GVfsJob *job)
+{
+  if (handle->restart_failed)
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Upload could not be resent after the server "
+                        "requested authentication or a redirect"));
+  else if (!SOUP_STATUS_IS_SUCCESSFUL (handle->msg->status_code))
+    http_job_failed (job, handle->msg);
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Upload was terminated by the server"));
+}
+
+static void
+put_wrote_body_data (SoupMessage *msg,
+                     SoupBuffer  *chunk,
+                     gpointer     user_data)
+{
+  DavWriteHandle *handle = user_data;
+
+  handle->sent_size += chunk->length;
+
+  if (handle->write_job &&
+      handle->queued_size - handle->sent_size <= PUT_MAX_UNSENT_SIZE)
+    {
+      g_vfs_job_succeeded (handle->write_job);
+      handle->write_job = NULL;
+    }
+}
+
+/* Sent chunks are gone, so a request that is requeued for auth or a
+ * redirect after the server took part of the body can't be resent */
+static void
+put_restarted (SoupMessage *msg,
+               gpointer     user_data)
+{
+  DavWriteHandle *handle = user_data;
+
+  if (handle->sent_size == 0)
+    return;
+
+  handle->restart_failed = TRUE;
+  soup_session_cancel_message (G_VFS_BACKEND_HTTP (handle->backend)->session_async,
+                               msg, SOUP_STATUS_CANCELLED);
+}
+
+static void
+put_finished (SoupSession *session,
+              SoupMessage *msg,
+              gpointer     user_data)
+{
+  DavWriteHandle *handle = user_data;
+
+  handle->done = TRUE;
+  g_signal_handlers_disconnect_by_func (msg, put_wrote_body_data, handle);
+  g_signal_handlers_disconnect_by_func (msg, put_restarted, handle);
+
+  if (handle->write_job)
+    {
+      dav_write_handle_fail_job (handle, handle->write_job);
+      handle->write_job = NULL;
+    }
+
+  if (handle->close_job)
+    {
+      if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code) && !handle->restart_failed)
+        g_vfs_job_succeeded (handle->close_job);
+      else
+        dav_write_handle_fail_job (handle, handle->close_job);
+
+      dav_write_handle_free (handle);
+    }
+}
+
+static void
+dav_write_handle_start_streaming (DavWriteHandle *handle)
+{
+  SoupMessage *msg = handle->msg;
+  gsize length;
+
+  handle->streaming = TRUE;
+
+  soup_message_headers_set_encoding (msg->request_headers,
+                                     SOUP_ENCODING_CHUNKED);
+  soup_message_headers_set_content_type (msg->request_headers,
+                                         "application/octet-stream", NULL);
+  /* Let the server refuse the request (e.g. on a failed If-Match or
+   * missing auth) before any of the body is sent, since sent chunks
+   * are not kept around for a resend */
+  soup_message_headers_set_expectations (msg->request_headers,
+                                         SOUP_EXPECTATION_CONTINUE);
+  soup_message_body_set_accumulate (msg->request_body, FALSE);
+
+  g_signal_connect (msg, "wrote-body-data",
+                    G_CALLBACK (put_wrote_body_data), handle);
+  g_signal_connect (msg, "restarted",
+                    G_CALLBACK (put_restarted), handle);
+
+  length = handle->buffer->len;
+  soup_message_body_append (msg->request_body, SOUP_MEMORY_TAKE,
+                            g_byte_array_free (handle->buffer, FALSE),
+                            length);
+  handle->buffer = NULL;
+  handle->queued_size = length;
+
+  g_object_ref (msg);
+  soup_session_queue_message (G_VFS_BACKEND_HTTP (handle->backend)->session_async,
+                              msg, put_finished, handle);
+}
+
 /* *** create () *** */
 static void
 try_create_tested_existence (SoupSession *session, SoupMessage *msg,
                              gpointer user_data)
 {
   GVfsJob *job = G_VFS_JOB (user_data);
-  GOutputStream   *stream;
+  DavWriteHandle  *handle;
   SoupMessage     *put_msg;
   SoupURI         *uri;
 
@@ -2305,10 +2467,9 @@ try_create_tested_existence (SoupSession *session, SoupMessage *msg,
    * Doesn't work with apache > 2.2.9
    * soup_message_headers_append (put_msg->request_headers, "If-None-Match", "*");
    */
-  stream = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-  g_object_set_data_full (G_OBJECT (stream), "-gvfs-stream-msg", put_msg, g_object_unref);
+  handle = dav_write_handle_new (job->backend_data, put_msg);
 
-  g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), stream);
+  g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_succeeded (job);
 }  
 
@@ -2340,17 +2501,16 @@ open_for_replace_succeeded (GVfsBackendHttp *op_backend, GVfsJob *job,
                             SoupURI *uri, const char *etag)
 {
   SoupMessage     *put_msg;
-  GOutputStream   *stream;
+  DavWriteHandle  *handle;
 
   put_msg = soup_message_new_from_uri (SOUP_METHOD_PUT, uri);
 
   if (etag)
     soup_message_headers_append (put_msg->request_headers, "If-Match", etag);
 
-  stream = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-  g_object_set_data_full (G_OBJECT (stream), "-gvfs-stream-msg", put_msg, g_object_unref);
+  handle = dav_write_handle_new (G_VFS_BACKEND (op_backend), put_msg);
 
-  g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), stream);
+  g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_succeeded (job);
 }
 
@@ -2386,8 +2546,8 @@ try_replace (GVfsBackend *backend,
   GVfsBackendHttp *op_backend;
   SoupURI         *uri;
 
-  /* TODO: if SoupOutputStream supported chunked requests, we could
-   * use a PUT with "If-Match: ..." and "Expect: 100-continue"
+  /* TODO: large uploads are sent with "Expect: 100-continue", so the
+   * PUT itself could do the "If-Match: ..." check instead of a HEAD
    */
 
   op_backend = G_VFS_BACKEND_HTTP (backend);
@@ -2425,98 +2585,93 @@ try_replace (GVfsBackend *backend,
 }
 
 /* *** write () *** */
-static void
-write_ready (GObject      *source_object,
-             GAsyncResult *result,
-             gpointer      user_data)
-{
-  GOutputStream *stream;
-  GVfsJob       *job;
-  GError        *error;
-  gssize         nwrote;
-
-  stream = G_OUTPUT_STREAM (source_object); 
-  error  = NULL;
-  job    = G_VFS_JOB (user_data);
-
-  nwrote = g_output_stream_write_finish (stream, result, &error);
-
-  if (nwrote < 0)
-   {
-     g_vfs_job_failed_literal (G_VFS_JOB (job),
-                              error->domain,
-                              error->code,
-                              error->message);
-
-     g_error_free (error);
-     return;
-   }
-
-  g_vfs_job_write_set_written_size (G_VFS_JOB_WRITE (job), nwrote);
-  g_vfs_job_succeeded (job);
-}
-
 static gboolean
 try_write (GVfsBackend *backend,
            GVfsJobWrite *job,
-           GVfsBackendHandle handle,
+           GVfsBackendHandle _handle,
            char *buffer,
            gsize buffer_size)
 {
-  GOutputStream   *stream;
+  DavWriteHandle *handle = _handle;
 
-  stream = G_OUTPUT_STREAM (handle);
+  if (handle->done)
+    {
+      dav_write_handle_fail_job (handle, G_VFS_JOB (job));
+      return TRUE;
+    }
 
-  g_output_stream_write_async (stream,
-                               buffer,
-                               buffer_size,
-                               G_PRIORITY_DEFAULT,
-                               G_VFS_JOB (job)->cancellable,
-                               write_ready,
-                               job);
-  return TRUE;
-}
+  g_vfs_job_write_set_written_size (job, buffer_size);
 
-/* *** close_write () *** */
-static void
-try_close_write_sent (SoupSession *session,
-		      SoupMessage *msg,
-		      gpointer     user_data)
-{
-  GVfsJob *job;
+  if (!handle->streaming)
+    {
+      g_byte_array_append (handle->buffer, (guint8 *)buffer, buffer_size);
+      if (handle->buffer->len >= PUT_STREAMING_THRESHOLD)
+        dav_write_handle_start_streaming (handle);
 
-  job = G_VFS_JOB (user_data);
-  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
-    http_job_failed (job, msg);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      return TRUE;
+    }
+
+  soup_message_body_append (handle->msg->request_body, SOUP_MEMORY_COPY,
+                            buffer, buffer_size);
+  handle->queued_size += buffer_size;
+  soup_session_unpause_message (G_VFS_BACKEND_HTTP (backend)->session_async,
+                                handle->msg);
+
+  /* Hold the reply back while too much is waiting to be sent, so
+   * the client can't fill our memory faster than the server reads */
+  if (handle->queued_size - handle->sent_size > PUT_MAX_UNSENT_SIZE)
+    handle->write_job = G_VFS_JOB (job);
   else
-    g_vfs_job_succeeded (job);
+    g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  return TRUE;
 }
 
+/* *** close_write () *** */
 static gboolean
 try_close_write (GVfsBackend *backend,
                  GVfsJobCloseWrite *job,
-                 GVfsBackendHandle handle)
+                 GVfsBackendHandle _handle)
 {
-  GOutputStream *stream;
+  DavWriteHandle *handle = _handle;
   SoupMessage *msg;
   gsize length;
-  gchar *data;
 
-  stream = G_OUTPUT_STREAM (handle);
+  msg = handle->msg;
 
-  msg = g_object_get_data (G_OBJECT (stream), "-gvfs-stream-msg");
-  g_object_ref (msg);
-  g_object_set_data (G_OBJECT (stream), "-gvfs-stream-msg", NULL);
+  if (handle->done)
+    {
+      if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code) && !handle->restart_failed)
+        g_vfs_job_succeeded (G_VFS_JOB (job));
+      else
+        dav_write_handle_fail_job (handle, G_VFS_JOB (job));
+
+      dav_write_handle_free (handle);
+      return TRUE;
+    }
 
-  g_output_stream_close (stream, NULL, NULL);
-  length = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (stream));
-  data = g_memory_output_stream_steal_data (G_MEMORY_OUTPUT_STREAM (stream));
-  g_object_unref (stream);
+  handle->close_job = G_VFS_JOB (job);
 
+  if (handle->streaming)
+    {
+      soup_message_body_complete (msg->request_body);
+      soup_session_unpause_message (G_VFS_BACKEND_HTTP (backend)->session_async,
+                                    msg);
+      return TRUE;
+    }
+
+  /* The whole file fit in the buffer, send it with a Content-Length */
+  length = handle->buffer->len;
   soup_message_set_request (msg, "application/octet-stream",
-			    SOUP_MEMORY_TAKE, data, length);
+			    SOUP_MEMORY_TAKE,
+			    (char *)g_byte_array_free (handle->buffer, FALSE),
+			    length);
+  handle->buffer = NULL;
+
+  g_object_ref (msg);
   soup_session_queue_message (G_VFS_BACKEND_HTTP (backend)->session_async,
-			      msg, try_close_write_sent, job);
+			      msg, put_finished, handle);
 
   return TRUE;
 }
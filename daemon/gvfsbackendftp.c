@@ -29,8 +29,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib/gi18n.h>
 #include <gio/gio.h>
+#include <gio/gfiledescriptorbased.h>
 
 #include "gvfsbackendftp.h"
 #include "gvfsjobopenforread.h"
@@ -104,8 +106,11 @@ gvfs_backend_ftp_determine_features (GVfsFtpTask *task)
     { "UTF8", G_VFS_FTP_FEATURE_UTF8 },
     { "AUTH TLS", G_VFS_FTP_FEATURE_AUTH_TLS },
     { "AUTH SSL", G_VFS_FTP_FEATURE_AUTH_SSL },
+    { "MLST", G_VFS_FTP_FEATURE_MLST },
+    { "REST STREAM", G_VFS_FTP_FEATURE_REST },
   };
   guint i, j;
+  gsize len;
   char **reply;
 
   if (!g_vfs_ftp_task_send_and_check (task, 0, NULL, NULL, &reply, "FEAT"))
@@ -128,7 +133,11 @@ gvfs_backend_ftp_determine_features (GVfsFtpTask *task)
 
       for (j = 0; j < G_N_ELEMENTS (features); j++)
         {
-          if (g_ascii_strcasecmp (feature, features[j].name) == 0)
+          /* some features list their options after the name, like
+           * "MLST type*;size*;modify*;" */
+          len = strlen (features[j].name);
+          if (g_ascii_strncasecmp (feature, features[j].name, len) == 0 &&
+              (feature[len] == '\0' || feature[len] == ' '))
             {
               g_debug ("# feature %s supported\n", features[j].name);
               task->backend->features |= 1 << features[j].enable;
@@ -240,7 +249,12 @@ gvfs_backend_ftp_determine_system (GVfsFtpTask *task)
 static void
 gvfs_backend_ftp_setup_directory_cache (GVfsBackendFtp *ftp)
 {
-  if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
+  /* MLSD is implied by MLST, see RFC 3659. GVFS_FTP_DISABLE_MLSD
+   * allows comparing it to LIST. */
+  if (g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_MLST) &&
+      g_getenv ("GVFS_FTP_DISABLE_MLSD") == NULL)
+    ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_mlsd;
+  else if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_unix;
   else
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_default;
@@ -380,6 +394,10 @@ g_vfs_backend_ftp_finalize (GObject *object)
   if (ftp->addr)
     g_object_unref (ftp->addr);
 
+  if (ftp->keepalive_id)
+    g_source_remove (ftp->keepalive_id);
+  g_object_unref (ftp->keepalive_cancellable);
+
   /* has been cleared on unmount */
   g_assert (ftp->queue == NULL);
   g_cond_clear (&ftp->cond);
@@ -395,8 +413,57 @@ g_vfs_backend_ftp_finalize (GObject *object)
 static void
 g_vfs_backend_ftp_init (GVfsBackendFtp *ftp)
 {
+  const char *pull_connections;
+  const char *warm_connections;
+
   g_mutex_init (&ftp->mutex);
   g_cond_init (&ftp->cond);
+  ftp->keepalive_cancellable = g_cancellable_new ();
+
+  /* by default, keep the connection used for mounting alive */
+  warm_connections = g_getenv ("GVFS_FTP_WARM_CONNECTIONS");
+  if (warm_connections)
+    ftp->warm_connections = g_ascii_strtoull (warm_connections, NULL, 10);
+  else
+    ftp->warm_connections = 1;
+
+  /* segmented pulls are opt-in, as not every server likes many
+   * connections from the same client */
+  pull_connections = g_getenv ("GVFS_FTP_PULL_CONNECTIONS");
+  if (pull_connections)
+    ftp->pull_connections = g_ascii_strtoull (pull_connections, NULL, 10);
+}
+
+static void
+keepalive_thread (GTask *       gtask,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+  GVfsBackendFtp *ftp = source_object;
+  GVfsFtpTask task = { ftp, NULL, cancellable, };
+
+  g_vfs_ftp_task_maintain_connections (&task);
+  g_vfs_ftp_task_done (&task);
+
+  g_atomic_int_set (&ftp->keepalive_running, FALSE);
+}
+
+static gboolean
+keepalive_cb (gpointer data)
+{
+  GVfsBackendFtp *ftp = data;
+  GTask *gtask;
+
+  /* don't pile up if the server is slow to answer */
+  if (g_atomic_int_compare_and_exchange (&ftp->keepalive_running, FALSE, TRUE))
+    {
+      gtask = g_task_new (ftp, ftp->keepalive_cancellable, NULL, NULL);
+      g_task_run_in_thread (gtask, keepalive_thread);
+      g_object_unref (gtask);
+    }
+
+  return G_SOURCE_CONTINUE;
 }
 
 static void
@@ -647,6 +714,14 @@ try_login:
  
   g_object_unref (addr);
   g_vfs_ftp_task_done (&task);
+
+  /* Keep idle connections alive and open the warm ones now, so the
+   * first operations don't have to log in. */
+  ftp->keepalive_id = g_timeout_add_seconds (G_VFS_FTP_KEEPALIVE_IN_SECONDS,
+                                             keepalive_cb,
+                                             ftp);
+  if (ftp->warm_connections > 1)
+    keepalive_cb (ftp);
 }
 
 static gboolean
@@ -699,6 +774,13 @@ do_unmount (GVfsBackend *   backend,
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpConnection *conn;
 
+  if (ftp->keepalive_id)
+    {
+      g_source_remove (ftp->keepalive_id);
+      ftp->keepalive_id = 0;
+    }
+  g_cancellable_cancel (ftp->keepalive_cancellable);
+
   g_mutex_lock (&ftp->mutex);
   while ((conn = g_queue_pop_head (ftp->queue)))
     {
@@ -797,39 +879,92 @@ error_550_parent_not_found (GVfsFtpTask *task, gpointer file)
   g_vfs_ftp_file_free (dir);
 }
 
+/* A read handle remembers the file and the current position, so the
+ * transfer can be restarted at another offset with REST after a seek.
+ * conn is NULL when no transfer is running, the next read will then
+ * start one at offset. */
+typedef struct {
+  GVfsFtpConnection *   conn;           /* connection of the running transfer or NULL */
+  GVfsFtpFile *         file;           /* file that is read */
+  goffset               offset;         /* current position in the file */
+} GVfsFtpReadHandle;
+
 static void
-do_open_for_read (GVfsBackend *backend,
-                  GVfsJobOpenForRead *job,
-                  const char *filename)
+g_vfs_ftp_read_handle_free (GVfsFtpReadHandle *handle)
+{
+  g_vfs_ftp_file_free (handle->file);
+  g_free (handle);
+}
+
+static void
+g_vfs_ftp_read_handle_open (GVfsFtpTask *task, GVfsFtpReadHandle *handle)
 {
-  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
-  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
-  GVfsFtpFile *file;
   static const GVfsFtpErrorFunc open_read_handlers[] = { error_550_is_directory, 
                                                          error_550_permission_or_not_found, 
                                                          NULL };
 
-  g_vfs_ftp_task_setup_data_connection (&task);
-  file = g_vfs_ftp_file_new_from_gvfs (ftp, filename);
+  g_vfs_ftp_task_setup_data_connection (task);
 
-  g_vfs_ftp_task_send_and_check (&task,
+  if (handle->offset > 0)
+    g_vfs_ftp_task_send (task,
+                         G_VFS_FTP_PASS_300,
+                         "REST %" G_GOFFSET_FORMAT, handle->offset);
+
+  g_vfs_ftp_task_send_and_check (task,
                                  G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
                                  open_read_handlers,
-                                 file,
+                                 handle->file,
                                  NULL,
-                                 "RETR %s", g_vfs_ftp_file_get_ftp_path (file));
-  g_vfs_ftp_file_free (file);
+                                 "RETR %s", g_vfs_ftp_file_get_ftp_path (handle->file));
 
-  g_vfs_ftp_task_open_data_connection (&task);
+  g_vfs_ftp_task_open_data_connection (task);
+
+  /* don't push the connection back, it's our handle now */
+  if (!g_vfs_ftp_task_is_in_error (task))
+    handle->conn = g_vfs_ftp_task_take_connection (task);
+}
+
+static void
+g_vfs_ftp_read_handle_abort (GVfsFtpTask *task, GVfsFtpReadHandle *handle)
+{
+  if (handle->conn == NULL)
+    return;
+
+  g_vfs_ftp_task_give_connection (task, handle->conn);
+  handle->conn = NULL;
+
+  /* The server answers the aborted transfer with a 426, or with a 226
+   * if it had already sent everything. Neither is an error here. If the
+   * control connection broke, the pool replaces it. */
+  g_vfs_ftp_task_close_data_connection (task);
+  g_vfs_ftp_task_receive (task, 0, NULL);
+  if (!g_cancellable_is_cancelled (task->cancellable))
+    g_vfs_ftp_task_clear_error (task);
+  g_vfs_ftp_task_release_connection (task);
+}
+
+static void
+do_open_for_read (GVfsBackend *backend,
+                  GVfsJobOpenForRead *job,
+                  const char *filename)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+  GVfsFtpReadHandle *handle;
+
+  handle = g_new0 (GVfsFtpReadHandle, 1);
+  handle->file = g_vfs_ftp_file_new_from_gvfs (ftp, filename);
+
+  g_vfs_ftp_read_handle_open (&task, handle);
 
   if (!g_vfs_ftp_task_is_in_error (&task))
     {
-      /* don't push the connection back, it's our handle now */
-      GVfsFtpConnection *conn = g_vfs_ftp_task_take_connection (&task);
-
-      g_vfs_job_open_for_read_set_handle (job, conn);
-      g_vfs_job_open_for_read_set_can_seek (job, FALSE);
+      g_vfs_job_open_for_read_set_handle (job, handle);
+      g_vfs_job_open_for_read_set_can_seek (job,
+                                            g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_REST));
     }
+  else
+    g_vfs_ftp_read_handle_free (handle);
 
   g_vfs_ftp_task_done (&task);
 }
@@ -841,12 +976,16 @@ do_close_read (GVfsBackend *     backend,
 {
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
-  GVfsFtpConnection *conn = handle;
+  GVfsFtpReadHandle *read_handle = handle;
 
-  g_vfs_ftp_task_give_connection (&task, conn);
-  g_vfs_ftp_task_close_data_connection (&task);
-  g_vfs_ftp_task_receive (&task, 0, NULL);
+  if (read_handle->conn)
+    {
+      g_vfs_ftp_task_give_connection (&task, read_handle->conn);
+      g_vfs_ftp_task_close_data_connection (&task);
+      g_vfs_ftp_task_receive (&task, 0, NULL);
+    }
 
+  g_vfs_ftp_read_handle_free (read_handle);
   g_vfs_ftp_task_done (&task);
 }
 
@@ -859,11 +998,22 @@ do_read (GVfsBackend *     backend,
 {
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
-  GVfsFtpConnection *conn = handle;
+  GVfsFtpReadHandle *read_handle = handle;
   GInputStream *input;
   gssize n_bytes;
 
-  input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (conn));
+  /* restart the transfer after a seek */
+  if (read_handle->conn == NULL)
+    {
+      g_vfs_ftp_read_handle_open (&task, read_handle);
+      if (g_vfs_ftp_task_is_in_error (&task))
+        {
+          g_vfs_ftp_task_done (&task);
+          return;
+        }
+    }
+
+  input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (read_handle->conn));
   n_bytes = g_input_stream_read (input,
                                  buffer,
                                  bytes_requested,
@@ -871,11 +1021,74 @@ do_read (GVfsBackend *     backend,
                                  &task.error);
 
   if (n_bytes >= 0)
-    g_vfs_job_read_set_size (job, n_bytes);
+    {
+      read_handle->offset += n_bytes;
+      g_vfs_job_read_set_size (job, n_bytes);
+    }
 
   g_vfs_ftp_task_done (&task);
 }
 
+static void
+do_seek_on_read (GVfsBackend *     backend,
+                 GVfsJobSeekRead * job,
+                 GVfsBackendHandle handle,
+                 goffset           offset,
+                 GSeekType         type)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+  GVfsFtpReadHandle *read_handle = handle;
+  GFileInfo *info;
+
+  switch (type)
+    {
+    case G_SEEK_SET:
+      break;
+    case G_SEEK_CUR:
+      offset += read_handle->offset;
+      break;
+    case G_SEEK_END:
+      info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, read_handle->file, TRUE);
+      if (info == NULL)
+        {
+          g_vfs_ftp_task_done (&task);
+          return;
+        }
+      offset += g_file_info_get_size (info);
+      g_object_unref (info);
+      break;
+    default:
+      g_set_error_literal (&task.error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_NOT_SUPPORTED,
+                           _("Unsupported seek type"));
+      g_vfs_ftp_task_done (&task);
+      return;
+    }
+
+  if (offset < 0)
+    {
+      g_set_error_literal (&task.error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_INVALID_ARGUMENT,
+                           _("Invalid seek offset"));
+      g_vfs_ftp_task_done (&task);
+      return;
+    }
+
+  /* the transfer is restarted at the new offset by the next read, so
+   * seeking around without reading is cheap */
+  if (offset != read_handle->offset)
+    {
+      g_vfs_ftp_read_handle_abort (&task, read_handle);
+      read_handle->offset = offset;
+    }
+
+  g_vfs_job_seek_read_set_offset (job, offset);
+  g_vfs_ftp_task_done (&task);
+}
+
 static void
 do_start_write (GVfsFtpTask *task,
                 GFileCreateFlags flags,
@@ -1568,6 +1781,267 @@ do_pull_improve_error_message (GVfsFtpTask *task,
     }
 }
 
+/* Files are pulled over several connections only if every connection
+ * gets at least this much to do */
+#define G_VFS_FTP_PULL_SEGMENT_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+  GVfsBackendFtp *      ftp;
+  GVfsFtpFile *         file;           /* file that is pulled */
+  int                   fd;             /* destination file */
+  goffset               size;           /* size of file */
+  goffset               segment_size;   /* size of each segment but the last */
+  GCancellable *        cancellable;    /* cancelled on errors to stop the other workers */
+
+  GMutex                mutex;          /* mutex protecting the following variables */
+  GCond                 cond;           /* signalled when a worker is done */
+  GQueue                segments;       /* indexes of segments still to pull */
+  guint                 n_running;      /* number of running workers */
+  goffset               bytes_copied;   /* bytes written to the destination so far */
+  GError *              error;          /* first error that occured */
+} GVfsFtpPull;
+
+static void
+g_vfs_ftp_pull_segment (GVfsFtpTask *task,
+                        GVfsFtpPull *pull,
+                        guint        segment)
+{
+  GInputStream *input;
+  char buffer[32768];
+  goffset offset, end;
+  gssize n_read, n_written, done;
+
+  offset = segment * pull->segment_size;
+  end = MIN (offset + pull->segment_size, pull->size);
+
+  g_vfs_ftp_task_setup_data_connection (task);
+  if (offset > 0)
+    g_vfs_ftp_task_send (task,
+                         G_VFS_FTP_PASS_300,
+                         "REST %" G_GOFFSET_FORMAT, offset);
+  g_vfs_ftp_task_send (task,
+                       G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
+                       "RETR %s", g_vfs_ftp_file_get_ftp_path (pull->file));
+  g_vfs_ftp_task_open_data_connection (task);
+  if (g_vfs_ftp_task_is_in_error (task))
+    return;
+
+  input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (task->conn));
+  while (offset < end)
+    {
+      n_read = g_input_stream_read (input,
+                                    buffer,
+                                    MIN ((goffset) sizeof (buffer), end - offset),
+                                    task->cancellable,
+                                    &task->error);
+      if (n_read < 0)
+        break;
+      if (n_read == 0)
+        {
+          /* the file shrank while we were pulling it */
+          g_set_error_literal (&task->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               _("Unexpected end of stream"));
+          break;
+        }
+
+      for (done = 0; done < n_read; done += n_written)
+        {
+          n_written = pwrite (pull->fd, buffer + done, n_read - done, offset + done);
+          if (n_written < 0)
+            {
+              int errsv = errno;
+
+              if (errsv == EINTR)
+                {
+                  n_written = 0;
+                  continue;
+                }
+              g_set_error (&task->error, G_IO_ERROR,
+                           g_io_error_from_errno (errsv),
+                           _("Error writing file: %s"),
+                           g_strerror (errsv));
+              break;
+            }
+        }
+      if (g_vfs_ftp_task_is_in_error (task))
+        break;
+
+      offset += n_read;
+      g_mutex_lock (&pull->mutex);
+      pull->bytes_copied += n_read;
+      g_mutex_unlock (&pull->mutex);
+    }
+
+  g_vfs_ftp_task_close_data_connection (task);
+  if (g_vfs_ftp_task_is_in_error (task))
+    return;
+
+  /* Every segment but the last one stops the transfer early, which the
+   * server answers with a 426. */
+  g_vfs_ftp_task_receive (task, 0, NULL);
+  if (!g_cancellable_is_cancelled (task->cancellable))
+    g_vfs_ftp_task_clear_error (task);
+  g_vfs_ftp_task_release_connection (task);
+}
+
+static gpointer
+g_vfs_ftp_pull_worker (gpointer data)
+{
+  GVfsFtpPull *pull = data;
+  GVfsFtpTask task = { pull->ftp, NULL, pull->cancellable, };
+  guint segment;
+
+  g_mutex_lock (&pull->mutex);
+  while (pull->error == NULL && !g_queue_is_empty (&pull->segments))
+    {
+      segment = GPOINTER_TO_UINT (g_queue_pop_head (&pull->segments));
+      g_mutex_unlock (&pull->mutex);
+
+      g_vfs_ftp_pull_segment (&task, pull, segment);
+
+      g_mutex_lock (&pull->mutex);
+      if (!g_vfs_ftp_task_is_in_error (&task))
+        continue;
+
+      /* No connection was free for us, leave the segment to the other
+       * workers unless we are the last one. */
+      if (g_vfs_ftp_task_error_matches (&task, G_IO_ERROR, G_IO_ERROR_BUSY) &&
+          pull->n_running > 1)
+        {
+          g_queue_push_head (&pull->segments, GUINT_TO_POINTER (segment));
+          g_vfs_ftp_task_clear_error (&task);
+          break;
+        }
+
+      if (pull->error == NULL)
+        {
+          pull->error = task.error;
+          task.error = NULL;
+          g_cancellable_cancel (pull->cancellable);
+        }
+      break;
+    }
+  pull->n_running--;
+  g_cond_signal (&pull->cond);
+  g_mutex_unlock (&pull->mutex);
+
+  g_vfs_ftp_task_done (&task);
+
+  return NULL;
+}
+
+/* Pulls the file into the file descriptor of output using up to
+ * ftp->pull_connections connections from the pool, each of them
+ * fetching segments of the file with REST. */
+static void
+do_pull_segmented (GVfsFtpTask *         task,
+                   GVfsFtpFile *         src,
+                   GOutputStream *       output,
+                   goffset               total_size,
+                   GFileProgressCallback progress_callback,
+                   gpointer              progress_callback_data)
+{
+  GVfsBackendFtp *ftp = task->backend;
+  GVfsFtpPull pull = { 0, };
+  GThread **threads;
+  guint i, n_workers, n_segments;
+  goffset bytes_copied;
+  gulong cancel_cb_id;
+
+  /* the connection the lookup of the size left on the task sits idle
+   * until the pull is done, so hand it to the workers; commands sent
+   * afterwards acquire a connection again */
+  g_vfs_ftp_task_release_connection (task);
+
+  /* don't take connections that are used by open handles */
+  g_mutex_lock (&ftp->mutex);
+  n_workers = ftp->max_connections > ftp->busy_connections ?
+              ftp->max_connections - ftp->busy_connections : 1;
+  g_mutex_unlock (&ftp->mutex);
+  n_workers = MIN (n_workers, ftp->pull_connections);
+
+  pull.ftp = ftp;
+  pull.file = src;
+  pull.fd = g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (output));
+  pull.size = total_size;
+  /* use a few segments per worker, so fast connections can help out
+   * slow ones at the end */
+  pull.segment_size = MAX (G_VFS_FTP_PULL_SEGMENT_SIZE, total_size / (n_workers * 4));
+  pull.cancellable = g_cancellable_new ();
+  g_mutex_init (&pull.mutex);
+  g_cond_init (&pull.cond);
+  g_queue_init (&pull.segments);
+
+  n_segments = (total_size + pull.segment_size - 1) / pull.segment_size;
+  for (i = 0; i < n_segments; i++)
+    g_queue_push_tail (&pull.segments, GUINT_TO_POINTER (i));
+  n_workers = MIN (n_workers, n_segments);
+
+  g_debug ("# pulling %s in %u segments over %u connections\n",
+           g_vfs_ftp_file_get_ftp_path (src), n_segments, n_workers);
+
+  cancel_cb_id = g_cancellable_connect (task->cancellable,
+                                        G_CALLBACK (cancel_timer_cb),
+                                        pull.cancellable,
+                                        NULL);
+
+  pull.n_running = n_workers;
+  threads = g_new (GThread *, n_workers);
+  for (i = 0; i < n_workers; i++)
+    threads[i] = g_thread_new ("gvfs-ftp-pull", g_vfs_ftp_pull_worker, &pull);
+
+  g_mutex_lock (&pull.mutex);
+  while (pull.n_running > 0)
+    {
+      if (g_cond_wait_until (&pull.cond,
+                             &pull.mutex,
+                             g_get_monotonic_time () + G_TIME_SPAN_SECOND) ||
+          progress_callback == NULL)
+        continue;
+
+      bytes_copied = pull.bytes_copied;
+      g_mutex_unlock (&pull.mutex);
+      progress_callback (bytes_copied, total_size, progress_callback_data);
+      g_mutex_lock (&pull.mutex);
+    }
+  g_mutex_unlock (&pull.mutex);
+
+  for (i = 0; i < n_workers; i++)
+    g_thread_join (threads[i]);
+  g_free (threads);
+
+  g_cancellable_disconnect (task->cancellable, cancel_cb_id);
+
+  if (pull.error)
+    task->error = pull.error;
+  else if (progress_callback)
+    progress_callback (total_size, total_size, progress_callback_data);
+
+  g_queue_clear (&pull.segments);
+  g_mutex_clear (&pull.mutex);
+  g_cond_clear (&pull.cond);
+  g_object_unref (pull.cancellable);
+}
+
+static GOutputStream *
+do_pull_create_output (GVfsFtpTask   *task,
+                       GFile         *dest,
+                       GFileCopyFlags flags)
+{
+  if (flags & G_FILE_COPY_OVERWRITE)
+    return G_OUTPUT_STREAM (g_file_replace (dest,
+                                            NULL,
+                                            flags & G_FILE_COPY_BACKUP ? TRUE : FALSE,
+                                            G_FILE_CREATE_REPLACE_DESTINATION,
+                                            task->cancellable,
+                                            &task->error));
+  else
+    return G_OUTPUT_STREAM (g_file_create (dest,
+                                           0,
+                                           task->cancellable,
+                                           &task->error));
+}
+
 static void
 do_pull (GVfsBackend *         backend,
          GVfsJobPull *         job,
@@ -1588,20 +2062,41 @@ do_pull (GVfsBackend *         backend,
   GInputStream *input;
   GOutputStream *output;
   goffset total_size = 0;
+  gboolean segmented = FALSE;
   
   src = g_vfs_ftp_file_new_from_gvfs (ftp, source);
   dest = g_file_new_for_path (local_path);
 
-  if (progress_callback)
+  if (progress_callback || ftp->pull_connections > 1)
     {
       GFileInfo *info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, src, TRUE);
       if (info)
         {
           total_size = g_file_info_get_size (info);
+          segmented = ftp->pull_connections > 1 &&
+                      g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR &&
+                      total_size >= 2 * G_VFS_FTP_PULL_SEGMENT_SIZE &&
+                      g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_REST);
           g_object_unref (info);
         }
     }
 
+  if (segmented)
+    {
+      output = do_pull_create_output (&task, dest, flags);
+      if (output == NULL)
+        goto out;
+
+      do_pull_segmented (&task,
+                         src,
+                         output,
+                         total_size,
+                         progress_callback,
+                         progress_callback_data);
+      g_object_unref (output);
+      goto done;
+    }
+
   g_vfs_ftp_task_setup_data_connection (&task);
   g_vfs_ftp_task_send_and_check (&task,
                                  G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
@@ -1616,18 +2111,7 @@ do_pull (GVfsBackend *         backend,
       goto out;
     }
 
-  if (flags & G_FILE_COPY_OVERWRITE)
-    output = G_OUTPUT_STREAM (g_file_replace (dest,
-                                              NULL,
-                                              flags & G_FILE_COPY_BACKUP ? TRUE : FALSE,
-                                              G_FILE_CREATE_REPLACE_DESTINATION,
-                                              task.cancellable,
-                                              &task.error));
-  else
-    output = G_OUTPUT_STREAM (g_file_create (dest,
-                                             0,
-                                             task.cancellable,
-                                             &task.error));
+  output = do_pull_create_output (&task, dest, flags);
   if (output == NULL)
     {
       g_vfs_ftp_task_close_data_connection (&task);
@@ -1647,6 +2131,7 @@ do_pull (GVfsBackend *         backend,
   g_vfs_ftp_task_receive (&task, 0, NULL);
   g_object_unref (output);
 
+done:
   if (remove_source)
     {
       g_vfs_ftp_task_send (&task,
@@ -1660,6 +2145,121 @@ out:
   g_vfs_ftp_task_done (&task);
 }
 
+static void
+do_push (GVfsBackend *         backend,
+         GVfsJobPush *         job,
+         const char *          destination,
+         const char *          local_path,
+         GFileCopyFlags        flags,
+         gboolean              remove_source,
+         GFileProgressCallback progress_callback,
+         gpointer              progress_callback_data)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+  GVfsFtpFile *dest;
+  GFile *source;
+  GFileInfo *info;
+  GFileInputStream *input;
+  GOutputStream *output;
+  GFileType file_type;
+  goffset total_size;
+
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      /* let the generic copy code report this */
+      g_set_error_literal (&task.error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_NOT_SUPPORTED,
+                           _("backups not supported yet"));
+      g_vfs_ftp_task_done (&task);
+      return;
+    }
+
+  source = g_file_new_for_path (local_path);
+  dest = g_vfs_ftp_file_new_from_gvfs (ftp, destination);
+
+  info = g_file_query_info (source,
+                            G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            flags & G_FILE_COPY_NOFOLLOW_SYMLINKS ? G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS : 0,
+                            task.cancellable,
+                            &task.error);
+  if (info == NULL)
+    goto out;
+
+  file_type = g_file_info_get_file_type (info);
+  total_size = g_file_info_get_size (info);
+  g_object_unref (info);
+
+  if (file_type == G_FILE_TYPE_DIRECTORY)
+    {
+      g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_WOULD_RECURSE,
+                           _("Can't recursively copy directory"));
+      goto out;
+    }
+  else if (file_type != G_FILE_TYPE_REGULAR)
+    {
+      /* symlinks and special files are left to the generic copy code */
+      g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           _("Not supported"));
+      goto out;
+    }
+
+  info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, dest, FALSE);
+  if (info)
+    {
+      file_type = g_file_info_get_file_type (info);
+      g_object_unref (info);
+
+      if (!(flags & G_FILE_COPY_OVERWRITE))
+        {
+          g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                               _("Target file already exists"));
+          goto out;
+        }
+      if (file_type == G_FILE_TYPE_DIRECTORY)
+        {
+          g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                               _("Can't copy file over directory"));
+          goto out;
+        }
+    }
+
+  input = g_file_read (source, task.cancellable, &task.error);
+  if (input == NULL)
+    goto out;
+
+  g_vfs_ftp_task_setup_data_connection (&task);
+  g_vfs_ftp_task_send (&task,
+                       G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
+                       "STOR %s", g_vfs_ftp_file_get_ftp_path (dest));
+  g_vfs_ftp_task_open_data_connection (&task);
+  if (!g_vfs_ftp_task_is_in_error (&task))
+    {
+      output = g_io_stream_get_output_stream (g_vfs_ftp_connection_get_data_stream (task.conn));
+      ftp_output_stream_splice (output,
+                                G_INPUT_STREAM (input),
+                                total_size,
+                                progress_callback,
+                                progress_callback_data,
+                                task.cancellable,
+                                &task.error);
+      g_vfs_ftp_task_close_data_connection (&task);
+      g_vfs_ftp_task_receive (&task, 0, NULL);
+    }
+  g_object_unref (input);
+  g_vfs_ftp_dir_cache_purge_file (ftp->dir_cache, dest);
+
+  if (remove_source && !g_vfs_ftp_task_is_in_error (&task))
+    g_file_delete (source, task.cancellable, &task.error);
+
+out:
+  g_vfs_ftp_file_free (dest);
+  g_object_unref (source);
+  g_vfs_ftp_task_done (&task);
+}
+
 static void
 g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
 {
@@ -1674,6 +2274,7 @@ g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
   backend_class->open_for_read = do_open_for_read;
   backend_class->close_read = do_close_read;
   backend_class->read = do_read;
+  backend_class->seek_on_read = do_seek_on_read;
   backend_class->create = do_create;
   backend_class->append_to = do_append;
   backend_class->replace = do_replace;
@@ -1688,6 +2289,7 @@ g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
   backend_class->try_query_settable_attributes = try_query_settable_attributes;
   backend_class->set_attribute = do_set_attribute;
   backend_class->pull = do_pull;
+  backend_class->push = do_push;
 }
 
 /*** PUBLIC API ***/
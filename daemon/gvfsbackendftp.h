@@ -29,6 +29,7 @@
 G_BEGIN_DECLS
 
 #define G_VFS_FTP_TIMEOUT_IN_SECONDS 30
+#define G_VFS_FTP_KEEPALIVE_IN_SECONDS 60
 
 typedef enum {
   G_VFS_FTP_FEATURE_MDTM,
@@ -40,7 +41,9 @@ typedef enum {
   G_VFS_FTP_FEATURE_AUTH_TLS,
   G_VFS_FTP_FEATURE_AUTH_SSL,
   G_VFS_FTP_FEATURE_CHMOD,
-  G_VFS_FTP_FEATURE_CHGRP
+  G_VFS_FTP_FEATURE_CHGRP,
+  G_VFS_FTP_FEATURE_MLST,
+  G_VFS_FTP_FEATURE_REST
 } GVfsFtpFeature;
 #define G_VFS_FTP_FEATURES_DEFAULT (0)
 
@@ -99,6 +102,9 @@ struct _GVfsBackendFtp
   const GVfsFtpDirFuncs *dir_funcs;             /* functions used in directory cache */
   GVfsFtpDirCache *     dir_cache;              /* directory cache */
 
+  /* segmented pull */
+  guint                 pull_connections;       /* connections to pull large files with or 0 if disabled */
+
   /* connection collection - accessed from gvfsftptask.c */
   GMutex                mutex;                  /* mutex protecting the following variables */
   GCond                 cond;                   /* cond used to signal tasks waiting on the mutex */
@@ -106,6 +112,12 @@ struct _GVfsBackendFtp
   guint                	connections;            /* current number of connections */
   guint                 busy_connections;       /* current number of connections being used for reads/writes */
   guint                	max_connections;        /* upper server limit for number of connections - dynamically generated */
+  guint                 warm_connections;       /* number of idle connections to keep open */
+
+  /* keepalive */
+  guint                 keepalive_id;           /* source id of the keepalive timeout or 0 */
+  GCancellable *        keepalive_cancellable;  /* cancellable for the keepalive, cancelled on unmount */
+  int                   keepalive_running;      /* TRUE while the keepalive runs - int because it's atomic */
 };
 
 struct _GVfsBackendFtpClass
@@ -337,6 +337,10 @@ g_vfs_backend_mtp_init (GVfsBackendMtp *backend)
   GMountSpec *mount_spec;
 
   g_mutex_init (&backend->mutex);
+  /* Device access is serialized by the backend mutex, so jobs only
+   * need to stay in order per handle */
+  g_vfs_backend_set_concurrency (G_VFS_BACKEND (backend),
+                                 G_VFS_BACKEND_CONCURRENCY_PER_HANDLE);
   g_vfs_backend_set_display_name (G_VFS_BACKEND (backend), "mtp");
   g_vfs_backend_set_icon_name (G_VFS_BACKEND (backend), "multimedia-player");
 
@@ -383,7 +387,7 @@ g_vfs_backend_mtp_finalize (GObject *object)
 /**
  * do_create_dir_monitor:
  *
- * Called with backend mutex lock held.
+ * Takes the backend mutex, jobs may run in parallel.
  */
 static void
 do_create_dir_monitor (GVfsBackend *backend,
@@ -401,7 +405,9 @@ do_create_dir_monitor (GVfsBackend *backend,
                           g_strdup (filename), g_free);
 
   g_vfs_job_create_monitor_set_monitor (job, vfs_monitor);
+  g_mutex_lock (&mtp_backend->mutex);
   g_hash_table_add (mtp_backend->monitors, vfs_monitor);
+  g_mutex_unlock (&mtp_backend->mutex);
   g_object_weak_ref (G_OBJECT (vfs_monitor), (GWeakNotify)g_hash_table_remove, mtp_backend->monitors);
   g_object_unref (vfs_monitor);
   g_vfs_job_succeeded (G_VFS_JOB (job));
@@ -413,7 +419,7 @@ do_create_dir_monitor (GVfsBackend *backend,
 /**
  * do_create_file_monitor:
  *
- * Called with backend mutex lock held.
+ * Takes the backend mutex, jobs may run in parallel.
  */
 static void
 do_create_file_monitor (GVfsBackend *backend,
@@ -431,7 +437,9 @@ do_create_file_monitor (GVfsBackend *backend,
                           g_strdup (filename), g_free);
 
   g_vfs_job_create_monitor_set_monitor (job, vfs_monitor);
+  g_mutex_lock (&mtp_backend->mutex);
   g_hash_table_add (mtp_backend->monitors, vfs_monitor);
+  g_mutex_unlock (&mtp_backend->mutex);
   g_object_weak_ref (G_OBJECT (vfs_monitor), (GWeakNotify)g_hash_table_remove, mtp_backend->monitors);
   g_object_unref (vfs_monitor);
   g_vfs_job_succeeded (G_VFS_JOB (job));
@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <utime.h>
 
 #include <glib/gstdio.h>
 #include <glib/gi18n.h>
@@ -56,6 +57,8 @@
 #include "gvfsjobqueryinforead.h"
 #include "gvfsjobqueryinfowrite.h"
 #include "gvfsjobmove.h"
+#include "gvfsjobpush.h"
+#include "gvfsjobpull.h"
 #include "gvfsjobdelete.h"
 #include "gvfsjobqueryfsinfo.h"
 #include "gvfsjobqueryattributes.h"
@@ -133,8 +136,26 @@ typedef struct {
   char *tempname;
   guint32 permissions;
   gboolean make_backup;
+
+  /* Read prefetching, see try_read() */
+  guint sequential_reads;
+  GQueue prefetch_blocks;
+  goffset prefetch_offset;
+  GVfsJob *prefetch_job;
 } SftpHandle;
 
+typedef struct {
+  SftpHandle *handle; /* NULL once discarded */
+  goffset offset;
+  guint32 size;
+  guchar *data;
+  gsize len;
+  gsize pos;
+  gboolean done;
+  gboolean eof;
+  GError *error;
+} SftpPrefetchBlock;
+
 
 typedef struct {
   ReplyCallback callback;
@@ -182,6 +203,14 @@ struct _GVfsBackendSftp
   GMountSource *mount_source; /* Only used/set during mount */
   int mount_try;
   gboolean mount_try_again;
+
+  /* Attribute cache */
+  GHashTable *cache;
+  gint64 cache_ttl;
+  guint cache_generation;
+  guint cache_insertions;
+  guint64 cache_hits;
+  guint64 cache_misses;
 };
 
 static void parse_attributes (GVfsBackendSftp *backend,
@@ -189,6 +218,11 @@ static void parse_attributes (GVfsBackendSftp *backend,
                               const char *basename,
                               GDataInputStream *reply,
                               GFileAttributeMatcher *attribute_matcher);
+static void parse_raw_attributes (GVfsBackendSftp *backend,
+                                  GFileInfo *info,
+                                  const char *basename,
+                                  GBytes *attrs,
+                                  GFileAttributeMatcher *attribute_matcher);
 
 G_DEFINE_TYPE (GVfsBackendSftp, g_vfs_backend_sftp, G_VFS_TYPE_BACKEND)
 
@@ -243,6 +277,379 @@ get_sftp_client_vendor (void)
   return res;
 }
 
+/* *** attribute cache *** */
+
+/* The attributes from stat and readdir replies are kept as sent by the
+ * server for a short time, keyed by path, so repeated queries of the
+ * same files don't all go to the server. Each query parses them for the
+ * attributes it asked for. The time can be set with GVFS_SFTP_CACHE_TTL
+ * (in seconds, 0 disables the cache). Our own changes invalidate the affected
+ * entries, changes by others show up after the ttl. */
+#define SFTP_CACHE_DEFAULT_TTL 2 /* seconds */
+#define SFTP_CACHE_PURGE_INTERVAL 1024 /* insertions */
+
+typedef struct {
+  gint64 stamp;
+  GBytes *lstat_attrs;
+  gboolean stat_known;
+  GBytes *stat_attrs; /* NULL for broken symlinks */
+  gboolean symlink_target_known;
+  char *symlink_target;
+
+  /* Names of the children, if the directory was listed */
+  gint64 children_stamp;
+  GPtrArray *children;
+} SftpCacheEntry;
+
+static void
+sftp_cache_entry_clear_attributes (SftpCacheEntry *entry)
+{
+  g_clear_pointer (&entry->lstat_attrs, g_bytes_unref);
+  g_clear_pointer (&entry->stat_attrs, g_bytes_unref);
+  entry->stat_known = FALSE;
+  g_free (entry->symlink_target);
+  entry->symlink_target = NULL;
+  entry->symlink_target_known = FALSE;
+}
+
+static void
+sftp_cache_entry_clear_children (SftpCacheEntry *entry)
+{
+  if (entry->children)
+    g_ptr_array_unref (entry->children);
+  entry->children = NULL;
+}
+
+static void
+sftp_cache_entry_free (SftpCacheEntry *entry)
+{
+  sftp_cache_entry_clear_attributes (entry);
+  sftp_cache_entry_clear_children (entry);
+  g_slice_free (SftpCacheEntry, entry);
+}
+
+static gboolean
+sftp_cache_purge_func (gpointer key,
+                       gpointer value,
+                       gpointer user_data)
+{
+  GVfsBackendSftp *backend = user_data;
+  SftpCacheEntry *entry = value;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  return entry->stamp + backend->cache_ttl <= now &&
+    entry->children_stamp + backend->cache_ttl <= now;
+}
+
+/* Returns the entry for path with expired data cleared, creating it if
+   asked for. Returns NULL if the cache is disabled. */
+static SftpCacheEntry *
+sftp_cache_get_entry (GVfsBackendSftp *backend,
+                      const char *path,
+                      gboolean create)
+{
+  SftpCacheEntry *entry;
+  gint64 now;
+
+  if (backend->cache_ttl == 0)
+    return NULL;
+
+  now = g_get_monotonic_time ();
+
+  entry = g_hash_table_lookup (backend->cache, path);
+  if (entry == NULL)
+    {
+      if (!create)
+        return NULL;
+
+      if (++backend->cache_insertions % SFTP_CACHE_PURGE_INTERVAL == 0)
+        g_hash_table_foreach_remove (backend->cache, sftp_cache_purge_func, backend);
+
+      entry = g_slice_new0 (SftpCacheEntry);
+      g_hash_table_insert (backend->cache, g_strdup (path), entry);
+      return entry;
+    }
+
+  if (entry->stamp + backend->cache_ttl <= now)
+    sftp_cache_entry_clear_attributes (entry);
+  if (entry->children_stamp + backend->cache_ttl <= now)
+    sftp_cache_entry_clear_children (entry);
+
+  return entry;
+}
+
+static void
+sftp_cache_count (GVfsBackendSftp *backend,
+                  gboolean hit)
+{
+  if (hit)
+    backend->cache_hits++;
+  else
+    backend->cache_misses++;
+
+  if ((backend->cache_hits + backend->cache_misses) % 1000 == 0)
+    g_debug ("sftp attribute cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %u entries\n",
+             backend->cache_hits, backend->cache_misses,
+             g_hash_table_size (backend->cache));
+}
+
+static gboolean
+sftp_cache_remove_descendant (gpointer key,
+                              gpointer value,
+                              gpointer user_data)
+{
+  const char *path = key;
+  const char *prefix = user_data;
+  gsize len;
+
+  len = strlen (prefix);
+  return strncmp (path, prefix, len) == 0 &&
+    (path[len] == '/' || (len > 0 && prefix[len - 1] == '/'));
+}
+
+/* Forgets everything about path and the listing of its parent
+   directory */
+static void
+sftp_cache_invalidate (GVfsBackendSftp *backend,
+                       const char *path)
+{
+  SftpCacheEntry *entry;
+  char *parent;
+
+  if (path == NULL)
+    return;
+
+  /* Replies to requests sent before this must not fill the cache */
+  backend->cache_generation++;
+
+  if (g_hash_table_size (backend->cache) == 0)
+    return;
+
+  g_hash_table_remove (backend->cache, path);
+
+  parent = g_path_get_dirname (path);
+  entry = g_hash_table_lookup (backend->cache, parent);
+  if (entry)
+    sftp_cache_entry_clear_children (entry);
+  g_free (parent);
+}
+
+/* Like sftp_cache_invalidate(), and also forgets everything below
+   path, for changes that can affect a whole directory tree */
+static void
+sftp_cache_invalidate_tree (GVfsBackendSftp *backend,
+                            const char *path)
+{
+  sftp_cache_invalidate (backend, path);
+
+  if (path != NULL)
+    g_hash_table_foreach_remove (backend->cache, sftp_cache_remove_descendant,
+                                 (gpointer) path);
+}
+
+static void
+sftp_cache_set_lstat_attrs (GVfsBackendSftp *backend,
+                            const char *path,
+                            GBytes *attrs)
+{
+  SftpCacheEntry *entry;
+
+  entry = sftp_cache_get_entry (backend, path, TRUE);
+  if (entry == NULL)
+    return;
+
+  sftp_cache_entry_clear_attributes (entry);
+  entry->stamp = g_get_monotonic_time ();
+  entry->lstat_attrs = g_bytes_ref (attrs);
+}
+
+static void
+sftp_cache_set_stat_attrs (GVfsBackendSftp *backend,
+                           const char *path,
+                           GBytes *attrs)
+{
+  SftpCacheEntry *entry;
+
+  entry = sftp_cache_get_entry (backend, path, FALSE);
+  if (entry == NULL || entry->lstat_attrs == NULL)
+    return;
+
+  g_clear_pointer (&entry->stat_attrs, g_bytes_unref);
+  entry->stat_attrs = attrs ? g_bytes_ref (attrs) : NULL;
+  entry->stat_known = TRUE;
+}
+
+static void
+sftp_cache_set_symlink_target (GVfsBackendSftp *backend,
+                               const char *path,
+                               const char *target)
+{
+  SftpCacheEntry *entry;
+
+  entry = sftp_cache_get_entry (backend, path, FALSE);
+  if (entry == NULL || entry->lstat_attrs == NULL)
+    return;
+
+  g_free (entry->symlink_target);
+  entry->symlink_target = g_strdup (target);
+  entry->symlink_target_known = TRUE;
+}
+
+static void
+sftp_cache_set_children (GVfsBackendSftp *backend,
+                         const char *path,
+                         GPtrArray *children)
+{
+  SftpCacheEntry *entry;
+
+  entry = sftp_cache_get_entry (backend, path, TRUE);
+  if (entry == NULL)
+    return;
+
+  sftp_cache_entry_clear_children (entry);
+  entry->children_stamp = g_get_monotonic_time ();
+  entry->children = g_ptr_array_ref (children);
+}
+
+/* Tells from the permissions in an ATTRS structure whether it
+   describes a symlink, without parsing all of it */
+static gboolean
+raw_attributes_is_symlink (GBytes *attrs)
+{
+  const guchar *data;
+  gsize size, offset;
+  guint32 flags, mode;
+
+  data = g_bytes_get_data (attrs, &size);
+  if (size < 4)
+    return FALSE;
+
+  memcpy (&flags, data, 4);
+  flags = GUINT32_FROM_BE (flags);
+  offset = 4;
+
+  if (flags & SSH_FILEXFER_ATTR_SIZE)
+    offset += 8;
+  if (flags & SSH_FILEXFER_ATTR_UIDGID)
+    offset += 8;
+
+  if (!(flags & SSH_FILEXFER_ATTR_PERMISSIONS) || offset + 4 > size)
+    return FALSE;
+
+  memcpy (&mode, data + offset, 4);
+  return S_ISLNK (GUINT32_FROM_BE (mode));
+}
+
+/* Fills info from what is known about a file, the same way a query
+   would. Returns FALSE if something needed is missing. */
+static gboolean
+sftp_cache_entry_fill_info (GVfsBackendSftp *backend,
+                            SftpCacheEntry *entry,
+                            const char *basename,
+                            GFileQueryInfoFlags flags,
+                            gboolean want_symlink_target,
+                            GFileAttributeMatcher *matcher,
+                            GFileInfo *info)
+{
+  gboolean is_symlink;
+
+  if (entry == NULL || entry->lstat_attrs == NULL)
+    return FALSE;
+
+  is_symlink = raw_attributes_is_symlink (entry->lstat_attrs);
+
+  if (is_symlink &&
+      ((!(flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS) && !entry->stat_known) ||
+       (want_symlink_target && !entry->symlink_target_known)))
+    return FALSE;
+
+  if ((flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS) ||
+      !is_symlink || entry->stat_attrs == NULL)
+    parse_raw_attributes (backend, info, basename, entry->lstat_attrs, matcher);
+  else
+    {
+      parse_raw_attributes (backend, info, basename, entry->stat_attrs, matcher);
+      g_file_info_set_is_symlink (info, TRUE);
+    }
+
+  if (want_symlink_target && entry->symlink_target)
+    g_file_info_set_symlink_target (info, entry->symlink_target);
+
+  return TRUE;
+}
+
+static gboolean
+sftp_cache_lookup_info (GVfsBackendSftp *backend,
+                        const char *path,
+                        GFileQueryInfoFlags flags,
+                        gboolean want_symlink_target,
+                        GFileAttributeMatcher *matcher,
+                        GFileInfo *info)
+{
+  SftpCacheEntry *entry;
+  char *basename;
+  gboolean found;
+
+  entry = sftp_cache_get_entry (backend, path, FALSE);
+  if (entry == NULL)
+    return FALSE;
+
+  basename = NULL;
+  if (strcmp (path, "/") != 0)
+    basename = g_path_get_basename (path);
+
+  found = sftp_cache_entry_fill_info (backend, entry, basename, flags,
+                                      want_symlink_target, matcher, info);
+  g_free (basename);
+
+  return found;
+}
+
+/* Gets the infos of all children of path, returns FALSE if the
+   listing or any of the children isn't known */
+static gboolean
+sftp_cache_lookup_children (GVfsBackendSftp *backend,
+                            const char *path,
+                            GFileQueryInfoFlags flags,
+                            gboolean want_symlink_target,
+                            GFileAttributeMatcher *matcher,
+                            GList **infos_out)
+{
+  SftpCacheEntry *entry;
+  GFileInfo *info;
+  GList *infos;
+  char *child_path;
+  gboolean found;
+  guint i;
+
+  entry = sftp_cache_get_entry (backend, path, FALSE);
+  if (entry == NULL || entry->children == NULL)
+    return FALSE;
+
+  infos = NULL;
+  for (i = 0; i < entry->children->len; i++)
+    {
+      child_path = g_build_filename (path, g_ptr_array_index (entry->children, i), NULL);
+      info = g_file_info_new ();
+      found = sftp_cache_lookup_info (backend, child_path, flags,
+                                      want_symlink_target, matcher, info);
+      g_free (child_path);
+
+      if (!found)
+        {
+          g_object_unref (info);
+          g_list_free_full (infos, g_object_unref);
+          return FALSE;
+        }
+
+      infos = g_list_prepend (infos, info);
+    }
+
+  *infos_out = g_list_reverse (infos);
+  return TRUE;
+}
+
 static void
 g_vfs_backend_sftp_finalize (GObject *object)
 {
@@ -251,6 +658,7 @@ g_vfs_backend_sftp_finalize (GObject *object)
   backend = G_VFS_BACKEND_SFTP (object);
 
   g_hash_table_destroy (backend->expected_replies);
+  g_hash_table_destroy (backend->cache);
   
   if (backend->command_stream)
     g_object_unref (backend->command_stream);
@@ -271,14 +679,24 @@ g_vfs_backend_sftp_finalize (GObject *object)
 static void
 expected_reply_free (ExpectedReply *reply)
 {
-  g_object_unref (reply->job);
+  if (reply->job)
+    g_object_unref (reply->job);
   g_slice_free (ExpectedReply, reply);
 }
 
 static void
 g_vfs_backend_sftp_init (GVfsBackendSftp *backend)
 {
+  const char *ttl;
+
   backend->expected_replies = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)expected_reply_free);
+
+  backend->cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, (GDestroyNotify)sftp_cache_entry_free);
+  backend->cache_ttl = SFTP_CACHE_DEFAULT_TTL * G_USEC_PER_SEC;
+  ttl = g_getenv ("GVFS_SFTP_CACHE_TTL");
+  if (ttl != NULL)
+    backend->cache_ttl = MAX (g_ascii_strtoll (ttl, NULL, 10), 0) * G_USEC_PER_SEC;
 }
 
 static void
@@ -1128,6 +1546,16 @@ handle_login (GVfsBackend *backend,
   return ret_val;
 }
 
+static void prefetch_read_reply (GVfsBackendSftp *backend,
+                                 int reply_type,
+                                 GDataInputStream *reply,
+                                 guint32 len,
+                                 GVfsJob *job,
+                                 gpointer user_data);
+static void prefetch_block_failed (GVfsBackendSftp *backend,
+                                   gpointer user_data,
+                                   const GError *error);
+
 static void
 fail_jobs_and_die (GVfsBackendSftp *backend, GError *error)
 {
@@ -1138,7 +1566,11 @@ fail_jobs_and_die (GVfsBackendSftp *backend, GError *error)
   while (g_hash_table_iter_next (&iter, &key, &value))
     {
       ExpectedReply *expected_reply = (ExpectedReply *) value;
-      g_vfs_job_failed_from_error (expected_reply->job, error);
+
+      if (expected_reply->callback == prefetch_read_reply)
+        prefetch_block_failed (backend, expected_reply->user_data, error);
+      else if (expected_reply->job != NULL)
+        g_vfs_job_failed_from_error (expected_reply->job, error);
     }
 
   g_error_free (error);
@@ -1339,7 +1771,8 @@ expect_reply (GVfsBackendSftp *backend,
 
   expected = g_slice_new (ExpectedReply);
   expected->callback = callback;
-  expected->job = g_object_ref (job);
+  /* Internal requests, such as prefetch reads, have no job */
+  expected->job = job ? g_object_ref (job) : NULL;
   expected->user_data = user_data;
 
   g_hash_table_replace (backend->expected_replies, GINT_TO_POINTER (id), expected);
@@ -2288,6 +2721,90 @@ parse_attributes (GVfsBackendSftp *backend,
     }
 }
 
+/* Copies the ATTRS structure at the current position of reply, so it
+   can be parsed again later for another set of attributes */
+static GBytes *
+read_raw_attributes (GDataInputStream *reply)
+{
+  GOutputStream *mem_stream;
+  GDataOutputStream *data_stream;
+  GBytes *attrs;
+  guint32 flags, count, i;
+  gsize len;
+  char *str;
+
+  mem_stream = g_memory_output_stream_new (NULL, 0, (GReallocFunc)g_realloc, g_free);
+  data_stream = g_data_output_stream_new (mem_stream);
+
+  flags = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+  g_data_output_stream_put_uint32 (data_stream, flags, NULL, NULL);
+
+  if (flags & SSH_FILEXFER_ATTR_SIZE)
+    g_data_output_stream_put_uint64 (data_stream,
+                                     g_data_input_stream_read_uint64 (reply, NULL, NULL),
+                                     NULL, NULL);
+  if (flags & SSH_FILEXFER_ATTR_UIDGID)
+    for (i = 0; i < 2; i++)
+      g_data_output_stream_put_uint32 (data_stream,
+                                       g_data_input_stream_read_uint32 (reply, NULL, NULL),
+                                       NULL, NULL);
+  if (flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+    g_data_output_stream_put_uint32 (data_stream,
+                                     g_data_input_stream_read_uint32 (reply, NULL, NULL),
+                                     NULL, NULL);
+  if (flags & SSH_FILEXFER_ATTR_ACMODTIME)
+    for (i = 0; i < 2; i++)
+      g_data_output_stream_put_uint32 (data_stream,
+                                       g_data_input_stream_read_uint32 (reply, NULL, NULL),
+                                       NULL, NULL);
+
+  if (flags & SSH_FILEXFER_ATTR_EXTENDED)
+    {
+      count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      g_data_output_stream_put_uint32 (data_stream, count, NULL, NULL);
+
+      /* Name and value of each extension */
+      for (i = 0; i < 2 * count; i++)
+        {
+          str = read_string (reply, &len);
+          if (str == NULL)
+            break;
+
+          g_data_output_stream_put_uint32 (data_stream, len, NULL, NULL);
+          g_output_stream_write_all (G_OUTPUT_STREAM (data_stream),
+                                     str, len, NULL, NULL, NULL);
+          g_free (str);
+        }
+    }
+
+  g_output_stream_close (G_OUTPUT_STREAM (data_stream), NULL, NULL);
+  attrs = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (mem_stream));
+
+  g_object_unref (data_stream);
+  g_object_unref (mem_stream);
+
+  return attrs;
+}
+
+static void
+parse_raw_attributes (GVfsBackendSftp *backend,
+                      GFileInfo *info,
+                      const char *basename,
+                      GBytes *attrs,
+                      GFileAttributeMatcher *matcher)
+{
+  GInputStream *mem_stream;
+  GDataInputStream *data_stream;
+
+  mem_stream = g_memory_input_stream_new_from_bytes (attrs);
+  data_stream = g_data_input_stream_new (mem_stream);
+  g_object_unref (mem_stream);
+
+  parse_attributes (backend, info, basename, data_stream, matcher);
+
+  g_object_unref (data_stream);
+}
+
 static SftpHandle *
 sftp_handle_new (GDataInputStream *reply)
 {
@@ -2300,9 +2817,33 @@ sftp_handle_new (GDataInputStream *reply)
   return handle;
 }
 
+static void
+prefetch_block_free (SftpPrefetchBlock *block)
+{
+  g_free (block->data);
+  g_clear_error (&block->error);
+  g_slice_free (SftpPrefetchBlock, block);
+}
+
+static void
+sftp_handle_discard_prefetch (SftpHandle *handle)
+{
+  SftpPrefetchBlock *block;
+
+  while ((block = g_queue_pop_head (&handle->prefetch_blocks)) != NULL)
+    {
+      /* Blocks still in flight are freed when their reply arrives */
+      if (block->done)
+        prefetch_block_free (block);
+      else
+        block->handle = NULL;
+    }
+}
+
 static void
 sftp_handle_free (SftpHandle *handle)
 {
+  sftp_handle_discard_prefetch (handle);
   data_buffer_free (handle->raw_handle);
   g_free (handle->filename);
   g_free (handle->tempname);
@@ -2476,53 +3017,311 @@ read_reply (GVfsBackendSftp *backend,
     }
   
   handle->offset += count;
+  handle->sequential_reads++;
 
   g_vfs_job_read_set_size (G_VFS_JOB_READ (job), count);
   g_vfs_job_succeeded (job);
 }
 
-static gboolean
-try_read (GVfsBackend *backend,
-          GVfsJobRead *job,
-          GVfsBackendHandle _handle,
-          char *buffer,
-          gsize bytes_requested)
+/* Once a handle is read sequentially, up to PREFETCH_MAX_BLOCKS reads
+ * of PREFETCH_BLOCK_SIZE are kept in flight ahead of the read offset,
+ * and reads are served from the blocks that arrived. Seeking discards
+ * the prefetched data. */
+#define PREFETCH_MIN_SEQUENTIAL_READS 2
+#define PREFETCH_BLOCK_SIZE (32 * 1024)
+#define PREFETCH_MAX_BLOCKS 16
+
+/* Prefetch reads are internal requests without a job, as the read job
+ * that started them has usually completed long before they return.
+ * Their errors are kept in the block and go to the read that reaches it. */
+static void
+prefetch_fill (GVfsBackendSftp *backend,
+               SftpHandle *handle)
 {
-  SftpHandle *handle = _handle;
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  SftpPrefetchBlock *block;
   GDataOutputStream *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_READ);
-  put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, bytes_requested, NULL, NULL);
-  
-  queue_command_stream_and_free (op_backend, command, read_reply, G_VFS_JOB (job), handle);
+  if (handle->prefetch_blocks.length == 0)
+    handle->prefetch_offset = handle->offset;
 
-  return TRUE;
+  while (handle->prefetch_blocks.length < PREFETCH_MAX_BLOCKS)
+    {
+      /* Nothing more to get after the end of file or an error */
+      block = g_queue_peek_tail (&handle->prefetch_blocks);
+      if (block && (block->eof || block->error))
+        return;
+
+      block = g_slice_new0 (SftpPrefetchBlock);
+      block->handle = handle;
+      block->offset = handle->prefetch_offset;
+      block->size = PREFETCH_BLOCK_SIZE;
+      g_queue_push_tail (&handle->prefetch_blocks, block);
+
+      handle->prefetch_offset += block->size;
+
+      command = new_command_stream (backend, SSH_FXP_READ);
+      put_data_buffer (command, handle->raw_handle);
+      g_data_output_stream_put_uint64 (command, block->offset, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, block->size, NULL, NULL);
+      queue_command_stream_and_free (backend, command, prefetch_read_reply,
+                                     NULL, block);
+    }
 }
 
 static void
-seek_read_fstat_reply (GVfsBackendSftp *backend,
-                       int reply_type,
-                       GDataInputStream *reply,
-                       guint32 len,
-                       GVfsJob *job,
-                       gpointer user_data)
+prefetch_read_cancelled_cb (GVfsJob *job,
+                            gpointer user_data)
 {
-  SftpHandle *handle;
-  GFileInfo *info;
-  goffset file_size;
-  GVfsJobSeekRead *op_job;
-  
-  handle = user_data;
-  
-  if (reply_type == SSH_FXP_STATUS)
-    {
-      result_from_status (job, reply, -1, -1);
-      return;
-    }
+  SftpHandle *handle = user_data;
+
+  if (handle->prefetch_job != job)
+    return;
+
+  handle->prefetch_job = NULL;
+  g_signal_handlers_disconnect_by_func (job, prefetch_read_cancelled_cb, handle);
+  g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                    _("Operation was cancelled"));
+}
+
+/* Takes the read job out of its wait for the first block */
+static GVfsJob *
+prefetch_take_job (SftpHandle *handle)
+{
+  GVfsJob *job;
+
+  job = handle->prefetch_job;
+  if (job != NULL)
+    {
+      handle->prefetch_job = NULL;
+      g_signal_handlers_disconnect_by_func (job, prefetch_read_cancelled_cb, handle);
+    }
+
+  return job;
+}
+
+/* Completes the read job from the prefetched blocks, or leaves it
+   waiting for the first block to arrive */
+static void
+prefetch_serve_read (GVfsBackendSftp *backend,
+                     SftpHandle *handle,
+                     GVfsJobRead *job)
+{
+  SftpPrefetchBlock *block;
+  gsize copied, n;
+
+  copied = 0;
+  while (copied < job->bytes_requested &&
+         (block = g_queue_peek_head (&handle->prefetch_blocks)) != NULL &&
+         block->done && !block->eof && !block->error)
+    {
+      /* A short read leaves a gap, start over from there */
+      if (block->offset + block->pos != handle->offset)
+        {
+          sftp_handle_discard_prefetch (handle);
+          break;
+        }
+
+      n = MIN (job->bytes_requested - copied, block->len - block->pos);
+      memcpy (job->buffer + copied, block->data + block->pos, n);
+      block->pos += n;
+      copied += n;
+      handle->offset += n;
+
+      if (block->pos == block->len)
+        prefetch_block_free (g_queue_pop_head (&handle->prefetch_blocks));
+    }
+
+  block = g_queue_peek_head (&handle->prefetch_blocks);
+
+  if (copied == 0)
+    {
+      if (block == NULL)
+        {
+          /* Restart after a gap */
+          prefetch_fill (backend, handle);
+          block = g_queue_peek_head (&handle->prefetch_blocks);
+        }
+
+      if (!block->done)
+        {
+          if (g_vfs_job_is_cancelled (G_VFS_JOB (job)))
+            {
+              g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                _("Operation was cancelled"));
+              return;
+            }
+
+          handle->prefetch_job = G_VFS_JOB (job);
+          g_signal_connect (job, "cancelled",
+                            G_CALLBACK (prefetch_read_cancelled_cb), handle);
+          return;
+        }
+
+      if (block->error)
+        g_vfs_job_failed_from_error (G_VFS_JOB (job), block->error);
+      else
+        {
+          /* Don't prefetch past the end of file on further reads */
+          handle->sequential_reads = 0;
+          g_vfs_job_read_set_size (job, 0);
+          g_vfs_job_succeeded (G_VFS_JOB (job));
+        }
+
+      sftp_handle_discard_prefetch (handle);
+      return;
+    }
+
+  g_vfs_job_read_set_size (job, copied);
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  prefetch_fill (backend, handle);
+}
+
+static void
+prefetch_read (GVfsBackendSftp *backend,
+               SftpHandle *handle,
+               GVfsJobRead *job)
+{
+  SftpPrefetchBlock *block;
+
+  block = g_queue_peek_head (&handle->prefetch_blocks);
+  if (block != NULL && block->offset + block->pos != handle->offset)
+    sftp_handle_discard_prefetch (handle);
+
+  prefetch_fill (backend, handle);
+  prefetch_serve_read (backend, handle, job);
+}
+
+static void
+prefetch_read_reply (GVfsBackendSftp *backend,
+                     int reply_type,
+                     GDataInputStream *reply,
+                     guint32 len,
+                     GVfsJob *job,
+                     gpointer user_data)
+{
+  SftpPrefetchBlock *block = user_data;
+  SftpHandle *handle;
+  GVfsJob *read_job;
+  guint32 count;
+
+  handle = block->handle;
+  if (handle == NULL)
+    {
+      prefetch_block_free (block);
+      return;
+    }
+
+  block->done = TRUE;
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      if (error_from_status (NULL, reply, -1, SSH_FX_EOF, &block->error))
+        block->eof = TRUE;
+    }
+  else if (reply_type == SSH_FXP_DATA)
+    {
+      count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      if (count > block->size)
+        block->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                            _("Invalid reply received"));
+      else
+        {
+          block->data = g_malloc (count);
+          if (!g_input_stream_read_all (G_INPUT_STREAM (reply),
+                                        block->data, count,
+                                        &block->len, NULL, NULL))
+            block->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                _("Invalid reply received"));
+          else if (count == 0)
+            block->eof = TRUE;
+        }
+    }
+  else
+    block->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                        _("Invalid reply received"));
+
+  if (handle->prefetch_job != NULL &&
+      block == g_queue_peek_head (&handle->prefetch_blocks))
+    {
+      read_job = prefetch_take_job (handle);
+      prefetch_serve_read (backend, handle, G_VFS_JOB_READ (read_job));
+    }
+}
+
+/* The connection died before the block's reply arrived */
+static void
+prefetch_block_failed (GVfsBackendSftp *backend,
+                       gpointer user_data,
+                       const GError *error)
+{
+  SftpPrefetchBlock *block = user_data;
+  SftpHandle *handle;
+  GVfsJob *read_job;
+
+  handle = block->handle;
+  if (handle == NULL)
+    {
+      prefetch_block_free (block);
+      return;
+    }
+
+  block->done = TRUE;
+  block->error = g_error_copy (error);
+
+  read_job = prefetch_take_job (handle);
+  if (read_job != NULL)
+    g_vfs_job_failed_from_error (read_job, error);
+}
+
+static gboolean
+try_read (GVfsBackend *backend,
+          GVfsJobRead *job,
+          GVfsBackendHandle _handle,
+          char *buffer,
+          gsize bytes_requested)
+{
+  SftpHandle *handle = _handle;
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+
+  if (handle->sequential_reads >= PREFETCH_MIN_SEQUENTIAL_READS)
+    {
+      prefetch_read (op_backend, handle, job);
+      return TRUE;
+    }
+
+  command = new_command_stream (op_backend,
+                                SSH_FXP_READ);
+  put_data_buffer (command, handle->raw_handle);
+  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
+  g_data_output_stream_put_uint32 (command, bytes_requested, NULL, NULL);
+  
+  queue_command_stream_and_free (op_backend, command, read_reply, G_VFS_JOB (job), handle);
+
+  return TRUE;
+}
+
+static void
+seek_read_fstat_reply (GVfsBackendSftp *backend,
+                       int reply_type,
+                       GDataInputStream *reply,
+                       guint32 len,
+                       GVfsJob *job,
+                       gpointer user_data)
+{
+  SftpHandle *handle;
+  GFileInfo *info;
+  goffset file_size;
+  GVfsJobSeekRead *op_job;
+  
+  handle = user_data;
+  
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      result_from_status (job, reply, -1, -1);
+      return;
+    }
 
   if (reply_type != SSH_FXP_ATTRS)
     {
@@ -2572,6 +3371,9 @@ try_seek_on_read (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_handle_discard_prefetch (handle);
+  handle->sequential_reads = 0;
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_FSTAT);
   put_data_buffer (command, handle->raw_handle);
@@ -2786,7 +3588,14 @@ close_write_reply (GVfsBackendSftp *backend,
     g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
 	                 _("Invalid reply received"));
 
-  if (res)
+  if (res && handle->tempname &&
+      G_VFS_JOB_CLOSE_WRITE (job)->aborted)
+    {
+      delete_temp_file (backend, handle, G_VFS_JOB (job));
+      g_vfs_job_succeeded (job);
+      sftp_handle_free (handle);
+    }
+  else if (res)
     {
       if (handle->tempname)
         {
@@ -2866,6 +3675,9 @@ try_close_write (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_cache_invalidate (op_backend, handle->filename);
+  sftp_cache_invalidate (op_backend, handle->tempname);
+
   command = new_command_stream (op_backend, SSH_FXP_FSTAT);
   put_data_buffer (command, handle->raw_handle);
 
@@ -3013,6 +3825,7 @@ create_reply (GVfsBackendSftp *backend,
     }
 
   handle = sftp_handle_new (reply);
+  handle->filename = g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), TRUE);
@@ -3028,6 +3841,8 @@ try_create (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_cache_invalidate (op_backend, filename);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_OPEN);
   put_string (command, filename);
@@ -3094,6 +3909,7 @@ append_to_reply (GVfsBackendSftp *backend,
     }
 
   handle = sftp_handle_new (reply);
+  handle->filename = g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), FALSE);
@@ -3109,6 +3925,8 @@ try_append_to (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_cache_invalidate (op_backend, filename);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_OPEN);
   put_string (command, filename);
@@ -3511,6 +4329,8 @@ try_replace (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_cache_invalidate (op_backend, filename);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_OPEN);
   put_string (command, filename);
@@ -3557,6 +4377,8 @@ try_write (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_cache_invalidate (op_backend, handle->filename);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_WRITE);
   put_data_buffer (command, handle->raw_handle);
@@ -3657,6 +4479,8 @@ try_seek_on_write (GVfsBackend *backend,
 typedef struct {
   DataBuffer *handle;
   int outstanding_requests;
+  guint cache_generation;
+  GPtrArray *children;
 } ReadDirData;
 
 static
@@ -3664,9 +4488,21 @@ void
 read_dir_data_free (ReadDirData *data)
 {
   data_buffer_free (data->handle);
+  g_ptr_array_unref (data->children);
   g_slice_free (ReadDirData, data);
 }
 
+/* Caches what a listing returned, unless something changed meanwhile */
+static gboolean
+read_dir_can_cache (GVfsBackendSftp *backend,
+                    GVfsJob *job)
+{
+  ReadDirData *data = job->backend_data;
+
+  return backend->cache_ttl != 0 &&
+    data->cache_generation == backend->cache_generation;
+}
+
 static void
 read_dir_readlink_reply (GVfsBackendSftp *backend,
                          int reply_type,
@@ -3681,17 +4517,26 @@ read_dir_readlink_reply (GVfsBackendSftp *backend,
 
   data = job->backend_data;
 
+  target = NULL;
   if (reply_type == SSH_FXP_NAME)
     {
       /* count = */ (void) g_data_input_stream_read_uint32 (reply, NULL, NULL);
       
       target = read_string (reply, NULL);
       if (target)
-        {
-          g_file_info_set_symlink_target (info, target);
-          g_free (target);
-        }
+        g_file_info_set_symlink_target (info, target);
+    }
+
+  if (read_dir_can_cache (backend, job))
+    {
+      char *abs_name;
+
+      abs_name = g_build_filename (G_VFS_JOB_ENUMERATE (job)->filename,
+                                   g_file_info_get_name (info), NULL);
+      sftp_cache_set_symlink_target (backend, abs_name, target);
+      g_free (abs_name);
     }
+  g_free (target);
 
   g_vfs_job_enumerate_add_info (G_VFS_JOB_ENUMERATE (job), info);
   g_object_unref (info);
@@ -3742,25 +4587,45 @@ read_dir_symlink_reply (GVfsBackendSftp *backend,
   GFileInfo *info;
   GFileInfo *lstat_info;
   ReadDirData *data;
+  char *abs_name;
 
   lstat_info = user_data;
   name = g_file_info_get_name (lstat_info);
   data = job->backend_data;
+  abs_name = g_build_filename (G_VFS_JOB_ENUMERATE (job)->filename, name, NULL);
   
   if (reply_type == SSH_FXP_ATTRS)
     {
+      GFileAttributeMatcher *matcher;
+      GBytes *attrs;
+
       info = g_file_info_new ();
       g_file_info_set_name (info, name);
-      g_file_info_set_is_symlink (info, TRUE);
       
-      parse_attributes (backend, info, name, reply, G_VFS_JOB_ENUMERATE (job)->attribute_matcher);
+      matcher = G_VFS_JOB_ENUMERATE (job)->attribute_matcher;
+      if (read_dir_can_cache (backend, job))
+        {
+          attrs = read_raw_attributes (reply);
+          parse_raw_attributes (backend, info, name, attrs, matcher);
+          sftp_cache_set_stat_attrs (backend, abs_name, attrs);
+          g_bytes_unref (attrs);
+        }
+      else
+        parse_attributes (backend, info, name, reply, matcher);
 
+      g_file_info_set_is_symlink (info, TRUE);
       read_dir_got_stat_info (backend, job, info);
       
       g_object_unref (info);
     }
   else
-    read_dir_got_stat_info (backend, job, lstat_info);
+    {
+      if (read_dir_can_cache (backend, job))
+        sftp_cache_set_stat_attrs (backend, abs_name, NULL);
+      read_dir_got_stat_info (backend, job, lstat_info);
+    }
+
+  g_free (abs_name);
 
   g_object_unref (lstat_info);
   
@@ -3790,6 +4655,11 @@ read_dir_reply (GVfsBackendSftp *backend,
       /* Ignore all error, including the expected END OF FILE.
        * Real errors are expected in open_dir anyway */
 
+      if (reply_type == SSH_FXP_STATUS &&
+          read_status_code (reply) == SSH_FX_EOF &&
+          read_dir_can_cache (backend, job))
+        sftp_cache_set_children (backend, enum_job->filename, data->children);
+
       /* Close handle */
 
       command = new_command_stream (backend,
@@ -3818,7 +4688,25 @@ read_dir_reply (GVfsBackendSftp *backend,
       longname = read_string (reply, NULL);
       g_free (longname);
       
-      parse_attributes (backend, info, name, reply, enum_job->attribute_matcher);
+      if (strcmp (".", name) != 0 &&
+          strcmp ("..", name) != 0 &&
+          read_dir_can_cache (backend, job))
+        {
+          GBytes *attrs;
+
+          attrs = read_raw_attributes (reply);
+          parse_raw_attributes (backend, info, name, attrs,
+                                enum_job->attribute_matcher);
+
+          abs_name = g_build_filename (enum_job->filename, name, NULL);
+          sftp_cache_set_lstat_attrs (backend, abs_name, attrs);
+          g_free (abs_name);
+          g_bytes_unref (attrs);
+          g_ptr_array_add (data->children, g_strdup (name));
+        }
+      else
+        parse_attributes (backend, info, name, reply,
+                          enum_job->attribute_matcher);
       
       if (g_file_info_get_file_type (info) == G_FILE_TYPE_SYMBOLIC_LINK &&
           ! (enum_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
@@ -3924,8 +4812,27 @@ try_enumerate (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
   ReadDirData *data;
+  GList *infos, *l;
+
+  if (sftp_cache_lookup_children (op_backend, filename, flags,
+                                  g_file_attribute_matcher_matches (attribute_matcher,
+                                                                    G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET),
+                                  attribute_matcher,
+                                  &infos))
+    {
+      sftp_cache_count (op_backend, TRUE);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      for (l = infos; l != NULL; l = l->next)
+        g_vfs_job_enumerate_add_info (job, l->data);
+      g_vfs_job_enumerate_done (job);
+      g_list_free_full (infos, g_object_unref);
+      return TRUE;
+    }
+  sftp_cache_count (op_backend, FALSE);
 
   data = g_slice_new0 (ReadDirData);
+  data->cache_generation = op_backend->cache_generation;
+  data->children = g_ptr_array_new_with_free_func (g_free);
 
   g_vfs_job_set_backend_data (G_VFS_JOB (job), data, (GDestroyNotify)read_dir_data_free);
   command = new_command_stream (op_backend,
@@ -3947,10 +4854,14 @@ query_info_reply (GVfsBackendSftp *backend,
   char *basename;
   int i;
   MultiReply *lstat_reply, *reply;
-  GFileInfo *lstat_info;
+  SftpCacheEntry entry = { 0 };
   GVfsJobQueryInfo *op_job;
+  gboolean want_symlink_target;
 
   op_job = G_VFS_JOB_QUERY_INFO (job);
+  want_symlink_target =
+    g_file_attribute_matcher_matches (op_job->attribute_matcher,
+                                      G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET);
   
   i = 0;
   lstat_reply = &replies[i++];
@@ -3972,58 +4883,49 @@ query_info_reply (GVfsBackendSftp *backend,
   if (strcmp (op_job->filename, "/") != 0)
     basename = g_path_get_basename (op_job->filename);
 
-  if (op_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS)
-    {
-      parse_attributes (backend, op_job->file_info, basename,
-                        lstat_reply->data, op_job->attribute_matcher);
-    }
-  else
+  entry.lstat_attrs = read_raw_attributes (lstat_reply->data);
+
+  if (!(op_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
     {
       /* Look at stat results */
       reply = &replies[i++];
 
+      /* Otherwise a broken symlink, use lstat data */
+      entry.stat_known = TRUE;
       if (reply->type == SSH_FXP_ATTRS)
-        {
-          parse_attributes (backend, op_job->file_info, basename,
-                            reply->data, op_job->attribute_matcher);
-
-          
-          lstat_info = g_file_info_new ();
-          parse_attributes (backend, lstat_info, basename,
-                            lstat_reply->data, op_job->attribute_matcher);
-          if (g_file_info_get_is_symlink (lstat_info))
-            g_file_info_set_is_symlink (op_job->file_info, TRUE);
-          g_object_unref (lstat_info);
-        }
-      else
-        {
-          /* Broken symlink, use lstat data */
-          parse_attributes (backend, op_job->file_info, basename,
-                            lstat_reply->data, op_job->attribute_matcher);
-        }
-      
+        entry.stat_attrs = read_raw_attributes (reply->data);
     }
-    
-  g_free (basename);
 
-  if (g_file_attribute_matcher_matches (op_job->attribute_matcher,
-                                        G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
+  if (want_symlink_target)
     {
       /* Look at readlink results */
       reply = &replies[i++];
 
+      entry.symlink_target_known = TRUE;
       if (reply->type == SSH_FXP_NAME)
         {
-          char *symlink_target;
-          
           /* Skip count (always 1 for replies to SSH_FXP_READLINK) */
           g_data_input_stream_read_uint32 (reply->data, NULL, NULL);
-          symlink_target = read_string (reply->data, NULL);
-          g_file_info_set_symlink_target (op_job->file_info, symlink_target);
-          g_free (symlink_target);
+          entry.symlink_target = read_string (reply->data, NULL);
         }
     }
 
+  /* Don't cache if something was changed since the query was sent */
+  if (GPOINTER_TO_UINT (user_data) == backend->cache_generation)
+    {
+      sftp_cache_set_lstat_attrs (backend, op_job->filename, entry.lstat_attrs);
+      if (entry.stat_known)
+        sftp_cache_set_stat_attrs (backend, op_job->filename, entry.stat_attrs);
+      if (entry.symlink_target_known)
+        sftp_cache_set_symlink_target (backend, op_job->filename, entry.symlink_target);
+    }
+
+  sftp_cache_entry_fill_info (backend, &entry, basename, op_job->flags,
+                              want_symlink_target, op_job->attribute_matcher,
+                              op_job->file_info);
+  sftp_cache_entry_clear_attributes (&entry);
+  g_free (basename);
+
   g_vfs_job_succeeded (G_VFS_JOB (job));
 }
 
@@ -4038,8 +4940,22 @@ try_query_info (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *commands[3];
   GDataOutputStream *command;
+  gboolean want_symlink_target;
   int n_commands;
 
+  want_symlink_target =
+    g_file_attribute_matcher_matches (job->attribute_matcher,
+                                      G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET);
+
+  if (sftp_cache_lookup_info (op_backend, filename, job->flags,
+                              want_symlink_target, matcher, info))
+    {
+      sftp_cache_count (op_backend, TRUE);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      return TRUE;
+    }
+  sftp_cache_count (op_backend, FALSE);
+
   n_commands = 0;
   
   command = commands[n_commands++] =
@@ -4055,8 +4971,7 @@ try_query_info (GVfsBackend *backend,
       put_string (command, filename);
     }
 
-  if (g_file_attribute_matcher_matches (job->attribute_matcher,
-                                        G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
+  if (want_symlink_target)
     {
       command = commands[n_commands++] =
         new_command_stream (op_backend,
@@ -4064,7 +4979,8 @@ try_query_info (GVfsBackend *backend,
       put_string (command, filename);
     }
 
-  queue_command_streams_and_free (op_backend, commands, n_commands, query_info_reply, G_VFS_JOB (job), NULL);
+  queue_command_streams_and_free (op_backend, commands, n_commands, query_info_reply, G_VFS_JOB (job),
+                                  GUINT_TO_POINTER (op_backend->cache_generation));
   
   return TRUE;
 }
@@ -4303,6 +5219,9 @@ try_move (GVfsBackend *backend,
   GDataOutputStream *command;
   GDataOutputStream *commands[2];
 
+  sftp_cache_invalidate_tree (op_backend, source);
+  sftp_cache_invalidate_tree (op_backend, destination);
+
   command = commands[0] =
     new_command_stream (op_backend,
                         SSH_FXP_LSTAT);
@@ -4358,6 +5277,9 @@ try_set_display_name (GVfsBackend *backend,
 
   g_vfs_job_set_display_name_set_new_path (job,
                                            new_name);
+
+  sftp_cache_invalidate_tree (op_backend, filename);
+  sftp_cache_invalidate_tree (op_backend, new_name);
   
   command = new_command_stream (op_backend,
                                 SSH_FXP_RENAME);
@@ -4396,6 +5318,8 @@ try_make_symlink (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
   
+  sftp_cache_invalidate (op_backend, filename);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_SYMLINK);
   /* Note: This is the reverse order of how this is documented in
@@ -4468,6 +5392,8 @@ try_make_directory (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_cache_invalidate (op_backend, filename);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_MKDIR);
   put_string (command, filename);
@@ -4557,6 +5483,8 @@ try_delete (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
   
+  sftp_cache_invalidate_tree (op_backend, filename);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_LSTAT);
   put_string (command, filename);
@@ -4614,6 +5542,8 @@ try_set_attribute (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_cache_invalidate (op_backend, filename);
+
   if (strcmp (attribute, G_FILE_ATTRIBUTE_UNIX_MODE) != 0)
     {
       g_vfs_job_failed (G_VFS_JOB (job),
@@ -4641,6 +5571,1171 @@ try_set_attribute (GVfsBackend *backend,
   return TRUE;
 }
 
+/* *** push () / pull () *** */
+
+/* Transfers keep this many SSH_FXP_READ/SSH_FXP_WRITE requests of
+ * TRANSFER_CHUNK_SIZE in flight at different offsets, like the
+ * OpenSSH sftp client does. 32 KiB is the largest size all servers
+ * are required to handle. The local file is read and written in a
+ * thread of the transfer, so a slow disk doesn't stall the backend. */
+#define TRANSFER_CHUNK_SIZE (32 * 1024)
+#define TRANSFER_MAX_REQUESTS 64
+/* Empty DATA replies before the end of the file are asked again, up
+   to this many times in a row */
+#define TRANSFER_MAX_EMPTY_READS 8
+#define TRANSFER_PROGRESS_INTERVAL (G_USEC_PER_SEC / 10)
+
+typedef struct {
+  gboolean is_push;
+  char *remote_path;
+  char *local_path;
+  /* Transfer over an existing file, written next to it and renamed
+     over it on success. Local for a pull, remote for a push. */
+  char *temp_path;
+  mode_t temp_mode; /* of the file being replaced, 0 if unknown */
+  gboolean created_local;
+  gboolean created_remote;
+
+  /* Applied to the target for G_FILE_COPY_ALL_METADATA */
+  gboolean source_has_mode;
+  guint32 source_mode;
+  gboolean source_has_times;
+  guint64 source_atime;
+  guint64 source_mtime;
+  int fd;
+  GThreadPool *io_pool;
+  DataBuffer *raw_handle;
+  GFileCopyFlags flags;
+  gboolean remove_source;
+
+  goffset total_size;
+  goffset offset;
+  goffset transferred;
+  int n_outstanding;
+  gboolean eof;
+  GError *error;
+
+  GFileProgressCallback progress_callback;
+  gpointer progress_callback_data;
+  gint64 last_progress_time;
+} SftpTransfer;
+
+typedef struct {
+  SftpTransfer *transfer;
+  goffset offset;
+  guint32 size;
+  guint empty_reads;
+} SftpTransferRequest;
+
+/* A pread() for a push or a pwrite() for a pull, done in io_pool */
+typedef struct {
+  GVfsBackendSftp *backend;
+  GVfsJob *job;
+  SftpTransferRequest *request;
+  guchar *data;
+  gsize count;
+  GError *error;
+} SftpTransferIO;
+
+static void transfer_queue_requests (GVfsBackendSftp *backend,
+                                     GVfsJob *job,
+                                     SftpTransfer *transfer);
+
+static SftpTransfer *
+transfer_new (gboolean is_push,
+              const char *remote_path,
+              const char *local_path,
+              GFileCopyFlags flags,
+              gboolean remove_source,
+              GFileProgressCallback progress_callback,
+              gpointer progress_callback_data)
+{
+  SftpTransfer *transfer;
+
+  transfer = g_slice_new0 (SftpTransfer);
+  transfer->is_push = is_push;
+  transfer->remote_path = g_strdup (remote_path);
+  transfer->local_path = g_strdup (local_path);
+  transfer->fd = -1;
+  transfer->flags = flags;
+  transfer->remove_source = remove_source;
+  transfer->progress_callback = progress_callback;
+  transfer->progress_callback_data = progress_callback_data;
+
+  return transfer;
+}
+
+static void
+transfer_free (SftpTransfer *transfer)
+{
+  /* Nothing is queued, transfers only finish with no I/O outstanding */
+  if (transfer->io_pool)
+    g_thread_pool_free (transfer->io_pool, TRUE, TRUE);
+  if (transfer->fd != -1)
+    close (transfer->fd);
+  data_buffer_free (transfer->raw_handle);
+  g_clear_error (&transfer->error);
+  g_free (transfer->remote_path);
+  g_free (transfer->local_path);
+  g_free (transfer->temp_path);
+  g_slice_free (SftpTransfer, transfer);
+}
+
+static void
+transfer_set_error (SftpTransfer *transfer,
+                    GError *error)
+{
+  if (transfer->error == NULL)
+    transfer->error = error;
+  else
+    g_error_free (error);
+}
+
+static void
+transfer_report_progress (SftpTransfer *transfer,
+                          gboolean force)
+{
+  gint64 now;
+
+  if (transfer->progress_callback == NULL)
+    return;
+
+  /* Every progress report is a synchronous D-Bus flush */
+  now = g_get_monotonic_time ();
+  if (!force && now - transfer->last_progress_time < TRANSFER_PROGRESS_INTERVAL)
+    return;
+
+  transfer->last_progress_time = now;
+  transfer->progress_callback (transfer->transferred,
+                               MAX (transfer->total_size, transfer->transferred),
+                               transfer->progress_callback_data);
+}
+
+static void
+transfer_complete (GVfsJob *job,
+                   SftpTransfer *transfer)
+{
+  /* Don't leave a partial file behind, an existing target is only
+     replaced by the rename after a successful pull */
+  if (transfer->error && transfer->created_local)
+    g_unlink (transfer->temp_path ? transfer->temp_path : transfer->local_path);
+
+  if (transfer->error)
+    g_vfs_job_failed_from_error (job, transfer->error);
+  else
+    {
+      transfer_report_progress (transfer, TRUE);
+      g_vfs_job_succeeded (job);
+    }
+
+  transfer_free (transfer);
+}
+
+static void
+transfer_remove_source_reply (GVfsBackendSftp *backend,
+                              int reply_type,
+                              GDataInputStream *reply,
+                              guint32 len,
+                              GVfsJob *job,
+                              gpointer user_data)
+{
+  SftpTransfer *transfer = user_data;
+  GError *error;
+
+  error = NULL;
+  if (reply_type != SSH_FXP_STATUS)
+    transfer_set_error (transfer,
+                        g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                             _("Invalid reply received")));
+  else if (!error_from_status (job, reply, -1, -1, &error))
+    transfer_set_error (transfer, error);
+
+  transfer_complete (job, transfer);
+}
+
+static void transfer_finish (GVfsBackendSftp *backend,
+                             GVfsJob *job,
+                             SftpTransfer *transfer);
+
+/* Applies the mode and times of the remote file to the pulled one.
+   Like in the copy fallback of gio, failing to do so is no error. */
+static void
+pull_set_metadata (SftpTransfer *transfer)
+{
+  struct utimbuf times;
+  const char *path;
+
+  if (!(transfer->flags & G_FILE_COPY_ALL_METADATA))
+    return;
+
+  path = transfer->temp_path ? transfer->temp_path : transfer->local_path;
+
+  if (transfer->source_has_mode)
+    g_chmod (path, transfer->source_mode & 07777);
+
+  if (transfer->source_has_times)
+    {
+      times.actime = transfer->source_atime;
+      times.modtime = transfer->source_mtime;
+      g_utime (path, &times);
+    }
+}
+
+/* Removes what a failed push wrote, an existing target was left alone */
+static void
+push_remove_partial (GVfsBackendSftp *backend,
+                     GVfsJob *job,
+                     SftpTransfer *transfer)
+{
+  GDataOutputStream *command;
+
+  if (!transfer->created_remote)
+    return;
+
+  command = new_command_stream (backend, SSH_FXP_REMOVE);
+  put_string (command,
+              transfer->temp_path ? transfer->temp_path : transfer->remote_path);
+  queue_command_stream_and_free (backend, command, NULL, job, NULL);
+}
+
+static void
+push_renamed_temp_reply (GVfsBackendSftp *backend,
+                         int reply_type,
+                         GDataInputStream *reply,
+                         guint32 len,
+                         GVfsJob *job,
+                         gpointer user_data)
+{
+  SftpTransfer *transfer = user_data;
+  GError *error;
+
+  /* On failure, don't remove the temp file, the original is gone */
+  error = NULL;
+  if (reply_type != SSH_FXP_STATUS)
+    transfer_set_error (transfer,
+                        g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                             _("Invalid reply received")));
+  else if (!error_from_status (job, reply, -1, -1, &error))
+    transfer_set_error (transfer, error);
+
+  sftp_cache_invalidate (backend, transfer->remote_path);
+  transfer_finish (backend, job, transfer);
+}
+
+static void
+push_removed_target_reply (GVfsBackendSftp *backend,
+                           int reply_type,
+                           GDataInputStream *reply,
+                           guint32 len,
+                           GVfsJob *job,
+                           gpointer user_data)
+{
+  SftpTransfer *transfer = user_data;
+  GDataOutputStream *command;
+  GError *error;
+
+  error = NULL;
+  if (reply_type != SSH_FXP_STATUS)
+    transfer_set_error (transfer,
+                        g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                             _("Invalid reply received")));
+  else if (!error_from_status (job, reply, -1, -1, &error))
+    transfer_set_error (transfer, error);
+
+  if (transfer->error)
+    {
+      push_remove_partial (backend, job, transfer);
+      transfer_complete (job, transfer);
+      return;
+    }
+
+  /* SSH_FXP_RENAME doesn't replace existing files in sftp v3 */
+  command = new_command_stream (backend, SSH_FXP_RENAME);
+  put_string (command, transfer->temp_path);
+  put_string (command, transfer->remote_path);
+  queue_command_stream_and_free (backend, command, push_renamed_temp_reply,
+                                 job, transfer);
+}
+
+/* Puts a push over an existing file in place, only now that all of
+   it was written the original is removed */
+static void
+push_replace_target (GVfsBackendSftp *backend,
+                     GVfsJob *job,
+                     SftpTransfer *transfer)
+{
+  GDataOutputStream *command;
+
+  if (transfer->temp_path == NULL)
+    {
+      transfer_finish (backend, job, transfer);
+      return;
+    }
+
+  command = new_command_stream (backend, SSH_FXP_REMOVE);
+  put_string (command, transfer->remote_path);
+  queue_command_stream_and_free (backend, command, push_removed_target_reply,
+                                 job, transfer);
+}
+
+static void
+push_setstat_reply (GVfsBackendSftp *backend,
+                    int reply_type,
+                    GDataInputStream *reply,
+                    guint32 len,
+                    GVfsJob *job,
+                    gpointer user_data)
+{
+  /* Like in the copy fallback of gio, failing to copy metadata is no
+     error */
+  push_replace_target (backend, job, user_data);
+}
+
+static void
+push_set_metadata (GVfsBackendSftp *backend,
+                   GVfsJob *job,
+                   SftpTransfer *transfer)
+{
+  GDataOutputStream *command;
+
+  if (!(transfer->flags & G_FILE_COPY_ALL_METADATA))
+    {
+      push_replace_target (backend, job, transfer);
+      return;
+    }
+
+  command = new_command_stream (backend, SSH_FXP_SETSTAT);
+  put_string (command,
+              transfer->temp_path ? transfer->temp_path : transfer->remote_path);
+  g_data_output_stream_put_uint32 (command,
+                                   SSH_FILEXFER_ATTR_PERMISSIONS |
+                                   SSH_FILEXFER_ATTR_ACMODTIME,
+                                   NULL, NULL);
+  g_data_output_stream_put_uint32 (command, transfer->source_mode & 07777, NULL, NULL);
+  g_data_output_stream_put_uint32 (command, transfer->source_atime, NULL, NULL);
+  g_data_output_stream_put_uint32 (command, transfer->source_mtime, NULL, NULL);
+  queue_command_stream_and_free (backend, command, push_setstat_reply,
+                                 job, transfer);
+}
+
+static void
+transfer_close_reply (GVfsBackendSftp *backend,
+                      int reply_type,
+                      GDataInputStream *reply,
+                      guint32 len,
+                      GVfsJob *job,
+                      gpointer user_data)
+{
+  SftpTransfer *transfer = user_data;
+  GDataOutputStream *command;
+  GError *error;
+
+  error = NULL;
+  if (reply_type != SSH_FXP_STATUS)
+    transfer_set_error (transfer,
+                        g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                             _("Invalid reply received")));
+  else if (!error_from_status (job, reply, -1, -1, &error))
+    transfer_set_error (transfer, error);
+
+  if (transfer->fd != -1 && close (transfer->fd) == -1 && !transfer->is_push)
+    {
+      int errsv = errno;
+
+      transfer_set_error (transfer,
+                          g_error_new (G_IO_ERROR, g_io_error_from_errno (errsv),
+                                       _("Error writing file: %s"),
+                                       g_strerror (errsv)));
+    }
+  transfer->fd = -1;
+
+  if (transfer->is_push)
+    {
+      if (transfer->error == NULL)
+        push_set_metadata (backend, job, transfer);
+      else
+        {
+          push_remove_partial (backend, job, transfer);
+          transfer_complete (job, transfer);
+        }
+      return;
+    }
+
+  if (transfer->error == NULL)
+    pull_set_metadata (transfer);
+
+  if (transfer->error == NULL && transfer->temp_path)
+    {
+      if (g_rename (transfer->temp_path, transfer->local_path) == -1)
+        {
+          int errsv = errno;
+
+          transfer_set_error (transfer,
+                              g_error_new (G_IO_ERROR, g_io_error_from_errno (errsv),
+                                           _("Error writing file: %s"),
+                                           g_strerror (errsv)));
+        }
+      else
+        g_clear_pointer (&transfer->temp_path, g_free);
+    }
+
+  transfer_finish (backend, job, transfer);
+}
+
+/* The target is complete, removes the source if asked to */
+static void
+transfer_finish (GVfsBackendSftp *backend,
+                 GVfsJob *job,
+                 SftpTransfer *transfer)
+{
+  GDataOutputStream *command;
+
+  /* The local file is complete, keep it even if removing the source fails */
+  if (transfer->error == NULL)
+    transfer->created_local = FALSE;
+
+  if (transfer->error == NULL && transfer->remove_source)
+    {
+      if (transfer->is_push)
+        {
+          if (g_unlink (transfer->local_path) == -1)
+            {
+              int errsv = errno;
+
+              transfer_set_error (transfer,
+                                  g_error_new (G_IO_ERROR, g_io_error_from_errno (errsv),
+                                               _("Error deleting file: %s"),
+                                               g_strerror (errsv)));
+            }
+        }
+      else
+        {
+          command = new_command_stream (backend, SSH_FXP_REMOVE);
+          put_string (command, transfer->remote_path);
+          queue_command_stream_and_free (backend, command,
+                                         transfer_remove_source_reply,
+                                         job, transfer);
+          return;
+        }
+    }
+
+  transfer_complete (job, transfer);
+}
+
+/* Called whenever a request finishes, closes the remote handle
+   once the transfer is done or failed and nothing is in flight */
+static void
+transfer_continue (GVfsBackendSftp *backend,
+                   GVfsJob *job,
+                   SftpTransfer *transfer)
+{
+  GDataOutputStream *command;
+
+  if (transfer->error == NULL &&
+      g_cancellable_is_cancelled (job->cancellable))
+    transfer_set_error (transfer,
+                        g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                             _("Operation was cancelled")));
+
+  if (transfer->error == NULL)
+    {
+      transfer_report_progress (transfer, FALSE);
+      transfer_queue_requests (backend, job, transfer);
+    }
+
+  if (transfer->n_outstanding > 0 ||
+      (transfer->error == NULL && !transfer->eof))
+    return;
+
+  command = new_command_stream (backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, transfer->raw_handle);
+  queue_command_stream_and_free (backend, command, transfer_close_reply,
+                                 job, transfer);
+}
+
+static void transfer_read_reply (GVfsBackendSftp *backend,
+                                 int reply_type,
+                                 GDataInputStream *reply,
+                                 guint32 len,
+                                 GVfsJob *job,
+                                 gpointer user_data);
+static void transfer_write_reply (GVfsBackendSftp *backend,
+                                  int reply_type,
+                                  GDataInputStream *reply,
+                                  guint32 len,
+                                  GVfsJob *job,
+                                  gpointer user_data);
+static gboolean transfer_io_done (gpointer data);
+
+static void
+transfer_io_thread (gpointer data,
+                    gpointer user_data)
+{
+  SftpTransferIO *io = data;
+  SftpTransferRequest *request = io->request;
+  SftpTransfer *transfer = request->transfer;
+  gsize done;
+  gssize res;
+
+  done = 0;
+  while (transfer->is_push ? done < request->size : done < io->count)
+    {
+      if (transfer->is_push)
+        res = pread (transfer->fd, io->data + done, request->size - done,
+                     request->offset + done);
+      else
+        res = pwrite (transfer->fd, io->data + done, io->count - done,
+                      request->offset + done);
+
+      if (res == -1)
+        {
+          int errsv = errno;
+
+          if (errsv == EINTR)
+            continue;
+
+          io->error = g_error_new (G_IO_ERROR, g_io_error_from_errno (errsv),
+                                   transfer->is_push ?
+                                   _("Error reading file: %s") :
+                                   _("Error writing file: %s"),
+                                   g_strerror (errsv));
+          break;
+        }
+
+      /* End of file */
+      if (res == 0)
+        break;
+
+      done += res;
+    }
+
+  io->count = done;
+
+  g_main_context_invoke (NULL, transfer_io_done, io);
+}
+
+/* Back in the main loop after a local read or write */
+static gboolean
+transfer_io_done (gpointer data)
+{
+  SftpTransferIO *io = data;
+  SftpTransferRequest *request = io->request;
+  SftpTransfer *transfer = request->transfer;
+  GDataOutputStream *command;
+
+  if (io->error)
+    {
+      transfer_set_error (transfer, io->error);
+      io->error = NULL;
+    }
+  else if (transfer->is_push && io->count > 0 && transfer->error == NULL)
+    {
+      /* Still outstanding until the server acknowledged the write */
+      request->size = io->count;
+
+      command = new_command_stream (io->backend, SSH_FXP_WRITE);
+      put_data_buffer (command, transfer->raw_handle);
+      g_data_output_stream_put_uint64 (command, request->offset, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, request->size, NULL, NULL);
+      g_output_stream_write_all (G_OUTPUT_STREAM (command),
+                                 io->data, request->size,
+                                 NULL, NULL, NULL);
+      queue_command_stream_and_free (io->backend, command, transfer_write_reply,
+                                     io->job, request);
+      request = NULL;
+    }
+  else if (transfer->is_push && io->count == 0)
+    transfer->eof = TRUE;
+  else if (!transfer->is_push)
+    transfer->transferred += io->count;
+
+  if (request)
+    {
+      transfer->n_outstanding--;
+      g_slice_free (SftpTransferRequest, request);
+    }
+
+  transfer_continue (io->backend, io->job, transfer);
+
+  g_free (io->data);
+  g_slice_free (SftpTransferIO, io);
+
+  return FALSE;
+}
+
+static void
+transfer_queue_io (GVfsBackendSftp *backend,
+                   GVfsJob *job,
+                   SftpTransferRequest *request,
+                   guchar *data,
+                   gsize count)
+{
+  SftpTransferIO *io;
+
+  io = g_slice_new0 (SftpTransferIO);
+  io->backend = backend;
+  io->job = job;
+  io->request = request;
+  io->data = data;
+  io->count = count;
+
+  g_thread_pool_push (request->transfer->io_pool, io, NULL);
+}
+
+static void
+transfer_read_reply (GVfsBackendSftp *backend,
+                     int reply_type,
+                     GDataInputStream *reply,
+                     guint32 len,
+                     GVfsJob *job,
+                     gpointer user_data)
+{
+  SftpTransferRequest *request = user_data;
+  SftpTransfer *transfer = request->transfer;
+  GDataOutputStream *command;
+  GError *error;
+  guint32 count;
+  guchar *data;
+
+  transfer->n_outstanding--;
+
+  error = NULL;
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      if (!error_from_status (job, reply, -1, SSH_FX_EOF, &error))
+        transfer_set_error (transfer, error);
+      else
+        transfer->eof = TRUE;
+      goto out;
+    }
+
+  if (reply_type != SSH_FXP_DATA)
+    {
+      transfer_set_error (transfer,
+                          g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                               _("Invalid reply received")));
+      goto out;
+    }
+
+  count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+  if (count > request->size)
+    {
+      transfer_set_error (transfer,
+                          g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                               _("Invalid reply received")));
+      goto out;
+    }
+
+  /* Not the end of the file, that is a SSH_FX_EOF status. Ask again. */
+  if (count == 0)
+    {
+      if (transfer->error != NULL)
+        goto out;
+
+      if (++request->empty_reads > TRANSFER_MAX_EMPTY_READS)
+        {
+          transfer_set_error (transfer,
+                              g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                   _("Invalid reply received")));
+          goto out;
+        }
+
+      command = new_command_stream (backend, SSH_FXP_READ);
+      put_data_buffer (command, transfer->raw_handle);
+      g_data_output_stream_put_uint64 (command, request->offset, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, request->size, NULL, NULL);
+      queue_command_stream_and_free (backend, command, transfer_read_reply,
+                                     job, request);
+      transfer->n_outstanding++;
+      return;
+    }
+
+  data = g_malloc (count);
+  if (!g_input_stream_read_all (G_INPUT_STREAM (reply),
+                                data, count,
+                                NULL, NULL, NULL))
+    {
+      g_free (data);
+      transfer_set_error (transfer,
+                          g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                               _("Invalid reply received")));
+      goto out;
+    }
+
+  /* Servers may return less than asked for before the end of the
+     file, ask again for the rest */
+  if (transfer->error == NULL && count < request->size)
+    {
+      SftpTransferRequest *rest;
+
+      rest = g_slice_new (SftpTransferRequest);
+      rest->transfer = transfer;
+      rest->offset = request->offset + count;
+      rest->size = request->size - count;
+      rest->empty_reads = 0;
+
+      command = new_command_stream (backend, SSH_FXP_READ);
+      put_data_buffer (command, transfer->raw_handle);
+      g_data_output_stream_put_uint64 (command, rest->offset, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, rest->size, NULL, NULL);
+      queue_command_stream_and_free (backend, command, transfer_read_reply,
+                                     job, rest);
+      transfer->n_outstanding++;
+    }
+
+  /* Replies can arrive in any order, the thread writes each at its
+     offset. The request stays outstanding until it's written. */
+  transfer->n_outstanding++;
+  transfer_queue_io (backend, job, request, data, count);
+  return;
+
+ out:
+  g_slice_free (SftpTransferRequest, request);
+  transfer_continue (backend, job, transfer);
+}
+
+static void
+transfer_write_reply (GVfsBackendSftp *backend,
+                      int reply_type,
+                      GDataInputStream *reply,
+                      guint32 len,
+                      GVfsJob *job,
+                      gpointer user_data)
+{
+  SftpTransferRequest *request = user_data;
+  SftpTransfer *transfer = request->transfer;
+  GError *error;
+
+  transfer->n_outstanding--;
+
+  error = NULL;
+  if (reply_type != SSH_FXP_STATUS)
+    transfer_set_error (transfer,
+                        g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                             _("Invalid reply received")));
+  else if (!error_from_status (job, reply, -1, -1, &error))
+    transfer_set_error (transfer, error);
+  else
+    transfer->transferred += request->size;
+
+  g_slice_free (SftpTransferRequest, request);
+  transfer_continue (backend, job, transfer);
+}
+
+static void
+transfer_queue_requests (GVfsBackendSftp *backend,
+                         GVfsJob *job,
+                         SftpTransfer *transfer)
+{
+  SftpTransferRequest *request;
+  GDataOutputStream *command;
+
+  while (!transfer->eof &&
+         transfer->n_outstanding < TRANSFER_MAX_REQUESTS)
+    {
+      /* Past the expected end, only probe one request at a time
+         for the end of the file */
+      if (transfer->offset >= transfer->total_size &&
+          transfer->n_outstanding > 0)
+        break;
+
+      request = g_slice_new (SftpTransferRequest);
+      request->transfer = transfer;
+      request->offset = transfer->offset;
+      request->size = TRANSFER_CHUNK_SIZE;
+      request->empty_reads = 0;
+
+      if (transfer->is_push)
+        {
+          transfer_queue_io (backend, job, request,
+                             g_malloc (TRANSFER_CHUNK_SIZE), 0);
+        }
+      else
+        {
+          command = new_command_stream (backend, SSH_FXP_READ);
+          put_data_buffer (command, transfer->raw_handle);
+          g_data_output_stream_put_uint64 (command, request->offset, NULL, NULL);
+          g_data_output_stream_put_uint32 (command, request->size, NULL, NULL);
+          queue_command_stream_and_free (backend, command, transfer_read_reply,
+                                         job, request);
+        }
+
+      transfer->offset += request->size;
+      transfer->n_outstanding++;
+    }
+}
+
+/* Creates the local file of a pull. An existing file is only replaced
+   once the whole file was received, see transfer_close_reply() */
+static void
+transfer_open_local (SftpTransfer *transfer)
+{
+  if (transfer->temp_path)
+    {
+      transfer->fd = g_mkstemp (transfer->temp_path);
+      if (transfer->fd != -1)
+        fchmod (transfer->fd, transfer->temp_mode);
+    }
+  else
+    transfer->fd = g_open (transfer->local_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+  if (transfer->fd == -1)
+    {
+      int errsv = errno;
+
+      g_clear_pointer (&transfer->temp_path, g_free);
+      transfer_set_error (transfer,
+                          g_error_new (G_IO_ERROR, g_io_error_from_errno (errsv),
+                                       _("Error opening file '%s': %s"),
+                                       transfer->local_path, g_strerror (errsv)));
+      return;
+    }
+
+  transfer->created_local = TRUE;
+}
+
+static void
+transfer_open_reply (GVfsBackendSftp *backend,
+                     int reply_type,
+                     GDataInputStream *reply,
+                     guint32 len,
+                     GVfsJob *job,
+                     gpointer user_data)
+{
+  SftpTransfer *transfer = user_data;
+  GError *error;
+
+  error = NULL;
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      if (error_from_status (job, reply,
+                             transfer->is_push ? G_IO_ERROR_EXISTS : -1, -1,
+                             &error))
+        error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                     _("Invalid reply received"));
+      transfer_set_error (transfer, error);
+      transfer_complete (job, transfer);
+      return;
+    }
+
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      transfer_free (transfer);
+      return;
+    }
+
+  transfer->raw_handle = read_data_buffer (reply);
+  transfer->io_pool = g_thread_pool_new (transfer_io_thread, NULL, 1, FALSE, NULL);
+  if (transfer->is_push)
+    transfer->created_remote = TRUE;
+
+  /* Only touch the local file once the remote one could be opened,
+     the handle is closed again on errors */
+  if (!transfer->is_push)
+    transfer_open_local (transfer);
+
+  if (transfer->error == NULL)
+    transfer_report_progress (transfer, TRUE);
+  transfer_continue (backend, job, transfer);
+}
+
+static void
+transfer_open_remote (GVfsBackendSftp *backend,
+                      GVfsJob *job,
+                      SftpTransfer *transfer,
+                      guint32 open_flags)
+{
+  GDataOutputStream *command;
+
+  command = new_command_stream (backend, SSH_FXP_OPEN);
+  if (transfer->is_push && transfer->temp_path)
+    {
+      /* Keeps the permissions of the file being replaced */
+      put_string (command, transfer->temp_path);
+      g_data_output_stream_put_uint32 (command, open_flags, NULL, NULL);
+      if (transfer->temp_mode != 0)
+        {
+          g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS, NULL, NULL);
+          g_data_output_stream_put_uint32 (command, transfer->temp_mode, NULL, NULL);
+        }
+      else
+        g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
+    }
+  else
+    {
+      put_string (command, transfer->remote_path);
+      g_data_output_stream_put_uint32 (command, open_flags, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
+    }
+  queue_command_stream_and_free (backend, command, transfer_open_reply,
+                                 job, transfer);
+}
+
+static GFileInfo *
+transfer_parse_info (GVfsBackendSftp *backend,
+                     GDataInputStream *reply)
+{
+  GFileInfo *info;
+
+  info = g_file_info_new ();
+  parse_attributes (backend, info, NULL, reply, NULL);
+
+  return info;
+}
+
+/* Leaves anything that isn't a plain file to file copy fallback in
+   gio, which knows how to handle directories, symlinks and backups */
+static void
+transfer_fail_unsupported (GVfsJob *job,
+                           SftpTransfer *transfer)
+{
+  g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    _("Operation not supported by backend"));
+  transfer_free (transfer);
+}
+
+static void
+pull_stat_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  SftpTransfer *transfer = user_data;
+  struct stat statbuf;
+  GFileInfo *info;
+  char *dirname;
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      failure_from_status (job, reply, -1, -1);
+      transfer_free (transfer);
+      return;
+    }
+
+  if (reply_type != SSH_FXP_ATTRS)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      transfer_free (transfer);
+      return;
+    }
+
+  info = transfer_parse_info (backend, reply);
+  if (g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR)
+    {
+      g_object_unref (info);
+      transfer_fail_unsupported (job, transfer);
+      return;
+    }
+
+  transfer->total_size = g_file_info_get_size (info);
+  if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_MODE))
+    {
+      transfer->source_has_mode = TRUE;
+      transfer->source_mode =
+        g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE);
+    }
+  if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    {
+      transfer->source_has_times = TRUE;
+      transfer->source_atime =
+        g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+      transfer->source_mtime =
+        g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+    }
+  g_object_unref (info);
+
+  if (g_stat (transfer->local_path, &statbuf) == 0)
+    {
+      if (S_ISDIR (statbuf.st_mode))
+        {
+          transfer_fail_unsupported (job, transfer);
+          return;
+        }
+
+      if (!(transfer->flags & G_FILE_COPY_OVERWRITE))
+        {
+          g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                            _("Target file already exists"));
+          transfer_free (transfer);
+          return;
+        }
+
+      /* Write next to the existing file and rename over it at the end */
+      dirname = g_path_get_dirname (transfer->local_path);
+      transfer->temp_path = g_build_filename (dirname, ".gvfs-sftp-pull-XXXXXX", NULL);
+      transfer->temp_mode = statbuf.st_mode & 07777;
+      g_free (dirname);
+    }
+
+  transfer_open_remote (backend, job, transfer, SSH_FXF_READ);
+}
+
+static gboolean
+try_pull (GVfsBackend *backend,
+          GVfsJobPull *job,
+          const char *source,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  SftpTransfer *transfer;
+
+  transfer = transfer_new (FALSE, source, local_path, flags, remove_source,
+                           progress_callback, progress_callback_data);
+
+  if (remove_source)
+    sftp_cache_invalidate (op_backend, source);
+
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      transfer_fail_unsupported (G_VFS_JOB (job), transfer);
+      return TRUE;
+    }
+
+  command = new_command_stream (op_backend,
+                                (flags & G_FILE_COPY_NOFOLLOW_SYMLINKS) ?
+                                SSH_FXP_LSTAT : SSH_FXP_STAT);
+  put_string (command, source);
+  queue_command_stream_and_free (op_backend, command, pull_stat_reply,
+                                 G_VFS_JOB (job), transfer);
+
+  return TRUE;
+}
+
+static void
+push_lstat_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  SftpTransfer *transfer = user_data;
+  GFileInfo *info;
+  GFileType type;
+  char *dirname;
+  char basename[] = ".giosaveXXXXXX";
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      if (read_status_code (reply) != SSH_FX_NO_SUCH_FILE)
+        {
+          transfer_fail_unsupported (job, transfer);
+          return;
+        }
+
+      transfer_open_remote (backend, job, transfer,
+                            SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_EXCL);
+      return;
+    }
+
+  if (reply_type != SSH_FXP_ATTRS)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      transfer_free (transfer);
+      return;
+    }
+
+  if (!(transfer->flags & G_FILE_COPY_OVERWRITE))
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                        _("Target file already exists"));
+      transfer_free (transfer);
+      return;
+    }
+
+  info = transfer_parse_info (backend, reply);
+  type = g_file_info_get_file_type (info);
+  if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_MODE))
+    transfer->temp_mode =
+      g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE) & 07777;
+  g_object_unref (info);
+
+  if (type != G_FILE_TYPE_REGULAR)
+    {
+      transfer_fail_unsupported (job, transfer);
+      return;
+    }
+
+  /* Write next to the existing file, so a failed or cancelled push
+     leaves it alone, and replace it at the end */
+  dirname = g_path_get_dirname (transfer->remote_path);
+  random_text (basename + 8);
+  transfer->temp_path = g_build_filename (dirname, basename, NULL);
+  g_free (dirname);
+  sftp_cache_invalidate (backend, transfer->temp_path);
+
+  transfer_open_remote (backend, job, transfer,
+                        SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_EXCL);
+}
+
+static gboolean
+try_push (GVfsBackend *backend,
+          GVfsJobPush *job,
+          const char *destination,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  SftpTransfer *transfer;
+  struct stat statbuf;
+  int open_flags;
+
+  transfer = transfer_new (TRUE, destination, local_path, flags, remove_source,
+                           progress_callback, progress_callback_data);
+
+  sftp_cache_invalidate (op_backend, destination);
+
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      transfer_fail_unsupported (G_VFS_JOB (job), transfer);
+      return TRUE;
+    }
+
+  open_flags = O_RDONLY;
+#ifdef O_NOFOLLOW
+  if (flags & G_FILE_COPY_NOFOLLOW_SYMLINKS)
+    open_flags |= O_NOFOLLOW;
+#endif
+
+  transfer->fd = g_open (local_path, open_flags, 0);
+  if (transfer->fd == -1 ||
+      fstat (transfer->fd, &statbuf) == -1 ||
+      !S_ISREG (statbuf.st_mode))
+    {
+      /* Errors are reported by the fallback as well */
+      transfer_fail_unsupported (G_VFS_JOB (job), transfer);
+      return TRUE;
+    }
+  transfer->total_size = statbuf.st_size;
+  transfer->source_has_mode = TRUE;
+  transfer->source_mode = statbuf.st_mode;
+  transfer->source_has_times = TRUE;
+  transfer->source_atime = statbuf.st_atime;
+  transfer->source_mtime = statbuf.st_mtime;
+
+  command = new_command_stream (op_backend, SSH_FXP_LSTAT);
+  put_string (command, destination);
+  queue_command_stream_and_free (op_backend, command, push_lstat_reply,
+                                 G_VFS_JOB (job), transfer);
+
+  return TRUE;
+}
+
 static void
 g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
 {
@@ -4669,6 +6764,8 @@ g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
   backend_class->try_write = try_write;
   backend_class->try_seek_on_write = try_seek_on_write;
   backend_class->try_move = try_move;
+  backend_class->try_push = try_push;
+  backend_class->try_pull = try_pull;
   backend_class->try_make_symlink = try_make_symlink;
   backend_class->try_make_directory = try_make_directory;
   backend_class->try_delete = try_delete;
@@ -75,6 +75,9 @@ struct _GVfsBackendSmb
   int port;
   
   SMBCCTX *smb_context;
+  /* libsmbclient contexts aren't thread-safe, held by every blocking
+     vfunc using smb_context once mounted */
+  GMutex smb_lock;
 
   char *last_user;
   char *last_domain;
@@ -119,6 +122,7 @@ g_vfs_backend_smb_finalize (GObject *object)
   g_free (backend->domain);
   g_free (backend->path);
   g_free (backend->default_workgroup);
+  g_mutex_clear (&backend->smb_lock);
   
   if (G_OBJECT_CLASS (g_vfs_backend_smb_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_smb_parent_class)->finalize) (object);
@@ -130,6 +134,11 @@ g_vfs_backend_smb_init (GVfsBackendSmb *backend)
   char *workgroup;
   GSettings *settings;
 
+  /* Mount and unmount run alone, everything else takes smb_lock */
+  g_mutex_init (&backend->smb_lock);
+  g_vfs_backend_set_concurrency (G_VFS_BACKEND (backend),
+                                 G_VFS_BACKEND_CONCURRENCY_PER_HANDLE);
+
   /* Get default workgroup name */
   settings = g_settings_new ("org.gnome.system.smb");
 
@@ -783,6 +792,7 @@ do_open_for_read (GVfsBackend *backend,
   int res;
   int olderr;
 
+  g_mutex_lock (&op_backend->smb_lock);
 
   uri = create_smb_uri (op_backend->server, op_backend->port, op_backend->share, filename);
   smbc_open = smbc_getFunctionOpen (op_backend->smb_context);
@@ -810,6 +820,8 @@ do_open_for_read (GVfsBackend *backend,
       g_vfs_job_open_for_read_set_handle (job, file);
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -823,6 +835,8 @@ do_read (GVfsBackend *backend,
   ssize_t res;
   smbc_read_fn smbc_read;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   /* libsmbclient limits blocksize to (64*1024)-2 for Windows servers,
    * let's do the same here to achieve reasonable performance. (#588391)
    *
@@ -841,6 +855,8 @@ do_read (GVfsBackend *backend,
       g_vfs_job_read_set_size (job, res);
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -855,6 +871,8 @@ do_seek_on_read (GVfsBackend *backend,
   off_t res;
   smbc_lseek_fn smbc_lseek;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   switch (type)
     {
     case G_SEEK_SET:
@@ -870,6 +888,7 @@ do_seek_on_read (GVfsBackend *backend,
       g_vfs_job_failed (G_VFS_JOB (job),
 			G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
 			_("Unsupported seek type"));
+      g_mutex_unlock (&op_backend->smb_lock);
       return;
     }
 
@@ -884,6 +903,7 @@ do_seek_on_read (GVfsBackend *backend,
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
 
+  g_mutex_unlock (&op_backend->smb_lock);
   return;
 }
 
@@ -899,6 +919,8 @@ do_query_info_on_read (GVfsBackend *backend,
   int res, saved_errno;
   smbc_fstat_fn smbc_fstat;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   smbc_fstat = smbc_getFunctionFstat (op_backend->smb_context);
   res = smbc_fstat (op_backend->smb_context, (SMBCFILE *)handle, &st);
   saved_errno = errno;
@@ -912,6 +934,7 @@ do_query_info_on_read (GVfsBackend *backend,
   else
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), saved_errno);
 
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -923,12 +946,16 @@ do_close_read (GVfsBackend *backend,
   ssize_t res;
   smbc_close_fn smbc_close;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   smbc_close = smbc_getFunctionClose (op_backend->smb_context);
   res = smbc_close (op_backend->smb_context, (SMBCFILE *)handle);
   if (res == -1)
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 typedef struct {
@@ -960,6 +987,8 @@ do_create (GVfsBackend *backend,
   smbc_open_fn smbc_open;
   int errsv;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   uri = create_smb_uri (op_backend->server, op_backend->port, op_backend->share, filename);
   smbc_open = smbc_getFunctionOpen (op_backend->smb_context);
   errno = 0;
@@ -985,6 +1014,8 @@ do_create (GVfsBackend *backend,
       g_vfs_job_open_for_write_set_handle (job, handle);
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -1001,6 +1032,8 @@ do_append_to (GVfsBackend *backend,
   smbc_open_fn smbc_open;
   smbc_lseek_fn smbc_lseek;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   uri = create_smb_uri (op_backend->server, op_backend->port, op_backend->share, filename);
   smbc_open = smbc_getFunctionOpen (op_backend->smb_context);
   errno = 0;
@@ -1028,6 +1061,8 @@ do_append_to (GVfsBackend *backend,
       g_vfs_job_open_for_write_set_handle (job, handle);
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 
@@ -1192,6 +1227,8 @@ do_replace (GVfsBackend *backend,
   smbc_open_fn smbc_open;
   smbc_stat_fn smbc_stat;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   uri = create_smb_uri (op_backend->server, op_backend->port, op_backend->share, filename);
   tmp_uri = NULL;
   if (make_backup)
@@ -1303,6 +1340,7 @@ do_replace (GVfsBackend *backend,
   g_vfs_job_open_for_write_set_handle (job, handle);
   g_vfs_job_succeeded (G_VFS_JOB (job));
   
+  g_mutex_unlock (&op_backend->smb_lock);
   return;
   
  error:
@@ -1311,6 +1349,8 @@ do_replace (GVfsBackend *backend,
   g_free (backup_uri);
   g_free (tmp_uri);
   g_free (uri);
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 
@@ -1326,6 +1366,8 @@ do_write (GVfsBackend *backend,
   ssize_t res;
   smbc_write_fn smbc_write;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   smbc_write = smbc_getFunctionWrite (op_backend->smb_context);
   res = smbc_write (op_backend->smb_context, handle->file,
 					buffer, buffer_size);
@@ -1336,6 +1378,8 @@ do_write (GVfsBackend *backend,
       g_vfs_job_write_set_written_size (job, res);
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -1351,6 +1395,8 @@ do_seek_on_write (GVfsBackend *backend,
   off_t res;
   smbc_lseek_fn smbc_lseek;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   switch (type)
     {
     case G_SEEK_SET:
@@ -1366,6 +1412,7 @@ do_seek_on_write (GVfsBackend *backend,
       g_vfs_job_failed (G_VFS_JOB (job),
 			G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
 			_("Unsupported seek type"));
+      g_mutex_unlock (&op_backend->smb_lock);
       return;
     }
 
@@ -1380,6 +1427,7 @@ do_seek_on_write (GVfsBackend *backend,
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
 
+  g_mutex_unlock (&op_backend->smb_lock);
   return;
 }
 
@@ -1396,6 +1444,8 @@ do_query_info_on_write (GVfsBackend *backend,
   int res, saved_errno;
   smbc_fstat_fn smbc_fstat;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   smbc_fstat = smbc_getFunctionFstat (op_backend->smb_context);
   res = smbc_fstat (op_backend->smb_context, handle->file, &st);
   saved_errno = errno;
@@ -1409,6 +1459,7 @@ do_query_info_on_write (GVfsBackend *backend,
   else
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), saved_errno);
 
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -1426,6 +1477,8 @@ do_close_write (GVfsBackend *backend,
   smbc_unlink_fn smbc_unlink;
   smbc_rename_fn smbc_rename;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   smbc_fstat = smbc_getFunctionFstat (op_backend->smb_context);
   smbc_close = smbc_getFunctionClose (op_backend->smb_context);
   smbc_unlink = smbc_getFunctionUnlink (op_backend->smb_context);
@@ -1486,6 +1539,8 @@ do_close_write (GVfsBackend *backend,
 
  out:
   smb_write_handle_free (handle);  
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -1682,6 +1737,8 @@ do_query_info (GVfsBackend *backend,
   char *basename;
   smbc_stat_fn smbc_stat;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   uri = create_smb_uri (op_backend->server, op_backend->port, op_backend->share, filename);
   smbc_stat = smbc_getFunctionStat (op_backend->smb_context);
   res = smbc_stat (op_backend->smb_context, uri, &st);
@@ -1699,6 +1756,7 @@ do_query_info (GVfsBackend *backend,
   else
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), saved_errno);
 
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -1710,6 +1768,8 @@ do_query_fs_info (GVfsBackend *backend,
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_FILESYSTEM_TYPE, "cifs");
 
 #ifdef HAVE_SAMBA_STAT_VFS
@@ -1748,12 +1808,15 @@ do_query_fs_info (GVfsBackend *backend,
       else
         {
           g_vfs_job_failed_from_errno (G_VFS_JOB (job), saved_errno);
+          g_mutex_unlock (&op_backend->smb_lock);
           return;
         }
     }
 #endif
 
   g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 
@@ -1813,6 +1876,7 @@ do_set_attribute (GVfsBackend *backend,
 
 
   op_backend = G_VFS_BACKEND_SMB (backend);
+  g_mutex_lock (&op_backend->smb_lock);
 
   if (strcmp (attribute, G_FILE_ATTRIBUTE_TIME_MODIFIED) != 0
 #if 0
@@ -1823,6 +1887,7 @@ do_set_attribute (GVfsBackend *backend,
       g_vfs_job_failed (G_VFS_JOB (job),
                         G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
                         _("Operation unsupported"));
+      g_mutex_unlock (&op_backend->smb_lock);
       return;
     }
 
@@ -1864,52 +1929,139 @@ do_set_attribute (GVfsBackend *backend,
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  g_mutex_unlock (&op_backend->smb_lock);
+}
+
+/* Attributes that can be filled in from a directory entry alone, without
+ * stat'ing the file. */
+#define DIRENT_ATTRIBUTES \
+  G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+  G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME "," \
+  G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME "," \
+  G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+  G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE "," \
+  G_FILE_ATTRIBUTE_STANDARD_ICON "," \
+  G_FILE_ATTRIBUTE_STANDARD_SYMBOLIC_ICON
+
+static GFileAttributeMatcher *dirent_matcher = NULL;
+
+static gboolean
+enumerate_needs_stat (GFileAttributeMatcher *matcher)
+{
+  GFileAttributeMatcher *remaining;
+
+  if (matcher == NULL)
+    return FALSE;
+
+  remaining = g_file_attribute_matcher_subtract (matcher, dirent_matcher);
+  if (remaining == NULL)
+    return FALSE;
+
+  g_file_attribute_matcher_unref (remaining);
+  return TRUE;
 }
 
 static void
-do_enumerate (GVfsBackend *backend,
-	      GVfsJobEnumerate *job,
-	      const char *filename,
-	      GFileAttributeMatcher *matcher,
-	      GFileQueryInfoFlags flags)
+set_info_from_dirent (GVfsBackendSmb *backend,
+		      GFileInfo *info,
+		      struct smbc_dirent *dirp,
+		      GFileAttributeMatcher *matcher)
+{
+  struct stat st = {0};
+
+  /* libsmbclient only ever reports directories and regular files from
+   * stat, so the entry type is all set_info_from_stat () needs for the
+   * attributes in DIRENT_ATTRIBUTES. The rest is masked out by the job. */
+  st.st_mode = dirp->smbc_type == SMBC_DIR ? S_IFDIR : S_IFREG;
+  set_info_from_stat (backend, info, &st, dirp->name, matcher);
+}
+
+static gboolean
+is_dot_or_dotdot (const char *name)
+{
+  return strcmp (name, ".") == 0 || strcmp (name, "..") == 0;
+}
+
+static void
+enumerate_add_infos (GVfsJobEnumerate *job,
+		     GList **files)
+{
+  if (*files)
+    {
+      *files = g_list_reverse (*files);
+      g_vfs_job_enumerate_add_infos (job, *files);
+      g_list_free_full (*files, g_object_unref);
+      *files = NULL;
+    }
+}
+
+#ifdef HAVE_SAMBA_READDIRPLUS2
+
+#define READDIRPLUS_BATCH_SIZE 100
+
+/* Lists the directory with a single round trip per server response
+ * instead of a stat per entry. */
+static void
+enumerate_readdirplus (GVfsBackendSmb *backend,
+		       GVfsJobEnumerate *job,
+		       SMBCFILE *dir,
+		       GFileAttributeMatcher *matcher)
+{
+  smbc_readdirplus2_fn smbc_readdirplus2;
+  const struct libsmb_file_info *file_info;
+  struct stat st;
+  GList *files;
+  GFileInfo *info;
+  int n_files;
+
+  smbc_readdirplus2 = smbc_getFunctionReaddirPlus2 (backend->smb_context);
+
+  files = NULL;
+  n_files = 0;
+  while ((file_info = smbc_readdirplus2 (backend->smb_context, dir, &st)) != NULL)
+    {
+      if (file_info->name == NULL || is_dot_or_dotdot (file_info->name))
+	continue;
+
+      info = g_file_info_new ();
+      set_info_from_stat (backend, info, &st, file_info->name, matcher);
+      files = g_list_prepend (files, info);
+
+      if (++n_files == READDIRPLUS_BATCH_SIZE)
+	{
+	  enumerate_add_infos (job, &files);
+	  n_files = 0;
+	}
+    }
+
+  enumerate_add_infos (job, &files);
+}
+
+#endif
+
+static void
+enumerate_getdents (GVfsBackendSmb *backend,
+		    GVfsJobEnumerate *job,
+		    SMBCFILE *dir,
+		    GString *uri,
+		    GFileAttributeMatcher *matcher)
 {
-  GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
   struct stat st;
   int res;
-  GError *error;
-  SMBCFILE *dir;
   char dirents[1024*4];
   struct smbc_dirent *dirp;
   GList *files;
   GFileInfo *info;
-  GString *uri;
   int uri_start_len;
-  smbc_opendir_fn smbc_opendir;
+  gboolean needs_stat;
   smbc_getdents_fn smbc_getdents;
   smbc_stat_fn smbc_stat;
-  smbc_closedir_fn smbc_closedir;
 
-  uri = create_smb_uri_string (op_backend->server, op_backend->port, op_backend->share, filename);
-  
-  smbc_opendir = smbc_getFunctionOpendir (op_backend->smb_context);
-  smbc_getdents = smbc_getFunctionGetdents (op_backend->smb_context);
-  smbc_stat = smbc_getFunctionStat (op_backend->smb_context);
-  smbc_closedir = smbc_getFunctionClosedir (op_backend->smb_context);
-  
-  dir = smbc_opendir (op_backend->smb_context, uri->str);
+  smbc_getdents = smbc_getFunctionGetdents (backend->smb_context);
+  smbc_stat = smbc_getFunctionStat (backend->smb_context);
 
-  if (dir == NULL)
-    {
-      int errsv = errno;
-
-      error = NULL;
-      g_set_error_literal (&error, G_IO_ERROR,
-			   g_io_error_from_errno (errsv),
-			   g_strerror (errsv));
-      goto error;
-    }
-
-  g_vfs_job_succeeded (G_VFS_JOB (job));
+  needs_stat = enumerate_needs_stat (matcher);
 
   if (uri->str[uri->len - 1] != '/')
     g_string_append_c (uri, '/');
@@ -1919,7 +2071,7 @@ do_enumerate (GVfsBackend *backend,
     {
       files = NULL;
       
-      res = smbc_getdents (op_backend->smb_context, dir, (struct smbc_dirent *)dirents, sizeof (dirents));
+      res = smbc_getdents (backend->smb_context, dir, (struct smbc_dirent *)dirents, sizeof (dirents));
       if (res <= 0)
 	break;
       
@@ -1928,35 +2080,28 @@ do_enumerate (GVfsBackend *backend,
 	{
 	  unsigned int dirlen;
 
-	  /* TODO: Only do stat if required for flags */
-	  
 	  if ((dirp->smbc_type == SMBC_DIR ||
 	       dirp->smbc_type == SMBC_FILE ||
 	       dirp->smbc_type == SMBC_LINK) &&
-	      strcmp (dirp->name, ".") != 0 &&
-	      strcmp (dirp->name, "..") != 0)
+	      !is_dot_or_dotdot (dirp->name))
 	    {
-	      int stat_res;
-	      g_string_truncate (uri, uri_start_len);
-	      g_string_append_encoded (uri,
-				       dirp->name,
-				       SUB_DELIM_CHARS ":@/");
-
-	      if (matcher == NULL ||
-		  g_file_attribute_matcher_matches_only (matcher, G_FILE_ATTRIBUTE_STANDARD_NAME))
+	      if (!needs_stat)
 		{
 		  info = g_file_info_new ();
-		  g_file_info_set_name (info, dirp->name);
+		  set_info_from_dirent (backend, info, dirp, matcher);
 		  files = g_list_prepend (files, info);
 		}
 	      else
 		{
-		  stat_res = smbc_stat (op_backend->smb_context,
-							    uri->str, &st);
-		  if (stat_res == 0)
+		  g_string_truncate (uri, uri_start_len);
+		  g_string_append_encoded (uri,
+					   dirp->name,
+					   SUB_DELIM_CHARS ":@/");
+
+		  if (smbc_stat (backend->smb_context, uri->str, &st) == 0)
 		    {
 		      info = g_file_info_new ();
-		      set_info_from_stat (op_backend, info, &st, dirp->name, matcher);
+		      set_info_from_stat (backend, info, &st, dirp->name, matcher);
 		      files = g_list_prepend (files, info);
 		    }
 		}
@@ -1967,25 +2112,67 @@ do_enumerate (GVfsBackend *backend,
 	  res -= dirlen;
 	}
       
-      if (files)
-	{
-	  files = g_list_reverse (files);
-	  g_vfs_job_enumerate_add_infos (job, files);
-	  g_list_free_full (files, g_object_unref);
-	}
+      enumerate_add_infos (job, &files);
     }
+}
+
+static void
+do_enumerate (GVfsBackend *backend,
+	      GVfsJobEnumerate *job,
+	      const char *filename,
+	      GFileAttributeMatcher *matcher,
+	      GFileQueryInfoFlags flags)
+{
+  GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  GError *error;
+  SMBCFILE *dir;
+  GString *uri;
+  smbc_opendir_fn smbc_opendir;
+  smbc_closedir_fn smbc_closedir;
+
+  g_mutex_lock (&op_backend->smb_lock);
+
+  uri = create_smb_uri_string (op_backend->server, op_backend->port, op_backend->share, filename);
+  
+  smbc_opendir = smbc_getFunctionOpendir (op_backend->smb_context);
+  smbc_closedir = smbc_getFunctionClosedir (op_backend->smb_context);
+  
+  dir = smbc_opendir (op_backend->smb_context, uri->str);
+
+  if (dir == NULL)
+    {
+      int errsv = errno;
+
+      error = NULL;
+      g_set_error_literal (&error, G_IO_ERROR,
+			   g_io_error_from_errno (errsv),
+			   g_strerror (errsv));
+      goto error;
+    }
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+
+#ifdef HAVE_SAMBA_READDIRPLUS2
+  if (enumerate_needs_stat (matcher))
+    enumerate_readdirplus (op_backend, job, dir, matcher);
+  else
+#endif
+    enumerate_getdents (op_backend, job, dir, uri, matcher);
       
-  res = smbc_closedir (op_backend->smb_context, dir);
+  smbc_closedir (op_backend->smb_context, dir);
 
   g_vfs_job_enumerate_done (job);
 
   g_string_free (uri, TRUE);
+  g_mutex_unlock (&op_backend->smb_lock);
   return;
   
  error:
   g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
   g_error_free (error);
   g_string_free (uri, TRUE);
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -2002,6 +2189,8 @@ do_set_display_name (GVfsBackend *backend,
   smbc_rename_fn smbc_rename;
   smbc_stat_fn smbc_stat;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   dirname = g_path_get_dirname (filename);
 
   /* TODO: display name is in utf8, atm we assume libsmb uris
@@ -2045,6 +2234,8 @@ do_set_display_name (GVfsBackend *backend,
   g_free (from_uri);
   g_free (to_uri);
   g_free (new_path);
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -2060,6 +2251,7 @@ do_delete (GVfsBackend *backend,
   smbc_rmdir_fn smbc_rmdir;
   smbc_unlink_fn smbc_unlink;
 
+  g_mutex_lock (&op_backend->smb_lock);
 
   uri = create_smb_uri (op_backend->server, op_backend->port, op_backend->share, filename);
 
@@ -2078,6 +2270,7 @@ do_delete (GVfsBackend *backend,
 			_("Error deleting file: %s"),
 			g_strerror (errsv));
       g_free (uri);
+      g_mutex_unlock (&op_backend->smb_lock);
       return;
     }
 
@@ -2092,6 +2285,8 @@ do_delete (GVfsBackend *backend,
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -2104,6 +2299,8 @@ do_make_directory (GVfsBackend *backend,
   int errsv, res;
   smbc_mkdir_fn smbc_mkdir;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   uri = create_smb_uri (op_backend->server, op_backend->port, op_backend->share, filename);
   smbc_mkdir = smbc_getFunctionMkdir (op_backend->smb_context);
   res = smbc_mkdir (op_backend->smb_context, uri, 0666);
@@ -2114,6 +2311,8 @@ do_make_directory (GVfsBackend *backend,
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -2134,6 +2333,8 @@ do_move (GVfsBackend *backend,
   smbc_rename_fn smbc_rename;
   smbc_unlink_fn smbc_unlink;
 
+  g_mutex_lock (&op_backend->smb_lock);
+
   
   source_uri = create_smb_uri (op_backend->server, op_backend->port, op_backend->share, source);
 
@@ -2152,6 +2353,7 @@ do_move (GVfsBackend *backend,
 			_("Error moving file: %s"),
 			g_strerror (errsv));
       g_free (source_uri);
+      g_mutex_unlock (&op_backend->smb_lock);
       return;
     }
   else
@@ -2176,6 +2378,7 @@ do_move (GVfsBackend *backend,
 				_("Can't move directory over directory"));
 	      g_free (source_uri);
 	      g_free (dest_uri);
+	      g_mutex_unlock (&op_backend->smb_lock);
 	      return;
 	    }
 	}
@@ -2187,6 +2390,7 @@ do_move (GVfsBackend *backend,
 			    _("Target file already exists"));
 	  g_free (source_uri);
 	  g_free (dest_uri);
+	  g_mutex_unlock (&op_backend->smb_lock);
 	  return;
 	}
     }
@@ -2205,6 +2409,7 @@ do_move (GVfsBackend *backend,
 	  g_free (source_uri);
 	  g_free (dest_uri);
 	  g_free (backup_uri);
+	  g_mutex_unlock (&op_backend->smb_lock);
 	  return;
 	}
       g_free (backup_uri);
@@ -2225,6 +2430,7 @@ do_move (GVfsBackend *backend,
 			    g_strerror (errsv));
 	  g_free (source_uri);
 	  g_free (dest_uri);
+	  g_mutex_unlock (&op_backend->smb_lock);
 	  return;
 	}
     }
@@ -2251,6 +2457,8 @@ do_move (GVfsBackend *backend,
     }
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  g_mutex_unlock (&op_backend->smb_lock);
 }
 
 static void
@@ -2261,6 +2469,8 @@ g_vfs_backend_smb_class_init (GVfsBackendSmbClass *klass)
   
   gobject_class->finalize = g_vfs_backend_smb_finalize;
 
+  dirent_matcher = g_file_attribute_matcher_new (DIRENT_ATTRIBUTES);
+
   backend_class->mount = do_mount;
   backend_class->try_mount = try_mount;
   backend_class->unmount = do_unmount;
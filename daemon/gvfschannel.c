@@ -560,7 +560,7 @@ send_reply_cb (GObject *source_object,
   gssize bytes_written;
   GVfsChannel *channel = user_data;
   GVfsChannelClass *class;
-  GVfsJob *job;
+  GVfsJob *job, *next_job;
 
   bytes_written = g_output_stream_write_finish (output_stream, res, NULL);
   
@@ -627,6 +627,14 @@ send_reply_cb (GObject *source_object,
       channel->priv->current_job_seq_nr = 0;
       g_vfs_job_source_new_job (G_VFS_JOB_SOURCE (channel), channel->priv->current_job);
     }
+  else if (class->continue_request != NULL &&
+	   (next_job = class->continue_request (channel, job)) != NULL)
+    {
+      /* Finish the rest of the request before anything queued,
+	 keeping its seq_nr */
+      channel->priv->current_job = next_job;
+      g_vfs_job_source_new_job (G_VFS_JOB_SOURCE (channel), channel->priv->current_job);
+    }
   /* Start queued request or readahead */
   else if (!start_queued_request (channel) &&
 	   class->readahead)
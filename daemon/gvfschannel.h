@@ -63,6 +63,8 @@ struct _GVfsChannelClass
 			      GError **error);
   GVfsJob *(*readahead)      (GVfsChannel *channel,
 			      GVfsJob *job);
+  GVfsJob *(*continue_request) (GVfsChannel *channel,
+				GVfsJob *job);
 };
 
 GType g_vfs_channel_get_type (void) G_GNUC_CONST;
@@ -39,6 +39,7 @@
 #include <gvfsdaemonprotocol.h>
 #include <gvfsdaemonutils.h>
 #include <gvfsjobmount.h>
+#include <gvfsjobunmount.h>
 #include <gvfsjobopenforread.h>
 #include <gvfsjobopenforwrite.h>
 
@@ -51,6 +52,14 @@ enum {
   LAST_SIGNAL
 };
 
+/* Blocking jobs of one constrained backend */
+typedef struct {
+  GQueue pending;
+  guint n_running;
+  gboolean exclusive_running;
+  GHashTable *busy_handles;
+} BackendJobQueue;
+
 typedef struct {
   char *obj_path;
   GVfsRegisterPathCallback callback;
@@ -67,6 +76,7 @@ struct _GVfsDaemon
   gboolean main_daemon;
 
   GThreadPool *thread_pool;
+  GHashTable *backend_job_queues;
   GHashTable *registered_paths;
   GHashTable *client_connections;
   GList *jobs;
@@ -166,6 +176,7 @@ g_vfs_daemon_finalize (GObject *object)
   
   g_hash_table_destroy (daemon->registered_paths);
   g_hash_table_destroy (daemon->client_connections);
+  g_hash_table_destroy (daemon->backend_job_queues);
   g_mutex_clear (&daemon->lock);
 
   if (G_OBJECT_CLASS (g_vfs_daemon_parent_class)->finalize)
@@ -191,13 +202,225 @@ g_vfs_daemon_class_init (GVfsDaemonClass *klass)
 		  G_TYPE_NONE, 0);
 }
 
+static void
+backend_job_queue_free (BackendJobQueue *queue)
+{
+  g_hash_table_destroy (queue->busy_handles);
+  g_free (queue);
+}
+
+static gboolean
+job_can_start (BackendJobQueue *queue,
+	       GVfsJobSchedule *schedule)
+{
+  if (queue->exclusive_running)
+    return FALSE;
+  if (schedule->exclusive)
+    return queue->n_running == 0;
+  if (schedule->handle_key != NULL)
+    return !g_hash_table_contains (queue->busy_handles, schedule->handle_key);
+  return TRUE;
+}
+
+/* Called with the daemon lock held. Starts pending jobs in order, but
+   never lets a job overtake a waiting exclusive one. Returns the jobs
+   no thread could be started for, to be failed with error once the
+   lock is dropped. */
+static GList *
+backend_job_queue_start_jobs (GVfsDaemon      *daemon,
+			      BackendJobQueue *queue,
+			      GError         **error)
+{
+  GVfsJobSchedule *schedule;
+  GVfsJob *job;
+  GList *l, *next;
+  GList *unstarted;
+  GError *push_error;
+
+  unstarted = NULL;
+
+  for (l = queue->pending.head; l != NULL; l = next)
+    {
+      next = l->next;
+      job = l->data;
+      schedule = &job->schedule;
+
+      if (!job_can_start (queue, schedule))
+	{
+	  if (schedule->exclusive)
+	    break;
+	  continue;
+	}
+
+      g_queue_delete_link (&queue->pending, l);
+
+      queue->n_running++;
+      if (schedule->exclusive)
+	queue->exclusive_running = TRUE;
+      if (schedule->handle_key != NULL)
+	g_hash_table_add (queue->busy_handles, schedule->handle_key);
+
+      push_error = NULL;
+      if (!g_thread_pool_push (daemon->thread_pool, job, &push_error))
+	{
+	  queue->n_running--;
+	  if (schedule->exclusive)
+	    queue->exclusive_running = FALSE;
+	  if (schedule->handle_key != NULL)
+	    g_hash_table_remove (queue->busy_handles, schedule->handle_key);
+
+	  unstarted = g_list_prepend (unstarted, job);
+	  if (*error == NULL)
+	    *error = push_error;
+	  else
+	    g_error_free (push_error);
+	  continue;
+	}
+
+      if (schedule->exclusive)
+	break;
+    }
+
+  return g_list_reverse (unstarted);
+}
+
+static void
+fail_unstarted_jobs (GList  *jobs,
+		     GError *error)
+{
+  GList *l;
+
+  for (l = jobs; l != NULL; l = l->next)
+    g_vfs_job_failed_from_error (G_VFS_JOB (l->data), error);
+
+  g_list_free (jobs);
+  if (error != NULL)
+    g_error_free (error);
+}
+
 static void
 job_handler_callback (gpointer       data,
 		      gpointer       user_data)
 {
+  GVfsDaemon *daemon = G_VFS_DAEMON (user_data);
   GVfsJob *job = G_VFS_JOB (data);
+  BackendJobQueue *queue;
+  GVfsJobSchedule *schedule;
+  GList *unstarted;
+  GError *error;
+
+  /* The schedule lives on the job, which may finish while running */
+  g_object_ref (job);
 
   g_vfs_job_run (job);
+
+  schedule = &job->schedule;
+  if (schedule->backend != NULL)
+    {
+      g_mutex_lock (&daemon->lock);
+
+      queue = g_hash_table_lookup (daemon->backend_job_queues, schedule->backend);
+      g_assert (queue != NULL);
+
+      queue->n_running--;
+      if (schedule->exclusive)
+	queue->exclusive_running = FALSE;
+      if (schedule->handle_key != NULL)
+	g_hash_table_remove (queue->busy_handles, schedule->handle_key);
+
+      unstarted = NULL;
+      error = NULL;
+      if (queue->n_running == 0 && g_queue_is_empty (&queue->pending))
+	g_hash_table_remove (daemon->backend_job_queues, schedule->backend);
+      else
+	unstarted = backend_job_queue_start_jobs (daemon, queue, &error);
+
+      g_mutex_unlock (&daemon->lock);
+
+      fail_unstarted_jobs (unstarted, error);
+    }
+
+  g_object_unref (job);
+}
+
+/* Runs a job on a worker thread, as soon as the concurrency model of
+   its backend allows */
+static void
+schedule_job_in_thread (GVfsDaemon *daemon,
+			GVfsJob    *job)
+{
+  BackendJobQueue *queue;
+  GVfsJobSchedule *schedule;
+  GList *unstarted;
+  GError *error;
+
+  error = NULL;
+  schedule = &job->schedule;
+  if (schedule->backend == NULL)
+    {
+      if (!g_thread_pool_push (daemon->thread_pool, job, &error))
+	{
+	  g_vfs_job_failed_from_error (job, error);
+	  g_error_free (error);
+	}
+      return;
+    }
+
+  g_mutex_lock (&daemon->lock);
+
+  queue = g_hash_table_lookup (daemon->backend_job_queues, schedule->backend);
+  if (queue == NULL)
+    {
+      queue = g_new0 (BackendJobQueue, 1);
+      g_queue_init (&queue->pending);
+      queue->busy_handles = g_hash_table_new (g_direct_hash, g_direct_equal);
+      g_hash_table_insert (daemon->backend_job_queues, schedule->backend, queue);
+    }
+
+  g_queue_push_tail (&queue->pending, job);
+  unstarted = backend_job_queue_start_jobs (daemon, queue, &error);
+
+  g_mutex_unlock (&daemon->lock);
+
+  fail_unstarted_jobs (unstarted, error);
+}
+
+static void
+job_schedule_init (GVfsJob       *job,
+		   GVfsJobSource *job_source)
+{
+  GVfsJobSchedule *schedule = &job->schedule;
+  GVfsBackend *backend;
+  gpointer handle_key;
+
+  if (job_source == NULL)
+    return;
+
+  handle_key = NULL;
+  if (G_VFS_IS_CHANNEL (job_source))
+    {
+      backend = g_vfs_channel_get_backend (G_VFS_CHANNEL (job_source));
+      handle_key = job_source;
+    }
+  else if (G_VFS_IS_BACKEND (job_source))
+    backend = G_VFS_BACKEND (job_source);
+  else
+    return;
+
+  switch (g_vfs_backend_get_concurrency (backend))
+    {
+    case G_VFS_BACKEND_CONCURRENCY_REENTRANT:
+      break;
+    case G_VFS_BACKEND_CONCURRENCY_PER_HANDLE:
+      schedule->backend = backend;
+      schedule->handle_key = handle_key;
+      schedule->exclusive = G_VFS_IS_JOB_MOUNT (job) || G_VFS_IS_JOB_UNMOUNT (job);
+      break;
+    case G_VFS_BACKEND_CONCURRENCY_GLOBAL:
+      schedule->backend = backend;
+      schedule->exclusive = TRUE;
+      break;
+    }
 }
 
 static void
@@ -232,7 +455,9 @@ static void
 g_vfs_daemon_init (GVfsDaemon *daemon)
 {
   GError *error;
-  gint max_threads = 1; /* TODO: handle max threads */
+  /* Raised to the MAX_JOB_THREADS of the backend executable by
+     g_vfs_daemon_set_max_threads() */
+  gint max_threads = 1;
 
   daemon->thread_pool = g_thread_pool_new (job_handler_callback,
 					   daemon,
@@ -241,6 +466,10 @@ g_vfs_daemon_init (GVfsDaemon *daemon)
   /* TODO: verify thread_pool != NULL in a nicer way */
   g_assert (daemon->thread_pool != NULL);
 
+  daemon->backend_job_queues =
+    g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			   NULL, (GDestroyNotify)backend_job_queue_free);
+
   g_mutex_init (&daemon->lock);
 
   daemon->mount_counter = 0;
@@ -383,12 +612,16 @@ daemon_schedule_exit (GVfsDaemon *daemon)
     daemon->exit_tag = g_timeout_add_seconds (1, (GSourceFunc)exit_at_idle, daemon);
 }
 
+static void daemon_queue_job (GVfsDaemon    *daemon,
+			      GVfsJob       *job,
+			      GVfsJobSource *job_source);
+
 static void
 job_source_new_job_callback (GVfsJobSource *job_source,
 			     GVfsJob *job,
 			     GVfsDaemon *daemon)
 {
-  g_vfs_daemon_queue_job (daemon, job);
+  daemon_queue_job (daemon, job, job_source);
 }
 
 static void
@@ -572,11 +805,14 @@ job_finished_callback (GVfsJob *job,
   g_object_unref (job);
 }
 
-void
-g_vfs_daemon_queue_job (GVfsDaemon *daemon,
-			GVfsJob *job)
+static void
+daemon_queue_job (GVfsDaemon    *daemon,
+		  GVfsJob       *job,
+		  GVfsJobSource *job_source)
 {
   g_debug ("Queued new job %p (%s)\n", job, g_type_name_from_instance ((gpointer)job));
+
+  job_schedule_init (job, job_source);
   
   g_object_ref (job);
   g_signal_connect (job, "finished", (GCallback)job_finished_callback, daemon);
@@ -590,10 +826,17 @@ g_vfs_daemon_queue_job (GVfsDaemon *daemon,
   if (!g_vfs_job_try (job))
     {
       /* Couldn't finish / run async, queue worker thread */
-      g_thread_pool_push (daemon->thread_pool, job, NULL); /* TODO: Check error */
+      schedule_job_in_thread (daemon, job);
     }
 }
 
+void
+g_vfs_daemon_queue_job (GVfsDaemon *daemon,
+			GVfsJob *job)
+{
+  daemon_queue_job (daemon, job, NULL);
+}
+
 static void
 new_connection_data_free (void *memory)
 {
@@ -1004,7 +1247,7 @@ g_vfs_daemon_initiate_mount (GVfsDaemon *daemon,
   g_object_unref (backend);
 
   job = g_vfs_job_mount_new (mount_spec, mount_source, is_automount, object, invocation, backend);
-  g_vfs_daemon_queue_job (daemon, job);
+  daemon_queue_job (daemon, job, G_VFS_JOB_SOURCE (backend));
   g_object_unref (job);
 }
 
@@ -1041,7 +1284,7 @@ void
 g_vfs_daemon_run_job_in_thread (GVfsDaemon *daemon,
 				GVfsJob    *job)
 {
-  g_thread_pool_push (daemon->thread_pool, job, NULL); /* TODO: Check error */
+  schedule_job_in_thread (daemon, job);
 }
 
 void
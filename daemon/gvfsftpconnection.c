@@ -39,6 +39,7 @@ struct _GVfsFtpConnection
   GIOStream *        	commands;               /* ftp command stream */
   GDataInputStream *    commands_in;            /* wrapper around in stream to allow line-wise reading */
   gboolean              waiting_for_reply;           /* TRUE if a command was sent but no reply received yet */
+  gint64                last_activity;          /* monotonic time the last command was sent */
 
   GSocket *             listen_socket;          /* socket we are listening on for active FTP connections */
   GIOStream *        	data;                   /* ftp data stream or NULL if not in use */
@@ -90,6 +91,7 @@ g_vfs_ftp_connection_new (GSocketConnectable *addr,
   g_data_input_stream_set_newline_type (conn->commands_in, G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
   /* The first thing that needs to happen is receiving the welcome message */
   conn->waiting_for_reply = TRUE;
+  conn->last_activity = g_get_monotonic_time ();
 
   return conn;
 }
@@ -139,6 +141,7 @@ g_vfs_ftp_connection_send (GVfsFtpConnection *conn,
     g_debug ("--%2d ->  %s", conn->debug_id, command);
 
   conn->waiting_for_reply = TRUE;
+  conn->last_activity = g_get_monotonic_time ();
   return g_output_stream_write_all (g_io_stream_get_output_stream (conn->commands),
                                     command,
                                     len,
@@ -479,7 +482,12 @@ g_vfs_ftp_connection_is_usable (GVfsFtpConnection *conn)
   if (conn->waiting_for_reply)
     return FALSE;
 
-  cond = G_IO_ERR | G_IO_HUP;
+  /* An idle connection has nothing to read. Input means the server sent
+   * a 421 before closing the connection or sent a stray reply. */
+  if (g_buffered_input_stream_get_available (G_BUFFERED_INPUT_STREAM (conn->commands_in)) > 0)
+    return FALSE;
+
+  cond = G_IO_IN | G_IO_ERR | G_IO_HUP;
   cond = g_socket_condition_check (g_socket_connection_get_socket (G_SOCKET_CONNECTION (conn->commands)), cond);
   if (cond)
     return FALSE;
@@ -487,3 +495,20 @@ g_vfs_ftp_connection_is_usable (GVfsFtpConnection *conn)
   return TRUE;
 }
 
+/**
+ * g_vfs_ftp_connection_get_last_activity:
+ * @conn: the connection
+ *
+ * Gets the time a command was last sent on @conn, or the time it was
+ * opened if no command was sent yet.
+ *
+ * Returns: the monotonic time of the last activity on @conn
+ **/
+gint64
+g_vfs_ftp_connection_get_last_activity (GVfsFtpConnection *conn)
+{
+  g_return_val_if_fail (conn != NULL, 0);
+
+  return conn->last_activity;
+}
+
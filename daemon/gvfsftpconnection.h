@@ -46,6 +46,7 @@ guint                   g_vfs_ftp_connection_receive          (GVfsFtpConnection
                                                                GError **                error);
 
 gboolean                g_vfs_ftp_connection_is_usable        (GVfsFtpConnection *      conn);
+gint64                  g_vfs_ftp_connection_get_last_activity(GVfsFtpConnection *      conn);
 GSocketAddress *        g_vfs_ftp_connection_get_address      (GVfsFtpConnection *      conn,
                                                                GError **                error);
 guint                   g_vfs_ftp_connection_get_debug_id     (GVfsFtpConnection *      conn);
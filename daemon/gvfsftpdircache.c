@@ -21,6 +21,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #include <config.h>
@@ -130,11 +131,12 @@ g_vfs_ftp_dir_cache_free (GVfsFtpDirCache *cache)
   g_slice_free (GVfsFtpDirCache, cache);
 }
 
+/* returns the cached entry for dir if it is recent enough, without
+ * listing the directory */
 static GVfsFtpDirCacheEntry *
-g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
-                                  GVfsFtpTask *      task,
-                                  const GVfsFtpFile *dir,
-                                  guint              stamp)
+g_vfs_ftp_dir_cache_peek_entry (GVfsFtpDirCache *  cache,
+                                const GVfsFtpFile *dir,
+                                guint              stamp)
 {
   GVfsFtpDirCacheEntry *entry;
 
@@ -144,8 +146,24 @@ g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
     g_vfs_ftp_dir_cache_entry_ref (entry);
   g_mutex_unlock (&cache->lock);
   if (entry && entry->stamp < stamp)
-    g_vfs_ftp_dir_cache_entry_unref (entry);
-  else if (entry)
+    {
+      g_vfs_ftp_dir_cache_entry_unref (entry);
+      entry = NULL;
+    }
+
+  return entry;
+}
+
+static GVfsFtpDirCacheEntry *
+g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
+                                  GVfsFtpTask *      task,
+                                  const GVfsFtpFile *dir,
+                                  guint              stamp)
+{
+  GVfsFtpDirCacheEntry *entry;
+
+  entry = g_vfs_ftp_dir_cache_peek_entry (cache, dir, stamp);
+  if (entry)
     return entry;
 
   if (g_vfs_ftp_task_send (task,
@@ -202,10 +220,21 @@ g_vfs_ftp_dir_cache_lookup_file_internal (GVfsFtpDirCache *  cache,
   if (!g_vfs_ftp_file_is_root (file))
     {
       dir = g_vfs_ftp_file_new_parent (file);
-      entry = g_vfs_ftp_dir_cache_lookup_entry (cache, task, dir, stamp);
-      g_vfs_ftp_file_free (dir);
-      if (entry == NULL)
-        return NULL;
+      if (cache->funcs->exact_lookup)
+        {
+          /* don't list a whole directory to find out about a single file */
+          entry = g_vfs_ftp_dir_cache_peek_entry (cache, dir, stamp);
+          g_vfs_ftp_file_free (dir);
+          if (entry == NULL)
+            return cache->funcs->lookup_uncached (task, file);
+        }
+      else
+        {
+          entry = g_vfs_ftp_dir_cache_lookup_entry (cache, task, dir, stamp);
+          g_vfs_ftp_file_free (dir);
+          if (entry == NULL)
+            return NULL;
+        }
 
       info = g_hash_table_lookup (entry->files, file);
       if (info != NULL)
@@ -801,16 +830,306 @@ g_vfs_ftp_dir_cache_funcs_process_default (GInputStream *        stream,
   return g_vfs_ftp_dir_cache_funcs_process (stream, debug_id, dir, entry, FALSE, cancellable, error);
 }
 
+/* MLSD and MLST, see RFC 3659 section 7 */
+
+static gboolean
+g_vfs_ftp_parse_mlsx_time (const char *value,
+                           GTimeVal *  tv)
+{
+  int year, month, day, hour, minute, second;
+  GDateTime *date_time;
+
+  /* YYYYMMDDHHMMSS[.sss] in UTC, we ignore fractions of a second */
+  if (sscanf (value, "%4d%2d%2d%2d%2d%2d",
+              &year, &month, &day, &hour, &minute, &second) != 6)
+    return FALSE;
+
+  date_time = g_date_time_new_utc (year, month, day, hour, minute, second);
+  if (date_time == NULL)
+    return FALSE;
+
+  tv->tv_sec = g_date_time_to_unix (date_time);
+  tv->tv_usec = 0;
+  g_date_time_unref (date_time);
+
+  return TRUE;
+}
+
+static void
+g_vfs_ftp_parse_mlsx_perm (GFileInfo * info,
+                           GFileType   file_type,
+                           const char *perm)
+{
+  gboolean can_read, can_write;
+
+  if (file_type == G_FILE_TYPE_DIRECTORY)
+    {
+      /* e = enter, l = list, c = create, m = mkdir, p = purge */
+      can_read = strpbrk (perm, "elEL") != NULL;
+      can_write = strpbrk (perm, "cmpCMP") != NULL;
+    }
+  else
+    {
+      /* r = retrieve, w = store, a = append */
+      can_read = strpbrk (perm, "rR") != NULL;
+      can_write = strpbrk (perm, "waWA") != NULL;
+    }
+
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ, can_read);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE, can_write);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_DELETE,
+                                     strpbrk (perm, "dD") != NULL);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_RENAME,
+                                     strpbrk (perm, "fF") != NULL);
+}
+
+/* Fills info from the facts of a MLSD line or MLST reply, that is the
+ * part before the file name. Returns FALSE if the entry should be
+ * skipped, which is the case for the listed directory and its parent.
+ */
+static gboolean
+g_vfs_ftp_parse_mlsx_facts (GFileInfo *        info,
+                            const GVfsFtpFile *file,
+                            const char *       facts)
+{
+  GFileType file_type = G_FILE_TYPE_REGULAR;
+  const char *perm = NULL;
+  guint32 mode = 0;
+  gboolean has_mode = FALSE;
+  GTimeVal tv;
+  char **split;
+  char *name, *value;
+  guint i;
+
+  split = g_strsplit (facts, ";", -1);
+  for (i = 0; split[i]; i++)
+    {
+      name = split[i];
+      value = strchr (name, '=');
+      if (value == NULL)
+        continue;
+      *value++ = '\0';
+
+      /* fact names and type values are case insensitive */
+      if (g_ascii_strcasecmp (name, "type") == 0)
+        {
+          if (g_ascii_strcasecmp (value, "cdir") == 0 ||
+              g_ascii_strcasecmp (value, "pdir") == 0)
+            {
+              g_strfreev (split);
+              return FALSE;
+            }
+          else if (g_ascii_strcasecmp (value, "dir") == 0)
+            file_type = G_FILE_TYPE_DIRECTORY;
+          else if (g_ascii_strcasecmp (value, "file") == 0)
+            file_type = G_FILE_TYPE_REGULAR;
+          else if (g_ascii_strncasecmp (value, "OS.unix=slink", 13) == 0 ||
+                   g_ascii_strcasecmp (value, "OS.unix=symlink") == 0)
+            {
+              file_type = G_FILE_TYPE_SYMBOLIC_LINK;
+              g_file_info_set_is_symlink (info, TRUE);
+              /* Pure-FTPd style: OS.unix=slink:target */
+              if (value[13] == ':' && value[14] != '\0')
+                g_file_info_set_symlink_target (info, value + 14);
+            }
+          else
+            file_type = G_FILE_TYPE_SPECIAL;
+        }
+      else if (g_ascii_strcasecmp (name, "size") == 0 ||
+               g_ascii_strcasecmp (name, "sizd") == 0)
+        g_file_info_set_size (info, g_ascii_strtoull (value, NULL, 10));
+      else if (g_ascii_strcasecmp (name, "modify") == 0)
+        {
+          if (g_vfs_ftp_parse_mlsx_time (value, &tv))
+            g_file_info_set_modification_time (info, &tv);
+        }
+      else if (g_ascii_strcasecmp (name, "perm") == 0)
+        perm = value;
+      else if (g_ascii_strcasecmp (name, "unique") == 0)
+        g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILE, value);
+      else if (g_ascii_strcasecmp (name, "UNIX.mode") == 0)
+        {
+          mode = g_ascii_strtoull (value, NULL, 8) & 07777;
+          has_mode = TRUE;
+        }
+      else if (g_ascii_strcasecmp (name, "UNIX.owner") == 0 ||
+               g_ascii_strcasecmp (name, "UNIX.uid") == 0)
+        g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_OWNER_USER, value);
+      else if (g_ascii_strcasecmp (name, "UNIX.group") == 0 ||
+               g_ascii_strcasecmp (name, "UNIX.gid") == 0)
+        g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_OWNER_GROUP, value);
+    }
+
+  if (perm)
+    g_vfs_ftp_parse_mlsx_perm (info, file_type, perm);
+
+  if (has_mode)
+    {
+      switch (file_type)
+        {
+        case G_FILE_TYPE_DIRECTORY:
+          mode |= S_IFDIR;
+          break;
+        case G_FILE_TYPE_SYMBOLIC_LINK:
+          mode |= S_IFLNK;
+          break;
+        case G_FILE_TYPE_REGULAR:
+          mode |= S_IFREG;
+          break;
+        default:
+          break;
+        }
+      g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE, mode);
+    }
+
+  g_strfreev (split);
+
+  name = g_path_get_basename (g_vfs_ftp_file_get_gvfs_path (file));
+  g_file_info_set_name (info, name);
+  gvfs_file_info_populate_default (info,
+                                   g_vfs_ftp_file_get_gvfs_path (file),
+                                   file_type);
+  g_file_info_set_is_hidden (info, name[0] == '.');
+  g_free (name);
+
+  return TRUE;
+}
+
+static gboolean
+g_vfs_ftp_dir_cache_funcs_process_mlsd (GInputStream *        stream,
+                                        int                   debug_id,
+                                        const GVfsFtpFile *   dir,
+                                        GVfsFtpDirCacheEntry *entry,
+                                        GCancellable *        cancellable,
+                                        GError **             error)
+{
+  GDataInputStream *data;
+  GFileInfo *info;
+  GVfsFtpFile *file;
+  char *line, *name;
+  gsize length;
+
+  g_assert (error != NULL);
+  g_assert (*error == NULL);
+
+  data = g_data_input_stream_new (stream);
+  g_data_input_stream_set_newline_type (data, G_DATA_STREAM_NEWLINE_TYPE_LF);
+  while ((line = g_data_input_stream_read_line (data, &length, cancellable, error)))
+    {
+      if (length > 0 && line[length - 1] == '\r')
+        line[--length] = '\0';
+
+      g_debug ("<<%2d <<  %s\n", debug_id, line);
+
+      /* facts are separated from the name by a single space */
+      name = strchr (line, ' ');
+      if (name == NULL || name[1] == '\0')
+        {
+          g_free (line);
+          continue;
+        }
+      *name++ = '\0';
+
+      file = g_vfs_ftp_file_new_child (dir, name, NULL);
+      if (file == NULL)
+        {
+          g_debug ("# invalid filename, skipping");
+          g_free (line);
+          continue;
+        }
+
+      info = g_file_info_new ();
+      if (g_vfs_ftp_parse_mlsx_facts (info, file, line))
+        g_vfs_ftp_dir_cache_entry_add (entry, file, info);
+      else
+        {
+          g_object_unref (info);
+          g_vfs_ftp_file_free (file);
+        }
+      g_free (line);
+    }
+
+  g_object_unref (data);
+  return *error == NULL;
+}
+
+static GFileInfo *
+g_vfs_ftp_dir_cache_funcs_lookup_mlst (GVfsFtpTask *      task,
+                                       const GVfsFtpFile *file)
+{
+  GFileInfo *info;
+  char **reply;
+  char *facts, *name;
+  guint i;
+
+  if (g_vfs_ftp_file_is_root (file))
+    return create_root_file_info (task->backend);
+
+  switch (g_vfs_ftp_task_send_and_check (task,
+                                         G_VFS_FTP_PASS_550,
+                                         NULL,
+                                         NULL,
+                                         &reply,
+                                         "MLST %s",
+                                         g_vfs_ftp_file_get_ftp_path (file)))
+    {
+    case 0:
+      /* MLST is broken on some servers that list MLSD fine */
+      g_vfs_ftp_task_clear_error (task);
+      return g_vfs_ftp_dir_cache_funcs_lookup_uncached (task, file);
+    case 550:
+      g_strfreev (reply);
+      return NULL;
+    default:
+      break;
+    }
+
+  /* the facts are on the first line starting with a space */
+  info = NULL;
+  for (i = 1; reply[i]; i++)
+    {
+      if (reply[i][0] != ' ')
+        continue;
+
+      facts = reply[i] + 1;
+      g_debug ("# MLST %s\n", facts);
+
+      /* facts are separated from the name by a single space */
+      name = strchr (facts, ' ');
+      if (name == NULL)
+        break;
+      *name = '\0';
+
+      info = g_file_info_new ();
+      if (!g_vfs_ftp_parse_mlsx_facts (info, file, facts))
+        g_clear_object (&info);
+      break;
+    }
+  g_strfreev (reply);
+
+  return info;
+}
+
 const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_unix = {
   "LIST -a",
   g_vfs_ftp_dir_cache_funcs_process_unix,
   g_vfs_ftp_dir_cache_funcs_lookup_uncached,
-  g_vfs_ftp_dir_cache_funcs_resolve_default
+  g_vfs_ftp_dir_cache_funcs_resolve_default,
+  FALSE
 };
 
 const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_default = {
   "LIST",
   g_vfs_ftp_dir_cache_funcs_process_default,
   g_vfs_ftp_dir_cache_funcs_lookup_uncached,
-  g_vfs_ftp_dir_cache_funcs_resolve_default
+  g_vfs_ftp_dir_cache_funcs_resolve_default,
+  FALSE
+};
+
+const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd = {
+  "MLSD",
+  g_vfs_ftp_dir_cache_funcs_process_mlsd,
+  g_vfs_ftp_dir_cache_funcs_lookup_mlst,
+  g_vfs_ftp_dir_cache_funcs_resolve_default,
+  TRUE
 };
@@ -46,10 +46,14 @@ struct _GVfsFtpDirFuncs {
   GVfsFtpFile *         (* resolve_symlink)                     (GVfsFtpTask *          task,
                                                                  const GVfsFtpFile *    file,
                                                                  const char *           target);
+  /* TRUE if lookup_uncached returns the same info a listing would, so
+   * files in directories that aren't cached are looked up on their own */
+  gboolean              exact_lookup;
 };
 
 extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_unix;
 extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_default;
+extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd;
 
 GVfsFtpDirCache *       g_vfs_ftp_dir_cache_new                 (const GVfsFtpDirFuncs *funcs);
 void                    g_vfs_ftp_dir_cache_free                (GVfsFtpDirCache *      cache);
@@ -205,7 +205,16 @@ g_vfs_ftp_task_acquire_connection (GVfsFtpTask *task)
 
       task->conn = g_queue_pop_head (ftp->queue);
       if (task->conn != NULL)
-        break;
+        {
+          if (g_vfs_ftp_connection_is_usable (task->conn))
+            break;
+
+          /* the server closed it while it was idle */
+          ftp->connections--;
+          g_vfs_ftp_connection_free (task->conn);
+          task->conn = NULL;
+          continue;
+        }
 
       if (ftp->connections < ftp->max_connections)
         {
@@ -277,7 +286,7 @@ g_vfs_ftp_task_acquire_connection (GVfsFtpTask *task)
  * a @task's connection, never use g_vfs_ftp_connection_free() directly. If
  * the task does not have a current connection, this function just returns.
  **/
-static void
+void
 g_vfs_ftp_task_release_connection (GVfsFtpTask *task)
 {
   g_return_if_fail (task != NULL);
@@ -301,6 +310,84 @@ g_vfs_ftp_task_release_connection (GVfsFtpTask *task)
   task->conn = NULL;
 }
 
+/**
+ * g_vfs_ftp_task_maintain_connections:
+ * @task: a task without a connection
+ *
+ * Keeps the backend's connection pool warm. Connections that were idle for
+ * %G_VFS_FTP_KEEPALIVE_IN_SECONDS get a NOOP so the server does not time
+ * them out, and new connections are opened until the pool holds the
+ * backend's warm_connections. This function blocks and is meant to be
+ * called periodically from a thread. Errors are not reported, connections
+ * that fail are dropped from the pool.
+ **/
+void
+g_vfs_ftp_task_maintain_connections (GVfsFtpTask *task)
+{
+  GVfsBackendFtp *ftp;
+  GQueue idle = G_QUEUE_INIT;
+  GSList *warm = NULL;
+  GList *walk, *next;
+  gint64 idle_since;
+  gboolean full;
+  guint i;
+
+  g_return_if_fail (task != NULL);
+  g_return_if_fail (task->conn == NULL);
+
+  ftp = task->backend;
+  idle_since = g_get_monotonic_time () - G_VFS_FTP_KEEPALIVE_IN_SECONDS * G_TIME_SPAN_SECOND;
+
+  /* take connections that were idle for a while out of the pool */
+  g_mutex_lock (&ftp->mutex);
+  if (ftp->queue)
+    {
+      for (walk = ftp->queue->head; walk; walk = next)
+        {
+          next = walk->next;
+          if (g_vfs_ftp_connection_get_last_activity (walk->data) <= idle_since)
+            {
+              g_queue_push_tail (&idle, walk->data);
+              g_queue_delete_link (ftp->queue, walk);
+            }
+        }
+    }
+  g_mutex_unlock (&ftp->mutex);
+
+  /* dead connections are freed when releasing them */
+  while ((task->conn = g_queue_pop_head (&idle)) != NULL)
+    {
+      if (g_vfs_ftp_connection_is_usable (task->conn))
+        g_vfs_ftp_task_send (task, 0, "NOOP");
+      g_vfs_ftp_task_clear_error (task);
+      g_vfs_ftp_task_release_connection (task);
+    }
+
+  /* Hold on to connections from the pool until we have enough of them, so
+   * the pool opens new ones. Stop when that would mean waiting for a
+   * connection to become free. */
+  for (i = 0; i < ftp->warm_connections; i++)
+    {
+      g_mutex_lock (&ftp->mutex);
+      full = ftp->queue == NULL ||
+             (g_queue_is_empty (ftp->queue) && ftp->connections >= ftp->max_connections);
+      g_mutex_unlock (&ftp->mutex);
+      if (full || !g_vfs_ftp_task_acquire_connection (task))
+        break;
+
+      warm = g_slist_prepend (warm, task->conn);
+      task->conn = NULL;
+    }
+  g_vfs_ftp_task_clear_error (task);
+
+  while (warm)
+    {
+      task->conn = warm->data;
+      g_vfs_ftp_task_release_connection (task);
+      warm = g_slist_delete_link (warm, warm);
+    }
+}
+
 /**
  * g_vfs_ftp_task_done:
  * @task: the task to finalize
@@ -64,6 +64,7 @@ void                    g_vfs_ftp_task_set_error_from_response  (GVfsFtpTask *
 void                    g_vfs_ftp_task_give_connection          (GVfsFtpTask *          task,
                                                                  GVfsFtpConnection *    conn);
 GVfsFtpConnection *     g_vfs_ftp_task_take_connection          (GVfsFtpTask *          task);
+void                    g_vfs_ftp_task_release_connection       (GVfsFtpTask *          task);
 
 guint                   g_vfs_ftp_task_send                     (GVfsFtpTask *          task,
                                                                  GVfsFtpResponseFlags   flags,
@@ -92,6 +93,7 @@ gboolean                g_vfs_ftp_task_login                    (GVfsFtpTask *
                                                                  const char *           username,
                                                                  const char *           password);
 void                    g_vfs_ftp_task_setup_connection         (GVfsFtpTask *          task);
+void                    g_vfs_ftp_task_maintain_connections     (GVfsFtpTask *          task);
 
 
 G_END_DECLS
@@ -42,6 +42,14 @@ typedef struct _GVfsJobClass   GVfsJobClass;
 /* Defined here to avoid circular includes */
 typedef struct _GVfsJobSource GVfsJobSource;
 
+/* Constraints for running a job on a worker thread, set by the daemon
+   from the concurrency model of its backend when the job is queued */
+typedef struct {
+  struct _GVfsBackend *backend; /* NULL if the job is unconstrained */
+  gpointer handle_key;
+  gboolean exclusive;
+} GVfsJobSchedule;
+
 struct _GVfsJob
 {
   GObject parent_instance;
@@ -56,6 +64,8 @@ struct _GVfsJob
   guint finished : 1;
   GError *error;
   GCancellable *cancellable;
+
+  GVfsJobSchedule schedule;
   
   GVfsJobPrivate *priv;
 };
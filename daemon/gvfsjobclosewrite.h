@@ -46,6 +46,10 @@ struct _GVfsJobCloseWrite
   GVfsWriteChannel *channel;
   GVfsBackend *backend;
   GVfsBackendHandle handle;
+
+  /* A write failed, backends writing to a temporary file drop it
+     instead of replacing the target */
+  gboolean aborted;
 };
 
 struct _GVfsJobCloseWriteClass
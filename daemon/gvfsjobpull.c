@@ -163,7 +163,8 @@ try (GVfsJob *job)
                          progress_job->send_progress ? g_vfs_job_progress_callback : NULL,
                          progress_job->send_progress ? job : NULL);
   
-  if (progress_job->progress_proxy)
+  /* Asynchronous transfers keep reporting progress until they finish */
+  if (progress_job->progress_proxy && (!res || g_vfs_job_is_finished (job)))
     g_clear_object (&progress_job->progress_proxy);
 
   return res;
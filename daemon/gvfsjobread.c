@@ -104,7 +104,8 @@ send_reply (GVfsJob *job)
     {
       g_vfs_read_channel_send_data (op_job->channel,
 				    op_job->buffer,
-				    op_job->data_count);
+				    op_job->data_count,
+				    op_job->start_time);
     }
 }
 
@@ -120,7 +121,8 @@ run (GVfsJob *job)
 			_("Operation not supported by backend"));
       return;
     }
-      
+
+  op_job->start_time = g_get_monotonic_time ();
   class->read (op_job->backend,
 	       op_job,
 	       op_job->handle,
@@ -137,6 +139,7 @@ try (GVfsJob *job)
   if (class->try_read == NULL)
     return FALSE;
 
+  op_job->start_time = g_get_monotonic_time ();
   return class->try_read (op_job->backend,
 			  op_job,
 			  op_job->handle,
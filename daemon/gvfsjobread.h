@@ -48,6 +48,9 @@ struct _GVfsJobRead
   gsize bytes_requested;
   char *buffer;
   gsize data_count;
+
+  /* When the backend was handed the read, for latency tracking */
+  gint64 start_time;
 };
 
 struct _GVfsJobReadClass
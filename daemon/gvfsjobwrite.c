@@ -76,6 +76,7 @@ g_vfs_job_write_new (GVfsWriteChannel *channel,
 		     GVfsBackendHandle handle,
 		     char *data,
 		     gsize data_size,
+		     gboolean write_behind,
 		     GVfsBackend *backend)
 {
   GVfsJobWrite *job;
@@ -89,6 +90,7 @@ g_vfs_job_write_new (GVfsWriteChannel *channel,
   /* Takes ownership */
   job->data = data;
   job->data_size = data_size;
+  job->write_behind = write_behind;
   job->written_size = 0;
   
   return G_VFS_JOB (job);
@@ -105,7 +107,9 @@ send_reply (GVfsJob *job)
     g_vfs_channel_send_error (G_VFS_CHANNEL (op_job->channel), job->error);
   else
     g_vfs_write_channel_send_written (op_job->channel,
-				      op_job->written_size);
+				      op_job->written_size,
+				      op_job->write_behind,
+				      g_vfs_job_write_is_partial (op_job));
 }
 
 static void
@@ -151,3 +155,14 @@ g_vfs_job_write_set_written_size (GVfsJobWrite *job,
 {
   job->written_size = written_size;
 }
+
+/* A short write of a write-behind request is not reported back as
+ * such, the write channel queues the rest of the data instead. */
+gboolean
+g_vfs_job_write_is_partial (GVfsJobWrite *job)
+{
+  return job->write_behind &&
+    !G_VFS_JOB (job)->failed &&
+    job->written_size > 0 &&
+    job->written_size < job->data_size;
+}
@@ -47,6 +47,7 @@ struct _GVfsJobWrite
   GVfsBackendHandle handle;
   char *data;
   gsize data_size;
+  gboolean write_behind;
   
   gsize written_size;
 };
@@ -62,9 +63,11 @@ GVfsJob *g_vfs_job_write_new              (GVfsWriteChannel  *channel,
 					   GVfsBackendHandle  handle,
 					   char              *data,
 					   gsize              data_size,
+					   gboolean           write_behind,
 					   GVfsBackend       *backend);
 void     g_vfs_job_write_set_written_size (GVfsJobWrite      *job,
 					   gsize              written_size);
+gboolean g_vfs_job_write_is_partial       (GVfsJobWrite      *job);
 
 G_END_DECLS
 
@@ -41,12 +41,24 @@
 #include <gvfsjobcloseread.h>
 #include <gvfsfileinfo.h>
 
+#define READAHEAD_INITIAL_SIZE (64*1024)
+
 struct _GVfsReadChannel
 {
   GVfsChannel parent_instance;
 
   guint read_count;
   int seek_generation;
+
+  /* Adaptive readahead, reset on every seek */
+  guint32 read_size;
+  guint readahead_window;
+  guint readahead_count;
+
+  /* Exponential averages, in microseconds */
+  gint64 read_latency;
+  gint64 last_request_time;
+  gint64 request_interval;
 };
 
 G_DEFINE_TYPE (GVfsReadChannel, g_vfs_read_channel, G_VFS_TYPE_CHANNEL)
@@ -82,9 +94,21 @@ g_vfs_read_channel_class_init (GVfsReadChannelClass *klass)
   channel_class->readahead = read_channel_readahead;
 }
 
+static void
+reset_readahead (GVfsReadChannel *channel)
+{
+  channel->read_count = 0;
+  channel->read_size = READAHEAD_INITIAL_SIZE;
+  channel->readahead_window = 1;
+  channel->readahead_count = 0;
+  channel->last_request_time = 0;
+  channel->request_interval = 0;
+}
+
 static void
 g_vfs_read_channel_init (GVfsReadChannel *channel)
 {
+  reset_readahead (channel);
 }
 
 static GVfsJob *
@@ -95,6 +119,15 @@ read_channel_close (GVfsChannel *channel)
 				   g_vfs_channel_get_backend (channel));
 } 
 
+static gint64
+update_average (gint64 average,
+		gint64 sample)
+{
+  if (average == 0)
+    return sample;
+  return (3 * average + sample) / 4;
+}
+
 /* Always request large chunks. Its very inefficient
  * to do network requests for smaller chunks.
  *
@@ -103,12 +136,15 @@ read_channel_close (GVfsChannel *channel)
  * it makes sense to never read more that 4k
  * (one page) on the first read. It should not affect
  * long-file copy performance anyway.
+ *
+ * Once we're streaming the size is the adaptive
+ * read_size, see update_readahead().
  */
 static guint32
 modify_read_size (GVfsReadChannel *channel,
 		  guint32 requested_size)
 {
-  guint32 real_size;
+  guint32 real_size, max_size;
 
   if (channel->read_count <= 1)
     real_size = 4*1024;
@@ -119,19 +155,71 @@ modify_read_size (GVfsReadChannel *channel,
   else if (channel->read_count <= 4)
     real_size = 32*1024;
   else
-    real_size = 64*1024;
+    real_size = channel->read_size;
 
   if (requested_size > real_size)
       real_size = requested_size;
 
   /* Don't do ridicoulously large requests as this
      is just stupid on the network */
-  if (real_size > 128 * 1024)
-    real_size = 128 * 1024;
+  g_vfs_backend_get_readahead_limits (g_vfs_channel_get_backend (G_VFS_CHANNEL (channel)),
+				      &max_size, NULL);
+  if (real_size > max_size)
+    real_size = max_size;
 
   return real_size;
 }
 
+/* Called for each read request from the client. If the client asks
+ * for more data about as fast as the backend produces it the client
+ * is waiting for us, so we read larger chunks and keep more of them
+ * in flight. This converges on the bandwidth-delay product of the
+ * backend, within the limits set by the backend.
+ */
+static void
+update_readahead (GVfsReadChannel *channel)
+{
+  guint32 max_size;
+  guint max_window;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  if (channel->last_request_time != 0)
+    channel->request_interval = update_average (channel->request_interval,
+						now - channel->last_request_time);
+  channel->last_request_time = now;
+
+  if (channel->read_count <= 4 ||
+      channel->read_latency == 0 ||
+      channel->request_interval == 0)
+    return;
+
+  if (channel->request_interval <= channel->read_latency + channel->read_latency / 4)
+    {
+      g_vfs_backend_get_readahead_limits (g_vfs_channel_get_backend (G_VFS_CHANNEL (channel)),
+					  &max_size, &max_window);
+
+      if (channel->read_size < max_size)
+	channel->read_size = MIN (channel->read_size * 2, max_size);
+      if (channel->readahead_window < max_window)
+	channel->readahead_window++;
+    }
+}
+
+static GVfsJob *
+read_channel_start_read (GVfsReadChannel *channel,
+			 guint32 requested_size)
+{
+  GVfsChannel *base;
+
+  base = G_VFS_CHANNEL (channel);
+
+  return g_vfs_job_read_new (channel,
+			     g_vfs_channel_get_backend_handle (base),
+			     modify_read_size (channel, requested_size),
+			     g_vfs_channel_get_backend (base));
+}
+
 static GVfsJob *
 read_channel_handle_request (GVfsChannel *channel,
 			     guint32 command,
@@ -157,11 +245,13 @@ read_channel_handle_request (GVfsChannel *channel,
   switch (command)
     {
     case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_READ:
+      /* The client reads the oldest outstanding reply first, so a
+	 request arriving while we are ahead consumes a readahead. */
+      if (read_channel->readahead_count > 0)
+	read_channel->readahead_count--;
       read_channel->read_count++;
-      job = g_vfs_job_read_new (read_channel,
-				backend_handle,
-				modify_read_size (read_channel, arg1),
-				backend);
+      update_readahead (read_channel);
+      job = read_channel_start_read (read_channel, arg1);
       break;
     case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_CLOSE:
       job = g_vfs_job_close_read_new (read_channel,
@@ -174,7 +264,7 @@ read_channel_handle_request (GVfsChannel *channel,
       if (command == G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_SEEK_END)
 	seek_type = G_SEEK_END;
       
-      read_channel->read_count = 0;
+      reset_readahead (read_channel);
       read_channel->seek_generation++;
       job = g_vfs_job_seek_read_new (read_channel,
 				     backend_handle,
@@ -231,15 +321,21 @@ read_channel_readahead (GVfsChannel  *channel,
 	 reading the readahead data, and after that is done
 	 send a new request but start reading the result of the
 	 previous read request. This way the reading will be
-	 fully pipelined. */
+	 fully pipelined.
+
+	 readahead_count is the number of replies we are ahead of
+	 the client; it drops when a client read consumes one and is
+	 reset when a seek discards them. When the client is waiting
+	 on the backend update_readahead() widens the window and we
+	 queue more readaheads here, up to readahead_window replies
+	 ahead. */
       if (read_job->data_count != 0 &&
-	  read_channel->read_count == 2)
+	  read_channel->read_count >= 2 &&
+	  read_channel->readahead_count < read_channel->readahead_window)
 	{
 	  read_channel->read_count++;
-	  readahead_job = g_vfs_job_read_new (read_channel,
-					      g_vfs_channel_get_backend_handle (channel),
-					      modify_read_size (read_channel, 8192),
-					      g_vfs_channel_get_backend (channel));
+	  read_channel->readahead_count++;
+	  readahead_job = read_channel_start_read (read_channel, 8192);
 	}
     }
 
@@ -289,13 +385,18 @@ g_vfs_read_channel_send_closed (GVfsReadChannel *read_channel)
 void
 g_vfs_read_channel_send_data (GVfsReadChannel  *read_channel,
 			      char            *buffer,
-			      gsize            count)
+			      gsize            count,
+			      gint64           start_time)
 {
   GVfsDaemonSocketProtocolReply reply;
   GVfsChannel *channel;
 
   channel = G_VFS_CHANNEL (read_channel);
 
+  if (count > 0 && start_time != 0)
+    read_channel->read_latency = update_average (read_channel->read_latency,
+						 g_get_monotonic_time () - start_time);
+
   reply.type = g_htonl (G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_DATA);
   reply.seq_nr = g_htonl (g_vfs_channel_get_current_seq_nr (channel));
   reply.arg1 = g_htonl (count);
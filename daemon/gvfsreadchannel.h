@@ -51,7 +51,8 @@ GVfsReadChannel *g_vfs_read_channel_new                (GVfsBackend        *back
                                                         GPid                actual_consumer);
 void            g_vfs_read_channel_send_data          (GVfsReadChannel     *read_channel,
 						       char               *buffer,
-						       gsize               count);
+						       gsize               count,
+						       gint64              start_time);
 void            g_vfs_read_channel_send_closed        (GVfsReadChannel     *read_channel);
 void            g_vfs_read_channel_send_seek_offset   (GVfsReadChannel     *read_channel,
 						      goffset             offset);
@@ -44,6 +44,10 @@
 struct _GVfsWriteChannel
 {
   GVfsChannel parent_instance;
+
+  /* A write-behind request failed, later ones would land at the
+     wrong offsets */
+  gboolean write_behind_failed;
 };
 
 G_DEFINE_TYPE (GVfsWriteChannel, g_vfs_write_channel, G_VFS_TYPE_CHANNEL)
@@ -57,6 +61,8 @@ static GVfsJob *write_channel_handle_request (GVfsChannel  *channel,
 					      gpointer      data,
 					      gsize         data_len,
 					      GError      **error);
+static GVfsJob *write_channel_continue_request (GVfsChannel *channel,
+						GVfsJob     *job);
   
 static void
 g_vfs_write_channel_finalize (GObject *object)
@@ -74,6 +80,7 @@ g_vfs_write_channel_class_init (GVfsWriteChannelClass *klass)
   gobject_class->finalize = g_vfs_write_channel_finalize;
   channel_class->close = write_channel_close;
   channel_class->handle_request = write_channel_handle_request;
+  channel_class->continue_request = write_channel_continue_request;
 }
 
 static void
@@ -84,9 +91,15 @@ g_vfs_write_channel_init (GVfsWriteChannel *channel)
 static GVfsJob *
 write_channel_close (GVfsChannel *channel)
 {
-  return g_vfs_job_close_write_new (G_VFS_WRITE_CHANNEL (channel),
-				    g_vfs_channel_get_backend_handle (channel),
-				    g_vfs_channel_get_backend (channel));
+  GVfsJob *job;
+
+  job = g_vfs_job_close_write_new (G_VFS_WRITE_CHANNEL (channel),
+				   g_vfs_channel_get_backend_handle (channel),
+				   g_vfs_channel_get_backend (channel));
+  G_VFS_JOB_CLOSE_WRITE (job)->aborted =
+    G_VFS_WRITE_CHANNEL (channel)->write_behind_failed;
+
+  return job;
 } 
 
 static GVfsJob *
@@ -114,9 +127,16 @@ write_channel_handle_request (GVfsChannel *channel,
   switch (command)
     {
     case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_WRITE:
+      if (write_channel->write_behind_failed)
+	{
+	  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			       _("An earlier write failed"));
+	  break;
+	}
       job = g_vfs_job_write_new (write_channel,
 				 backend_handle,
 				 data, data_len,
+				 (arg2 & G_VFS_DAEMON_SOCKET_PROTOCOL_WRITE_FLAG_BEHIND) != 0,
 				 backend);
       data = NULL; /* Pass ownership */
       break;
@@ -124,6 +144,10 @@ write_channel_handle_request (GVfsChannel *channel,
       job = g_vfs_job_close_write_new (write_channel,
 				       backend_handle,
 				       backend);
+      /* Don't commit a file some of the writes to which failed */
+      G_VFS_JOB_CLOSE_WRITE (job)->aborted =
+	write_channel->write_behind_failed ||
+	(arg2 & G_VFS_DAEMON_SOCKET_PROTOCOL_CLOSE_FLAG_ABORT) != 0;
       break;
     case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_SEEK_END:
     case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_SEEK_SET:
@@ -159,6 +183,33 @@ write_channel_handle_request (GVfsChannel *channel,
   return job;
 }
 
+static GVfsJob *
+write_channel_continue_request (GVfsChannel *channel,
+				GVfsJob     *job)
+{
+  GVfsJobWrite *write_job;
+
+  if (!G_VFS_IS_JOB_WRITE (job))
+    return NULL;
+
+  write_job = G_VFS_JOB_WRITE (job);
+  if (write_job->write_behind && G_VFS_JOB (job)->failed)
+    G_VFS_WRITE_CHANNEL (channel)->write_behind_failed = TRUE;
+
+  if (!g_vfs_job_write_is_partial (write_job))
+    return NULL;
+
+  /* The client has already moved on to later requests, so we
+     must write the remaining data ourselves before any of them */
+  return g_vfs_job_write_new (G_VFS_WRITE_CHANNEL (channel),
+			      g_vfs_channel_get_backend_handle (channel),
+			      g_memdup (write_job->data + write_job->written_size,
+					write_job->data_size - write_job->written_size),
+			      write_job->data_size - write_job->written_size,
+			      TRUE,
+			      g_vfs_channel_get_backend (channel));
+}
+
 /* Might be called on an i/o thread
  */
 void
@@ -201,8 +252,12 @@ g_vfs_write_channel_send_closed (GVfsWriteChannel *write_channel,
  */
 void
 g_vfs_write_channel_send_written (GVfsWriteChannel  *write_channel,
-				  gsize bytes_written)
+				  gsize bytes_written,
+				  gboolean write_behind,
+				  gboolean partial)
 {
+  guint32 flags;
+
   GVfsDaemonSocketProtocolReply reply;
   GVfsChannel *channel;
 
@@ -211,7 +266,12 @@ g_vfs_write_channel_send_written (GVfsWriteChannel  *write_channel,
   reply.type = g_htonl (G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_WRITTEN);
   reply.seq_nr = g_htonl (g_vfs_channel_get_current_seq_nr (channel));
   reply.arg1 = g_htonl (bytes_written);
-  reply.arg2 = 0;
+  flags = 0;
+  if (write_behind)
+    flags |= G_VFS_DAEMON_SOCKET_PROTOCOL_WRITTEN_FLAG_BEHIND;
+  if (partial)
+    flags |= G_VFS_DAEMON_SOCKET_PROTOCOL_WRITTEN_FLAG_PARTIAL;
+  reply.arg2 = g_htonl (flags);
 
   g_vfs_channel_send_reply (channel, &reply, NULL, 0);
 }
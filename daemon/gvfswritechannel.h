@@ -50,7 +50,9 @@ GType g_vfs_write_channel_get_type (void) G_GNUC_CONST;
 GVfsWriteChannel *g_vfs_write_channel_new              (GVfsBackend      *backend,
                                                         GPid              actual_consumer);
 void              g_vfs_write_channel_send_written     (GVfsWriteChannel *write_channel,
-							gsize             bytes_written);
+							gsize             bytes_written,
+							gboolean          write_behind,
+							gboolean          partial);
 void              g_vfs_write_channel_send_closed      (GVfsWriteChannel *write_channel,
 							const char       *etag);
 void              g_vfs_write_channel_send_seek_offset (GVfsWriteChannel *write_channel,
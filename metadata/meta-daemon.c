@@ -33,11 +33,14 @@
 
 #define WRITEOUT_TIMEOUT_SECS 60
 #define WRITEOUT_TIMEOUT_SECS_NFS 15
+#define WRITEOUT_POLL_MSECS 200
 
 typedef struct {
   char *filename;
   MetaTree *tree;
   guint writeout_timeout;
+  gboolean writeout_running; /* background rewrite being polled */
+  gboolean writeout_again;   /* changes made while it was running */
 } TreeInfo;
 
 static GHashTable *tree_infos = NULL;
@@ -54,14 +57,44 @@ tree_info_free (TreeInfo *info)
   g_free (info);
 }
 
+static void tree_info_schedule_writeout (TreeInfo *info);
+
+static gboolean
+writeout_poll_timeout (gpointer data)
+{
+  TreeInfo *info = data;
+
+  if (!meta_tree_flush_finish (info->tree))
+    return TRUE;
+
+  info->writeout_timeout = 0;
+  info->writeout_running = FALSE;
+
+  if (info->writeout_again)
+    {
+      info->writeout_again = FALSE;
+      tree_info_schedule_writeout (info);
+    }
+
+  return FALSE;
+}
+
+/* Rewrites the tree in a thread, and polls for it to finish so the
+   main loop isn't blocked meanwhile */
 static gboolean
 writeout_timeout (gpointer data)
 {
   TreeInfo *info = data;
 
-  meta_tree_flush (info->tree);
   info->writeout_timeout = 0;
 
+  if (meta_tree_flush_start (info->tree))
+    {
+      info->writeout_running = TRUE;
+      info->writeout_timeout =
+        g_timeout_add (WRITEOUT_POLL_MSECS, writeout_poll_timeout, info);
+    }
+
   return FALSE;
 }
 
@@ -70,7 +103,9 @@ tree_info_schedule_writeout (TreeInfo *info)
 {
   gboolean on_nfs;
 
-  if (info->writeout_timeout == 0)
+  if (info->writeout_running)
+    info->writeout_again = TRUE;
+  else if (info->writeout_timeout == 0)
     {
       on_nfs = meta_tree_is_on_nfs (info->tree);
       info->writeout_timeout =
@@ -87,7 +122,12 @@ flush_single (const gchar *filename,
   if (info->writeout_timeout != 0)
     {
       g_source_remove (info->writeout_timeout);
-      writeout_timeout (info);
+      info->writeout_timeout = 0;
+      info->writeout_running = FALSE;
+      info->writeout_again = FALSE;
+
+      /* Waits for a running background rewrite */
+      meta_tree_flush (info->tree);
     }
 }
 
@@ -132,80 +172,78 @@ tree_info_lookup (const char *filename)
   return info;
 }
 
-static gboolean
-handle_set (GVfsMetadata *object,
-            GDBusMethodInvocation *invocation,
-            const gchar *arg_treefile,
-            const gchar *arg_path,
-            GVariant *arg_data,
-            GVfsMetadata *daemon)
+static void
+batch_add_data (MetaTreeBatch *batch,
+                const char *path,
+                GVariant *data)
 {
-  TreeInfo *info;
   const gchar *str;
   const gchar **strv;
   const gchar *key;
-  GError *error;
   GVariantIter iter;
   GVariant *value;
 
-  info = tree_info_lookup (arg_treefile);
-  if (info == NULL)
-    {
-      g_dbus_method_invocation_return_error (invocation,
-                                             G_IO_ERROR,
-                                             G_IO_ERROR_NOT_FOUND,
-                                             _("Can't find metadata file %s"),
-                                             arg_treefile);
-      return TRUE;
-    }
-
-  error = NULL;
-
-  g_variant_iter_init (&iter, arg_data);
+  g_variant_iter_init (&iter, data);
   while (g_variant_iter_next (&iter, "{&sv}", &key, &value))
     {
       if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING_ARRAY))
 	{
 	  /* stringv */
           strv = g_variant_get_strv (value, NULL);
-	  if (!meta_tree_set_stringv (info->tree, arg_path, key, (gchar **) strv))
-	    {
-	      g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                  _("Unable to set metadata key"));
-	    }
+	  meta_tree_batch_set_stringv (batch, path, key, (gchar **) strv);
 	  g_free (strv);
 	}
       else if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
 	{
 	  /* string */
           str = g_variant_get_string (value, NULL);
-	  if (!meta_tree_set_string (info->tree, arg_path, key, str))
-	    {
-              g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                   _("Unable to set metadata key"));
-	    }
+	  meta_tree_batch_set_string (batch, path, key, str);
 	}
       else if (g_variant_is_of_type (value, G_VARIANT_TYPE_BYTE))
 	{
 	  /* Unset */
-	  if (!meta_tree_unset (info->tree, arg_path, key))
-	    {
-              g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                   _("Unable to unset metadata key"));
-	    }
+	  meta_tree_batch_unset (batch, path, key);
 	}
       g_variant_unref (value);
     }
+}
+
+static gboolean
+handle_set (GVfsMetadata *object,
+            GDBusMethodInvocation *invocation,
+            const gchar *arg_treefile,
+            const gchar *arg_path,
+            GVariant *arg_data,
+            GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+  gboolean res;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
+    }
+
+  batch = meta_tree_batch_new ();
+  batch_add_data (batch, arg_path, arg_data);
+  res = meta_tree_apply_batch (info->tree, batch);
+  meta_tree_batch_free (batch);
 
   tree_info_schedule_writeout (info);
 
-  if (error)
+  if (!res)
     {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      g_error_free (error);
+      g_dbus_method_invocation_return_error_literal (invocation,
+                                                     G_IO_ERROR,
+                                                     G_IO_ERROR_FAILED,
+                                                     _("Unable to set metadata key"));
     }
   else
     {
@@ -215,6 +253,62 @@ handle_set (GVfsMetadata *object,
   return TRUE;
 }
 
+/* All changes go to the journal in one go and the tree is written out
+   once, instead of once per path as with separate Set calls */
+static gboolean
+handle_set_many (GVfsMetadata *object,
+                 GDBusMethodInvocation *invocation,
+                 const gchar *arg_treefile,
+                 GVariant *arg_data,
+                 GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+  const gchar *path;
+  GVariantIter iter;
+  GVariant *data;
+  gboolean res;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
+    }
+
+  batch = meta_tree_batch_new ();
+
+  g_variant_iter_init (&iter, arg_data);
+  while (g_variant_iter_next (&iter, "(^&ay@a{sv})", &path, &data))
+    {
+      batch_add_data (batch, path, data);
+      g_variant_unref (data);
+    }
+
+  res = meta_tree_apply_batch (info->tree, batch);
+  meta_tree_batch_free (batch);
+
+  tree_info_schedule_writeout (info);
+
+  if (!res)
+    {
+      g_dbus_method_invocation_return_error_literal (invocation,
+                                                     G_IO_ERROR,
+                                                     G_IO_ERROR_FAILED,
+                                                     _("Unable to set metadata key"));
+    }
+  else
+    {
+      gvfs_metadata_complete_set_many (object, invocation);
+    }
+
+  return TRUE;
+}
+
 static void
 append_key (GVariantBuilder *builder,
 	    MetaTree *tree,
@@ -253,6 +347,42 @@ enum_keys (const char *key,
   return TRUE;
 }
 
+static GVariant *
+get_keys (MetaTree *tree,
+          const char *path,
+          const gchar *const *keys)
+{
+  GPtrArray *meta_keys;
+  gboolean free_keys;
+  gchar **iter_keys;
+  gchar **i;
+  GVariantBuilder builder;
+
+  if (keys == NULL)
+    {
+      /* Get all keys */
+      free_keys = TRUE;
+      meta_keys = g_ptr_array_new ();
+      meta_tree_enumerate_keys (tree, path, enum_keys, meta_keys);
+      g_ptr_array_add (meta_keys, NULL);
+      iter_keys = (gchar **) g_ptr_array_free (meta_keys, FALSE);
+    }
+  else
+    {
+      free_keys = FALSE;
+      iter_keys = (gchar **) keys;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+
+  for (i = iter_keys; *i; i++)
+    append_key (&builder, tree, path, *i);
+  if (free_keys)
+    g_strfreev (iter_keys);
+
+  return g_variant_builder_end (&builder);
+}
+
 static gboolean
 handle_get (GVfsMetadata *object,
             GDBusMethodInvocation *invocation,
@@ -262,11 +392,6 @@ handle_get (GVfsMetadata *object,
             GVfsMetadata *daemon)
 {
   TreeInfo *info;
-  GPtrArray *meta_keys;
-  gboolean free_keys;
-  gchar **iter_keys;
-  gchar **i;
-  GVariantBuilder *builder;
 
   info = tree_info_lookup (arg_treefile);
   if (info == NULL)
@@ -279,30 +404,44 @@ handle_get (GVfsMetadata *object,
       return TRUE;
     }
 
-  if (arg_keys == NULL)
-    {
-      /* Get all keys */
-      free_keys = TRUE;
-      meta_keys = g_ptr_array_new ();
-      meta_tree_enumerate_keys (info->tree, arg_path, enum_keys, meta_keys);
-      iter_keys = (gchar **) g_ptr_array_free (meta_keys, FALSE);
-    }
-  else
+  gvfs_metadata_complete_get (object, invocation,
+                              get_keys (info->tree, arg_path, arg_keys));
+
+  return TRUE;
+}
+
+/* Replies with one dictionary per path, in the order of the paths */
+static gboolean
+handle_get_many (GVfsMetadata *object,
+                 GDBusMethodInvocation *invocation,
+                 const gchar *arg_treefile,
+                 const gchar *const *arg_paths,
+                 const gchar *const *arg_keys,
+                 GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  GVariantBuilder builder;
+  const gchar *const *path;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
     {
-      free_keys = FALSE;
-      iter_keys = (gchar **) arg_keys;
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
     }
 
-  builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
 
-  for (i = iter_keys; *i; i++)
-    append_key (builder, info->tree, arg_path, *i);
-  if (free_keys)
-    g_strfreev (iter_keys);
-  
-  gvfs_metadata_complete_get (object, invocation,
-                              g_variant_builder_end (builder));
-  g_variant_builder_unref (builder);
+  for (path = arg_paths; *path; path++)
+    g_variant_builder_add_value (&builder,
+                                 get_keys (info->tree, *path, arg_keys));
+
+  gvfs_metadata_complete_get_many (object, invocation,
+                                   g_variant_builder_end (&builder));
 
   return TRUE;
 }
@@ -430,6 +569,8 @@ on_name_acquired (GDBusConnection *connection,
   g_signal_connect (skeleton, "handle-set", G_CALLBACK (handle_set), skeleton);
   g_signal_connect (skeleton, "handle-unset", G_CALLBACK (handle_unset), skeleton);
   g_signal_connect (skeleton, "handle-get", G_CALLBACK (handle_get), skeleton);
+  g_signal_connect (skeleton, "handle-set-many", G_CALLBACK (handle_set_many), skeleton);
+  g_signal_connect (skeleton, "handle-get-many", G_CALLBACK (handle_get_many), skeleton);
   g_signal_connect (skeleton, "handle-remove", G_CALLBACK (handle_remove), skeleton);
   g_signal_connect (skeleton, "handle-move", G_CALLBACK (handle_move), skeleton);
 
@@ -47,8 +47,11 @@
 #endif
 
 
-#define MAJOR_VERSION 1
+#define MAJOR_VERSION 2
 #define MINOR_VERSION 0
+#define V1_MAJOR_VERSION 1
+/* v1 trees with a path index, readers before it only check the major */
+#define V1_INDEXED_MINOR_VERSION 1
 #define MAJOR_JOURNAL_VERSION 1
 #define MINOR_JOURNAL_VERSION 0
 #define NEW_JOURNAL_SIZE (32*1024)
@@ -57,6 +60,15 @@
 #define ROTATED_OFFSET 8
 
 #define KEY_IS_LIST_MASK (1<<31)
+/* v2 stores keyword ids in 16 bits, trees with more keywords are
+   written as v1 even if v2 was asked for */
+#define KEY16_IS_LIST_MASK (1<<15)
+#define MAX_KEY16_KEYWORDS KEY16_IS_LIST_MASK
+
+#define CACHE_LINE_SIZE 64
+#define PATH_SLOT_SIZE 32
+#define PATH_SLOT_NAME_LEN 19
+#define NO_PARENT_SLOT 0xffffffff
 
 MetaBuilder *
 meta_builder_new (void)
@@ -493,6 +505,21 @@ append_uint32 (GString *s, guint32 val, guint32 *offset)
   return s;
 }
 
+static GString *
+append_uint16 (GString *s, guint16 val)
+{
+  union {
+    guint16 as_int;
+    char as_bytes[2];
+  } u;
+
+  u.as_int = GUINT16_TO_BE (val);
+
+  g_string_append_len (s, u.as_bytes, 2);
+
+  return s;
+}
+
 static GString *
 append_time_t (GString *s, gint64 val, MetaBuilder *builder)
 {
@@ -693,14 +720,29 @@ stringv_block_end (GString *out,
     g_string_append_c (out, 0);
 }
 
+static gboolean
+metafile_is_stored (MetaFile *file)
+{
+  /* No mtime, children or metadata, no need for this
+     to be in the file */
+  return
+    file->last_changed != 0 ||
+    file->children != NULL ||
+    file->data != NULL;
+}
+
+/* If indexed is not NULL, the written children are added to it in
+   breadth first order, see write_path_index() */
 static void
 write_children (GString *out,
-		MetaBuilder *builder)
+		MetaBuilder *builder,
+		GPtrArray *indexed)
 {
   GHashTable *strings;
   MetaFile *child, *file;
   GList *l;
   GList *files;
+  guint32 num_children;
 
   files = g_list_prepend (NULL, builder->root);
 
@@ -717,24 +759,36 @@ write_children (GString *out,
       if (file->children_pointer != 0)
 	set_uint32 (out, file->children_pointer, out->len);
 
-      append_uint32 (out, g_list_length (file->children), NULL);
+      num_children = 0;
+      for (l = file->children; l != NULL; l = l->next)
+	{
+	  if (metafile_is_stored (l->data))
+	    num_children++;
+	}
+      append_uint32 (out, num_children, NULL);
 
       for (l = file->children; l != NULL; l = l->next)
 	{
 	  child = l->data;
 
-	  /* No mtime, children or metadata, no need for this
-	     to be in the file */
-	  if (child->last_changed == 0 &&
-	      child->children == NULL &&
-	      child->data == NULL)
+	  if (!metafile_is_stored (child))
 	    continue;
 
+	  child->dirent_pointer = out->len;
 	  append_string (out, child->name, strings);
 	  append_uint32 (out, 0, &child->children_pointer);
 	  append_uint32 (out, 0, &child->metadata_pointer);
 	  append_time_t (out, child->last_changed, builder);
 
+	  if (indexed)
+	    {
+	      child->path_hash = meta_builder_hash_path (file->path_hash,
+							 child->name,
+							 strlen (child->name));
+	      child->path_parent = file == builder->root ? NULL : file;
+	      g_ptr_array_add (indexed, child);
+	    }
+
 	  if (file->children)
 	    files = g_list_append (files, child);
 	}
@@ -743,12 +797,101 @@ write_children (GString *out,
     }
 }
 
+/* The path index is an open addressing hash table (linear probing)
+ * over all entries but the root, keyed by the hash of the full path.
+ * Each slot links to the slot of its parent and has short names
+ * inline, so a lookup can verify the whole path from the index alone.
+ */
+static void
+write_path_index (GString *out,
+		  GPtrArray *indexed,
+		  guint32 path_index_pointer,
+		  guint32 num_path_slots_pointer)
+{
+  static const char empty_slot[PATH_SLOT_SIZE] = { 0 };
+  MetaFile **slots;
+  MetaFile *file;
+  guint32 num_slots, mask, slot, i;
+  gsize name_len;
+  char name[PATH_SLOT_NAME_LEN];
+
+  if (indexed->len == 0)
+    return;
+
+  /* Keep the load factor at or below 1/2 */
+  num_slots = 8;
+  while (num_slots < indexed->len * 2)
+    num_slots *= 2;
+  mask = num_slots - 1;
+
+  slots = g_new0 (MetaFile *, num_slots);
+  for (i = 0; i < indexed->len; i++)
+    {
+      file = g_ptr_array_index (indexed, i);
+      slot = file->path_hash & mask;
+      while (slots[slot] != NULL)
+	slot = (slot + 1) & mask;
+      slots[slot] = file;
+      file->path_slot = slot;
+    }
+
+  /* Start on a cache line, so two slots share a line */
+  while (out->len % CACHE_LINE_SIZE != 0)
+    g_string_append_c (out, 0);
+
+  set_uint32 (out, path_index_pointer, out->len);
+  set_uint32 (out, num_path_slots_pointer, num_slots);
+
+  for (slot = 0; slot < num_slots; slot++)
+    {
+      file = slots[slot];
+      if (file == NULL)
+	{
+	  /* hash 0 marks an unused slot */
+	  g_string_append_len (out, empty_slot, PATH_SLOT_SIZE);
+	  continue;
+	}
+
+      append_uint32 (out, file->path_hash, NULL);
+      append_uint32 (out, file->dirent_pointer, NULL);
+      append_uint32 (out, file->path_parent ?
+		     file->path_parent->path_slot : NO_PARENT_SLOT, NULL);
+
+      /* Longer names are only in the dirent, marked by length 0 */
+      memset (name, 0, sizeof (name));
+      name_len = strlen (file->name);
+      if (name_len <= PATH_SLOT_NAME_LEN)
+	memcpy (name, file->name, name_len);
+      else
+	name_len = 0;
+      g_string_append_c (out, name_len);
+      g_string_append_len (out, name, PATH_SLOT_NAME_LEN);
+    }
+
+  g_free (slots);
+}
+
+static void
+write_metadata_value (GString *out,
+		      MetaData *data,
+		      GList **stringvs,
+		      GHashTable *strings)
+{
+  if (data->is_list)
+    append_stringv (out, data->values, stringvs);
+  else
+    append_string (out, data->value, strings);
+}
+
+/* v1 interleaves 32bit keys and values, v2 has all 16bit keys
+   first so looking up a key touches only the key array */
 static void
 write_metadata_for_file (GString *out,
 			 MetaFile *file,
 			 GList **stringvs,
 			 GHashTable *strings,
-			 GHashTable *key_hash)
+			 GHashTable *key_hash,
+			 gboolean v2)
 {
   GList *l;
   MetaData *data;
@@ -764,20 +907,37 @@ write_metadata_for_file (GString *out,
       data = l->data;
 
       key = GPOINTER_TO_UINT (g_hash_table_lookup (key_hash, data->key));
-      if (data->is_list)
-	key |= KEY_IS_LIST_MASK;
-      append_uint32 (out, key, NULL);
-      if (data->is_list)
-	append_stringv (out, data->values, stringvs);
+      if (v2)
+	{
+	  if (data->is_list)
+	    key |= KEY16_IS_LIST_MASK;
+	  append_uint16 (out, key);
+	}
       else
-	append_string (out, data->value, strings);
+	{
+	  if (data->is_list)
+	    key |= KEY_IS_LIST_MASK;
+	  append_uint32 (out, key, NULL);
+	  write_metadata_value (out, data, stringvs, strings);
+	}
+    }
+
+  if (v2)
+    {
+      /* Pad to 32bit */
+      while (out->len % 4 != 0)
+	g_string_append_c (out, 0);
+
+      for (l = file->data; l != NULL; l = l->next)
+	write_metadata_value (out, l->data, stringvs, strings);
     }
 }
 
 static void
 write_metadata (GString *out,
 		MetaBuilder *builder,
-		GHashTable *key_hash)
+		GHashTable *key_hash,
+		gboolean v2)
 {
   GHashTable *strings;
   GList *stringvs;
@@ -791,7 +951,7 @@ write_metadata (GString *out,
       strings = string_block_begin ();
       stringvs = stringv_block_begin ();
       write_metadata_for_file (out, builder->root,
-			       &stringvs, strings, key_hash);
+			       &stringvs, strings, key_hash, v2);
       stringv_block_end (out, strings, stringvs);
       string_block_end (out, strings);
     }
@@ -816,7 +976,7 @@ write_metadata (GString *out,
 
 	  if (child->data != NULL)
 	    write_metadata_for_file (out, child,
-				     &stringvs, strings, key_hash);
+				     &stringvs, strings, key_hash, v2);
 
 	  if (child->children != NULL)
 	    files = g_list_append (files, child);
@@ -864,6 +1024,23 @@ write_all_data_and_close (int fd, char *data, gsize len)
   return res;
 }
 
+/* FNV-1a over "/" and the name, continuing from the hash of the
+   parent path. Never 0, which marks unused path index slots. */
+guint32
+meta_builder_hash_path (guint32     parent_hash,
+			const char *name,
+			gsize       name_len)
+{
+  guint32 hash;
+  gsize i;
+
+  hash = (parent_hash ^ '/') * 16777619U;
+  for (i = 0; i < name_len; i++)
+    hash = (hash ^ (guchar) name[i]) * 16777619U;
+
+  return hash != 0 ? hash : 1;
+}
+
 gboolean
 meta_builder_is_on_nfs (const char *filename)
 {
@@ -972,6 +1149,20 @@ meta_builder_get_journal_filename (const char *tree_filename, guint32 random_tag
 
 gboolean
 meta_builder_create_new_journal (const char *filename, guint32 random_tag)
+{
+  return meta_builder_create_journal (filename, random_tag, 0, NULL, 0, 0);
+}
+
+/* Creates a journal of at least size bytes (NEW_JOURNAL_SIZE if smaller)
+   that already contains the num_entries entries in entries, which must
+   be complete journal entries, e.g. copied from an older journal. */
+gboolean
+meta_builder_create_journal (const char *filename,
+			     guint32     random_tag,
+			     gsize       size,
+			     const char *entries,
+			     gsize       entries_len,
+			     guint32     num_entries)
 {
   char *journal_name;
   guint32 size_offset;
@@ -997,11 +1188,19 @@ meta_builder_create_new_journal (const char *filename, guint32 random_tag)
 
   append_uint32 (out, random_tag, NULL);
   append_uint32 (out, 0, &size_offset);
-  append_uint32 (out, 0, NULL); /* Num entries, none so far */
+  append_uint32 (out, num_entries, NULL);
+
+  if (entries_len > 0)
+    g_string_append_len (out, entries, entries_len);
 
   pos = out->len;
 
-  g_string_set_size (out, NEW_JOURNAL_SIZE);
+  size = MAX (size, NEW_JOURNAL_SIZE);
+  /* Always leave room for more entries */
+  size = MAX (size, pos + NEW_JOURNAL_SIZE / 2);
+  size = (size + 3) & ~3;
+
+  g_string_set_size (out, size);
   memset (out->str + pos, 0, out->len - pos);
 
   set_uint32 (out, size_offset, out->len);
@@ -1016,6 +1215,16 @@ meta_builder_create_new_journal (const char *filename, guint32 random_tag)
   return res;
 }
 
+/* gvfs versions before v2 can't read v2 trees and would lose their
+   metadata, so v2 is only written when GVFS_METADATA_TREE_V2=1 is set.
+   v1 trees get the path index as well, as minor version 1, which older
+   readers accept and ignore. */
+static gboolean
+want_v2_format (void)
+{
+  return g_strcmp0 (g_getenv ("GVFS_METADATA_TREE_V2"), "1") == 0;
+}
+
 static GString *
 metadata_create_static (MetaBuilder *builder,
 			guint32 *random_tag_out)
@@ -1026,11 +1235,27 @@ metadata_create_static (MetaBuilder *builder,
   char *key;
   GList *keys, *l;
   GHashTable *strings;
+  GPtrArray *indexed;
   guint32 index;
   guint32 attributes_pointer;
+  guint32 path_index_pointer, num_path_slots_pointer;
   gint64 time_t_min;
   gint64 time_t_max;
   guint32 random_tag, root_name;
+  gboolean v2;
+
+  /* Collect and sort all used keys */
+  hash = g_hash_table_new (g_str_hash, g_str_equal);
+  metafile_collect_keywords (builder->root, hash);
+  g_hash_table_iter_init (&iter, hash);
+  keys = NULL;
+  while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
+    keys = g_list_prepend (keys, key);
+  g_hash_table_destroy (hash);
+  keys = g_list_sort (keys, (GCompareFunc)strcmp);
+
+  v2 = want_v2_format () && g_list_length (keys) <= MAX_KEY16_KEYWORDS;
+  path_index_pointer = num_path_slots_pointer = 0;
 
   out = g_string_new (NULL);
 
@@ -1043,8 +1268,8 @@ metadata_create_static (MetaBuilder *builder,
   g_string_append_c (out, 'a');
 
   /* VERSION */
-  g_string_append_c (out, MAJOR_VERSION);
-  g_string_append_c (out, MINOR_VERSION);
+  g_string_append_c (out, v2 ? MAJOR_VERSION : V1_MAJOR_VERSION);
+  g_string_append_c (out, v2 ? MINOR_VERSION : V1_INDEXED_MINOR_VERSION);
 
   append_uint32 (out, 0, NULL); /* Rotated */
   random_tag = g_random_int ();
@@ -1069,15 +1294,9 @@ metadata_create_static (MetaBuilder *builder,
   builder->time_t_base = time_t_min;
   append_int64 (out, builder->time_t_base);
 
-  /* Collect and sort all used keys */
-  hash = g_hash_table_new (g_str_hash, g_str_equal);
-  metafile_collect_keywords (builder->root, hash);
-  g_hash_table_iter_init (&iter, hash);
-  keys = NULL;
-  while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
-    keys = g_list_prepend (keys, key);
-  g_hash_table_destroy (hash);
-  keys = g_list_sort (keys, (GCompareFunc)strcmp);
+  /* Path index, 0 if there is none */
+  append_uint32 (out, 0, &path_index_pointer);
+  append_uint32 (out, 0, &num_path_slots_pointer);
 
   /* Write keys to file and collect mapping for keys */
   set_uint32 (out, attributes_pointer, out->len);
@@ -1115,8 +1334,15 @@ metadata_create_static (MetaBuilder *builder,
   while (out->len % 4 != 0)
     g_string_append_c (out, 0);
 
-  write_children (out, builder);
-  write_metadata (out, builder, key_hash);
+  builder->root->path_hash = META_PATH_HASH_ROOT;
+  indexed = g_ptr_array_new ();
+
+  write_children (out, builder, indexed);
+  write_metadata (out, builder, key_hash, v2);
+
+  write_path_index (out, indexed,
+		    path_index_pointer, num_path_slots_pointer);
+  g_ptr_array_free (indexed, TRUE);
 
   g_hash_table_destroy (key_hash);
   g_list_free (keys);
@@ -1124,26 +1350,60 @@ metadata_create_static (MetaBuilder *builder,
   return out;
 }
 
-gboolean
-meta_builder_write (MetaBuilder *builder,
-		    const char *filename)
+/* Writes the tree to a temporary file next to filename and returns its
+   name, the file is put in place by meta_builder_write_commit(). This
+   is the expensive part of writing a tree and doesn't touch filename or
+   its journal, so it can run while the old tree is still in use. */
+char *
+meta_builder_write_tmp (MetaBuilder *builder,
+			const char  *filename,
+			guint32     *random_tag)
 {
   GString *out;
-  guint32 random_tag;
-  int fd, fd2, fd_dir;
-  char *tmp_name, *dirname;
+  int fd;
+  char *tmp_name;
 
-  out = metadata_create_static (builder, &random_tag);
+  out = metadata_create_static (builder, random_tag);
 
   tmp_name = g_strdup_printf ("%s.XXXXXX", filename);
   fd = g_mkstemp (tmp_name);
   if (fd == -1)
-    goto out;
+    goto err;
 
   if (!write_all_data_and_close (fd, out->str, out->len))
-    goto out;
+    {
+      g_unlink (tmp_name);
+      goto err;
+    }
 
-  if (!meta_builder_create_new_journal (filename, random_tag))
+  g_string_free (out, TRUE);
+  return tmp_name;
+
+ err:
+  g_string_free (out, TRUE);
+  g_free (tmp_name);
+  return NULL;
+}
+
+/* Replaces filename with tmp_name from meta_builder_write_tmp(), with a
+   new journal of journal_size bytes that starts out with the given
+   entries, and marks the old tree as rotated. tmp_name is removed on
+   failure. */
+gboolean
+meta_builder_write_commit (const char *filename,
+			   const char *tmp_name,
+			   guint32     random_tag,
+			   gsize       journal_size,
+			   const char *journal_entries,
+			   gsize       journal_entries_len,
+			   guint32     num_journal_entries)
+{
+  int fd2, fd_dir;
+  char *dirname;
+
+  if (!meta_builder_create_journal (filename, random_tag, journal_size,
+				    journal_entries, journal_entries_len,
+				    num_journal_entries))
     goto out;
 
   /* Open old file so we can set it rotated */
@@ -1188,14 +1448,28 @@ meta_builder_write (MetaBuilder *builder,
 	}
     }
 
-  g_string_free (out, TRUE);
-  g_free (tmp_name);
   return TRUE;
 
  out:
-  if (fd != -1)
-    g_unlink (tmp_name);
-  g_string_free (out, TRUE);
-  g_free (tmp_name);
+  g_unlink (tmp_name);
   return FALSE;
 }
+
+gboolean
+meta_builder_write (MetaBuilder *builder,
+		    const char *filename)
+{
+  char *tmp_name;
+  guint32 random_tag;
+  gboolean res;
+
+  tmp_name = meta_builder_write_tmp (builder, filename, &random_tag);
+  if (tmp_name == NULL)
+    return FALSE;
+
+  res = meta_builder_write_commit (filename, tmp_name, random_tag,
+				   0, NULL, 0, 0);
+  g_free (tmp_name);
+
+  return res;
+}
@@ -29,6 +29,9 @@ typedef struct _MetaBuilder MetaBuilder;
 typedef struct _MetaFile MetaFile;
 typedef struct _MetaData MetaData;
 
+/* Hash of "/", see meta_builder_hash_path() */
+#define META_PATH_HASH_ROOT 2166136261U
+
 struct _MetaBuilder {
   MetaFile *root;
 
@@ -44,6 +47,12 @@ struct _MetaFile {
 
   guint32 metadata_pointer;
   guint32 children_pointer;
+
+  /* Path index, v2 format only */
+  guint32 dirent_pointer;
+  guint32 path_hash;
+  guint32 path_slot;
+  MetaFile *path_parent; /* NULL below the root */
 };
 
 struct _MetaData {
@@ -68,11 +77,30 @@ void         meta_builder_copy      (MetaBuilder *builder,
 				     guint64      mtime);
 gboolean     meta_builder_write     (MetaBuilder *builder,
 				     const char  *filename);
+char *       meta_builder_write_tmp (MetaBuilder *builder,
+				     const char  *filename,
+				     guint32     *random_tag);
+gboolean     meta_builder_write_commit (const char *filename,
+				     const char  *tmp_name,
+				     guint32      random_tag,
+				     gsize        journal_size,
+				     const char  *journal_entries,
+				     gsize        journal_entries_len,
+				     guint32      num_journal_entries);
 gboolean     meta_builder_create_new_journal (const char *filename,
 				     guint32      random_tag);
+gboolean     meta_builder_create_journal (const char *filename,
+				     guint32      random_tag,
+				     gsize        size,
+				     const char  *entries,
+				     gsize        entries_len,
+				     guint32      num_entries);
 char *       meta_builder_get_journal_filename (const char *tree_filename,
 				     guint32      random_tag);
 gboolean     meta_builder_is_on_nfs (const char  *filename);
+guint32      meta_builder_hash_path (guint32      parent_hash,
+				     const char  *name,
+				     gsize        name_len);
 MetaFile *   metafile_new           (const char  *name,
 				     MetaFile    *parent);
 void         metafile_free          (MetaFile    *file);
@@ -22,14 +22,31 @@
 
 #define MAGIC "\xda\x1ameta"
 #define MAGIC_LEN 6
-#define MAJOR_VERSION 1
+#define MAJOR_VERSION 2
 #define MINOR_VERSION 0
+#define V1_MAJOR_VERSION 1
+/* v1 trees with a path index, readers before it only check the major */
+#define V1_INDEXED_MINOR_VERSION 1
 #define JOURNAL_MAGIC "\xda\x1ajour"
 #define JOURNAL_MAGIC_LEN 6
 #define JOURNAL_MAJOR_VERSION 1
 #define JOURNAL_MINOR_VERSION 0
 
 #define KEY_IS_LIST_MASK (1<<31)
+#define KEY16_IS_LIST_MASK (1<<15)
+
+#define PATH_SLOT_NAME_LEN 19
+#define NO_PARENT_SLOT 0xffffffff
+/* Deeper paths are looked up by walking the tree */
+#define MAX_INDEXED_DEPTH 64
+
+/* Start rewriting the tree in the background once the journal is this
+   full, writers keep appending to the rest of it meanwhile */
+#define JOURNAL_COMPACT_THRESHOLD(len) ((len) / 4 * 3)
+/* The journal of a rewritten tree is sized relative to the tree, so
+   the number of journal bytes between rewrites grows with their cost */
+#define JOURNAL_SIZE_TREE_RATIO 8
+#define MAX_JOURNAL_SIZE (1024*1024)
 
 static GRWLock metatree_lock;
 
@@ -52,6 +69,21 @@ typedef struct {
   guint64 time_t_base;
 } MetaFileHeader;
 
+/* Header of v2 and of v1.1 trees */
+typedef struct {
+  MetaFileHeader base;
+  guint32 path_index;
+  guint32 num_path_slots;
+} MetaFileHeaderV2;
+
+typedef struct {
+  guint32 hash;   /* 0 => unused slot */
+  guint32 dirent;
+  guint32 parent; /* slot of the parent, NO_PARENT_SLOT below the root */
+  guchar name_len; /* 0 => name too long to be inline */
+  char name[PATH_SLOT_NAME_LEN];
+} MetaFilePathSlot;
+
 typedef struct {
   guint32 name;
   guint32 children;
@@ -74,6 +106,8 @@ typedef struct {
   guint32 value;
 } MetaFileDataEnt;
 
+/* In v2 the keys are an array of 16bit keyword ids, padded to 32bit,
+   followed by an array of values */
 typedef struct {
   guint32 num_keys;
   MetaFileDataEnt keys[1];
@@ -108,8 +142,32 @@ typedef struct {
   MetaJournalEntry *last_entry;
 
   gboolean journal_valid; /* True if all entries validated on open */
+
+  /* Index of the validated entries, each value is a GArray of
+     MetaJournalEntry pointers in journal order */
+  GHashTable *key_index;      /* path => set/setv/unset entries for path */
+  GHashTable *path_op_index;  /* path => copy/remove entries for path */
+  GHashTable *children_index; /* path => entries for paths below path */
 } MetaJournal;
 
+typedef enum {
+  COMPACTION_RUNNING,
+  COMPACTION_DONE,
+  COMPACTION_ABANDONED  /* the thread frees the compaction itself */
+} MetaTreeCompactionState;
+
+typedef struct {
+  MetaTree *snapshot;  /* private read-only copy of the tree and journal */
+  guint32 tag;         /* tag of the tree being rewritten */
+  guint32 num_entries; /* journal entries included in the rewrite */
+  gsize journal_pos;   /* offset of the first entry not included */
+
+  GThread *thread;
+  volatile gint state; /* MetaTreeCompactionState */
+  char *tmp_name;      /* the rewritten tree, NULL on failure */
+  guint32 random_tag;
+} MetaTreeCompaction;
+
 struct _MetaTree {
   volatile guint ref_count;
   char *filename;
@@ -123,13 +181,18 @@ struct _MetaTree {
 
   guint32 tag;
   gint64 time_t_base;
+  guchar major;
   MetaFileHeader *header;
   MetaFileDirEnt *root;
+  MetaFilePathSlot *path_slots; /* v2 path index, may be NULL */
+  guint32 num_path_slots;
 
   int num_attributes;
   char **attributes;
 
   MetaJournal *journal;
+
+  MetaTreeCompaction *compaction; /* background rewrite in progress */
 };
 
 static void         meta_tree_refresh_locked   (MetaTree    *tree,
@@ -140,6 +203,7 @@ static MetaJournal *meta_journal_open          (MetaTree    *tree,
 						guint32      tag);
 static void         meta_journal_free          (MetaJournal *journal);
 static void         meta_journal_validate_more (MetaJournal *journal);
+static void         meta_tree_compaction_abort (MetaTree    *tree);
 
 static gpointer
 verify_block_pointer (MetaTree *tree, guint32 pos, guint32 len)
@@ -180,10 +244,28 @@ verify_children_block (MetaTree *tree, guint32 pos)
   return verify_array_block (tree, pos, sizeof (MetaFileDirEnt));
 }
 
+static gsize
+get_metadata_keys_size (MetaTree *tree, guint32 num_keys)
+{
+  if (tree->major == V1_MAJOR_VERSION)
+    return num_keys * sizeof (MetaFileDataEnt);
+
+  return ((num_keys * sizeof (guint16) + 3) & ~3) + num_keys * sizeof (guint32);
+}
+
 static gpointer
 verify_metadata_block (MetaTree *tree, guint32 pos)
 {
-  return verify_array_block (tree, pos, sizeof (MetaFileDataEnt));
+  guint32 *nump, num;
+
+  nump = verify_block_pointer (tree, pos, sizeof (guint32));
+  if (nump == NULL)
+    return NULL;
+
+  num = GUINT32_FROM_BE (*nump);
+
+  return verify_block_pointer (tree, pos,
+			       sizeof (guint32) + get_metadata_keys_size (tree, num));
 }
 
 static char *
@@ -211,6 +293,8 @@ verify_string (MetaTree *tree, guint32 pos)
 static void
 meta_tree_clear (MetaTree *tree)
 {
+  meta_tree_compaction_abort (tree);
+
   if (tree->journal)
     {
       meta_journal_free (tree->journal);
@@ -223,8 +307,11 @@ meta_tree_clear (MetaTree *tree)
 
   tree->tag = 0;
   tree->time_t_base = 0;
+  tree->major = 0;
   tree->header = NULL;
   tree->root = NULL;
+  tree->path_slots = NULL;
+  tree->num_path_slots = 0;
 
   if (tree->data)
     {
@@ -399,9 +486,38 @@ meta_tree_init (MetaTree *tree)
   if (memcmp (tree->header->magic, MAGIC, MAGIC_LEN) != 0)
     goto err;
 
-  if (tree->header->major != MAJOR_VERSION)
+  tree->major = tree->header->major;
+  if (tree->major != MAJOR_VERSION &&
+      tree->major != V1_MAJOR_VERSION)
     goto err;
 
+  if (tree->major == MAJOR_VERSION ||
+      tree->header->minor >= V1_INDEXED_MINOR_VERSION)
+    {
+      MetaFileHeaderV2 *header_v2;
+      guint32 num_slots;
+
+      if (tree->len < sizeof (MetaFileHeaderV2))
+	goto err;
+
+      header_v2 = (MetaFileHeaderV2 *)tree->header;
+      num_slots = GUINT32_FROM_BE (header_v2->num_path_slots);
+
+      /* Must be a power of two, see write_path_index() */
+      if (num_slots != 0)
+	{
+	  if ((num_slots & (num_slots - 1)) != 0 ||
+	      num_slots > G_MAXUINT32 / sizeof (MetaFilePathSlot))
+	    goto err;
+
+	  tree->path_slots = verify_block_pointer (tree, header_v2->path_index,
+						   num_slots * sizeof (MetaFilePathSlot));
+	  if (tree->path_slots == NULL)
+	    goto err;
+	  tree->num_path_slots = num_slots;
+	}
+    }
+
   tree->root = verify_block_pointer (tree, tree->header->root, sizeof (MetaFileDirEnt));
   if (tree->root == NULL)
     goto err;
@@ -446,6 +562,8 @@ meta_tree_open (const char *filename,
   MetaTree *tree;
 
   g_assert (sizeof (MetaFileHeader) == 32);
+  g_assert (sizeof (MetaFileHeaderV2) == 40);
+  g_assert (sizeof (MetaFilePathSlot) == 32);
   g_assert (sizeof (MetaFileDirEnt) == 16);
   g_assert (sizeof (MetaFileDataEnt) == 8);
 
@@ -677,6 +795,132 @@ dir_lookup_path (MetaTree *tree,
   return dir_lookup_path (tree, dirent, end_path);
 }
 
+static gboolean
+path_slot_has_name (MetaTree *tree,
+		    MetaFilePathSlot *slot,
+		    const char *name,
+		    gsize name_len)
+{
+  MetaFileDirEnt *dirent;
+  char *dirent_name;
+
+  if (slot->name_len != 0)
+    return
+      slot->name_len == name_len &&
+      memcmp (slot->name, name, name_len) == 0;
+
+  /* Short names are always inline */
+  if (name_len <= PATH_SLOT_NAME_LEN)
+    return FALSE;
+
+  dirent = verify_block_pointer (tree, slot->dirent, sizeof (MetaFileDirEnt));
+  if (dirent == NULL)
+    return FALSE;
+
+  dirent_name = verify_string (tree, dirent->name);
+  return
+    dirent_name != NULL &&
+    strncmp (dirent_name, name, name_len) == 0 &&
+    dirent_name[name_len] == 0;
+}
+
+/* Checks slot and its parent slots against the first depth + 1 path
+   elements */
+static gboolean
+path_slot_matches (MetaTree *tree,
+		   MetaFilePathSlot *slot,
+		   const char **names,
+		   const gsize *name_lens,
+		   const guint32 *hashes,
+		   int depth)
+{
+  guint32 parent;
+
+  while (TRUE)
+    {
+      if (GUINT32_FROM_BE (slot->hash) != hashes[depth] ||
+	  !path_slot_has_name (tree, slot, names[depth], name_lens[depth]))
+	return FALSE;
+
+      parent = GUINT32_FROM_BE (slot->parent);
+      if (depth == 0)
+	return parent == NO_PARENT_SLOT;
+
+      if (parent >= tree->num_path_slots)
+	return FALSE;
+
+      slot = &tree->path_slots[parent];
+      depth--;
+    }
+}
+
+/* Returns FALSE if the path is too deep for the index */
+static gboolean
+path_index_lookup (MetaTree *tree,
+		   const char *path,
+		   MetaFileDirEnt **dirent_out)
+{
+  const char *names[MAX_INDEXED_DEPTH];
+  gsize name_lens[MAX_INDEXED_DEPTH];
+  guint32 hashes[MAX_INDEXED_DEPTH];
+  MetaFilePathSlot *slot;
+  guint32 hash, mask, i, probes;
+  const char *end;
+  int depth;
+
+  *dirent_out = NULL;
+
+  depth = 0;
+  hash = META_PATH_HASH_ROOT;
+  while (TRUE)
+    {
+      while (*path == '/')
+	path++;
+      if (*path == 0)
+	break;
+
+      if (depth == MAX_INDEXED_DEPTH)
+	return FALSE;
+
+      end = path;
+      while (*end != 0 && *end != '/')
+	end++;
+
+      hash = meta_builder_hash_path (hash, path, end - path);
+      names[depth] = path;
+      name_lens[depth] = end - path;
+      hashes[depth] = hash;
+      depth++;
+
+      path = end;
+    }
+
+  if (depth == 0)
+    {
+      *dirent_out = tree->root;
+      return TRUE;
+    }
+
+  mask = tree->num_path_slots - 1;
+  for (i = hash & mask, probes = 0;
+       probes < tree->num_path_slots;
+       i = (i + 1) & mask, probes++)
+    {
+      slot = &tree->path_slots[i];
+      if (slot->hash == 0)
+	break;
+
+      if (path_slot_matches (tree, slot, names, name_lens, hashes, depth - 1))
+	{
+	  *dirent_out = verify_block_pointer (tree, slot->dirent,
+					      sizeof (MetaFileDirEnt));
+	  break;
+	}
+    }
+
+  return TRUE;
+}
+
 static MetaFileDirEnt *
 meta_tree_lookup (MetaTree *tree,
 		  const char *path)
@@ -687,6 +931,10 @@ meta_tree_lookup (MetaTree *tree,
   if (tree->root == NULL)
     return NULL;
 
+  if (tree->path_slots != NULL &&
+      path_index_lookup (tree, path, &dirent))
+    return dirent;
+
   path_copy = g_strdup (path);
   dirent = dir_lookup_path (tree, tree->root, path_copy);
   g_free (path_copy);
@@ -736,43 +984,84 @@ get_id_for_key (MetaTree *tree,
   return attribute_ptr - tree->attributes;
 }
 
-struct FindId {
-  MetaTree *tree;
-  guint32 id;
-};
-
-static int
-find_data_element (const void *_key, const void *_dataent)
+/* Reads key i of data into ent, in the v1 encoding */
+static void
+meta_data_get_ent (MetaTree *tree,
+		   MetaFileData *data,
+		   guint32 i,
+		   MetaFileDataEnt *ent)
 {
-  const struct FindId *key = _key;
-  const MetaFileDataEnt *dataent = _dataent;
-  guint32 key_id;
+  guint16 *keys;
+  guint32 *values;
+  guint32 key, num_keys;
+
+  if (tree->major == V1_MAJOR_VERSION)
+    {
+      *ent = data->keys[i];
+      return;
+    }
 
-  key_id = GUINT32_FROM_BE (dataent->key) & ~KEY_IS_LIST_MASK;
+  num_keys = GUINT32_FROM_BE (data->num_keys);
+  keys = (guint16 *)&data->keys[0];
+  values = (guint32 *)((char *)keys + ((num_keys * sizeof (guint16) + 3) & ~3));
+
+  key = GUINT16_FROM_BE (keys[i]);
+  if (key & KEY16_IS_LIST_MASK)
+    key = (key & ~KEY16_IS_LIST_MASK) | KEY_IS_LIST_MASK;
+  ent->key = GUINT32_TO_BE (key);
+  ent->value = values[i];
+}
+
+static guint32
+meta_data_get_key_id (MetaTree *tree,
+		      MetaFileData *data,
+		      guint32 i)
+{
+  if (tree->major == V1_MAJOR_VERSION)
+    return GUINT32_FROM_BE (data->keys[i].key) & ~KEY_IS_LIST_MASK;
 
-  return key->id - key_id;
+  return GUINT16_FROM_BE (((guint16 *)&data->keys[0])[i]) & ~KEY16_IS_LIST_MASK;
 }
 
-static MetaFileDataEnt *
+static gboolean
 meta_data_get_key (MetaTree *tree,
 		   MetaFileData *data,
-		   const char *attribute)
+		   const char *attribute,
+		   MetaFileDataEnt *ent)
 {
-  MetaFileDataEnt *dataent;
-  struct FindId key;
+  guint32 id, key_id, low, high, mid;
 
-  key.id = get_id_for_key (tree, attribute);
-  key.tree = tree;
-  dataent = bsearch (&key, &data->keys[0],
-		     GUINT32_FROM_BE (data->num_keys), sizeof (MetaFileDataEnt),
-		     find_data_element);
+  id = get_id_for_key (tree, attribute);
+  if (id == NO_KEY)
+    return FALSE;
+
+  /* Keys are sorted by id */
+  low = 0;
+  high = GUINT32_FROM_BE (data->num_keys);
+  while (low < high)
+    {
+      mid = low + (high - low) / 2;
+      key_id = meta_data_get_key_id (tree, data, mid);
+      if (key_id == id)
+	{
+	  meta_data_get_ent (tree, data, mid, ent);
+	  return TRUE;
+	}
+      if (key_id < id)
+	low = mid + 1;
+      else
+	high = mid;
+    }
 
-  return dataent;
+  return FALSE;
 }
 
 static void
 meta_journal_free (MetaJournal *journal)
 {
+  g_hash_table_destroy (journal->key_index);
+  g_hash_table_destroy (journal->path_op_index);
+  g_hash_table_destroy (journal->children_index);
   g_free (journal->filename);
   munmap(journal->data, journal->len);
   close (journal->fd);
@@ -826,6 +1115,85 @@ verify_journal_entry (MetaJournal *journal,
   return (MetaJournalEntry *)(journal->data + offset + entry_len);
 }
 
+static gboolean
+journal_entry_is_key_type (MetaJournalEntry *entry)
+{
+ return
+   entry->entry_type == JOURNAL_OP_SET_KEY ||
+   entry->entry_type == JOURNAL_OP_SETV_KEY ||
+   entry->entry_type == JOURNAL_OP_UNSET_KEY;
+}
+
+static gboolean
+journal_entry_is_path_type (MetaJournalEntry *entry)
+{
+ return
+   entry->entry_type == JOURNAL_OP_COPY_PATH ||
+   entry->entry_type == JOURNAL_OP_REMOVE_PATH;
+}
+
+static void
+journal_index_add (GHashTable *index,
+		   const char *path,
+		   gsize path_len,
+		   MetaJournalEntry *entry)
+{
+  GArray *entries;
+  char *key;
+
+  key = g_strndup (path, path_len);
+  entries = g_hash_table_lookup (index, key);
+  if (entries == NULL)
+    {
+      entries = g_array_new (FALSE, FALSE, sizeof (MetaJournalEntry *));
+      g_hash_table_insert (index, key, entries);
+    }
+  else
+    g_free (key);
+
+  g_array_append_val (entries, entry);
+}
+
+/* Path ops affect everything below them, see get_prefix_match(), so
+   they are indexed by their path without trailing slashes. Every entry
+   is also indexed under all of its parents for meta_tree_enumerate_dir(). */
+static void
+meta_journal_index_entry (MetaJournal *journal,
+			  MetaJournalEntry *entry)
+{
+  const char *path, *p;
+  gsize len;
+
+  path = &entry->path[0];
+
+  if (journal_entry_is_key_type (entry))
+    journal_index_add (journal->key_index, path, strlen (path), entry);
+  else if (journal_entry_is_path_type (entry))
+    {
+      len = strlen (path);
+      while (len > 0 && path[len-1] == '/')
+	len--;
+      journal_index_add (journal->path_op_index, path, len, entry);
+    }
+  else
+    {
+      g_warning ("Unknown journal entry type %d\n", entry->entry_type);
+      return;
+    }
+
+  for (p = strchr (path, '/'); p != NULL; p = strchr (p + 1, '/'))
+    {
+      len = p - path;
+      /* Parents never end with a slash, and the remainder must not be
+	 empty for the entry to be below them */
+      if (len > 0 && path[len-1] == '/')
+	continue;
+      if (p[strspn (p, "/")] == 0)
+	break;
+      journal_index_add (journal->children_index, path, len, entry);
+    }
+}
+
 /* Try to validate more entries, call with writer lock */
 static void
 meta_journal_validate_more (MetaJournal *journal)
@@ -851,6 +1219,7 @@ meta_journal_validate_more (MetaJournal *journal)
 	  break;
 	}
 
+      meta_journal_index_entry (journal, entry);
       entry = next_entry;
       i++;
     }
@@ -1104,6 +1473,15 @@ meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, gui
   journal->first_entry = (MetaJournalEntry *)(data + sizeof (MetaJournalHeader));
   journal->last_entry = journal->first_entry;
   journal->last_entry_num = 0;
+  journal->key_index =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+			   g_free, (GDestroyNotify)g_array_unref);
+  journal->path_op_index =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+			   g_free, (GDestroyNotify)g_array_unref);
+  journal->children_index =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+			   g_free, (GDestroyNotify)g_array_unref);
 
   if (memcmp (journal->header->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0)
     goto err;
@@ -1133,23 +1511,6 @@ get_next_arg (char *str)
   return str  + strlen (str) + 1;
 }
 
-static gboolean
-journal_entry_is_key_type (MetaJournalEntry *entry)
-{
- return
-   entry->entry_type == JOURNAL_OP_SET_KEY ||
-   entry->entry_type == JOURNAL_OP_SETV_KEY ||
-   entry->entry_type == JOURNAL_OP_UNSET_KEY;
-}
-
-static gboolean
-journal_entry_is_path_type (MetaJournalEntry *entry)
-{
- return
-   entry->entry_type == JOURNAL_OP_COPY_PATH ||
-   entry->entry_type == JOURNAL_OP_REMOVE_PATH;
-}
-
 /* returns remainer if path has "prefix" as prefix (or is equal to prefix) */
 static const char *
 get_prefix_match (const char *path,
@@ -1197,77 +1558,167 @@ typedef gboolean (*journal_path_callback) (MetaJournal *journal,
 					   char **iter_path,
 					   gpointer user_data);
 
+/* Returns the newest copy/remove entry before limit that affects path,
+   i.e. whose path is path itself or one of its parents */
+static MetaJournalEntry *
+meta_journal_find_path_op (MetaJournal *journal,
+			   const char *path,
+			   MetaJournalEntry *limit)
+{
+  MetaJournalEntry *op, *entry;
+  GArray *entries;
+  char *prefix;
+  gsize len, i;
+  guint j;
+
+  op = NULL;
+  if (g_hash_table_size (journal->path_op_index) == 0)
+    return NULL;
+
+  prefix = g_strdup (path);
+  len = strlen (path);
+  for (i = 0; i <= len; i++)
+    {
+      if (path[i] != '/' && path[i] != 0)
+	continue;
+
+      prefix[i] = 0;
+      entries = g_hash_table_lookup (journal->path_op_index, prefix);
+      prefix[i] = path[i];
+      if (entries == NULL)
+	continue;
+
+      for (j = entries->len; j > 0; j--)
+	{
+	  entry = g_array_index (entries, MetaJournalEntry *, j - 1);
+	  if (entry < limit)
+	    {
+	      if (op == NULL || entry > op)
+		op = entry;
+	      break;
+	    }
+	}
+    }
+  g_free (prefix);
+
+  return op;
+}
+
+static gboolean
+meta_journal_dispatch (MetaJournal *journal,
+		       MetaJournalEntry *entry,
+		       journal_key_callback key_callback,
+		       journal_path_callback path_callback,
+		       char **iter_path,
+		       gpointer user_data)
+{
+  char *journal_path, *journal_key, *source_path;
+  char *value;
+  guint64 mtime;
+
+  mtime = GUINT64_FROM_BE (entry->mtime);
+  journal_path = &entry->path[0];
+
+  if (journal_entry_is_key_type (entry)) /* set, setv or unset */
+    {
+      if (key_callback == NULL)
+	return TRUE;
+
+      journal_key = get_next_arg (journal_path);
+      value = get_next_arg (journal_key);
+
+      return key_callback (journal, entry->entry_type,
+			   journal_path, mtime, journal_key,
+			   value,
+			   iter_path, user_data);
+    }
+  else /* copy or remove */
+    {
+      if (path_callback == NULL)
+	return TRUE;
+
+      source_path = NULL;
+      if (entry->entry_type == JOURNAL_OP_COPY_PATH)
+	source_path = get_next_arg (journal_path);
+
+      return path_callback (journal, entry->entry_type,
+			    journal_path, mtime, source_path,
+			    iter_path, user_data);
+    }
+}
+
+/* Calls the callbacks for the journal entries that can affect path, from
+ * the newest to the oldest, following copies to their source. These are
+ * the set/setv/unset entries for exactly the current path, or with
+ * children set the entries for anything below it, and the copy/remove
+ * entries for it or any of its parents. Other entries are skipped using
+ * the journal index, so this does not depend on the journal size.
+ */
 static char *
 meta_journal_iterate (MetaJournal *journal,
 		      const char *path,
+		      gboolean children,
 		      journal_key_callback key_callback,
 		      journal_path_callback path_callback,
 		      gpointer user_data)
 {
-  MetaJournalEntry *entry;
-  guint32 *sizep, size;
-  char *journal_path, *journal_key, *source_path;
-  char *path_copy, *value;
-  gboolean res;
-  guint64 mtime;
+  MetaJournalEntry *entry, *op, *limit;
+  GArray *entries;
+  char *path_copy, *index_path;
+  gsize len;
+  guint i;
 
   path_copy = g_strdup (path);
 
   if (journal == NULL)
     return path_copy;
 
-  entry = journal->last_entry;
-  while (entry > journal->first_entry)
+  limit = journal->last_entry;
+  while (TRUE)
     {
-      sizep = (guint32 *)entry;
-      size = GUINT32_FROM_BE (*(sizep-1));
-      entry = (MetaJournalEntry *)((char *)entry - size);
-      if (size < sizeof (MetaJournalEntry) ||
-	  entry < journal->first_entry ||
-	  entry >= journal->last_entry)
-        {
-          g_warning ("meta_journal_iterate: found wrong sized entry, possible journal corruption\n");
-          break;
-        }
+      op = meta_journal_find_path_op (journal, path_copy, limit);
 
-      mtime = GUINT64_FROM_BE (entry->mtime);
-      journal_path = &entry->path[0];
+      if (children)
+	{
+	  len = strlen (path_copy);
+	  while (len > 0 && path_copy[len-1] == '/')
+	    len--;
+	  index_path = g_strndup (path_copy, len);
+	  entries = g_hash_table_lookup (journal->children_index, index_path);
+	  g_free (index_path);
+	}
+      else
+	entries = g_hash_table_lookup (journal->key_index, path_copy);
 
-      if (journal_entry_is_key_type (entry) &&
-	  key_callback) /* set, setv or unset */
+      for (i = entries ? entries->len : 0; i > 0; i--)
 	{
-	  journal_key = get_next_arg (journal_path);
-	  value = get_next_arg (journal_key);
+	  entry = g_array_index (entries, MetaJournalEntry *, i - 1);
+	  if (entry >= limit)
+	    continue;
+	  if (op != NULL && entry <= op)
+	    break;
 
-	  /* Only affects is path is exactly the same */
-	  res = key_callback (journal, entry->entry_type,
-			      journal_path, mtime, journal_key,
-			      value,
-			      &path_copy, user_data);
-	  if (!res)
+	  if (!meta_journal_dispatch (journal, entry,
+				      key_callback, path_callback,
+				      &path_copy, user_data))
 	    {
 	      g_free (path_copy);
 	      return NULL;
 	    }
 	}
-      else if (journal_entry_is_path_type (entry) &&
-	       path_callback) /* copy or remove */
+
+      if (op == NULL)
+	break;
+
+      /* May change path_copy, continue with the older entries from there */
+      if (!meta_journal_dispatch (journal, op,
+				  key_callback, path_callback,
+				  &path_copy, user_data))
 	{
-	  source_path = NULL;
-	  if (entry->entry_type == JOURNAL_OP_COPY_PATH)
-	    source_path = get_next_arg (journal_path);
-
-	  res = path_callback (journal, entry->entry_type,
-			       journal_path, mtime, source_path,
-			       &path_copy, user_data);
-	  if (!res)
-	    {
-	      g_free (path_copy);
-	      return NULL;
-	    }
+	  g_free (path_copy);
+	  return NULL;
 	}
-      else
-	g_warning ("Unknown journal entry type %d\n", entry->entry_type);
+      limit = op;
     }
 
   return path_copy;
@@ -1377,6 +1828,7 @@ meta_journal_reverse_map_path_and_key (MetaJournal *journal,
   data.key = key;
   res_path = meta_journal_iterate (journal,
 				   path,
+				   FALSE,
 				   journal_iter_key,
 				   journal_iter_path,
 				   &data);
@@ -1393,7 +1845,8 @@ meta_tree_lookup_key_type  (MetaTree                         *tree,
 			    const char                       *key)
 {
   MetaFileData *data;
-  MetaFileDataEnt *ent;
+  MetaFileDataEnt ent;
+  gboolean found;
   char *new_path;
   MetaKeyType type;
   gpointer value;
@@ -1408,15 +1861,13 @@ meta_tree_lookup_key_type  (MetaTree                         *tree,
     goto out; /* type is set */
 
   data = meta_tree_lookup_data (tree, new_path);
-  ent = NULL;
-  if (data)
-    ent = meta_data_get_key (tree, data, key);
+  found = data != NULL && meta_data_get_key (tree, data, key, &ent);
 
   g_free (new_path);
 
-  if (ent == NULL)
+  if (!found)
     type = META_KEY_TYPE_NONE;
-  else if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
+  else if (GUINT32_FROM_BE (ent.key) & KEY_IS_LIST_MASK)
     type = META_KEY_TYPE_STRINGV;
   else
     type = META_KEY_TYPE_STRING;
@@ -1467,7 +1918,8 @@ meta_tree_lookup_string (MetaTree   *tree,
 			 const char *key)
 {
   MetaFileData *data;
-  MetaFileDataEnt *ent;
+  MetaFileDataEnt ent;
+  gboolean found;
   MetaKeyType type;
   gpointer value;
   char *new_path;
@@ -1488,18 +1940,16 @@ meta_tree_lookup_string (MetaTree   *tree,
     }
 
   data = meta_tree_lookup_data (tree, new_path);
-  ent = NULL;
-  if (data)
-    ent = meta_data_get_key (tree, data, key);
+  found = data != NULL && meta_data_get_key (tree, data, key, &ent);
 
   g_free (new_path);
 
-  if (ent == NULL)
+  if (!found)
     res = NULL;
-  else if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
+  else if (GUINT32_FROM_BE (ent.key) & KEY_IS_LIST_MASK)
     res = NULL;
   else
-    res = g_strdup (verify_string (tree, ent->value));
+    res = g_strdup (verify_string (tree, ent.value));
 
  out:
   g_rw_lock_reader_unlock (&metatree_lock);
@@ -1543,7 +1993,8 @@ meta_tree_lookup_stringv   (MetaTree                         *tree,
 			    const char                       *key)
 {
   MetaFileData *data;
-  MetaFileDataEnt *ent;
+  MetaFileDataEnt ent;
+  gboolean found;
   MetaKeyType type;
   MetaFileStringv *stringv;
   gpointer value;
@@ -1566,19 +2017,17 @@ meta_tree_lookup_stringv   (MetaTree                         *tree,
     }
 
   data = meta_tree_lookup_data (tree, new_path);
-  ent = NULL;
-  if (data)
-    ent = meta_data_get_key (tree, data, key);
+  found = data != NULL && meta_data_get_key (tree, data, key, &ent);
 
   g_free (new_path);
 
-  if (ent == NULL)
+  if (!found)
     res = NULL;
-  else if ((GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK) == 0)
+  else if ((GUINT32_FROM_BE (ent.key) & KEY_IS_LIST_MASK) == 0)
     res = NULL;
   else
     {
-      stringv = verify_array_block (tree, ent->value,
+      stringv = verify_array_block (tree, ent.value,
 				    sizeof (guint32));
       num_strings = GUINT32_FROM_BE (stringv->num_strings);
       res = g_new (char *, num_strings + 1);
@@ -1817,6 +2266,7 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
 
   res_path = meta_journal_iterate (tree->journal,
 				   path,
+				   TRUE,
 				   enum_dir_iter_key,
 				   enum_dir_iter_path,
 				   &data);
@@ -1965,7 +2415,7 @@ enumerate_data (MetaTree *tree,
 		gpointer user_data)
 {
   guint32 i, j, num_keys, num_strings;
-  MetaFileDataEnt *ent;
+  MetaFileDataEnt ent;
   EnumKeysInfo *info;
   char *key_name;
   guint32 key_id;
@@ -1979,10 +2429,10 @@ enumerate_data (MetaTree *tree,
   num_keys = GUINT32_FROM_BE (data->num_keys);
   for (i = 0; i < num_keys; i++)
     {
-      ent = &data->keys[i];
+      meta_data_get_ent (tree, data, i, &ent);
 
-      key_id = GUINT32_FROM_BE (ent->key) & ~KEY_IS_LIST_MASK;
-      if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
+      key_id = GUINT32_FROM_BE (ent.key) & ~KEY_IS_LIST_MASK;
+      if (GUINT32_FROM_BE (ent.key) & KEY_IS_LIST_MASK)
 	type = META_KEY_TYPE_STRINGV;
       else
 	type = META_KEY_TYPE_STRING;
@@ -2000,10 +2450,10 @@ enumerate_data (MetaTree *tree,
 
       free_me = NULL;
       if (type == META_KEY_TYPE_STRING)
-	value = verify_string (tree, ent->value);
+	value = verify_string (tree, ent.value);
       else
 	{
-	  stringv = verify_array_block (tree, ent->value,
+	  stringv = verify_array_block (tree, ent.value,
 					sizeof (guint32));
 	  num_strings = GUINT32_FROM_BE (stringv->num_strings);
 
@@ -2057,6 +2507,7 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
 
   res_path = meta_journal_iterate (tree->journal,
 				   path,
+				   FALSE,
 				   enum_keys_iter_key,
 				   enum_keys_iter_path,
 				   &keydata);
@@ -2111,7 +2562,7 @@ copy_tree_to_builder (MetaTree *tree,
 {
   MetaFile *builder_child;
   MetaFileData *data;
-  MetaFileDataEnt *ent;
+  MetaFileDataEnt ent;
   MetaFileDir *dir;
   MetaFileDirEnt *child_dirent;
   MetaKeyType type;
@@ -2126,10 +2577,10 @@ copy_tree_to_builder (MetaTree *tree,
       num_keys = GUINT32_FROM_BE (data->num_keys);
       for (i = 0; i < num_keys; i++)
 	{
-	  ent = &data->keys[i];
+	  meta_data_get_ent (tree, data, i, &ent);
 
-	  key_id = GUINT32_FROM_BE (ent->key) & ~KEY_IS_LIST_MASK;
-	  if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
+	  key_id = GUINT32_FROM_BE (ent.key) & ~KEY_IS_LIST_MASK;
+	  if (GUINT32_FROM_BE (ent.key) & KEY_IS_LIST_MASK)
 	    type = META_KEY_TYPE_STRINGV;
 	  else
 	    type = META_KEY_TYPE_STRING;
@@ -2143,7 +2594,7 @@ copy_tree_to_builder (MetaTree *tree,
 
 	  if (type == META_KEY_TYPE_STRING)
 	    {
-	      value = verify_string (tree, ent->value);
+	      value = verify_string (tree, ent.value);
 	      if (value)
 		metafile_key_set_value (builder_file,
 					key_name, value);
@@ -2154,7 +2605,7 @@ copy_tree_to_builder (MetaTree *tree,
 	      guint32 num_strings;
 	      char *str;
 
-	      stringv = verify_array_block (tree, ent->value,
+	      stringv = verify_array_block (tree, ent.value,
 					    sizeof (guint32));
 
 	      if (stringv)
@@ -2281,13 +2732,198 @@ apply_journal_to_builder (MetaTree *tree,
 }
 
 
+static gsize
+meta_tree_get_new_journal_size (MetaTree *tree)
+{
+  gsize size;
+
+  size = tree->len / JOURNAL_SIZE_TREE_RATIO;
+  size = MIN (size, MAX_JOURNAL_SIZE);
+
+  /* meta_builder_create_journal() enforces the minimum */
+  return (size + 4095) & ~4095;
+}
+
+static void
+meta_tree_compaction_free (MetaTreeCompaction *compaction)
+{
+  meta_tree_unref (compaction->snapshot);
+  if (compaction->tmp_name)
+    {
+      g_unlink (compaction->tmp_name);
+      g_free (compaction->tmp_name);
+    }
+  g_free (compaction);
+}
+
+static gpointer
+meta_tree_compaction_thread (gpointer data)
+{
+  MetaTreeCompaction *compaction = data;
+  MetaTree *snapshot = compaction->snapshot;
+  MetaBuilder *builder;
+
+  if (g_atomic_int_get (&compaction->state) != COMPACTION_ABANDONED)
+    {
+      builder = meta_builder_new ();
+
+      copy_tree_to_builder (snapshot, snapshot->root, builder->root);
+      if (snapshot->journal)
+	apply_journal_to_builder (snapshot, builder);
+
+      if (g_atomic_int_get (&compaction->state) != COMPACTION_ABANDONED)
+	compaction->tmp_name = meta_builder_write_tmp (builder,
+						       meta_tree_get_filename (snapshot),
+						       &compaction->random_tag);
+      meta_builder_free (builder);
+    }
+
+  /* Nobody is going to join an abandoned rewrite, clean up here */
+  if (!g_atomic_int_compare_and_exchange (&compaction->state,
+					  COMPACTION_RUNNING, COMPACTION_DONE))
+    meta_tree_compaction_free (compaction);
+
+  return NULL;
+}
+
+/* Needs write lock. Starts rewriting the tree with the current journal
+   in a thread if the journal is getting full, or if force is set and
+   the journal has any entries. */
+static void
+meta_tree_compaction_maybe_start (MetaTree *tree,
+				  gboolean force)
+{
+  MetaTreeCompaction *compaction;
+  MetaJournal *journal;
+  gsize used;
+
+  journal = tree->journal;
+  if (!tree->for_write ||
+      tree->compaction != NULL ||
+      journal == NULL ||
+      !journal->journal_valid)
+    return;
+
+  used = (char *)journal->last_entry - journal->data;
+  if (force ? journal->last_entry_num == 0 : used < JOURNAL_COMPACT_THRESHOLD (journal->len))
+    return;
+
+  compaction = g_new0 (MetaTreeCompaction, 1);
+
+  /* Opened with the writer lock held, so the snapshot sees exactly the
+     entries validated in our journal. The files it maps are never
+     modified in place except for appending entries, which it ignores. */
+  compaction->snapshot = meta_tree_open (tree->filename, FALSE);
+  if (compaction->snapshot->tag != tree->tag ||
+      compaction->snapshot->journal == NULL ||
+      compaction->snapshot->journal->last_entry_num != journal->last_entry_num)
+    {
+      meta_tree_unref (compaction->snapshot);
+      g_free (compaction);
+      return;
+    }
+
+  compaction->tag = tree->tag;
+  compaction->num_entries = journal->last_entry_num;
+  compaction->journal_pos = used;
+  compaction->thread = g_thread_new ("metadata compaction",
+				     meta_tree_compaction_thread,
+				     compaction);
+  tree->compaction = compaction;
+}
+
+/* Needs write lock. Puts the rewritten tree in place if the background
+   rewrite is done, or waits for it if wait is set. The entries written
+   to the journal since the rewrite started are carried over to the
+   new journal. Returns TRUE if the tree was replaced. */
+static gboolean
+meta_tree_compaction_finish (MetaTree *tree,
+			     gboolean wait)
+{
+  MetaTreeCompaction *compaction;
+  MetaJournal *journal;
+  gboolean res;
+
+  compaction = tree->compaction;
+  if (compaction == NULL)
+    return FALSE;
+
+  if (!wait && g_atomic_int_get (&compaction->state) != COMPACTION_DONE)
+    return FALSE;
+
+  tree->compaction = NULL;
+  g_thread_join (compaction->thread);
+  compaction->thread = NULL;
+
+  journal = tree->journal;
+  res = FALSE;
+  if (compaction->tmp_name != NULL &&
+      compaction->tag == tree->tag &&
+      journal != NULL &&
+      journal->journal_valid)
+    {
+      res = meta_builder_write_commit (tree->filename,
+				       compaction->tmp_name,
+				       compaction->random_tag,
+				       meta_tree_get_new_journal_size (tree),
+				       journal->data + compaction->journal_pos,
+				       (char *)journal->last_entry - (journal->data + compaction->journal_pos),
+				       journal->last_entry_num - compaction->num_entries);
+      /* Removed by meta_builder_write_commit() on failure */
+      g_free (compaction->tmp_name);
+      compaction->tmp_name = NULL;
+
+      if (res)
+	/* Force re-read since we wrote a new file */
+	meta_tree_refresh_locked (tree, TRUE);
+    }
+
+  meta_tree_compaction_free (compaction);
+
+  return res;
+}
+
+/* Needs write lock. Drops the background rewrite without waiting for
+   it, a running thread throws away its result and frees it. */
+static void
+meta_tree_compaction_abort (MetaTree *tree)
+{
+  MetaTreeCompaction *compaction;
+  GThread *thread;
+
+  compaction = tree->compaction;
+  if (compaction == NULL)
+    return;
+
+  tree->compaction = NULL;
+
+  /* The compaction belongs to the thread once abandoned */
+  thread = compaction->thread;
+  if (g_atomic_int_compare_and_exchange (&compaction->state,
+					 COMPACTION_RUNNING, COMPACTION_ABANDONED))
+    {
+      g_thread_unref (thread);
+      return;
+    }
+
+  /* Done, the thread is only returning */
+  g_thread_join (thread);
+  meta_tree_compaction_free (compaction);
+}
+
 /* Needs write lock */
 static gboolean
 meta_tree_flush_locked (MetaTree *tree)
 {
   MetaBuilder *builder;
+  char *tmp_name;
+  guint32 random_tag;
   gboolean res;
 
+  if (meta_tree_compaction_finish (tree, TRUE) &&
+      (tree->journal == NULL || tree->journal->last_entry_num == 0))
+    return TRUE;
+
   builder = meta_builder_new ();
 
   copy_tree_to_builder (tree, tree->root, builder->root);
@@ -2295,8 +2931,18 @@ meta_tree_flush_locked (MetaTree *tree)
   if (tree->journal)
     apply_journal_to_builder (tree, builder);
 
-  res = meta_builder_write (builder,
-			    meta_tree_get_filename (tree));
+  res = FALSE;
+  tmp_name = meta_builder_write_tmp (builder,
+				     meta_tree_get_filename (tree),
+				     &random_tag);
+  if (tmp_name != NULL)
+    {
+      res = meta_builder_write_commit (meta_tree_get_filename (tree),
+				       tmp_name, random_tag,
+				       meta_tree_get_new_journal_size (tree),
+				       NULL, 0, 0);
+      g_free (tmp_name);
+    }
   if (res)
     /* Force re-read since we wrote a new file */
     meta_tree_refresh_locked (tree, TRUE);
@@ -2306,6 +2952,42 @@ meta_tree_flush_locked (MetaTree *tree)
   return res;
 }
 
+/* Needs write lock */
+static gboolean
+meta_tree_try_add_journal_entry (MetaTree *tree,
+				 GString *entry)
+{
+  return
+    tree->journal != NULL &&
+    tree->journal->journal_valid &&
+    meta_journal_add_entry (tree->journal, entry);
+}
+
+/* Needs write lock */
+static gboolean
+meta_tree_add_journal_entry_locked (MetaTree *tree,
+				    GString *entry)
+{
+  /* Pick up a finished background rewrite early, so the journal
+     entries it has to carry over stay few */
+  meta_tree_compaction_finish (tree, FALSE);
+
+  if (!meta_tree_try_add_journal_entry (tree, entry))
+    {
+      /* Journal full, the background rewrite makes room if there is
+	 one, otherwise rewrite the tree now */
+      if (!(meta_tree_compaction_finish (tree, TRUE) &&
+	    meta_tree_try_add_journal_entry (tree, entry)) &&
+	  !(meta_tree_flush_locked (tree) &&
+	    meta_tree_try_add_journal_entry (tree, entry)))
+	return FALSE;
+    }
+
+  meta_tree_compaction_maybe_start (tree, FALSE);
+
+  return TRUE;
+}
+
 gboolean
 meta_tree_flush (MetaTree *tree)
 {
@@ -2317,6 +2999,38 @@ meta_tree_flush (MetaTree *tree)
   return res;
 }
 
+/* Starts rewriting the tree with its journal in a thread, if the
+   journal has any entries. Returns TRUE if a rewrite is running, which
+   meta_tree_flush_finish() then has to put in place. */
+gboolean
+meta_tree_flush_start (MetaTree *tree)
+{
+  gboolean running;
+
+  g_rw_lock_writer_lock (&metatree_lock);
+  meta_tree_compaction_finish (tree, FALSE);
+  meta_tree_compaction_maybe_start (tree, TRUE);
+  running = tree->compaction != NULL;
+  g_rw_lock_writer_unlock (&metatree_lock);
+
+  return running;
+}
+
+/* Puts the rewrite started by meta_tree_flush_start() in place if it
+   is done. Returns FALSE while it is still running. */
+gboolean
+meta_tree_flush_finish (MetaTree *tree)
+{
+  gboolean done;
+
+  g_rw_lock_writer_lock (&metatree_lock);
+  meta_tree_compaction_finish (tree, FALSE);
+  done = tree->compaction == NULL;
+  g_rw_lock_writer_unlock (&metatree_lock);
+
+  return done;
+}
+
 gboolean
 meta_tree_unset (MetaTree                         *tree,
 		 const char                       *path,
@@ -2339,15 +3053,7 @@ meta_tree_unset (MetaTree                         *tree,
 
   entry = meta_journal_entry_new_unset (mtime, path, key);
 
-  res = TRUE;
- retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
-    {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
-
-      res = FALSE;
-    }
+  res = meta_tree_add_journal_entry_locked (tree, entry);
 
   g_string_free (entry, TRUE);
 
@@ -2379,15 +3085,7 @@ meta_tree_set_string (MetaTree                         *tree,
 
   entry = meta_journal_entry_new_set (mtime, path, key, value);
 
-  res = TRUE;
- retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
-    {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
-
-      res = FALSE;
-    }
+  res = meta_tree_add_journal_entry_locked (tree, entry);
 
   g_string_free (entry, TRUE);
 
@@ -2419,17 +3117,97 @@ meta_tree_set_stringv (MetaTree                         *tree,
 
   entry = meta_journal_entry_new_setv (mtime, path, key, value);
 
-  res = TRUE;
- retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
-    {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
+  res = meta_tree_add_journal_entry_locked (tree, entry);
+
+  g_string_free (entry, TRUE);
+
+ out:
+  g_rw_lock_writer_unlock (&metatree_lock);
+  return res;
+}
+
+struct _MetaTreeBatch {
+  guint64 mtime;
+  GPtrArray *entries;
+};
+
+MetaTreeBatch *
+meta_tree_batch_new (void)
+{
+  MetaTreeBatch *batch;
+
+  batch = g_new0 (MetaTreeBatch, 1);
+  batch->mtime = time (NULL);
+  batch->entries = g_ptr_array_new ();
 
+  return batch;
+}
+
+static void
+batch_free_entry (gpointer data, gpointer user_data)
+{
+  g_string_free (data, TRUE);
+}
+
+void
+meta_tree_batch_free (MetaTreeBatch *batch)
+{
+  g_ptr_array_foreach (batch->entries, batch_free_entry, NULL);
+  g_ptr_array_free (batch->entries, TRUE);
+  g_free (batch);
+}
+
+void
+meta_tree_batch_unset (MetaTreeBatch *batch,
+		       const char    *path,
+		       const char    *key)
+{
+  g_ptr_array_add (batch->entries,
+		   meta_journal_entry_new_unset (batch->mtime, path, key));
+}
+
+void
+meta_tree_batch_set_string (MetaTreeBatch *batch,
+			    const char    *path,
+			    const char    *key,
+			    const char    *value)
+{
+  g_ptr_array_add (batch->entries,
+		   meta_journal_entry_new_set (batch->mtime, path, key, value));
+}
+
+void
+meta_tree_batch_set_stringv (MetaTreeBatch *batch,
+			     const char    *path,
+			     const char    *key,
+			     char         **value)
+{
+  g_ptr_array_add (batch->entries,
+		   meta_journal_entry_new_setv (batch->mtime, path, key, value));
+}
+
+/* Entries are applied in order, on failure the ones before the failing
+   entry stay in the journal */
+gboolean
+meta_tree_apply_batch (MetaTree      *tree,
+		       MetaTreeBatch *batch)
+{
+  gboolean res;
+  guint i;
+
+  g_rw_lock_writer_lock (&metatree_lock);
+
+  if (tree->journal == NULL ||
+      !tree->journal->journal_valid)
+    {
       res = FALSE;
+      goto out;
     }
 
-  g_string_free (entry, TRUE);
+  res = TRUE;
+  for (i = 0; res && i < batch->entries->len; i++)
+    res = meta_tree_add_journal_entry_locked (tree,
+					      g_ptr_array_index (batch->entries, i));
 
  out:
   g_rw_lock_writer_unlock (&metatree_lock);
@@ -2457,15 +3235,7 @@ meta_tree_remove (MetaTree *tree,
 
   entry = meta_journal_entry_new_remove (mtime, path);
 
-  res = TRUE;
- retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
-    {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
-
-      res = FALSE;
-    }
+  res = meta_tree_add_journal_entry_locked (tree, entry);
 
   g_string_free (entry, TRUE);
 
@@ -2496,15 +3266,7 @@ meta_tree_copy (MetaTree                         *tree,
 
   entry = meta_journal_entry_new_copy (mtime, src, dest);
 
-  res = TRUE;
- retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
-    {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
-
-      res = FALSE;
-    }
+  res = meta_tree_add_journal_entry_locked (tree, entry);
 
   g_string_free (entry, TRUE);
 
@@ -27,6 +27,7 @@
 
 typedef struct _MetaTree MetaTree;
 typedef struct _MetaLookupCache MetaLookupCache;
+typedef struct _MetaTreeBatch MetaTreeBatch;
 
 typedef enum {
   META_KEY_TYPE_NONE,
@@ -88,6 +89,8 @@ void        meta_tree_enumerate_keys   (MetaTree                         *tree,
 					meta_tree_keys_enumerate_callback callback,
 					gpointer                          user_data);
 gboolean    meta_tree_flush            (MetaTree                         *tree);
+gboolean    meta_tree_flush_start      (MetaTree                         *tree);
+gboolean    meta_tree_flush_finish     (MetaTree                         *tree);
 gboolean    meta_tree_unset            (MetaTree                         *tree,
 					const char                       *path,
 					const char                       *key);
@@ -104,4 +107,22 @@ gboolean    meta_tree_remove           (MetaTree                         *tree,
 gboolean    meta_tree_copy             (MetaTree                         *tree,
 					const char                       *src,
 					const char                       *dest);
+
+/* Collects changes to several paths so they are appended to the
+   journal under a single writer lock */
+MetaTreeBatch *meta_tree_batch_new           (void);
+void           meta_tree_batch_free          (MetaTreeBatch *batch);
+void           meta_tree_batch_unset         (MetaTreeBatch *batch,
+					      const char    *path,
+					      const char    *key);
+void           meta_tree_batch_set_string    (MetaTreeBatch *batch,
+					      const char    *path,
+					      const char    *key,
+					      const char    *value);
+void           meta_tree_batch_set_stringv   (MetaTreeBatch *batch,
+					      const char    *path,
+					      const char    *key,
+					      char         **value);
+gboolean       meta_tree_apply_batch         (MetaTree      *tree,
+					      MetaTreeBatch *batch);
 #endif /* __META_TREE_H__ */
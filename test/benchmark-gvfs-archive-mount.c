@@ -0,0 +1,246 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Measures how long the archive backend takes to mount archives with a
+ * growing number of entries in a single directory, e.g.:
+ *
+ *   benchmark-gvfs-archive-mount /tmp
+ *
+ * Synthetic tar files are written to the given local directory. Prints
+ * the number of entries and the time in seconds needed to mount the
+ * archive and look up its last entry.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#define BENCHMARK_UNIT_NAME "gvfs-archive-mount"
+
+#include "benchmark-common.c"
+
+#define TAR_BLOCK_SIZE  512
+#define MIN_ENTRIES     1000
+#define MAX_ENTRIES     100000
+
+static GError *mount_error;
+
+static void
+tar_write_entry (FILE *tar, const gchar *name)
+{
+  guchar  header [TAR_BLOCK_SIZE];
+  guint   checksum;
+  gint    i;
+
+  memset (header, 0, sizeof (header));
+  strncpy ((gchar *) header, name, 99);
+  memcpy (header + 100, "0000644", 7);                /* mode */
+  memcpy (header + 108, "0000000", 7);                /* uid */
+  memcpy (header + 116, "0000000", 7);                /* gid */
+  memcpy (header + 124, "00000000000", 11);           /* size */
+  memcpy (header + 136, "00000000000", 11);           /* mtime */
+  header [156] = '0';                                 /* regular file */
+  memcpy (header + 257, "ustar", 6);
+  memcpy (header + 263, "00", 2);
+
+  /* the checksum is computed with its own field set to spaces */
+  memset (header + 148, ' ', 8);
+  checksum = 0;
+  for (i = 0; i < TAR_BLOCK_SIZE; i++)
+    checksum += header [i];
+  g_snprintf ((gchar *) header + 148, 8, "%06o", checksum);
+
+  fwrite (header, 1, sizeof (header), tar);
+}
+
+static gchar *
+create_archive (const gchar *base_dir, gint n_entries)
+{
+  gchar  *path;
+  gchar  *name;
+  guchar  end [TAR_BLOCK_SIZE * 2];
+  FILE   *tar;
+  gint    i;
+
+  path = g_strdup_printf ("%s/gvfs-benchmark-archive-%d-%d.tar", base_dir, getpid (), n_entries);
+  tar = fopen (path, "wb");
+  if (!tar)
+    {
+      g_printerr ("Failed to create %s\n", path);
+      g_free (path);
+      return NULL;
+    }
+
+  for (i = 0; i < n_entries; i++)
+    {
+      name = g_strdup_printf ("dir/file-%08d", i);
+      tar_write_entry (tar, name);
+      g_free (name);
+    }
+
+  memset (end, 0, sizeof (end));
+  fwrite (end, 1, sizeof (end), tar);
+  fclose (tar);
+
+  return path;
+}
+
+static GFile *
+get_archive_root (const gchar *path)
+{
+  GFile *file;
+  gchar *uri;
+  gchar *escaped;
+  gchar *archive_uri;
+
+  file = g_file_new_for_path (path);
+  uri = g_file_get_uri (file);
+  escaped = g_uri_escape_string (uri, NULL, FALSE);
+  archive_uri = g_strdup_printf ("archive://%s/", escaped);
+
+  g_object_unref (file);
+  file = g_file_new_for_uri (archive_uri);
+
+  g_free (archive_uri);
+  g_free (escaped);
+  g_free (uri);
+  return file;
+}
+
+static void
+mount_done (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  g_file_mount_enclosing_volume_finish (G_FILE (source), res, &mount_error);
+  benchmark_quit_main_loop ();
+}
+
+static void
+unmount_done (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  g_mount_unmount_with_operation_finish (G_MOUNT (source), res, NULL);
+  benchmark_quit_main_loop ();
+}
+
+static gboolean
+mount_archive (GFile *root, gint n_entries)
+{
+  GFile     *last;
+  GFileInfo *info;
+  gchar     *name;
+  GError    *error = NULL;
+
+  g_file_mount_enclosing_volume (root, G_MOUNT_MOUNT_NONE, NULL, NULL, mount_done, NULL);
+  benchmark_run_main_loop ();
+
+  if (mount_error)
+    {
+      g_printerr ("Failed to mount archive: %s\n", mount_error->message);
+      g_clear_error (&mount_error);
+      return FALSE;
+    }
+
+  name = g_strdup_printf ("dir/file-%08d", n_entries - 1);
+  last = g_file_resolve_relative_path (root, name);
+  g_free (name);
+
+  info = g_file_query_info (last, G_FILE_ATTRIBUTE_STANDARD_SIZE, 0, NULL, &error);
+  g_object_unref (last);
+  if (!info)
+    {
+      g_printerr ("Failed to query last entry: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  g_object_unref (info);
+  return TRUE;
+}
+
+static void
+unmount_archive (GFile *root)
+{
+  GMount *mount;
+
+  mount = g_file_find_enclosing_mount (root, NULL, NULL);
+  if (!mount)
+    return;
+
+  g_mount_unmount_with_operation (mount, G_MOUNT_UNMOUNT_NONE, NULL, NULL, unmount_done, NULL);
+  benchmark_run_main_loop ();
+  g_object_unref (mount);
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  GFile  *root;
+  GTimer *timer;
+  gchar  *path;
+  gint    n_entries;
+  gboolean result;
+
+  setlocale (LC_ALL, "");
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s <scratch directory>\n", argv [0]);
+      return 1;
+    }
+
+  if (!g_file_test (argv [1], G_FILE_TEST_IS_DIR))
+    {
+      g_printerr ("Scratch directory %s is not a directory\n", argv [1]);
+      return 1;
+    }
+
+  timer = g_timer_new ();
+
+  for (n_entries = MIN_ENTRIES; n_entries <= MAX_ENTRIES; n_entries *= 10)
+    {
+      path = create_archive (argv [1], n_entries);
+      if (!path)
+        break;
+
+      root = get_archive_root (path);
+
+      g_timer_start (timer);
+      result = mount_archive (root, n_entries);
+      g_timer_stop (timer);
+
+      if (result)
+        g_print ("%10d entries: %10.3lf s\n", n_entries, g_timer_elapsed (timer, NULL));
+
+      unmount_archive (root);
+      g_object_unref (root);
+      g_unlink (path);
+      g_free (path);
+
+      if (!result)
+        break;
+    }
+
+  g_timer_destroy (timer);
+  return 0;
+}
@@ -0,0 +1,147 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Measures enumerating a (large) mounted directory and querying each
+ * of its children, e.g.:
+ *
+ *   benchmark-gvfs-enumerate ftp://server/big-directory
+ *
+ * The location must already be mounted. Prints the number of children, the time in milliseconds per
+ * enumeration and the time in milliseconds per query of a child.
+ *
+ * To compare the FTP backend's MLSD listing with LIST, run it again
+ * with GVFS_FTP_DISABLE_MLSD set in the environment of gvfsd.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define BENCHMARK_UNIT_NAME "gvfs-enumerate"
+
+#include "benchmark-common.c"
+
+#define ATTRIBUTES          "standard::*,time::modified,unix::mode,owner::*,access::*"
+#define ENUMERATE_ITERATIONS 10
+
+static gint
+enumerate_dir (GFile *dir, GPtrArray *names)
+{
+  GFileEnumerator *enumerator;
+  GFileInfo       *info;
+  GError          *error = NULL;
+  gint             n_children;
+
+  enumerator = g_file_enumerate_children (dir, ATTRIBUTES, G_FILE_QUERY_INFO_NONE, NULL, &error);
+  if (!enumerator)
+    {
+      g_printerr ("Failed to enumerate directory: %s\n", error->message);
+      g_error_free (error);
+      return -1;
+    }
+
+  n_children = 0;
+  while ((info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
+    {
+      if (names)
+        g_ptr_array_add (names, g_strdup (g_file_info_get_name (info)));
+      g_object_unref (info);
+      n_children++;
+    }
+
+  g_object_unref (enumerator);
+
+  if (error)
+    {
+      g_printerr ("Failed to read directory: %s\n", error->message);
+      g_error_free (error);
+      return -1;
+    }
+
+  return n_children;
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  GFile     *dir;
+  GFile     *child;
+  GFileInfo *info;
+  GPtrArray *names;
+  GTimer    *timer;
+  GError    *error = NULL;
+  gdouble    enumerate_time, query_time;
+  gint       n_children;
+  gint       i;
+  guint      j;
+
+  setlocale (LC_ALL, "");
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s <directory URI>\n", argv [0]);
+      return 1;
+    }
+
+  dir = g_file_new_for_commandline_arg (argv [1]);
+  names = g_ptr_array_new_with_free_func (g_free);
+
+  /* First run mounts and warms up the connections */
+  n_children = enumerate_dir (dir, names);
+  if (n_children < 0)
+    goto out;
+
+  timer = g_timer_new ();
+
+  for (i = 0; i < ENUMERATE_ITERATIONS; i++)
+    if (enumerate_dir (dir, NULL) < 0)
+      break;
+  enumerate_time = g_timer_elapsed (timer, NULL) * 1000 / ENUMERATE_ITERATIONS;
+
+  g_timer_start (timer);
+  for (j = 0; j < names->len; j++)
+    {
+      child = g_file_get_child (dir, g_ptr_array_index (names, j));
+      info = g_file_query_info (child, ATTRIBUTES, G_FILE_QUERY_INFO_NONE, NULL, &error);
+      g_object_unref (child);
+      if (!info)
+        {
+          g_printerr ("Failed to query child: %s\n", error->message);
+          g_clear_error (&error);
+          continue;
+        }
+      g_object_unref (info);
+    }
+  query_time = names->len > 0 ? g_timer_elapsed (timer, NULL) * 1000 / names->len : 0;
+
+  g_print ("%10d children: %10.3lf ms/enumerate %10.3lf ms/query\n",
+           n_children, enumerate_time, query_time);
+
+  g_timer_destroy (timer);
+
+ out:
+  g_ptr_array_free (names, TRUE);
+  g_object_unref (dir);
+  return 0;
+}
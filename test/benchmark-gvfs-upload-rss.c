@@ -0,0 +1,170 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Uploads a large file and tracks the resident memory of the backend
+ * daemon while doing so, e.g.:
+ *
+ *   benchmark-gvfs-upload-rss dav://host/scratch $(pidof gvfsd-dav)
+ *
+ * Prints the uploaded size and the daemon's RSS in KiB after every
+ * BUFFER_SIZE * SAMPLE_INTERVAL bytes, then its peak RSS.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define BENCHMARK_UNIT_NAME "gvfs-upload-rss"
+
+#include "benchmark-common.c"
+
+#define FILE_SIZE       (1024 * 1024 * 512)  /* 512 MiB */
+#define BUFFER_SIZE     (64 * 1024)
+#define SAMPLE_INTERVAL 128
+
+/* Returns the value of a "Vm..." line of /proc/<pid>/status in KiB */
+static guint64
+get_vm_size (gint pid, const gchar *key)
+{
+  gchar   *path;
+  gchar   *contents;
+  gchar  **lines;
+  guint64  value = 0;
+  gint     i;
+
+  path = g_strdup_printf ("/proc/%d/status", pid);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    {
+      g_free (path);
+      return 0;
+    }
+  g_free (path);
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], key) && lines[i][strlen (key)] == ':')
+        {
+          value = g_ascii_strtoull (lines[i] + strlen (key) + 1, NULL, 10);
+          break;
+        }
+    }
+
+  g_strfreev (lines);
+  g_free (contents);
+  return value;
+}
+
+static gboolean
+upload_file (GFile *scratch_file, gint daemon_pid)
+{
+  GOutputStream *output_stream;
+  GError        *error = NULL;
+  gchar          buffer [BUFFER_SIZE];
+  guint64        rss, peak_rss = 0;
+  gint64         i;
+
+  output_stream = G_OUTPUT_STREAM (g_file_replace (scratch_file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error));
+  if (!output_stream)
+    {
+      g_printerr ("Failed to create scratch file: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  memset (buffer, 0xaa, BUFFER_SIZE);
+
+  for (i = 0; i < FILE_SIZE; i += BUFFER_SIZE)
+    {
+      if (!g_output_stream_write_all (output_stream, buffer, BUFFER_SIZE, NULL, NULL, &error))
+        {
+          g_printerr ("Failed to write scratch file: %s\n", error->message);
+          g_error_free (error);
+          g_output_stream_close (output_stream, NULL, NULL);
+          g_object_unref (output_stream);
+          return FALSE;
+        }
+
+      if ((i / BUFFER_SIZE) % SAMPLE_INTERVAL == 0)
+        {
+          rss = get_vm_size (daemon_pid, "VmRSS");
+          peak_rss = MAX (peak_rss, rss);
+          g_print ("%20" G_GINT64_FORMAT " %20" G_GUINT64_FORMAT "\n", i, rss);
+        }
+    }
+
+  if (!g_output_stream_close (output_stream, NULL, &error))
+    {
+      g_printerr ("Failed to close scratch file: %s\n", error->message);
+      g_error_free (error);
+      g_object_unref (output_stream);
+      return FALSE;
+    }
+  g_object_unref (output_stream);
+
+  rss = get_vm_size (daemon_pid, "VmRSS");
+  peak_rss = MAX (peak_rss, rss);
+  g_print ("%20d %20" G_GUINT64_FORMAT "\n", FILE_SIZE, rss);
+
+  /* VmHWM also catches peaks between samples, but covers the whole
+   * lifetime of the daemon */
+  g_print ("peak RSS: %" G_GUINT64_FORMAT " KiB sampled, %" G_GUINT64_FORMAT " KiB high water mark\n",
+           peak_rss, get_vm_size (daemon_pid, "VmHWM"));
+
+  return TRUE;
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  GFile *base_dir;
+  GFile *scratch_file;
+  gchar *scratch_name;
+  gint   daemon_pid;
+  gboolean res;
+
+  setlocale (LC_ALL, "");
+
+  if (argc < 3)
+    {
+      g_printerr ("Usage: %s <scratch URI> <backend daemon pid>\n", argv [0]);
+      return 1;
+    }
+
+  daemon_pid = atoi (argv [2]);
+  base_dir = g_file_new_for_commandline_arg (argv [1]);
+
+  scratch_name = g_strdup_printf ("gvfs-benchmark-upload-%d", getpid ());
+  scratch_file = g_file_resolve_relative_path (base_dir, scratch_name);
+  g_free (scratch_name);
+
+  res = upload_file (scratch_file, daemon_pid);
+  if (res)
+    g_file_delete (scratch_file, NULL, NULL);
+
+  g_object_unref (scratch_file);
+  g_object_unref (base_dir);
+  return res ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Measures metadata lookups against a journal at increasing fill
+ * levels, up to the fullest journal that is not yet rewritten into the
+ * tree.
+ * Prints the number of journal entries, the time in microseconds per
+ * meta_tree_lookup_string() and per meta_tree_enumerate_dir() of the
+ * directory holding all the entries.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "metadata/metatree.h"
+
+#define BENCHMARK_UNIT_NAME "metadata-journal"
+
+#include "benchmark-common.c"
+
+/* Matches NEW_JOURNAL_SIZE and the journal header in metadata/ */
+#define JOURNAL_SIZE        (32 * 1024)
+#define JOURNAL_HEADER_SIZE 20
+
+#define PATH_FORMAT         "/dir/file-%05d"
+#define KEY                 "key"
+#define VALUE               "value"
+
+#define LOOKUP_ITERATIONS   100000
+#define ENUMERATE_ITERATIONS 1000
+
+/* Size of a set entry for PATH_FORMAT, KEY and VALUE, see
+ * meta_journal_entry_new_set() */
+static gsize
+get_entry_size (void)
+{
+  gsize size;
+
+  size = 4 + 4 + 8 + 1;
+  size += strlen ("/dir/file-00000") + 1;
+  size += strlen (KEY) + 1;
+  size += strlen (VALUE) + 1;
+  size = (size + 3) & ~3;
+
+  return size + 4;
+}
+
+static gboolean
+count_entry (const char *entry,
+             guint64 last_changed,
+             gboolean has_children,
+             gboolean has_data,
+             gpointer user_data)
+{
+  (*(gint *) user_data)++;
+  return TRUE;
+}
+
+static gboolean
+run_fill_level (const gchar *base_dir, gint n_entries)
+{
+  MetaTree *tree;
+  GTimer   *timer;
+  gchar    *filename;
+  gchar    *path;
+  gchar    *value;
+  gdouble   lookup_time, enumerate_time;
+  gint      n_children;
+  gint      i;
+
+  filename = g_strdup_printf ("%s/journal-%d", base_dir, n_entries);
+  tree = meta_tree_open (filename, TRUE);
+  if (!tree)
+    {
+      g_printerr ("Failed to open metadata tree %s\n", filename);
+      g_free (filename);
+      return FALSE;
+    }
+
+  for (i = 0; i < n_entries; i++)
+    {
+      path = g_strdup_printf (PATH_FORMAT, i);
+      meta_tree_set_string (tree, path, KEY, VALUE);
+      g_free (path);
+    }
+
+  timer = g_timer_new ();
+
+  for (i = 0; i < LOOKUP_ITERATIONS; i++)
+    {
+      path = g_strdup_printf (PATH_FORMAT, g_random_int_range (0, MAX (n_entries, 1)));
+      value = meta_tree_lookup_string (tree, path, KEY);
+      g_free (value);
+      g_free (path);
+    }
+  lookup_time = g_timer_elapsed (timer, NULL) * G_USEC_PER_SEC / LOOKUP_ITERATIONS;
+
+  g_timer_start (timer);
+  for (i = 0; i < ENUMERATE_ITERATIONS; i++)
+    {
+      n_children = 0;
+      meta_tree_enumerate_dir (tree, "/dir", count_entry, &n_children);
+    }
+  enumerate_time = g_timer_elapsed (timer, NULL) * G_USEC_PER_SEC / ENUMERATE_ITERATIONS;
+
+  g_print ("%10d entries: %10.3lf us/lookup %12.3lf us/enumerate\n",
+           n_entries, lookup_time, enumerate_time);
+
+  g_timer_destroy (timer);
+  meta_tree_unref (tree);
+  g_free (filename);
+  return TRUE;
+}
+
+static void
+remove_dir (const gchar *base_dir)
+{
+  GDir        *dir;
+  const gchar *name;
+  gchar       *path;
+
+  dir = g_dir_open (base_dir, 0, NULL);
+  if (dir)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          path = g_build_filename (base_dir, name, NULL);
+          g_unlink (path);
+          g_free (path);
+        }
+      g_dir_close (dir);
+    }
+
+  g_rmdir (base_dir);
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  gchar  *base_dir;
+  gint    max_entries;
+  gint    quarter;
+  GError *error = NULL;
+
+  setlocale (LC_ALL, "");
+
+  base_dir = g_dir_make_tmp ("gvfs-benchmark-metadata-XXXXXX", &error);
+  if (!base_dir)
+    {
+      g_printerr ("Failed to create scratch directory: %s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  /* Stay below the fill level that starts rewriting the tree, see
+   * JOURNAL_COMPACT_THRESHOLD */
+  max_entries = (JOURNAL_SIZE / 4 * 3 - JOURNAL_HEADER_SIZE) / get_entry_size () - 1;
+
+  for (quarter = 0; quarter <= 4; quarter++)
+    if (!run_fill_level (base_dir, max_entries * quarter / 4))
+      break;
+
+  remove_dir (base_dir);
+  g_free (base_dir);
+
+  return 0;
+}